@@ -91,9 +91,11 @@ endif
 
 WINDOWS = $(filter-out windows,$(TARGET_HOST))
 OSX = $(filter-out osx,$(TARGET_HOST))
+LINUX = $(filter-out linux,$(TARGET_HOST))
 
 $(WINDOWS)EXE_SUFFIX = .exe
 $(OSX)EXE_SUFFIX =
+$(LINUX)EXE_SUFFIX =
 
 HOST_WINDOWS = $(patsubst %,n-,$(filter-out MINGW32_NT-%,$(shell uname -s)))
 HOST_LINUX = $(patsubst %,n-,$(filter-out Linux,$(shell uname -s)))
@@ -87,7 +87,7 @@ extern FILE *ERR_STDERR;
 #define _set_errno(e) errno = (e)
 #endif
 
-#if defined(_WIN32)
+#if defined(_WIN32) || defined(__linux__)
 static inline const char *
 getprogname(void)
 {
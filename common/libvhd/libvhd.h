@@ -56,9 +56,13 @@
 #endif
 
 #if !defined(__APPLE__)
+#ifndef MIN
 #define MIN(a, b)                  (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
 #define MAX(a, b)                  (((a) > (b)) ? (a) : (b))
 #endif
+#endif
 
 #define VHD_MAX_NAME_LEN           1024
 
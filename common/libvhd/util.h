@@ -60,6 +60,12 @@ typedef off_t off64_t;
 #define PRIuS "zu"
 #define lseek64 lseek
 #else
+#define O_BINARY 0
+#define FMT_SIZE "z"
+#define read_return_t ssize_t
+#define write_return_t ssize_t
+#define read_write_size_t size_t
+#define PRIx_rw_size "zx"
 #define PRIdS "zd"
 #define PRIuS "zu"
 #endif
@@ -165,6 +171,11 @@ posix_memfree(void *ptr)
 #define __STR(...) #__VA_ARGS__
 #define STR(...) __STR(__VA_ARGS__)
 
+#if defined(__linux__)
+/* not glibc's, which leaves trailing slashes and may be declared already */
+#define basename libvhd_basename
+#endif
+
 static inline char *
 basename(char *path)
 {
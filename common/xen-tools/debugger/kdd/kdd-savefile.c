@@ -81,6 +81,7 @@ svf_init(const char *save_file, FILE *log, int verbosity)
     int32_t marker;
     struct xc_save_version_info version_info;
     struct xc_save_hvm_context s_hvm_context;
+    struct xc_save_batch_index s_batch_index;
     int end_marker = 0;
     int batch_type;
     int32_t batch;
@@ -126,6 +127,7 @@ svf_init(const char *save_file, FILE *log, int verbosity)
     case 4:
         chunks_v4 = 1;
         break;
+    case 5:
     case SAVE_FORMAT_VERSION:
         break;
     default:
@@ -185,6 +187,16 @@ svf_init(const char *save_file, FILE *log, int verbosity)
         case XC_SAVE_ID_VM_UUID:
             SKIP_MARKER_STRUCT(svf->f, sizeof(struct xc_save_vm_uuid));
             break;
+        case XC_SAVE_ID_BATCH_INDEX:
+            /* size covers the whole record, including the header */
+            fseek(svf->f, - (long) sizeof(int32_t), SEEK_CUR);
+            if (fread(&s_batch_index, sizeof(s_batch_index), 1, svf->f) != 1) {
+                if (log)
+                    fprintf(log, "error reading batch index struct\n");
+                goto err;
+            }
+            fseek(svf->f, s_batch_index.size - sizeof(s_batch_index), SEEK_CUR);
+            break;
         default:
             if (marker < 0) {
                 if (log)
@@ -141,6 +141,13 @@ wait_for_objects(int timeout, WaitObjects *w)
             event->func(event->opaque);
     }
 }
+#elif defined(__linux__)
+static void
+wait_for_objects(int timeout, WaitObjects *w)
+{
+
+    ioh_wait_for_objects(NULL, w, NULL, &timeout, NULL);
+}
 #endif
 
 void
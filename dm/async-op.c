@@ -7,18 +7,41 @@
 #include "config.h"
 #include "queue.h"
 #include "async-op.h"
+#include "clock.h"
 #include "debug.h"
+#include "thread-event.h"
+
+/* Workers are kept once started, each with its own queue of ops per
+ * priority.  New ops go to an idle worker, or a new one while below
+ * max_threads, or else are queued on the busy workers in turn, and a
+ * worker running out of ops steals the oldest op queued on another
+ * before going idle.  Idle workers beyond ASYNC_OP_MIN_THREADS exit
+ * after ASYNC_OP_IDLE_MS.  Without max_threads set, the pool grows
+ * without bound, as it did with a thread per op. */
+#define ASYNC_OP_MIN_THREADS 2
+#define ASYNC_OP_IDLE_MS 30000
+
+TAILQ_HEAD(async_op_queue, async_op_t);
 
 struct async_op_thread {
-    LIST_ENTRY(async_op_thread) entry;
+    TAILQ_ENTRY(async_op_thread) entry;
+    TAILQ_ENTRY(async_op_thread) idle_entry;
     struct async_op_ctx *ctx;
     uxen_thread handle;
     int complete;
+    int idle;
+    critical_section mx;        /* protects queue */
+    struct async_op_queue queue[ASOP_PRIO_NR];
+    thread_event event;
 };
 
+TAILQ_HEAD(async_op_threads, async_op_thread);
+
 struct async_op_ctx {
-    LIST_HEAD(, async_op_t) list;
-    LIST_HEAD(, async_op_thread) threads;
+    struct async_op_queue process;
+    struct async_op_queue permanent;
+    struct async_op_threads threads;
+    struct async_op_threads idle;
     critical_section mx;
     ioh_event *threads_event;
     int exiting;
@@ -27,29 +50,56 @@ struct async_op_ctx {
     int max_threads;
     int threads_cancel;
     int threads_detach;
+    int orphaned;               /* freed, the last worker frees it */
+
+    struct async_op_stats stats;
 };
 
 static struct async_op_ctx *default_ctx = NULL;
 
+static void
+free_thread_ctx(struct async_op_thread *thread_ctx)
+{
+    struct async_op_t *op;
+    int prio;
+
+    /* ops left queued on an exiting worker are never run */
+    for (prio = 0; prio < ASOP_PRIO_NR; prio++)
+        while ((op = TAILQ_FIRST(&thread_ctx->queue[prio]))) {
+            TAILQ_REMOVE(&thread_ctx->queue[prio], op, entry);
+            free(op);
+        }
+
+    thread_event_close(&thread_ctx->event);
+    critical_section_free(&thread_ctx->mx);
+    free(thread_ctx);
+}
+
 static void wait_completed_threads(struct async_op_ctx *ctx)
 {
+    struct async_op_threads completed;
     struct async_op_thread *thread_ctx, *thread_next;
 
-    LIST_FOREACH_SAFE(thread_ctx, &ctx->threads, entry, thread_next) {
+    TAILQ_INIT(&completed);
+    critical_section_enter(&ctx->mx);
+    TAILQ_FOREACH_SAFE(thread_ctx, &ctx->threads, entry, thread_next) {
         if (!thread_ctx->complete)
             continue;
-        LIST_REMOVE(thread_ctx, entry);
+        TAILQ_REMOVE(&ctx->threads, thread_ctx, entry);
+        TAILQ_INSERT_TAIL(&completed, thread_ctx, entry);
+    }
+    critical_section_leave(&ctx->mx);
+
+    TAILQ_FOREACH_SAFE(thread_ctx, &completed, entry, thread_next) {
         if (ctx->exiting && ctx->threads_detach) {
             detach_thread(thread_ctx->handle);
             close_thread_handle(thread_ctx->handle);
-            thread_ctx->handle = NULL;
             continue; /* leak thread_ctx if exiting in detach mode */
         }
 
         wait_thread(thread_ctx->handle);
         close_thread_handle(thread_ctx->handle);
-        thread_ctx->handle = NULL;
-        free(thread_ctx);
+        free_thread_ctx(thread_ctx);
     }
 }
 
@@ -62,8 +112,10 @@ async_op_init(void)
     if (!ctx)
         err(1, "%s: calloc failed", __FUNCTION__);
 
-    LIST_INIT(&ctx->list);
-    LIST_INIT(&ctx->threads);
+    TAILQ_INIT(&ctx->process);
+    TAILQ_INIT(&ctx->permanent);
+    TAILQ_INIT(&ctx->threads);
+    TAILQ_INIT(&ctx->idle);
     critical_section_init(&ctx->mx);
     ctx->number_threads = 0;
     ctx->max_threads = 0;
@@ -71,49 +123,173 @@ async_op_init(void)
     return ctx;
 }
 
+static void
+async_op_stop_threads(struct async_op_ctx *ctx, int cancel)
+{
+    struct async_op_thread *thread_ctx;
+
+    critical_section_enter(&ctx->mx);
+    ctx->exiting = 1;
+    TAILQ_FOREACH(thread_ctx, &ctx->threads, entry) {
+        /* wake idle workers before cancelling, a cancelled wait keeps
+         * the event's lock */
+        thread_event_set(&thread_ctx->event);
+        if (cancel)
+            cancel_thread(thread_ctx->handle);
+        thread_ctx->complete = 1;
+    }
+    critical_section_leave(&ctx->mx);
+    wait_completed_threads(ctx);
+}
+
+static void
+free_ctx(struct async_op_ctx *ctx)
+{
+    struct async_op_t *op;
+
+    if (ctx->stats.ops)
+        debug_printf("async_op: %"PRIu64" ops, %"PRIu64" stolen, "
+                     "max queued %d, max threads %d, wait avg %"PRId64" max "
+                     "%"PRId64" us, run avg %"PRId64" max %"PRId64" us\n",
+                     ctx->stats.ops, ctx->stats.steals,
+                     ctx->stats.max_queued, ctx->stats.max_threads_seen,
+                     ctx->stats.wait_ns / (int64_t)ctx->stats.ops / 1000,
+                     ctx->stats.max_wait_ns / 1000,
+                     ctx->stats.run_ns / (int64_t)ctx->stats.ops / 1000,
+                     ctx->stats.max_run_ns / 1000);
+
+    while ((op = TAILQ_FIRST(&ctx->process))) {
+        TAILQ_REMOVE(&ctx->process, op, entry);
+        free(op);
+    }
+    while ((op = TAILQ_FIRST(&ctx->permanent))) {
+        TAILQ_REMOVE(&ctx->permanent, op, entry);
+        free(op);
+    }
+
+    critical_section_free(&ctx->mx);
+    free(ctx);
+}
+
+/* doesn't wait for workers still running an op, they are detached and
+ * the last one to exit frees the ctx */
 void
 async_op_free(struct async_op_ctx *ctx)
 {
+    struct async_op_thread *thread_ctx, *thread_next;
 
     if (!ctx && !(ctx = default_ctx))
         return;
 
     critical_section_enter(&ctx->mx);
-    if (!LIST_EMPTY(&ctx->threads) || ctx->number_threads) {
-        /* leak if there are pending threads */
-        debug_printf("%s: leaked ctx: %d threads\n", __FUNCTION__, ctx->number_threads);
+    ctx->exiting = 1;
+    ctx->orphaned = 1;
+    TAILQ_FOREACH_SAFE(thread_ctx, &ctx->threads, entry, thread_next) {
+        detach_thread(thread_ctx->handle);
+        close_thread_handle(thread_ctx->handle);
+        if (thread_ctx->complete) {
+            /* past its last use of thread_ctx */
+            TAILQ_REMOVE(&ctx->threads, thread_ctx, entry);
+            free_thread_ctx(thread_ctx);
+            continue;
+        }
+        thread_event_set(&thread_ctx->event);
+    }
+    if (ctx->number_threads) {
         critical_section_leave(&ctx->mx);
         return;
     }
     critical_section_leave(&ctx->mx);
 
-    critical_section_free(&ctx->mx);
-    free(ctx);
+    free_ctx(ctx);
 }
 
 void
 async_op_exit_wait(struct async_op_ctx *ctx)
 {
-    struct async_op_thread *thread_ctx;
 
     if (!ctx && !(ctx = default_ctx))
         return;
 
-    ctx->exiting = 1;
-    LIST_FOREACH(thread_ctx, &ctx->threads, entry) {
-        if (ctx->threads_cancel)
-            cancel_thread(thread_ctx->handle);
-        thread_ctx->complete = 1;
-    }
-    wait_completed_threads(ctx);
+    async_op_stop_threads(ctx, ctx->threads_cancel);
     async_op_process(ctx);
     async_op_free(ctx);
 }
 
+static struct async_op_t *
+queue_take(struct async_op_thread *thread_ctx, int prio)
+{
+    struct async_op_queue *queue = &thread_ctx->queue[prio];
+    struct async_op_t *op;
+
+    /* owner and thieves alike take the oldest op */
+    critical_section_enter(&thread_ctx->mx);
+    op = TAILQ_FIRST(queue);
+    if (op)
+        TAILQ_REMOVE(queue, op, entry);
+    critical_section_leave(&thread_ctx->mx);
+
+    return op;
+}
+
+/* called with ctx->mx held */
+static struct async_op_t *
+steal_op(struct async_op_ctx *ctx, struct async_op_thread *self)
+{
+    struct async_op_thread *thread_ctx;
+    struct async_op_t *op;
+    int prio;
+
+    for (prio = 0; prio < ASOP_PRIO_NR; prio++) {
+        TAILQ_FOREACH(thread_ctx, &ctx->threads, entry) {
+            if (thread_ctx == self)
+                continue;
+            op = queue_take(thread_ctx, prio);
+            if (op) {
+                ctx->stats.steals++;
+                return op;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void
+run_op(struct async_op_ctx *ctx, struct async_op_t *op)
+{
+    int64_t start, end;
+
+    __sync_fetch_and_sub(&ctx->stats.queued, 1);
+    op->state = ASOP_PROCESS_ASYNC;
+    start = os_get_clock();
+    op->cb_process_async(op->opaque);
+    end = os_get_clock();
+
+    critical_section_enter(&ctx->mx);
+    ctx->stats.ops++;
+    ctx->stats.wait_ns += start - op->queued_time;
+    if (start - op->queued_time > ctx->stats.max_wait_ns)
+        ctx->stats.max_wait_ns = start - op->queued_time;
+    ctx->stats.run_ns += end - start;
+    if (end - start > ctx->stats.max_run_ns)
+        ctx->stats.max_run_ns = end - start;
+    if (ctx->orphaned) {
+        /* nobody left to process it */
+        critical_section_leave(&ctx->mx);
+        free(op);
+        return;
+    }
+    op->state = ASOP_PROCESS;
+    TAILQ_INSERT_TAIL(&ctx->process, op, entry);
+    ioh_event_set(op->event);
+    critical_section_leave(&ctx->mx);
+}
+
 #if defined(_WIN32)
 static DWORD WINAPI
 async_op_run(void *opaque)
-#elif defined(__APPLE__)
+#elif defined(__APPLE__) || defined(__linux__)
 static void *
 async_op_run(void *opaque)
 #else
@@ -122,40 +298,64 @@ async_op_run(void *opaque)
 {
     struct async_op_thread *thread_ctx = (struct async_op_thread *)opaque;
     struct async_op_ctx *ctx = thread_ctx->ctx;
+    struct async_op_t *op;
+    int prio, timed_out = 0, last;
 
     if (ctx->threads_cancel)
         setcancel_thread();
 
     for (;;) {
-        struct async_op_t *elm, *op;
-
-        critical_section_enter(&ctx->mx);
         op = NULL;
+        if (!ctx->exiting)
+            for (prio = 0; !op && prio < ASOP_PRIO_NR; prio++)
+                op = queue_take(thread_ctx, prio);
 
-        if (ctx->exiting)
-            break;
-
-        LIST_FOREACH(elm, &ctx->list, entry) {
-            if (elm->state == ASOP_SCHED_ASYNC) {
-                elm->state = ASOP_PROCESS_ASYNC;
-                op = elm;
+        if (!op) {
+            critical_section_enter(&ctx->mx);
+            if (ctx->exiting)
                 break;
+            /* ops are only queued on a worker under ctx->mx, check again
+             * before going idle */
+            for (prio = 0; !op && prio < ASOP_PRIO_NR; prio++)
+                op = queue_take(thread_ctx, prio);
+            if (!op)
+                op = steal_op(ctx, thread_ctx);
+            if (!op) {
+                if (timed_out && thread_ctx->idle &&
+                    ctx->number_threads > ASYNC_OP_MIN_THREADS)
+                    break;
+                /* most recently idle first, so the others can time out */
+                if (!thread_ctx->idle) {
+                    thread_ctx->idle = 1;
+                    TAILQ_INSERT_HEAD(&ctx->idle, thread_ctx, idle_entry);
+                }
+                critical_section_leave(&ctx->mx);
+                timed_out = thread_event_wait_timeout(&thread_ctx->event,
+                                                      ASYNC_OP_IDLE_MS);
+                continue;
             }
+            critical_section_leave(&ctx->mx);
         }
-        if (!op)
-            break;
-        critical_section_leave(&ctx->mx);
-
-        if (op->cb_process_async)
-            op->cb_process_async(op->opaque);
+        timed_out = 0;
 
-        critical_section_enter(&ctx->mx);
-        op->state = ASOP_PROCESS;
-        ioh_event_set(op->event);
-        critical_section_leave(&ctx->mx);
+        run_op(ctx, op);
     }
 
+    if (thread_ctx->idle)
+        TAILQ_REMOVE(&ctx->idle, thread_ctx, idle_entry);
+    thread_ctx->idle = 0;
     ctx->number_threads--;
+    ctx->stats.threads = ctx->number_threads;
+    if (ctx->orphaned) {
+        /* detached by async_op_free(), clean up after ourselves */
+        TAILQ_REMOVE(&ctx->threads, thread_ctx, entry);
+        last = !ctx->number_threads;
+        critical_section_leave(&ctx->mx);
+        free_thread_ctx(thread_ctx);
+        if (last)
+            free_ctx(ctx);
+        return 0;
+    }
     thread_ctx->complete = 1;
     if (ctx->threads_event)
         ioh_event_set(ctx->threads_event);
@@ -164,19 +364,95 @@ async_op_run(void *opaque)
     return 0;
 }
 
+/* called with ctx->mx held */
+static int
+start_thread(struct async_op_ctx *ctx, struct async_op_t *op)
+{
+    struct async_op_thread *thread_ctx;
+    int prio;
+
+    thread_ctx = calloc(1, sizeof(*thread_ctx));
+    if (!thread_ctx) {
+        warnx("%s: malloc error", __FUNCTION__);
+        return -1;
+    }
+    thread_ctx->ctx = ctx;
+    critical_section_init(&thread_ctx->mx);
+    for (prio = 0; prio < ASOP_PRIO_NR; prio++)
+        TAILQ_INIT(&thread_ctx->queue[prio]);
+    thread_event_init(&thread_ctx->event);
+    TAILQ_INSERT_TAIL(&thread_ctx->queue[op->priority], op, entry);
+
+    if (create_thread(&thread_ctx->handle, async_op_run, thread_ctx)) {
+        Wwarn("%s: create_thread failed", __FUNCTION__);
+        free_thread_ctx(thread_ctx);
+        return -1;
+    }
+    TAILQ_INSERT_TAIL(&ctx->threads, thread_ctx, entry);
+    ctx->number_threads++;
+    ctx->stats.threads = ctx->number_threads;
+    if (ctx->number_threads > ctx->stats.max_threads_seen)
+        ctx->stats.max_threads_seen = ctx->number_threads;
+    elevate_thread(thread_ctx->handle);
+
+    return 0;
+}
+
+/* called with ctx->mx held */
+static int
+queue_op(struct async_op_ctx *ctx, struct async_op_t *op)
+{
+    struct async_op_thread *thread_ctx;
+    int n;
+
+    thread_ctx = TAILQ_FIRST(&ctx->idle);
+    if (thread_ctx) {
+        TAILQ_REMOVE(&ctx->idle, thread_ctx, idle_entry);
+        thread_ctx->idle = 0;
+        critical_section_enter(&thread_ctx->mx);
+        TAILQ_INSERT_TAIL(&thread_ctx->queue[op->priority], op, entry);
+        critical_section_leave(&thread_ctx->mx);
+        thread_event_set(&thread_ctx->event);
+        return 0;
+    }
+
+    if ((!ctx->max_threads || ctx->number_threads < ctx->max_threads) &&
+        !start_thread(ctx, op))
+        return 0;
+
+    /* all busy, queue on the next worker in turn, whichever worker is
+     * done first takes it */
+    for (n = ctx->number_threads; n > 0; n--) {
+        thread_ctx = TAILQ_FIRST(&ctx->threads);
+        if (!thread_ctx)
+            break;
+        TAILQ_REMOVE(&ctx->threads, thread_ctx, entry);
+        TAILQ_INSERT_TAIL(&ctx->threads, thread_ctx, entry);
+        if (thread_ctx->complete)
+            continue;
+        critical_section_enter(&thread_ctx->mx);
+        TAILQ_INSERT_TAIL(&thread_ctx->queue[op->priority], op, entry);
+        critical_section_leave(&thread_ctx->mx);
+        return 0;
+    }
+
+    return -1;
+}
+
 int
-async_op_add(struct async_op_ctx *ctx, void *opaque, ioh_event *event,
-             void (*cb_process_async)(void *), void (*cb_process)(void *))
+async_op_add_prio(struct async_op_ctx *ctx, enum async_op_priority priority,
+                  void *opaque, ioh_event *event,
+                  void (*cb_process_async)(void *), void (*cb_process)(void *))
 {
-    int ret = -1;
+    int ret = -1, n;
     struct async_op_t *op;
-    struct async_op_thread *thread_ctx = NULL;
-    uxen_thread thread_handle;
 
     if (!ctx && !(ctx = default_ctx))
         goto out;
     if (ctx->exiting)
         goto out;
+    if (priority < 0 || priority >= ASOP_PRIO_NR)
+        goto out;
 
     op = calloc(1, sizeof(*op));
     if (!op)
@@ -184,52 +460,44 @@ async_op_add(struct async_op_ctx *ctx, void *opaque, ioh_event *event,
 
     ret = 0;
     op->state = cb_process_async ? ASOP_SCHED_ASYNC : ASOP_PROCESS;
+    op->priority = priority;
     op->opaque = opaque;
     op->event = event;
     op->cb_process_async = cb_process_async;
     op->cb_process = cb_process;
 
+    critical_section_enter(&ctx->mx);
     if (!cb_process_async) {
-        critical_section_enter(&ctx->mx);
-        op->state = ASOP_PROCESS;
-        LIST_INSERT_HEAD(&ctx->list, op, entry);
+        TAILQ_INSERT_TAIL(&ctx->process, op, entry);
         ioh_event_set(op->event);
         critical_section_leave(&ctx->mx);
         goto out;
     }
 
-    critical_section_enter(&ctx->mx);
-    LIST_INSERT_HEAD(&ctx->list, op, entry);
-    if (ctx->max_threads && ctx->number_threads >= ctx->max_threads) {
+    op->queued_time = os_get_clock();
+    n = __sync_add_and_fetch(&ctx->stats.queued, 1);
+    if (n > ctx->stats.max_queued)
+        ctx->stats.max_queued = n;
+    if (queue_op(ctx, op)) {
+        __sync_fetch_and_sub(&ctx->stats.queued, 1);
         critical_section_leave(&ctx->mx);
+        free(op);
+        ret = -1;
         goto out;
     }
-    ctx->number_threads++;
-    thread_ctx = calloc(1, sizeof(*thread_ctx));
-    if (!thread_ctx) {
-        warnx("%s: malloc error", __FUNCTION__);
-        goto cleanup_unlock;
-    }
-    thread_ctx->ctx = ctx;
-    if (create_thread(&thread_handle, async_op_run, thread_ctx) < 0) {
-        Wwarn("%s: create_thread failed", __FUNCTION__);
-        goto cleanup_unlock;
-    }
     critical_section_leave(&ctx->mx);
-    thread_ctx->handle = thread_handle;
-    LIST_INSERT_HEAD(&ctx->threads, thread_ctx, entry);
-    elevate_thread(thread_handle);
 
 out:
     return ret;
-cleanup_unlock:
-    free(thread_ctx);
-    LIST_REMOVE(op, entry);
-    free(op);
-    ctx->number_threads--;
-    critical_section_leave(&ctx->mx);
-    ret = -1;
-    goto out;
+}
+
+int
+async_op_add(struct async_op_ctx *ctx, void *opaque, ioh_event *event,
+             void (*cb_process_async)(void *), void (*cb_process)(void *))
+{
+
+    return async_op_add_prio(ctx, ASOP_PRIO_NORMAL, opaque, event,
+                             cb_process_async, cb_process);
 }
 
 int
@@ -251,7 +519,7 @@ async_op_add_bh(struct async_op_ctx *ctx, void *opaque, void (*cb)(void *))
     op->cb_process = cb;
 
     critical_section_enter(&ctx->mx);
-    LIST_INSERT_HEAD(&ctx->list, op, entry);
+    TAILQ_INSERT_TAIL(&ctx->permanent, op, entry);
     critical_section_leave(&ctx->mx);
 
     return 0;
@@ -260,28 +528,17 @@ async_op_add_bh(struct async_op_ctx *ctx, void *opaque, void (*cb)(void *))
 void
 async_op_process(struct async_op_ctx *ctx)
 {
-    struct async_op_t *elm, *op;
-    bool permanent = false;
+    struct async_op_t *op, *last;
 
     if (!ctx && !(ctx = default_ctx))
         return;
 
     for (;;) {
         critical_section_enter(&ctx->mx);
-        op = NULL;
-        LIST_FOREACH(elm, &ctx->list, entry) {
-            if (elm->state == ASOP_PROCESS) {
-                elm->state = ASOP_DONE;
-                op = elm;
-                break;
-            }
-
-            if (elm->state == ASOP_PERMANENT) {
-                elm->state = ASOP_PERMANENT_DONE;
-                op = elm;
-                permanent = true;
-                break;
-            }
+        op = TAILQ_FIRST(&ctx->process);
+        if (op) {
+            TAILQ_REMOVE(&ctx->process, op, entry);
+            op->state = ASOP_DONE;
         }
         critical_section_leave(&ctx->mx);
 
@@ -290,23 +547,34 @@ async_op_process(struct async_op_ctx *ctx)
 
         if (op->cb_process)
             op->cb_process(op->opaque);
-
-        if (!ctx->exiting && op->state == ASOP_PERMANENT_DONE)
-            continue;
-
-        critical_section_enter(&ctx->mx);
-        LIST_REMOVE(op, entry);
-        critical_section_leave(&ctx->mx);
         free(op);
     }
 
-    if (permanent) {
+    /* run each permanent op once, including ones added meanwhile only
+     * from the next call on */
+    critical_section_enter(&ctx->mx);
+    last = TAILQ_LAST(&ctx->permanent, async_op_queue);
+    critical_section_leave(&ctx->mx);
+    while (last) {
         critical_section_enter(&ctx->mx);
-        LIST_FOREACH(elm, &ctx->list, entry) {
-            if (elm->state == ASOP_PERMANENT_DONE)
-                elm->state = ASOP_PERMANENT;
-        }
+        op = TAILQ_FIRST(&ctx->permanent);
+        TAILQ_REMOVE(&ctx->permanent, op, entry);
+        op->state = ASOP_PERMANENT_DONE;
         critical_section_leave(&ctx->mx);
+
+        if (op->cb_process)
+            op->cb_process(op->opaque);
+
+        if (op == last)
+            last = NULL;
+        if (ctx->exiting) {
+            free(op);
+        } else {
+            critical_section_enter(&ctx->mx);
+            op->state = ASOP_PERMANENT;
+            TAILQ_INSERT_TAIL(&ctx->permanent, op, entry);
+            critical_section_leave(&ctx->mx);
+        }
     }
 
     wait_completed_threads(ctx);
@@ -324,6 +592,20 @@ void async_op_set_prop(struct async_op_ctx *ctx, ioh_event *threads_event,
     ctx->threads_detach = threads_detach;
 }
 
+void
+async_op_get_stats(struct async_op_ctx *ctx, struct async_op_stats *stats)
+{
+
+    if (!ctx && !(ctx = default_ctx)) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    critical_section_enter(&ctx->mx);
+    *stats = ctx->stats;
+    critical_section_leave(&ctx->mx);
+}
+
 
 initcall(async_op_init_default)
 {
@@ -16,28 +16,54 @@ enum async_op_type {
     ASOP_PERMANENT_DONE
 };
 
+enum async_op_priority {
+    ASOP_PRIO_HIGH,
+    ASOP_PRIO_NORMAL,
+    ASOP_PRIO_NR
+};
+
 struct async_op_t {
     void *opaque;
     ioh_event *event;
 
     enum async_op_type state;
+    enum async_op_priority priority;
     void (*cb_process_async)(void *);
     void (*cb_process)(void *);
+    int64_t queued_time;
 
-    LIST_ENTRY(async_op_t) entry;
+    TAILQ_ENTRY(async_op_t) entry;
 };
 
 struct async_op_ctx;
 
+struct async_op_stats {
+    uint64_t ops;               /* async callbacks run */
+    uint64_t steals;            /* ops taken from another worker's queue */
+    int queued;                 /* ops waiting for a worker */
+    int max_queued;
+    int threads;                /* workers */
+    int max_threads_seen;
+    int64_t wait_ns;            /* total and worst time queued */
+    int64_t max_wait_ns;
+    int64_t run_ns;             /* total and worst cb_process_async time */
+    int64_t max_run_ns;
+};
+
 struct async_op_ctx *async_op_init(void);
 void async_op_free(struct async_op_ctx *ctx);
 int async_op_add(struct async_op_ctx *ctx, void *opaque, ioh_event *event,
                  void (*cb_process_async)(void *), void (*cb_process)(void *));
+int async_op_add_prio(struct async_op_ctx *ctx,
+                      enum async_op_priority priority, void *opaque,
+                      ioh_event *event, void (*cb_process_async)(void *),
+                      void (*cb_process)(void *));
 int async_op_add_bh(struct async_op_ctx *ctx, void *opaque, void (*cb)(void *));
 
 void async_op_process(struct async_op_ctx *ctx);
 void async_op_exit_wait(struct async_op_ctx *ctx);
 void async_op_set_prop(struct async_op_ctx *ctx, ioh_event *threads_event,
                        int max_threads, int threads_cancel, int threads_detach);
+void async_op_get_stats(struct async_op_ctx *ctx, struct async_op_stats *stats);
 
 #endif  /* _ASYNC_OP_H_ */
@@ -11,26 +11,40 @@
 
 #include "bh.h"
 #include "ioh.h"
-#include "queue.h"
 
 #include <dm/dm.h>
 #include <dm/whpx/whpx.h>
 
 static ioh_event bh_schedule_event;
-static critical_section bh_lock;
 
 struct BH {
     BHFunc *cb;
     void *opaque;
-    int scheduled;
+    volatile int scheduled;
     int idle;
-    int deleted;
+    volatile int deleted;
     int delete_one_shot;
-    TAILQ_ENTRY(BH) queue;
+    /* set while the BH is on a ready queue or being polled, so that it
+     * is queued at most once -- 2 when that is the idle queue */
+    volatile int queued;
+    BH *next;
     char _data[];
 };
 
-static TAILQ_HEAD(bh_tailq, BH) bhs = TAILQ_HEAD_INITIALIZER(bhs);
+/* Scheduled BHs are pushed onto one of two lock-free lists, from any
+ * thread, and only the main loop takes them off again.  bh_poll()
+ * therefore only visits BHs which have been scheduled, and BHs are only
+ * ever freed by the main loop.  Idle BHs are kept on their own list and
+ * run after the others. */
+static BH *volatile bh_ready;
+static BH *volatile bh_ready_idle;
+/* a BH on the idle queue was scheduled again as non-idle */
+static volatile int bh_idle_promoted;
+/* BHs taken off the ready lists and not run yet, main loop only -- kept
+ * here rather than on bh_poll's stack so that a bh_poll nested in a BH
+ * callback, from aio_poll or qemu_aio_flush, runs them too */
+static BH *bh_taken;
+static BH *bh_taken_idle;
 
 static void
 bh_schedule_event_cb(void *opaque)
@@ -43,8 +57,6 @@ void
 bh_init(void)
 {
 
-    critical_section_init(&bh_lock);
-
     ioh_event_init(&bh_schedule_event);
     ioh_add_wait_object(&bh_schedule_event, bh_schedule_event_cb, NULL, NULL);
 }
@@ -57,9 +69,6 @@ bh_new(BHFunc *cb, void *opaque)
     bh = calloc(1, sizeof(BH));
     bh->cb = cb;
     bh->opaque = opaque;
-    critical_section_enter(&bh_lock);
-    TAILQ_INSERT_TAIL(&bhs, bh, queue);
-    critical_section_leave(&bh_lock);
 
     return bh;
 }
@@ -71,30 +80,104 @@ BH *bh_new_with_data(BHFunc *cb, int data_size, void **data)
     bh = calloc(1, sizeof(BH) + data_size);
     bh->cb = cb;
     bh->opaque = bh->_data;
-    critical_section_enter(&bh_lock);
-    TAILQ_INSERT_TAIL(&bhs, bh, queue);
-    critical_section_leave(&bh_lock);
 
     *data = bh->_data;
 
     return bh;
 }
 
-int bh_poll(void)
+static void
+bh_enqueue(BH *bh)
 {
-    BH *bh, *next;
-    int ret;
+    BH *volatile *head;
+    BH *old;
+
+    if (!__sync_bool_compare_and_swap(&bh->queued, 0, bh->idle ? 2 : 1)) {
+        /* already queued, but if that is on the idle queue it must not
+         * wait for the idle timeout any more */
+        if (!bh->idle && bh->scheduled && bh->queued == 2) {
+            bh_idle_promoted = 1;
+            ioh_event_set(&bh_schedule_event);
+        }
+        return;
+    }
 
-    ret = 0;
-    critical_section_enter(&bh_lock);
-    TAILQ_FOREACH_SAFE(bh, &bhs, queue, next) {
-        if (!bh->deleted && bh->scheduled) {
-            bh->scheduled = 0;
+    head = bh->idle ? &bh_ready_idle : &bh_ready;
+    do {
+        old = *head;
+        bh->next = old;
+    } while (!__sync_bool_compare_and_swap(head, old, bh));
+
+    ioh_event_set(&bh_schedule_event);
+}
+
+/* take the whole list and append it to *list, in the order the BHs were
+ * queued */
+static void
+bh_dequeue_all(BH *volatile *head, BH **list)
+{
+    BH *bh, *next, *taken = NULL;
+
+    bh = __sync_lock_test_and_set(head, NULL);
+    while (bh) {
+        next = bh->next;
+        bh->next = taken;
+        taken = bh;
+        bh = next;
+    }
+
+    while (*list)
+        list = &(*list)->next;
+    *list = taken;
+}
+
+/* move the BHs which are no longer idle off the idle list, onto the end
+ * of *promoted, keeping the order of both */
+static BH *
+bh_split_promoted(BH *list, BH **promoted)
+{
+    BH *bh, *next, *idle = NULL;
+    BH **tail = promoted, **idle_tail = &idle;
+
+    while (*tail)
+        tail = &(*tail)->next;
+    for (bh = list; bh; bh = next) {
+        next = bh->next;
+        bh->next = NULL;
+        if (!bh->idle && bh->scheduled && !bh->deleted) {
+            *tail = bh;
+            tail = &bh->next;
+        } else {
+            *idle_tail = bh;
+            idle_tail = &bh->next;
+        }
+    }
+
+    return idle;
+}
+
+/* run the BHs on *list, taking them off one at a time, since a nested
+ * bh_poll may run the rest */
+static int
+bh_run_list(BH **list)
+{
+    BH *bh;
+    int ret = 0;
+
+    while ((bh = *list)) {
+        *list = bh->next;
+        bh->next = NULL;
+
+        if (bh->deleted) {
+            free(bh);
+            continue;
+        }
+
+        if (__sync_lock_test_and_set(&bh->scheduled, 0)) {
             if (!bh->idle)
                 ret = 1;
             else
                 bh->idle = 0;
-            critical_section_leave(&bh_lock);
 #if !defined(LIBIMG)
             if (whpx_enable)
                 whpx_lock_iothread();
@@ -104,43 +187,62 @@ int bh_poll(void)
             if (whpx_enable)
                 whpx_unlock_iothread();
 #endif
-            critical_section_enter(&bh_lock);
             if (bh->delete_one_shot)
                 bh->deleted = 1;
         }
-	if (bh->deleted) {
-	    TAILQ_REMOVE(&bhs, bh, queue);
-	    free(bh);
-	    continue;
-	}
+
+        if (bh->deleted) {
+            free(bh);
+            continue;
+        }
+
+        /* rescheduled or deleted from another thread while we held it
+         * queued: put it back */
+        __sync_lock_release(&bh->queued);
+        __sync_synchronize();
+        if (bh->scheduled || bh->deleted)
+            bh_enqueue(bh);
+    }
+
+    return ret;
+}
+
+int bh_poll(void)
+{
+    int ret;
+
+    bh_dequeue_all(&bh_ready, &bh_taken);
+    ret = bh_run_list(&bh_taken);
+    bh_dequeue_all(&bh_ready_idle, &bh_taken_idle);
+    if (__sync_lock_test_and_set(&bh_idle_promoted, 0)) {
+        bh_taken_idle = bh_split_promoted(bh_taken_idle, &bh_taken);
+        ret |= bh_run_list(&bh_taken);
     }
-    critical_section_leave(&bh_lock);
+    bh_run_list(&bh_taken_idle);
 
     return ret;
 }
 
 static void
-_bh_schedule(BH *bh)
+_bh_schedule(BH *bh, int idle)
 {
 
-    bh->scheduled = 1;
-    ioh_event_set(&bh_schedule_event);
+    if (!__sync_bool_compare_and_swap(&bh->scheduled, 0, 1))
+        return;
+    bh->idle = idle;
+    bh_enqueue(bh);
 }
 
 void bh_schedule_idle(BH *bh)
 {
-    if (bh->scheduled)
-        return;
-    bh->idle = 1;
-    _bh_schedule(bh);
+
+    _bh_schedule(bh, 1);
 }
 
 void bh_schedule(BH *bh)
 {
-    if (bh->scheduled)
-        return;
-    bh->idle = 0;
-    _bh_schedule(bh);
+
+    _bh_schedule(bh, 0);
 }
 
 void bh_schedule_one_shot(BH *bh)
@@ -159,26 +261,21 @@ void bh_delete(BH *bh)
 {
     bh->scheduled = 0;
     bh->deleted = 1;
+    __sync_synchronize();
+    /* the main loop frees it when it next takes it off a ready queue */
+    bh_enqueue(bh);
 }
 
 void bh_update_timeout(int *timeout)
 {
-    BH *bh;
 
-    critical_section_enter(&bh_lock);
-    TAILQ_FOREACH(bh, &bhs, queue) {
-        if (!bh->deleted && bh->scheduled) {
-            if (bh->idle) {
-                /* idle bottom halves will be polled at least
-                 * every 10ms */
-                *timeout = MIN(10, *timeout);
-            } else {
-                /* non-idle bottom halves will be executed
-                 * immediately */
-                *timeout = 0;
-                break;
-            }
-        }
+    if (bh_ready || bh_taken || bh_idle_promoted) {
+        /* non-idle bottom halves will be executed
+         * immediately */
+        *timeout = 0;
+    } else if (bh_ready_idle || bh_taken_idle) {
+        /* idle bottom halves will be polled at least
+         * every 10ms */
+        *timeout = MIN(10, *timeout);
     }
-    critical_section_leave(&bh_lock);
 }
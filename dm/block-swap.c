@@ -26,8 +26,10 @@
 #include "clock.h"
 #include "os.h"
 #include "qemu_bswap.h"
+#include "slab.h"
 #include "thread-event.h"
 #include "timer.h"
+#include "trace.h"
 
 #ifndef _WIN32
 #include <sys/mman.h>
@@ -255,6 +257,7 @@ typedef struct BDRVSwapState {
     volatile int flush;
     volatile int quit;
     volatile int alloced;
+    struct slab_heap *slab;
     void *insert_context;
 
     thread_event write_event;
@@ -453,27 +456,41 @@ static inline void swap_wait_all_flushed(BDRVSwapState *s)
     thread_event_wait(&s->all_flushed_event);
 }
 
-static void *swap_malloc(void *_s, size_t sz)
+static void *swap_heap_alloc(void *_s, size_t sz)
 {
-    BDRVSwapState *s = _s;
-    __sync_fetch_and_add(&s->alloced, 1);
 #ifdef _WIN32
+    BDRVSwapState *s = _s;
     return HeapAlloc(s->heap, 0, sz);
 #else
     return malloc(sz);
 #endif
 }
 
+static void swap_heap_free(void *_s, void *b)
+{
+#ifdef _WIN32
+    BDRVSwapState *s = _s;
+    HeapFree(s->heap, 0, b);
+#else
+    free(b);
+#endif
+}
+
+/* Block buffers and write batches cycle through the slab, which keeps
+ * them in s->heap. */
+static void *swap_malloc(void *_s, size_t sz)
+{
+    BDRVSwapState *s = _s;
+    __sync_fetch_and_add(&s->alloced, 1);
+    return slab_malloc(s->slab, sz);
+}
+
 static void swap_free(void *_s, void *b)
 {
     BDRVSwapState *s = _s;
     if (b) {
         __sync_fetch_and_sub(&s->alloced, 1);
-#ifdef _WIN32
-        HeapFree(s->heap, 0, b);
-#else
-        free(b);
-#endif
+        slab_free(s->slab, b);
     }
 }
 
@@ -538,7 +555,7 @@ swap_insert_thread(void * _s)
 
         free(keys);
         swap_free(c->s, c->cbuf);
-        free(c);
+        swap_free(s, c);
         load = s->busy_blocks.load;
         swap_unlock(s);
 
@@ -644,7 +661,10 @@ wait:
 
         if (flush || total_size + 2 * SWAP_SECTOR_SIZE > max_sz) {
 
-            struct insert_context *c = malloc(sizeof(*c));
+            struct insert_context *c = swap_malloc(s, sizeof(*c));
+            if (!c) {
+                errx(1, "swap: OOM on line %d", __LINE__);
+            }
             c->n = n;
             c->s = s;
             c->cbuf = cbuf;
@@ -1036,6 +1056,10 @@ static int swap_open(BlockDriverState *bs, const char *filename, int flags)
 #ifdef _WIN32
     s->heap = HeapCreate(0, 0, 0);
 #endif
+    s->slab = slab_heap_create("swap", swap_heap_alloc, swap_heap_free, s);
+    if (!s->slab) {
+        errx(1, "OOM out %s line %d", __FUNCTION__, __LINE__);
+    }
 
     /* Strip swap: prefix from path if given. */
     if (strncmp(filename, "swap:", 5) == 0) {
@@ -1803,6 +1827,7 @@ static void swap_read_cb(void *opaque)
         free(acb->tmp);
     }
     free(acb->map);
+    TRACE_ASYNC_END(TRACE_SWAP_READ, acb, 0, 0);
     acb->common.cb(acb->common.opaque, 0);
     swap_common_cb(acb);
 }
@@ -1824,6 +1849,7 @@ static void swap_rmw_cb(void *opaque)
         swap_signal_write(s);
     }
     free(acb->tmp);
+    TRACE_ASYNC_END(TRACE_SWAP_WRITE, acb, 0, 0);
     acb->common.cb(acb->common.opaque, 0);
     swap_common_cb(acb);
 }
@@ -1833,6 +1859,7 @@ static void swap_write_cb(void *opaque)
 {
     SwapAIOCB *acb = opaque;
 
+    TRACE_ASYNC_END(TRACE_SWAP_WRITE, acb, 0, 0);
     acb->common.cb(acb->common.opaque, 0);
     swap_common_cb(acb);
 }
@@ -2050,6 +2077,7 @@ static BlockDriverAIOCB *swap_aio_read(BlockDriverState *bs,
         return NULL;
     } else if (found == size) {
         swap_unlock(s);
+        TRACE_INSTANT(TRACE_SWAP_READ, block, size);
         if (tmp) {
             memcpy(buf, tmp + modulo, size - modulo);
             free(tmp);
@@ -2072,6 +2100,7 @@ static BlockDriverAIOCB *swap_aio_read(BlockDriverState *bs,
         acb->tmp = tmp;
         acb->map = map;
         aio_add_wait_object(&acb->event, swap_read_cb, acb);
+        TRACE_ASYNC_BEGIN(TRACE_SWAP_READ, acb, block, size);
 
         __swap_queue_read_acb(bs, acb);
         swap_unlock(s);
@@ -2223,6 +2252,7 @@ static BlockDriverAIOCB *swap_aio_write(BlockDriverState *bs,
         }
 
         aio_add_wait_object(&acb->event, swap_rmw_cb, acb);
+        TRACE_ASYNC_BEGIN(TRACE_SWAP_WRITE, acb, acb->block, acb->size);
 
         swap_lock(s);
         found = __swap_nonblocking_read(s, acb->tmp ? acb->tmp : acb->buffer,
@@ -2267,6 +2297,8 @@ static BlockDriverAIOCB *swap_aio_write(BlockDriverState *bs,
             }
 
             aio_add_wait_object(&acb->event, swap_write_cb, acb);
+            TRACE_ASYNC_BEGIN(TRACE_SWAP_WRITE, acb, sector_num / 8,
+                              nb_sectors << BDRV_SECTOR_BITS);
             acb->ratelimit_complete_timer = new_timer_ms(
                     rt_clock, swap_ratelimit_complete_timer_notify, acb);
             mod_timer(acb->ratelimit_complete_timer,
@@ -2275,6 +2307,8 @@ static BlockDriverAIOCB *swap_aio_write(BlockDriverState *bs,
 #endif
         } else {
             /* immediate completion */
+            TRACE_INSTANT(TRACE_SWAP_WRITE, sector_num / 8,
+                          nb_sectors << BDRV_SECTOR_BITS);
             cb(opaque, 0);
             acb = &dummy_acb;
         }
@@ -2352,6 +2386,7 @@ static int swap_flush(BlockDriverState *bs)
         assert(0);
     }
     swap_lock(s);
+    slab_heap_drain(s->slab);
     HeapDestroy(s->heap);
     s->heap = HeapCreate(0, 0, 0);
     swap_unlock(s);
@@ -2439,6 +2474,9 @@ static void swap_close(BlockDriverState *bs)
     hashtable_clear(&s->cached_blocks);
     lruCacheClose(&s->fc);
     hashtable_clear(&s->open_files);
+
+    slab_heap_destroy(s->slab);
+    s->slab = NULL;
 }
 
 static int
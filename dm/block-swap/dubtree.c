@@ -12,6 +12,7 @@
 #include "simpletree.h"
 #include "lz4.h"
 #include <dm/aio.h>
+#include <dm/trace.h>
 
 #define DUBTREE_FILE_MAGIC_MMAP 0x73776170
 
@@ -1287,6 +1288,7 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
     SimpleTree st;
     int i;
     int j = 0;
+    int ret = 0;
     uint64_t last_key = -1;
     uint64_t needed = 0;
     uint32_t fragments = 0;
@@ -1402,6 +1404,8 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
         return -1;
     }
 
+    TRACE_BEGIN(TRACE_DUBTREE_MERGE, num_keys, i);
+
     /* Create the new B-tree to index the destination level. */
     simpletree_init(&st);
 
@@ -1453,7 +1457,8 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
                         if (!out) {
                             warnx("%s: calloc failed on line %d",
                                     __FUNCTION__, __LINE__);
-                            return -1;
+                            ret = -1;
+                            goto merge_done;
                         }
                         out_chunk = add_chunk_id(&ud, out_id);
                     }
@@ -1506,7 +1511,8 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
                                                      t->buffer_max);
                     if (!buffered) {
                         errx(1, "%s: malloc failed", __FUNCTION__);
-                        return -1;
+                        ret = -1;
+                        goto merge_done;
                     }
                 }
 
@@ -1571,7 +1577,8 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
     dubtree_handle_t f = get_chunk(t, tree_chunk, 1, &l);
     if (f == DUBTREE_INVALID_HANDLE) {
         err(1, "unable to open tree chunk %"PRIx64" for write", tree_chunk);
-        return -1;
+        ret = -1;
+        goto merge_done;
     }
     dubtree_pwrite(f, st.mem, simpletree_get_nodes_size(&st), 0);
     put_chunk(t, f, l);
@@ -1618,7 +1625,9 @@ int dubtree_insert(DubTree *t, int num_keys, uint64_t* keys, uint8_t *values,
     critical_section_leave(&t->write_lock);
     hashtable_clear(&keep);
 
-    return 0;
+merge_done:
+    TRACE_END(TRACE_DUBTREE_MERGE, ret, 0);
+    return ret;
 }
 
 int dubtree_delete(DubTree *t)
@@ -0,0 +1,317 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "cksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CKSUM_X86
+#include <immintrin.h>
+#endif
+
+/* vector loops widen 16-bit words into 32-bit lanes, and spill the lanes
+ * into a 64-bit sum before they can overflow -- each iteration adds at
+ * most 8 words to a lane */
+#define CKSUM_SPILL_ITERATIONS 4096
+
+static uint32_t
+fold64(uint64_t sum)
+{
+
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint32_t)sum;
+}
+
+/* 32-bit words into a 64-bit sum, which is the same one's complement sum
+ * as the 16-bit words, and cannot overflow for any buffer that fits in
+ * memory */
+static uint64_t
+sum_tail(const uint8_t *p, size_t len, uint64_t sum)
+{
+    uint32_t w;
+    uint16_t h;
+
+    while (len >= 4) {
+        memcpy(&w, p, sizeof(w));
+        sum += w;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        memcpy(&h, p, sizeof(h));
+        sum += h;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        h = 0;
+        memcpy(&h, p, 1);
+        sum += h;
+    }
+
+    return sum;
+}
+
+static uint32_t
+cksum_partial_generic(const void *_p, size_t len, uint32_t sum)
+{
+    const uint8_t *p = _p;
+    uint64_t s = sum;
+    uint32_t w[8];
+
+    while (len >= sizeof(w)) {
+        memcpy(w, p, sizeof(w));
+        s += (uint64_t)w[0] + w[1] + w[2] + w[3] + w[4] + w[5] + w[6] + w[7];
+        p += sizeof(w);
+        len -= sizeof(w);
+    }
+
+    return fold64(sum_tail(p, len, s));
+}
+
+static uint32_t
+cksum_copy_generic(void *dst, const void *src, size_t len, uint32_t sum)
+{
+
+    memcpy(dst, src, len);
+    return cksum_partial_generic(dst, len, sum);
+}
+
+#ifdef CKSUM_X86
+/* SSE2 is part of the x86_64 baseline, and is only built for i386 when
+ * enabled there */
+#if defined(__x86_64__) || defined(__SSE2__)
+#define CKSUM_SSE2
+static inline __m128i
+sum_sse2(__m128i acc, __m128i v)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    return _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(v, zero),
+                                            _mm_unpackhi_epi16(v, zero)));
+}
+
+static inline uint64_t
+spill_sse2(__m128i acc)
+{
+    uint32_t l[4];
+
+    _mm_storeu_si128((__m128i *)l, acc);
+    return (uint64_t)l[0] + l[1] + l[2] + l[3];
+}
+
+/* 64 bytes per iteration, 8 words per lane */
+static uint32_t
+cksum_do_sse2(void *dst, const void *src, size_t len, uint32_t sum)
+{
+    const __m128i *q = src;
+    __m128i *d = dst;
+    __m128i acc, v0, v1, v2, v3;
+    uint64_t s = sum;
+    int n;
+
+    while (len >= 64) {
+        acc = _mm_setzero_si128();
+        for (n = 0; n < CKSUM_SPILL_ITERATIONS && len >= 64; n++) {
+            v0 = _mm_loadu_si128(q);
+            v1 = _mm_loadu_si128(q + 1);
+            v2 = _mm_loadu_si128(q + 2);
+            v3 = _mm_loadu_si128(q + 3);
+            if (d) {
+                _mm_storeu_si128(d, v0);
+                _mm_storeu_si128(d + 1, v1);
+                _mm_storeu_si128(d + 2, v2);
+                _mm_storeu_si128(d + 3, v3);
+                d += 4;
+            }
+            acc = sum_sse2(sum_sse2(acc, v0), v1);
+            acc = sum_sse2(sum_sse2(acc, v2), v3);
+            q += 4;
+            len -= 64;
+        }
+        s += spill_sse2(acc);
+    }
+
+    if (d)
+        memcpy(d, q, len);
+    return fold64(sum_tail((const uint8_t *)q, len, s));
+}
+
+static uint32_t
+cksum_partial_sse2(const void *p, size_t len, uint32_t sum)
+{
+
+    return cksum_do_sse2(NULL, p, len, sum);
+}
+
+static uint32_t
+cksum_copy_sse2(void *dst, const void *src, size_t len, uint32_t sum)
+{
+
+    return cksum_do_sse2(dst, src, len, sum);
+}
+#endif  /* __x86_64__ || __SSE2__ */
+
+#define CKSUM_AVX2
+static inline __m256i __attribute__((target("avx2")))
+sum_avx2(__m256i acc, __m256i v)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    return _mm256_add_epi32(acc,
+                            _mm256_add_epi32(_mm256_unpacklo_epi16(v, zero),
+                                             _mm256_unpackhi_epi16(v, zero)));
+}
+
+static inline uint64_t __attribute__((target("avx2")))
+spill_avx2(__m256i acc)
+{
+    uint32_t l[8];
+
+    _mm256_storeu_si256((__m256i *)l, acc);
+    return (uint64_t)l[0] + l[1] + l[2] + l[3] + l[4] + l[5] + l[6] + l[7];
+}
+
+/* 128 bytes per iteration, 8 words per lane */
+static uint32_t __attribute__((target("avx2")))
+cksum_do_avx2(void *dst, const void *src, size_t len, uint32_t sum)
+{
+    const __m256i *q = src;
+    __m256i *d = dst;
+    __m256i acc, v0, v1, v2, v3;
+    uint64_t s = sum;
+    int n;
+
+    while (len >= 128) {
+        acc = _mm256_setzero_si256();
+        for (n = 0; n < CKSUM_SPILL_ITERATIONS && len >= 128; n++) {
+            v0 = _mm256_loadu_si256(q);
+            v1 = _mm256_loadu_si256(q + 1);
+            v2 = _mm256_loadu_si256(q + 2);
+            v3 = _mm256_loadu_si256(q + 3);
+            if (d) {
+                _mm256_storeu_si256(d, v0);
+                _mm256_storeu_si256(d + 1, v1);
+                _mm256_storeu_si256(d + 2, v2);
+                _mm256_storeu_si256(d + 3, v3);
+                d += 4;
+            }
+            acc = sum_avx2(sum_avx2(acc, v0), v1);
+            acc = sum_avx2(sum_avx2(acc, v2), v3);
+            q += 4;
+            len -= 128;
+        }
+        s += spill_avx2(acc);
+    }
+
+    if (d)
+        memcpy(d, q, len);
+    return fold64(sum_tail((const uint8_t *)q, len, s));
+}
+
+static uint32_t __attribute__((target("avx2")))
+cksum_partial_avx2(const void *p, size_t len, uint32_t sum)
+{
+
+    return cksum_do_avx2(NULL, p, len, sum);
+}
+
+static uint32_t __attribute__((target("avx2")))
+cksum_copy_avx2(void *dst, const void *src, size_t len, uint32_t sum)
+{
+
+    return cksum_do_avx2(dst, src, len, sum);
+}
+#endif  /* CKSUM_X86 */
+
+static const struct {
+    const char *name;
+    uint32_t (*partial)(const void *, size_t, uint32_t);
+    uint32_t (*copy)(void *, const void *, size_t, uint32_t);
+} cksum_impls[] = {
+#ifdef CKSUM_AVX2
+    { "avx2", cksum_partial_avx2, cksum_copy_avx2 },
+#endif
+#ifdef CKSUM_SSE2
+    { "sse2", cksum_partial_sse2, cksum_copy_sse2 },
+#endif
+    { "generic", cksum_partial_generic, cksum_copy_generic },
+};
+#define CKSUM_NR_IMPLS (sizeof(cksum_impls) / sizeof(cksum_impls[0]))
+
+static int cksum_impl_idx = -1;
+
+static int
+impl_supported(int idx)
+{
+
+#ifdef CKSUM_AVX2
+    if (cksum_impls[idx].partial == cksum_partial_avx2) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return 1;
+}
+
+static int
+impl_resolve(void)
+{
+    int i;
+
+    /* racing first callers resolve to the same result */
+    if (cksum_impl_idx < 0) {
+        for (i = 0; i < CKSUM_NR_IMPLS; i++)
+            if (impl_supported(i))
+                break;
+        cksum_impl_idx = i;
+    }
+
+    return cksum_impl_idx;
+}
+
+const char *
+cksum_impl(void)
+{
+
+    return cksum_impls[impl_resolve()].name;
+}
+
+int
+cksum_select(const char *name)
+{
+    int i;
+
+    for (i = 0; i < CKSUM_NR_IMPLS; i++) {
+        if (strcmp(cksum_impls[i].name, name))
+            continue;
+        if (!impl_supported(i))
+            return -1;
+        cksum_impl_idx = i;
+        return 0;
+    }
+
+    return -1;
+}
+
+uint32_t
+cksum_partial(const void *p, size_t len, uint32_t sum)
+{
+
+    return cksum_impls[impl_resolve()].partial(p, len, sum);
+}
+
+uint32_t
+cksum_copy(void *dst, const void *src, size_t len, uint32_t sum)
+{
+
+    return cksum_impls[impl_resolve()].copy(dst, src, len, sum);
+}
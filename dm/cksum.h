@@ -0,0 +1,74 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _CKSUM_H_
+#define _CKSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Internet checksum (RFC 1071).  Sums are taken over 16-bit words in
+ * memory order, so a folded result can be stored straight into a header
+ * field regardless of host byte order.  Partial sums compose by adding
+ * them, as long as every buffer but the last has an even length.
+ */
+
+/* partial sum of len bytes at p, plus sum -- folded to 16 bits, but not
+ * complemented */
+uint32_t cksum_partial(const void *p, size_t len, uint32_t sum);
+
+/* memcpy(dst, src, len), returning cksum_partial(src, len, sum) */
+uint32_t cksum_copy(void *dst, const void *src, size_t len, uint32_t sum);
+
+/* name of the implementation selected for this cpu */
+const char *cksum_impl(void);
+/* force an implementation ("generic", "sse2", "avx2"), for testing and
+ * benchmarking -- fails if the cpu does not support it */
+int cksum_select(const char *name);
+
+/* fold a sum into the checksum field value */
+static inline uint16_t
+cksum_fold(uint32_t sum)
+{
+
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/* TCP/UDP pseudo header sum -- addresses as stored in the IP header,
+ * len in host order */
+static inline uint32_t
+cksum_pseudo(uint32_t saddr, uint32_t daddr, uint8_t proto, uint16_t len)
+{
+    uint8_t b[4] = { 0, proto, len >> 8, len & 0xff };
+    uint32_t w;
+
+    memcpy(&w, b, sizeof(w));
+    return (saddr & 0xffff) + (saddr >> 16) + (daddr & 0xffff) +
+        (daddr >> 16) + (w & 0xffff) + (w >> 16);
+}
+
+/* RFC 1624 eqn. 3, HC' = ~(~HC + ~m + m'), for a 16-bit header field
+ * changed from old to new, both as stored */
+static inline uint16_t
+cksum_update16(uint16_t cksum, uint16_t old, uint16_t new)
+{
+
+    return cksum_fold((uint16_t)~cksum + (uint16_t)~old + (uint32_t)new);
+}
+
+/* as cksum_update16, for a 32-bit field */
+static inline uint16_t
+cksum_update32(uint16_t cksum, uint32_t old, uint32_t new)
+{
+
+    return cksum_fold((uint16_t)~cksum + (~old & 0xffff) + (~old >> 16) +
+                      (new & 0xffff) + (new >> 16));
+}
+
+#endif  /* _CKSUM_H_ */
@@ -146,7 +146,52 @@ int64_t _os_get_clock_ms(int type)
     return _os_get_clock(type) / SCALE_MS;
 }
 
-#endif	/* _WIN32 / __APPLE__ */
+#elif defined(__linux__)
+
+#include <time.h>
+
+static int64_t get_monotonic_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * CLOCK_BASE + (int64_t) ts.tv_nsec;
+}
+
+initcall(init_get_clock)
+{
+#ifdef RELATIVE_CLOCK
+    critical_section_init(&clock_lck);
+    start_time = get_monotonic_time();
+#endif
+}
+
+int64_t _os_get_clock(int type)
+{
+    int64_t ret;
+
+    if (type == CLOCK_VIRTUAL)
+        vm_clock_lock();
+    if (type == CLOCK_VIRTUAL && clock_paused_time)
+        ret = clock_paused_time;
+    else {
+        ret = get_monotonic_time() - start_time;
+        if (type == CLOCK_VIRTUAL)
+            ret -= time_pause_adjust - clock_save_adjust;
+    }
+    if (type == CLOCK_VIRTUAL)
+        vm_clock_unlock();
+
+    return ret;
+}
+
+int64_t _os_get_clock_ms(int type)
+{
+
+    return _os_get_clock(type) / SCALE_MS;
+}
+
+#endif	/* _WIN32 / __APPLE__ / __linux__ */
 
 #ifdef RELATIVE_CLOCK
 static void vm_clock_lock(void)
@@ -829,6 +829,8 @@ struct config_option config_options[] = {
     { "vpt-align", co_set_boolean_opt, &vm_vpt_align },
     { "vpt-coalesce-period", co_set_integer_opt, &vm_vpt_coalesce_period },
     { "vram-dirty-tracking", co_set_boolean_opt, &vm_vram_dirty_tracking },
+    { "vram-keyframe-interval", co_set_integer_opt,
+      &vm_vram_keyframe_interval },
     { "vram-refresh-delay", co_set_integer_opt, &vm_vram_refresh_delay },
     { "vram-refresh-period", co_set_integer_opt, &vm_vram_refresh_delay },
     { "whpx-perf-stats", co_set_boolean_opt, &whpx_perf_stats },
@@ -26,6 +26,7 @@
 #include "vm.h"
 #include "vm-save.h"
 #include "input.h"
+#include "ioreq.h"
 #include "timer.h"
 #include "block.h"
 #include "guest-agent.h"
@@ -1196,6 +1197,26 @@ collect_vm_stats(void *opaque, const char *id, const char *opt,
     return 0;
 }
 
+static int
+control_command_ioreq_stats(void *opaque, const char *id, const char *opt,
+                            dict d, void *command_opaque)
+{
+    struct control_desc *cd = (struct control_desc *)opaque;
+    dict stats;
+
+    stats = ioreq_stats_dict();
+    if (!stats) {
+        control_send_error(cd, opt, id, ENOMEM, NULL);
+        return 0;
+    }
+    if (dict_get_boolean(d, "clear"))
+        ioreq_stats_clear();
+
+    control_send_ok(cd, opt, id, "d", stats);
+    dict_free(stats);
+    return 0;
+}
+
 #define CONTROL_SUSPEND_OK 0x0001
 
 /* must be strcmp sorted */
@@ -1242,6 +1263,12 @@ struct dict_rpc_command control_commands[] = {
             { "cr2", DICT_RPC_ARG_TYPE_INTEGER, .optional = 1 },
             { NULL, },
         }, },
+    { "ioreq-stats", control_command_ioreq_stats,
+      .args = (struct dict_rpc_arg_desc[]) {
+            { "clear", DICT_RPC_ARG_TYPE_BOOLEAN,
+              .defval = DICT_RPC_ARG_DEFVAL_BOOLEAN(false) },
+            { NULL, },
+        }, },
 #if defined(CONFIG_NICKEL)
     { "nc_AccessControlChange",  ni_rpc_ac_event,
       .args = (struct dict_rpc_arg_desc[]) {
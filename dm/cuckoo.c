@@ -1140,8 +1140,10 @@ execute_plan(struct cuckoo_context *cc,
         thread_event_close(&s->data_ready);
         thread_event_close(&s->processed);
 
+#ifdef _WIN32
         if (s->io_queued)
             debug_printf("unexpected outstanding i/o (%d) on slot %d\n", (int)s->io_queued, i);
+#endif
     }
 
     /* release WHP CoW mappings if cancelled */
@@ -98,6 +98,7 @@ uint64_t vm_use_v4v_disk = 0;
 uint64_t vm_v4v_storage = 1;
 uint64_t vm_v4v_disable_ahci_clones = 0;
 uint64_t vm_vram_dirty_tracking = 0;
+uint64_t vm_vram_keyframe_interval = 8;
 uint8_t v4v_idtoken[16] = { };
 uint8_t v4v_idtoken_is_vm_uuid = 1;
 const char *vmsavefile_on_crash = NULL;
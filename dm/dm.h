@@ -56,6 +56,7 @@ extern uint64_t vm_use_v4v_disk;
 extern uint64_t vm_v4v_storage;
 extern uint64_t vm_v4v_disable_ahci_clones;
 extern uint64_t vm_vram_dirty_tracking;
+extern uint64_t vm_vram_keyframe_interval;
 extern uint8_t v4v_idtoken[16];
 extern uint8_t v4v_idtoken_is_vm_uuid;
 extern uint64_t vm_uxenfb;
@@ -6,6 +6,7 @@
 
 #include "config.h"
 #include "filebuf.h"
+#include "thread-event.h"
 
 #include <errno.h>
 #include <fcntl.h>
@@ -17,17 +18,44 @@
 #include <winioctl.h>
 #endif
 
-#ifdef __APPLE__
+#if defined(__APPLE__) || defined(__linux__)
 #include <sys/mman.h>
-#endif  /* __APPLE__ */
+#endif
 
 static const size_t default_buffer_max = 1 << 20;
 
+/* Buffers rotated by the async writer: one is filled by filebuf_write()
+ * while the others are queued for, or being written by, the writer
+ * thread. */
+#define FILEBUF_ASYNC_BUFFERS 4
+
+struct filebuf_async {
+    uint8_t *buffers[FILEBUF_ASYNC_BUFFERS];
+    size_t len[FILEBUF_ASYNC_BUFFERS];
+    off_t offset[FILEBUF_ASYNC_BUFFERS];
+    int head;                   /* buffer being filled */
+    int tail;                   /* oldest queued buffer */
+    int nr_queued;
+    int error;
+    int exit;
+    critical_section lock;
+    thread_event queued_ev;
+    thread_event done_ev;
+    uxen_thread thread;
+#ifdef _WIN32
+    HANDLE io_event;
+#endif  /* _WIN32 */
+};
+
+static int filebuf_async_start(struct filebuf *fb);
+static void filebuf_async_stop(struct filebuf *fb);
+
 struct filebuf *
 filebuf_open(const char *fn, const char *mode)
 {
     struct filebuf *fb;
     int no_buffering = 0;
+    int async = 0;
 #ifdef _WIN32
     int sequential = 0;
     int write_through = 0;
@@ -46,6 +74,9 @@ filebuf_open(const char *fn, const char *mode)
 
     while (*mode) {
         switch (*mode) {
+            case 'a':
+                async = 1;
+                break;
             case 'n':
                 no_buffering = 1;
                 break;
@@ -97,14 +128,26 @@ filebuf_open(const char *fn, const char *mode)
         free(fb);
         fb = NULL;
     }
-#ifdef __APPLE__
+#if defined(__APPLE__) || defined(__linux__)
     else {
+#ifdef __APPLE__
         if (no_buffering)
             fcntl(fb->file, F_NOCACHE, 1);
+#else  /* __APPLE__ */
+        /* O_DIRECT would also need aligned reads, only hint */
+        if (no_buffering)
+            posix_fadvise(fb->file, 0, 0, POSIX_FADV_NOREUSE);
+#endif  /* __APPLE__ */
         if (fb->file >= 0)
             fb->filename = strdup(fn);
     }
-#endif  /* __APPLE__ */
+#endif
+
+    /* async writes are an optimisation, stay synchronous if the writer
+     * thread can't be started */
+    if (fb && fb->writable && async && filebuf_async_start(fb))
+        warnx("%s: %s: async writer not started", __FUNCTION__, fn);
+
     return fb;
 }
 
@@ -116,6 +159,8 @@ filebuf_set_readable(struct filebuf *fb)
         return -1;
 
     filebuf_flush(fb);
+    if (fb->async)
+        filebuf_async_stop(fb);
 
     fb->offset = 0;
     fb->writable = 0;
@@ -123,51 +168,248 @@ filebuf_set_readable(struct filebuf *fb)
     return 0;
 }
 
-int
-filebuf_flush(struct filebuf *fb)
+static int
+filebuf_write_at(struct filebuf *fb, const uint8_t *buf, size_t len,
+                 off_t offset)
 {
 #ifdef _WIN32
     DWORD ret;
     OVERLAPPED o = { };
-#else  /* _WIN32 */
-    ssize_t ret, o = 0;
-#endif  /* _WIN32 */
-
-    if (!fb->writable) {
-        /* flush buffered data for read files */
-        fb->offset = filebuf_tell(fb);
-        fb->buffered = fb->consumed = 0;
-        return 0;
-    }
 
-#ifdef _WIN32
-    o.Offset = fb->offset;
-    o.OffsetHigh = fb->offset >> 32ULL;
+    o.Offset = offset;
+    o.OffsetHigh = offset >> 32ULL;
+    /* the async writer waits on its own event rather than the handle */
+    if (fb->async)
+        o.hEvent = fb->async->io_event;
 
-    if (!WriteFile(fb->file, fb->buffer, fb->buffered, &ret, &o) &&
+    if (!WriteFile(fb->file, buf, len, &ret, &o) &&
         GetLastError() != ERROR_IO_PENDING) {
         Wwarn("%s: WriteFile failed", __FUNCTION__);
         return -1;
     }
     if (!GetOverlappedResult(fb->file, &o, &ret, TRUE) ||
-        ret != fb->buffered) {
+        ret != len) {
         Wwarn("%s: GetOverlappedResult failed", __FUNCTION__);
         return -1;
     }
 #else  /* _WIN32 */
+    ssize_t ret;
+    size_t o = 0;
+
     do {
-        ret = pwrite(fb->file, fb->buffer + o, fb->buffered - o,
-                     fb->offset + o);
+        ret = pwrite(fb->file, buf + o, len - o, offset + o);
         if (ret > 0)
             o += ret;
-    } while (ret < 0 && errno == EINTR);
+    } while ((ret < 0 && errno == EINTR) || (ret > 0 && o < len));
     if (ret < 0) {
         warn("%s: pwrite failed", __FUNCTION__);
         return -1;
     }
-    ret = o;
 #endif  /* _WIN32 */
-    fb->offset += ret;
+    return 0;
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI
+filebuf_async_run(void *opaque)
+#elif defined(__APPLE__) || defined(__linux__)
+static void *
+filebuf_async_run(void *opaque)
+#else
+#error "filebuf_async_run: unknown arch"
+#endif
+{
+    struct filebuf *fb = opaque;
+    struct filebuf_async *a = fb->async;
+    int slot, error, ret;
+
+    for (;;) {
+        critical_section_enter(&a->lock);
+        if (!a->nr_queued) {
+            ret = a->exit;
+            critical_section_leave(&a->lock);
+            if (ret)
+                break;
+            thread_event_wait(&a->queued_ev);
+            continue;
+        }
+        slot = a->tail;
+        error = a->error;
+        critical_section_leave(&a->lock);
+
+        /* after an error, drain the queue without writing, the next
+         * filebuf_flush() reports the failure */
+        ret = error ? -1 :
+            filebuf_write_at(fb, a->buffers[slot], a->len[slot],
+                             a->offset[slot]);
+
+        critical_section_enter(&a->lock);
+        if (ret < 0)
+            a->error = 1;
+        a->tail = (slot + 1) % FILEBUF_ASYNC_BUFFERS;
+        a->nr_queued--;
+        critical_section_leave(&a->lock);
+        thread_event_set(&a->done_ev);
+    }
+
+    return 0;
+}
+
+/* queue the buffer being filled, if any, and switch to the next one,
+ * waiting for the writer thread while all buffers are queued */
+static int
+filebuf_async_submit(struct filebuf *fb)
+{
+    struct filebuf_async *a = fb->async;
+    int error;
+
+    if (fb->buffered) {
+        a->len[a->head] = fb->buffered;
+        a->offset[a->head] = fb->offset;
+        a->head = (a->head + 1) % FILEBUF_ASYNC_BUFFERS;
+        fb->offset += fb->buffered;
+        fb->buffered = 0;
+
+        critical_section_enter(&a->lock);
+        a->nr_queued++;
+        critical_section_leave(&a->lock);
+        thread_event_set(&a->queued_ev);
+    }
+
+    critical_section_enter(&a->lock);
+    while (a->nr_queued == FILEBUF_ASYNC_BUFFERS) {
+        critical_section_leave(&a->lock);
+        thread_event_wait(&a->done_ev);
+        critical_section_enter(&a->lock);
+    }
+    error = a->error;
+    critical_section_leave(&a->lock);
+
+    fb->buffer = a->buffers[a->head];
+    return error ? -1 : 0;
+}
+
+/* wait for all queued buffers to be written */
+static int
+filebuf_async_wait(struct filebuf *fb)
+{
+    struct filebuf_async *a = fb->async;
+    int error;
+
+    critical_section_enter(&a->lock);
+    while (a->nr_queued) {
+        critical_section_leave(&a->lock);
+        thread_event_wait(&a->done_ev);
+        critical_section_enter(&a->lock);
+    }
+    error = a->error;
+    critical_section_leave(&a->lock);
+
+    return error ? -1 : 0;
+}
+
+static void
+filebuf_async_free(struct filebuf *fb, struct filebuf_async *a)
+{
+    int i;
+
+    for (i = 0; i < FILEBUF_ASYNC_BUFFERS; i++)
+        if (a->buffers[i] != fb->buffer)
+            align_free(a->buffers[i]);
+    thread_event_close(&a->queued_ev);
+    thread_event_close(&a->done_ev);
+    critical_section_free(&a->lock);
+#ifdef _WIN32
+    if (a->io_event)
+        CloseHandle(a->io_event);
+#endif  /* _WIN32 */
+    free(a);
+}
+
+static int
+filebuf_async_start(struct filebuf *fb)
+{
+    struct filebuf_async *a;
+    int i;
+
+    a = calloc(1, sizeof(*a));
+    if (!a)
+        return -1;
+
+    critical_section_init(&a->lock);
+    thread_event_init(&a->queued_ev);
+    thread_event_init(&a->done_ev);
+
+    /* the current buffer becomes the first of the set */
+    a->buffers[0] = fb->buffer;
+    for (i = 1; i < FILEBUF_ASYNC_BUFFERS; i++) {
+        a->buffers[i] = page_align_alloc(fb->buffer_max);
+        if (!a->buffers[i])
+            goto fail;
+    }
+
+#ifdef _WIN32
+    a->io_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!a->io_event) {
+        Wwarn("%s: CreateEvent failed", __FUNCTION__);
+        goto fail;
+    }
+#endif  /* _WIN32 */
+
+    fb->async = a;
+    if (create_thread(&a->thread, filebuf_async_run, fb)) {
+        fb->async = NULL;
+        goto fail;
+    }
+    elevate_thread(a->thread);
+
+    return 0;
+
+  fail:
+    filebuf_async_free(fb, a);
+    return -1;
+}
+
+/* write out all queued buffers and stop the writer thread -- the buffer
+ * being filled stays in use for synchronous i/o */
+static void
+filebuf_async_stop(struct filebuf *fb)
+{
+    struct filebuf_async *a = fb->async;
+
+    critical_section_enter(&a->lock);
+    a->exit = 1;
+    critical_section_leave(&a->lock);
+    thread_event_set(&a->queued_ev);
+    wait_thread(a->thread);
+    close_thread_handle(a->thread);
+
+    fb->async = NULL;
+    filebuf_async_free(fb, a);
+}
+
+int
+filebuf_flush(struct filebuf *fb)
+{
+    int ret;
+
+    if (!fb->writable) {
+        /* flush buffered data for read files */
+        fb->offset = filebuf_tell(fb);
+        fb->buffered = fb->consumed = 0;
+        return 0;
+    }
+
+    if (fb->async) {
+        ret = filebuf_async_submit(fb);
+        if (filebuf_async_wait(fb) < 0)
+            ret = -1;
+        return ret;
+    }
+
+    if (filebuf_write_at(fb, fb->buffer, fb->buffered, fb->offset) < 0)
+        return -1;
+    fb->offset += fb->buffered;
     fb->buffered = 0;
     return 0;
 }
@@ -180,13 +422,15 @@ filebuf_close(struct filebuf *fb)
     if (fb->users)
         return;
 
-#ifdef __APPLE__
+#if defined(__APPLE__) || defined(__linux__)
     if (fb->delete_on_close)
         unlink(fb->filename);
     else                        /* only flush if the file isn't deleted */
-#endif  /* __APPLE__ */
+#endif
     if (fb->writable)
         filebuf_flush(fb);
+    if (fb->async)
+        filebuf_async_stop(fb);
 #ifdef _WIN32
     CloseHandle(fb->file);
     if (fb->mapping)
@@ -225,7 +469,10 @@ filebuf_write(struct filebuf *fb, void *buf, size_t size)
         size -= n;
 
         if (fb->buffered == fb->buffer_max) {
-            if (filebuf_flush(fb) < 0)
+            /* in async mode, only wait for the writer thread if it is
+             * behind by all buffers */
+            if ((fb->async ? filebuf_async_submit(fb) :
+                 filebuf_flush(fb)) < 0)
                 return -1;
         }
     }
@@ -309,6 +556,72 @@ filebuf_read(struct filebuf *fb, void *buf, size_t size)
     return b - (uint8_t *)buf;
 }
 
+/* Unbuffered positional read, which neither uses nor disturbs the
+ * buffered read position, and can be issued from several threads at
+ * once. */
+int
+filebuf_pread(struct filebuf *fb, void *buf, size_t size, off_t offset)
+{
+    uint8_t *b = buf;
+#ifdef _WIN32
+    OVERLAPPED o = { };
+    DWORD ret;
+
+    o.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!o.hEvent) {
+        Wwarn("%s: CreateEvent failed", __FUNCTION__);
+        return -1;
+    }
+    while (size) {
+        o.Offset = offset;
+        o.OffsetHigh = offset >> 32ULL;
+        ret = 0;
+        if (!ReadFile(fb->file, b, (DWORD)size, &ret, &o) &&
+            GetLastError() != ERROR_IO_PENDING) {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+            _set_errno(GetLastError());
+            Wwarn("%s: ReadFile failed", __FUNCTION__);
+            CloseHandle(o.hEvent);
+            return -1;
+        }
+        if (!GetOverlappedResult(fb->file, &o, &ret, TRUE)) {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+            _set_errno(GetLastError());
+            Wwarn("%s: GetOverlappedResult failed", __FUNCTION__);
+            CloseHandle(o.hEvent);
+            return -1;
+        }
+        if (!ret)
+            break;
+        b += ret;
+        size -= ret;
+        offset += ret;
+    }
+    CloseHandle(o.hEvent);
+#else  /* _WIN32 */
+    ssize_t ret;
+
+    while (size) {
+        ret = pread(fb->file, b, size, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            warn("%s: pread failed", __FUNCTION__);
+            return -1;
+        }
+        if (!ret)
+            break;
+        b += ret;
+        size -= ret;
+        offset += ret;
+    }
+#endif  /* _WIN32 */
+
+    return b - (uint8_t *)buf;
+}
+
 int
 filebuf_skip(struct filebuf *fb, size_t size)
 {
@@ -349,17 +662,18 @@ filebuf_tell(struct filebuf *fb)
 off_t
 filebuf_seek(struct filebuf *fb, off_t offset, int whence)
 {
+    off_t pos = 0;
 
-    filebuf_flush(fb);
-    fb->eof = 0;
     switch (whence) {
     case FILEBUF_SEEK_SET:
-        fb->offset = offset;
+        pos = offset;
         break;
     case FILEBUF_SEEK_CUR:
-        fb->offset += offset;
+        pos = filebuf_tell(fb) + offset;
         break;
     case FILEBUF_SEEK_END: {
+        /* the size includes everything written so far */
+        filebuf_flush(fb);
 #ifdef _WIN32
         LARGE_INTEGER size;
         if (!GetFileSizeEx(fb->file, &size))
@@ -370,18 +684,41 @@ filebuf_seek(struct filebuf *fb, off_t offset, int whence)
         if (fb->end == -1)
             err(1, "%s: lseek(SEEK_END) failed", __FUNCTION__);
 #endif /* _WIN32 */
-        fb->offset = fb->end + offset;
+        pos = fb->end + offset;
     }
         break;
     }
-    return fb->offset;
+
+    /* only give up the buffer when the seek leaves it: a write buffer
+     * covers the file from fb->offset, a read buffer up to fb->offset */
+    if (fb->writable) {
+        if (pos == filebuf_tell(fb))
+            return pos;
+        /* queued async writes carry their own offset, so the seek need
+         * not wait for them */
+        if ((fb->async ? filebuf_async_submit(fb) : filebuf_flush(fb)) < 0)
+            return -1;
+    } else {
+        if (pos >= fb->offset - (off_t)fb->buffered && pos <= fb->offset) {
+            fb->consumed = fb->buffered - (fb->offset - pos);
+            return pos;
+        }
+        filebuf_flush(fb);
+    }
+
+    fb->eof = 0;
+    fb->offset = pos;
+    return pos;
 }
 
 void
 filebuf_buffer_max(struct filebuf *fb, size_t new_buffer_max)
 {
+    int async = !!fb->async;
 
     filebuf_flush(fb);
+    if (async)
+        filebuf_async_stop(fb);
 
     fb->buffer_max = new_buffer_max;
     do {
@@ -393,6 +730,9 @@ filebuf_buffer_max(struct filebuf *fb, size_t new_buffer_max)
                 errx(1, "%s: out of memory", __FUNCTION__);
         }
     } while (!fb->buffer);
+
+    if (async && filebuf_async_start(fb))
+        warnx("%s: async writer not restarted", __FUNCTION__);
 }
 
 int
@@ -422,6 +762,12 @@ _filebuf_mmap(struct filebuf *fb, off_t offset, size_t len,
 #ifdef _WIN32
     HANDLE h = INVALID_HANDLE_VALUE;
     SYSTEM_INFO si;
+#endif  /* _WIN32 */
+
+    if (fb->async)
+        filebuf_async_wait(fb);
+
+#ifdef _WIN32
 
     if (!align_mask) {
         GetSystemInfo(&si);
@@ -499,6 +845,9 @@ filebuf_set_zero_data(struct filebuf *fb, off_t offset, size_t len)
 #ifdef _WIN32
     FILE_ZERO_DATA_INFORMATION fzdi = { };
 
+    if (fb->async)
+        filebuf_async_wait(fb);
+
     fzdi.FileOffset.QuadPart = offset;
     fzdi.BeyondFinalZero.QuadPart = offset + len + 1;
     if (!DeviceIoControl(fb->file, FSCTL_SET_ZERO_DATA,
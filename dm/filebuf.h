@@ -7,6 +7,8 @@
 #ifndef _FILEBUF_H_
 #define _FILEBUF_H_
 
+struct filebuf_async;
+
 struct filebuf {
 #ifdef _WIN32
     HANDLE file;
@@ -25,9 +27,10 @@ struct filebuf {
     int eof;
     size_t buffer_max;
     uint8_t *mapping;
-#ifdef __APPLE__
+#ifndef _WIN32
     size_t mapping_len;
 #endif
+    struct filebuf_async *async;
 };
 
 struct filebuf *filebuf_open(const char *fn, const char *mode);
@@ -35,6 +38,7 @@ int filebuf_set_readable(struct filebuf *fb);
 int filebuf_flush(struct filebuf *fb);
 int filebuf_read(struct filebuf *fb, void *buf, size_t size);
 int filebuf_write(struct filebuf *fb, void *buf, size_t size);
+int filebuf_pread(struct filebuf *fb, void *buf, size_t size, off_t offset);
 void filebuf_close(struct filebuf *fb);
 struct filebuf *filebuf_openref(struct filebuf *fb);
 int filebuf_skip(struct filebuf *fb, size_t size);
@@ -8,6 +8,7 @@
 #include <dm/qemu/net.h>
 
 #include <dm/block.h>
+#include <dm/cksum.h>
 #include <dm/dmpdev.h>
 #include <dm/hw.h>
 #include <dm/firmware.h>
@@ -141,66 +142,19 @@ struct tcphdr {
 };
 
 
-uint16_t
-checksum (uint8_t *packet, size_t len, uint32_t sum)
-{
-
-    // make 16 bit words out of every two adjacent 8 bit words in the packet
-    // and add them up
-    while (len > 1) {
-        uint16_t w = ((packet[0] << 8) & 0xFF00) + (packet[1] & 0xFF);
-        sum += w;
-        packet += 2;
-        len -= 2;
-    }
-
-    if (len)
-        sum += packet[0] << 8;
-
-    // take only 16 bits out of the 32 bit sum and add up the carries
-    while (sum >> 16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
-
-    // one's complement the result
-    sum = ~sum;
-
-    return (uint16_t) sum;
-}
-
-static uint32_t
-partial_sum (void *_d, size_t len)
-{
-    uint8_t *packet = (uint8_t *) _d;
-    uint32_t sum = 0;
-
-    while (len > 1) {
-        uint16_t w = ((packet[0] << 8) & 0xFF00) + (packet[1] & 0xFF);
-        sum += w;
-        packet += 2;
-        len -= 2;
-    }
-
-    return sum;
-}
-
 static void
 fix_checksum_udp (uint32_t saddr, uint32_t daddr, uint8_t *packet,
                   size_t len)
 {
     struct udphdr *u = (struct udphdr *) packet;
 #if 0
-    uint32_t sum = 0;
     if (len < sizeof (struct udphdr))
         return;
 
     u->uh_sum = 0;
-
-    sum += partial_sum (&saddr, sizeof (saddr));
-    sum += partial_sum (&daddr, sizeof (daddr));
-    sum += 11 << 8;
-    sum += len;
-
-    u->uh_sum = htons (checksum (packet, len, sum));
+    u->uh_sum = cksum_fold (cksum_partial (packet, len,
+                                           cksum_pseudo (saddr, daddr, 17,
+                                                         len)));
 
     debug_printf("fixed udp checksum to %04x\n", ntohs(u->uh_sum));
 #else
@@ -216,18 +170,13 @@ fix_checksum_tcp (uint32_t saddr, uint32_t daddr, uint8_t *packet,
                   size_t len)
 {
     struct tcphdr *t = (struct tcphdr *) packet;
-    uint32_t sum = 0;
     if (len < sizeof (struct tcphdr))
         return;
 
     t->th_sum = 0;
-
-    sum += partial_sum (&saddr, sizeof (saddr));
-    sum += partial_sum (&daddr, sizeof (daddr));
-    sum += 6;
-    sum += len;
-
-    t->th_sum = htons (checksum (packet, len, sum));
+    t->th_sum = cksum_fold (cksum_partial (packet, len,
+                                           cksum_pseudo (saddr, daddr, 6,
+                                                         len)));
 
     // debug_printf("fixed tcp checksum to %04x\n", ntohs(t->th_sum));
 
@@ -247,7 +196,7 @@ fix_checksum_ip (uint8_t *packet, size_t len)
         return;
 
     i->check = 0;
-    i->check = htons (checksum (packet, sizeof (struct iphdr), 0));
+    i->check = cksum_fold (cksum_partial (packet, sizeof (struct iphdr), 0));
 
     len -= hl;
     packet += hl;
@@ -295,6 +244,82 @@ fix_checksum (uint8_t *packet, size_t len)
     fix_checksum_ip (packet, len);
 }
 
+/* as copying the pieces of a frame and fix_checksum, but TCP segments are
+ * summed as they are copied rather than in a second pass over the frame --
+ * what is summed is the segment with its old checksum, which is then taken
+ * back out.  The IP and TCP headers must be in the first piece, and all
+ * pieces but the last of an even length from the TCP header on */
+static void
+copy_fix_checksum (uint8_t *dst, const struct iovec *iov, int iovcnt,
+                   size_t len)
+{
+    struct ethhdr *e = (struct ethhdr *) dst;
+    struct iphdr *i = (struct iphdr *) (dst + sizeof (struct ethhdr));
+    struct tcphdr *t;
+    const uint8_t *src = iov[0].iov_base;
+    size_t hl, ilen, l, off = sizeof (struct ethhdr) + sizeof (struct iphdr);
+    uint32_t sum;
+    int n;
+
+    if (iov[0].iov_len < off)
+        goto slow;
+    memcpy (dst, src, off);
+
+    if (e->prot != htons (0x800) || i->protocol != 6)
+        goto slow;
+    hl = i->ihl << 2;
+    ilen = ntohs (i->tot_len);
+    if (hl < sizeof (struct iphdr) || ilen < hl + sizeof (struct tcphdr))
+        goto slow;
+    off = sizeof (struct ethhdr) + hl;
+    if (iov[0].iov_len < off + sizeof (struct tcphdr))
+        goto slow;
+    if (iovcnt == 1) {
+        if (len < sizeof (struct ethhdr) + ilen)
+            goto slow;
+    } else {
+        if (len != sizeof (struct ethhdr) + ilen ||
+            ((iov[0].iov_len - off) & 1))
+            goto slow;
+        for (n = 1; n < iovcnt - 1; n++)
+            if (iov[n].iov_len & 1)
+                goto slow;
+    }
+
+    memcpy (dst + sizeof (struct ethhdr) + sizeof (struct iphdr),
+            src + sizeof (struct ethhdr) + sizeof (struct iphdr),
+            hl - sizeof (struct iphdr));
+    ilen -= hl;
+    if (iovcnt == 1) {
+        sum = cksum_copy (dst + off, src + off, ilen, 0);
+        memcpy (dst + off + ilen, src + off + ilen, len - off - ilen);
+    } else {
+        sum = cksum_copy (dst + off, src + off, iov[0].iov_len - off, 0);
+        l = iov[0].iov_len;
+        for (n = 1; n < iovcnt; n++) {
+            sum = cksum_copy (dst + l, iov[n].iov_base, iov[n].iov_len, sum);
+            l += iov[n].iov_len;
+        }
+    }
+
+    t = (struct tcphdr *) (dst + off);
+    sum += (uint16_t) ~t->th_sum;
+    t->th_sum = cksum_fold (sum + cksum_pseudo (i->saddr, i->daddr, 6, ilen));
+
+    i->check = 0;
+    i->check = cksum_fold (cksum_partial (i, sizeof (struct iphdr), 0));
+    return;
+
+slow:
+    for (n = 0, l = 0; n < iovcnt && l < len; n++) {
+        size_t c = MIN (iov[n].iov_len, len - l);
+
+        memcpy (dst + l, iov[n].iov_base, c);
+        l += c;
+    }
+    fix_checksum (dst, len);
+}
+
 
 #endif
 
@@ -642,12 +667,15 @@ uxen_net_can_receive (VLANClientState *nc)
 }
 
 
+/* nickel hands over frames as headers + payload, this is the one copy of
+ * the payload on the way to the ring */
 static ssize_t
-uxen_net_receive (VLANClientState *nc, const uint8_t *buf, size_t size)
+uxen_net_receive_iov (VLANClientState *nc, const struct iovec *iov,
+                      int iovcnt)
 {
     uxen_net_t *s = DO_UPCAST (NICState, nc, nc)->opaque;
     uxen_net_packet_t *p = packet_new();
-    //unsigned int len;
+    size_t size = iov_size (iov, iovcnt);
 
     if (!p) return 0;
 
@@ -657,14 +685,13 @@ uxen_net_receive (VLANClientState *nc, const uint8_t *buf, size_t size)
     p->state = PACKET_IDLE;
     p->len = size;
 
-    memcpy (p->packet->data, buf, size);
-
     if (size < ETH_MINTU)  {
+        iov_to_buf (iov, iovcnt, p->packet->data, 0, size);
         memset(p->packet->data + size, 0, ETH_MINTU - size);
         p->len = ETH_MINTU;
-    }
-
-    fix_checksum (p->packet->data, p->len);
+        fix_checksum (p->packet->data, p->len);
+    } else
+        copy_fix_checksum (p->packet->data, iov, iovcnt, size);
 
 #if PCAP
     s->pcap_last_tx_nr = uxen_net_log_packet (s, p->packet->data, p->len, 0);
@@ -682,6 +709,17 @@ uxen_net_receive (VLANClientState *nc, const uint8_t *buf, size_t size)
     return size;
 }
 
+static ssize_t
+uxen_net_receive (VLANClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *) buf,
+        .iov_len = size,
+    };
+
+    return uxen_net_receive_iov (nc, &iov, 1);
+}
+
 
 /*********************** RX path ***************************/
 
@@ -792,6 +830,7 @@ static NetClientInfo uxen_net_net_info = {
     .size = sizeof (NICState),
     .can_receive = uxen_net_can_receive,
     .receive = uxen_net_receive,
+    .receive_iov = uxen_net_receive_iov,
     .cleanup = uxen_net_cleanup,
 };
 
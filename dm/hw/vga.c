@@ -48,7 +48,7 @@
 #include <dm/console.h>
 #include <dm/qemu/hw/pci.h>
 #include <dm/vmstate.h>
-#include <lz4.h>
+#include <dm/vram.h>
 
 #include "vga.h"
 
@@ -1811,34 +1811,22 @@ const MemoryRegionOps vga_mem_ops = {
     },
 };
 
+/* in the vram's tiled format, which also reads the single LZ4 stream
+ * VGA RAM used to be saved as */
 static int
 get_vga_ram(QEMUFile *f, void *pv, size_t size)
 {
     uint8_t *vmem_ptr = *(uint8_t **)pv;
-    void *tmp;
-    size_t len;
 
-    len = qemu_get_be32(f);
-    tmp = malloc(len);
-    qemu_get_buffer(f, tmp, len);
-    LZ4_decompress_fast(tmp, (void *)vmem_ptr, VGA_RAM_SIZE);
-    free(tmp);
-
-    return 0;
+    return vram_get_buffer(f, vmem_ptr, VGA_RAM_SIZE);
 }
 
 static void
 put_vga_ram(QEMUFile *f, void *pv, size_t size)
 {
-    uint8_t *vmem_ptr = *(uint8_t **)pv;
-    void *tmp;
-    size_t len;
-
-    tmp = malloc(LZ4_compressBound(VGA_RAM_SIZE));
-    len = LZ4_compress((void *)vmem_ptr, tmp, VGA_RAM_SIZE);
-    qemu_put_be32(f, len);
-    qemu_put_buffer(f, tmp, len);
-    free(tmp);
+    VGAState *s = container_of(pv, VGAState, vmem_ptr);
+
+    vram_put_buffer(f, &s->vmem_tiles, s->vmem_ptr, VGA_RAM_SIZE);
 }
 
 const VMStateInfo vmstate_info_vga_ram = {
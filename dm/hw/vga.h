@@ -105,6 +105,7 @@ typedef struct VGAState {
     uint32_t last_ch_attr[CH_ATTR_SIZE]; /* XXX: make it dynamic */
     uint8_t vram_dirty[VGA_DIRTY_BITMAP_SIZE];
     uint8_t *vmem_ptr;
+    struct vram_tiles vmem_tiles; /* VGA RAM as last saved */
 } VGAState;
 
 static inline int c6_to_8(int v)
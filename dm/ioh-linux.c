@@ -0,0 +1,677 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+
+#include "dm.h"
+#include "ioh.h"
+#include "timer.h"
+#include "queue.h"
+
+#ifndef LIBIMG
+#include "async-op.h"
+#endif
+
+WaitObjects wait_objects;
+struct io_handler_queue io_handlers;
+
+#ifdef DEBUG_WAITOBJECTS
+int trace_waitobjects = 0;
+#define trace_waitobjects_print(fmt, ...) if (trace_waitobjects) dprintf(fmt, ## __VA_ARGS__)
+#else
+#define trace_waitobjects_print(fmt, ...) do { ; } while(0)
+#endif
+
+#if 0
+#define delay_log(fmt, ...) do {		\
+	debug_printf(fmt, ## __VA_ARGS__);	\
+    } while (0)
+#else
+#define delay_log(fmt, ...) do { ; } while(0)
+#endif
+
+/*
+ * Every fd and event stays registered with the epoll set of its
+ * WaitObjects from ioh_add_wait_* until ioh_del_wait_*, so a wait is a
+ * single epoll_wait() and only ready objects are looked at afterwards.
+ *
+ * The epoll data of an fd is the fd tagged with bit 0, which indexes
+ * w->fd_index to find its slot in w->events/w->desc.  The epoll data of
+ * an event is the ioh_event itself, and 0 is the interrupt eventfd.
+ *
+ * Events are edge-triggered: the eventfd stays readable until the event
+ * is reset, which happens before its callback runs.  Fds are
+ * level-triggered, like the select() they replace, since callers don't
+ * necessarily read until EAGAIN.
+ */
+#define IOH_EPOLL_EVENTS 256
+#define IOH_EPOLL_FD 1ULL
+
+void
+ioh_waitobjects_grow(WaitObjects *w)
+{
+    w->max += 8;
+    w->events = realloc(w->events, sizeof(ioh_wait_event) * w->max);
+    w->desc = realloc(w->desc, sizeof(WaitObjectsDesc) * w->max);
+}
+
+static void
+fd_index_set(WaitObjects *w, int fd, int num)
+{
+
+    if (fd >= w->fd_index_max) {
+        int max = w->fd_index_max ? w->fd_index_max : 64;
+
+        while (max <= fd)
+            max *= 2;
+        w->fd_index = realloc(w->fd_index, max * sizeof(w->fd_index[0]));
+        if (!w->fd_index)
+            err(1, "%s: realloc failed", __FUNCTION__);
+        memset(&w->fd_index[w->fd_index_max], 0xff,
+               (max - w->fd_index_max) * sizeof(w->fd_index[0]));
+        w->fd_index_max = max;
+    }
+
+    w->fd_index[fd] = num;
+}
+
+static inline int
+fd_index_get(WaitObjects *w, int fd)
+{
+
+    return fd >= 0 && fd < w->fd_index_max ? w->fd_index[fd] : -1;
+}
+
+static uint32_t
+poll_to_epoll(int events)
+{
+    uint32_t e = 0;
+
+    if (events & POLLIN)
+        e |= EPOLLIN;
+    if (events & POLLOUT)
+        e |= EPOLLOUT;
+    if (events & POLLERR)
+        e |= EPOLLPRI;
+
+    return e;
+}
+
+/* report what select() would have: hangup and errors make an fd
+ * readable and writable, exceptional conditions are only out-of-band
+ * data */
+static int
+epoll_to_poll(uint32_t e, int events)
+{
+    int revents = 0;
+
+    if (e & (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+        revents |= POLLIN;
+    if (e & (EPOLLOUT | EPOLLERR))
+        revents |= POLLOUT;
+    if (e & EPOLLPRI)
+        revents |= POLLERR;
+
+    return revents & events;
+}
+
+static int
+ioh_add_wait(int fd, int events, WaitObjects *w)
+{
+    struct epoll_event eev;
+    int num;
+
+    assert(w != NULL);
+
+    num = fd_index_get(w, fd);
+    if (num >= 0 && !w->desc[num].del) {
+        debug_printf("%s: fd %d already waited on\n", __FUNCTION__, fd);
+        return -1;
+    }
+
+    memset(&eev, 0, sizeof(eev));
+    eev.events = poll_to_epoll(events);
+    eev.data.u64 = ((uint64_t)fd << 1) | IOH_EPOLL_FD;
+    if (epoll_ctl(w->queue_fd, EPOLL_CTL_ADD, fd, &eev) == -1) {
+        Wwarn("%s: epoll_ctl(ADD, %d) failed", __FUNCTION__, fd);
+        return -1;
+    }
+
+    if (w->num == w->max)
+        ioh_waitobjects_grow(w);
+
+    w->events[w->num].fd = fd;
+    w->events[w->num].events = events;
+    w->events[w->num].revents = 0;
+
+    w->desc[w->num].del = 0;
+
+#ifdef DEBUG_WAITOBJECTS
+    w->desc[w->num].func_name = __FUNCTION__;
+    w->desc[w->num].triggered = 0;
+#endif
+
+    fd_index_set(w, fd, w->num);
+
+    return w->num++;
+}
+
+int
+ioh_add_wait_fd(int fd, int events, WaitObjectFunc2 *func2, void *opaque,
+                WaitObjects *w)
+{
+    int num;
+
+    if (w == NULL)
+        w = &wait_objects;
+
+    num = ioh_add_wait(fd, events, w);
+    if (num < 0)
+        return -1;
+
+    w->desc[num].func2 = func2;
+    w->desc[num].opaque = opaque;
+
+    return 0;
+}
+
+void ioh_init_wait_objects(WaitObjects *w)
+{
+    struct epoll_event eev;
+
+    w->num = 0;
+    w->events = NULL;
+    w->desc = NULL;
+    w->max = 0;
+    w->del_state = WO_OK;
+    w->queue_len = 0;
+    w->fd_index = NULL;
+    w->fd_index_max = 0;
+    w->queue_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->queue_fd < 0)
+        err(1, "%s: epoll_create1 failed", __FUNCTION__);
+
+    w->interrupt = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((int)w->interrupt < 0)
+        err(1, "%s: eventfd failed", __FUNCTION__);
+
+    memset(&eev, 0, sizeof(eev));
+    eev.events = EPOLLIN | EPOLLET;
+    eev.data.u64 = 0;
+    if (epoll_ctl(w->queue_fd, EPOLL_CTL_ADD, w->interrupt, &eev) == -1)
+        err(1, "%s: epoll_ctl failed", __FUNCTION__);
+}
+
+void ioh_wait_interrupt(WaitObjects *w)
+{
+    uint64_t one = 1;
+
+    if (write(w->interrupt, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        err(1, "%s: write failed", __FUNCTION__);
+}
+
+static void interrupt_reset(WaitObjects *w)
+{
+    uint64_t val;
+
+    if (read(w->interrupt, &val, sizeof(val)) == -1 && errno != EAGAIN)
+        err(1, "%s: read failed", __FUNCTION__);
+}
+
+void ioh_cleanup_wait_objects(WaitObjects *w)
+{
+    close(w->queue_fd);
+    close(w->interrupt);
+    free(w->fd_index);
+    w->fd_index = NULL;
+    w->fd_index_max = 0;
+}
+
+#ifndef DEBUG_WAITOBJECTS
+int ioh_add_wait_object(ioh_event *event, WaitObjectFunc *func, void *opaque,
+                        WaitObjects *w)
+#else
+int _ioh_add_wait_object(ioh_event *event, WaitObjectFunc *func, void *opaque,
+                         WaitObjects *w, const char *func_name)
+#endif
+{
+    struct epoll_event eev;
+
+    if (w == NULL)
+	w = &wait_objects;
+
+    event->func = func;
+    event->opaque = opaque;
+#ifdef DEBUG_WAITOBJECTS
+    event->func_name = func_name;
+#endif
+
+    /* an event that is already set is reported by the first wait */
+    memset(&eev, 0, sizeof(eev));
+    eev.events = EPOLLIN | EPOLLET;
+    eev.data.ptr = event;
+    if (epoll_ctl(w->queue_fd, EPOLL_CTL_ADD, event->fd, &eev) == -1)
+        err(1, "%s: epoll_ctl failed - fd %d", __FUNCTION__, event->fd);
+
+    w->queue_len++;
+
+    return 0;
+}
+
+static void ioh_gc_del_fds(WaitObjects *w)
+{
+    int i = -1, j;
+    if (!w)
+        w = &wait_objects;
+    while (++i < w->num) {
+        if (!w->desc[i].del)
+           continue;
+        j = i+1;
+        while (j < w->num && w->desc[j].del)
+            j++;
+        if (j < w->num) {
+            memmove(&w->events[i], &w->events[j],
+                    (w->num - j) * sizeof(w->events[0]));
+            memmove(&w->desc[i], &w->desc[j],
+                    (w->num - j) * sizeof(w->desc[0]));
+        }
+        w->num -= (j-i);
+    }
+    for (i = 0; i < w->num; i++)
+        fd_index_set(w, w->events[i].fd, i);
+}
+
+void ioh_del_wait_fd(int fd, WaitObjects *w)
+{
+    int i;
+
+    if (w == NULL)
+        w = &wait_objects;
+
+    i = fd_index_get(w, fd);
+    if (i < 0 || w->desc[i].del) {
+        debug_printf("ioh_del_wait_object: fd %d not found in %s\n",
+                     fd, w == &wait_objects ? "main" : "block");
+        debug_break();
+        return;
+    }
+
+    /* the fd may already be closed, which removed it from the set */
+    if (epoll_ctl(w->queue_fd, EPOLL_CTL_DEL, fd, NULL) == -1 &&
+        errno != EBADF && errno != ENOENT)
+        Wwarn("%s: epoll_ctl(DEL, %d) failed", __FUNCTION__, fd);
+    w->fd_index[fd] = -1;
+
+    if (w->del_state != WO_OK) {
+        w->desc[i].del = 1;
+        w->del_state = WO_GC;
+        return;
+    }
+    w->num--;
+    if (i < w->num) {
+	memmove(&w->events[i], &w->events[i + 1],
+		(w->num - i) * sizeof(w->events[0]));
+	memmove(&w->desc[i], &w->desc[i + 1],
+		(w->num - i) * sizeof(w->desc[0]));
+        for (; i < w->num; i++)
+            fd_index_set(w, w->events[i].fd, i);
+    }
+}
+
+/* change the interest set of a waited on fd in place, which unlike a
+ * del/add pair does not shift the other fds in w->events */
+int ioh_mod_wait_fd(int fd, int events, WaitObjects *w)
+{
+    struct epoll_event eev;
+    int i;
+
+    if (w == NULL)
+        w = &wait_objects;
+
+    i = fd_index_get(w, fd);
+    if (i < 0 || w->desc[i].del) {
+        debug_printf("%s: fd %d not found in %s\n", __FUNCTION__,
+                     fd, w == &wait_objects ? "main" : "block");
+        return -1;
+    }
+
+    if (w->events[i].events == events)
+        return 0;
+
+    memset(&eev, 0, sizeof(eev));
+    eev.events = poll_to_epoll(events);
+    eev.data.u64 = ((uint64_t)fd << 1) | IOH_EPOLL_FD;
+    if (epoll_ctl(w->queue_fd, EPOLL_CTL_MOD, fd, &eev) == -1) {
+        Wwarn("%s: epoll_ctl(MOD, %d) failed", __FUNCTION__, fd);
+        return -1;
+    }
+    w->events[i].events = events;
+
+    return 0;
+}
+
+void ioh_del_wait_object(ioh_event *event, WaitObjects *w)
+{
+
+    if (w == NULL)
+	w = &wait_objects;
+
+    if (epoll_ctl(w->queue_fd, EPOLL_CTL_DEL, event->fd, NULL) == -1)
+        err(1, "%s: epoll_ctl failed", __FUNCTION__);
+
+    /* don't run it if it was reported by the wait being dispatched */
+    if (event->processq) {
+        TAILQ_REMOVE(event->processq, event, link);
+        event->processq = NULL;
+    }
+
+    w->queue_len--;
+}
+
+#if defined(CONFIG_NETEVENT)
+static void
+ioh_object_signalled(void *context, int events)
+{
+    IOHandlerRecord *ioh = (IOHandlerRecord *)context;
+
+    if (ioh->deleted)
+        return;
+
+#define IOH_READ_EVENTS (POLLIN | POLLERR)
+#define IOH_WRITE_EVENTS (POLLOUT | POLLERR)
+    if (events) {
+        if (ioh->fd_read)
+            if (events & IOH_READ_EVENTS)
+                ioh->fd_read(ioh->read_opaque);
+
+        if (ioh->fd_write)
+            if (events & IOH_WRITE_EVENTS)
+                ioh->fd_write(ioh->write_opaque);
+    }
+}
+#endif  /* CONFIG_NETEVENT */
+
+void ioh_wait_for_objects(struct io_handler_queue *iohq,
+                          WaitObjects *w, TimerQueue *active_timers,
+                          int *timeout, int *ret_wait)
+{
+    IOHandlerRecord *ioh, *next;
+    struct epoll_event eev[IOH_EPOLL_EVENTS];
+    int ret, ev, interrupted = 0;
+    int64_t tmp_ts;
+#ifdef DEBUG_WAITOBJECTS
+    uint64_t t1, t2, t3, t4;
+#endif
+    ioh_event_queue events = TAILQ_HEAD_INITIALIZER(events);
+
+    if (ret_wait)
+        *ret_wait = 0;
+
+    if (iohq) {
+        critical_section_enter(&iohq->lock);
+        TAILQ_FOREACH_SAFE(ioh, &iohq->queue, queue, next) {
+#if defined(CONFIG_NETEVENT)
+            int events = 0;
+
+            if (ioh->fd != -1 && !ioh->deleted) {
+                if (ioh->fd_read &&
+                    (!ioh->fd_read_poll ||
+                     ioh->fd_read_poll(ioh->read_opaque) != 0)) {
+                    events |= POLLIN | POLLERR;
+                }
+                if (ioh->fd_write &&
+                    (!ioh->fd_write_poll ||
+                     ioh->fd_write_poll(ioh->write_opaque) != 0)) {
+                    events |= POLLOUT | POLLERR;
+                }
+            }
+            if (events != ioh->object_events) {
+                if (ioh->object_events)
+                    ioh_del_wait_fd(ioh->fd, w);
+                if (events)
+                    ioh_add_wait_fd(ioh->fd, events, ioh_object_signalled,
+                                    ioh, w);
+                ioh->object_events = events;
+            }
+#endif  /* CONFIG_NETEVENT */
+        }
+        assert(!iohq->wait_queue);
+        iohq->wait_queue = w;
+        critical_section_leave(&iohq->lock);
+    }
+
+#ifndef LIBIMG
+    if (active_timers) {
+        timer_deadline(active_timers, rt_clock, timeout);
+        timer_deadline(active_timers, vm_clock, timeout);
+    }
+#endif
+
+#ifdef DEBUG_WAITOBJECTS
+    t1 = os_get_clock();
+#endif
+
+    if (ret_wait)
+        tmp_ts = os_get_clock_ms();
+    ret = epoll_wait(w->queue_fd, eev, IOH_EPOLL_EVENTS, *timeout);
+    if (ret_wait)
+        *ret_wait += (int) (os_get_clock_ms() - tmp_ts);
+    if (ret == -1)
+        ret = errno == EINTR ? 0 : -errno;
+
+    /* events are queued here so that deleting one from a callback
+     * dispatched before it keeps it from running */
+    for (ev = 0; ev < ret; ev++) {
+        ioh_event *event;
+
+        if (eev[ev].data.u64 & IOH_EPOLL_FD)
+            continue;
+        if (!eev[ev].data.u64) {
+            interrupted = 1;
+            continue;
+        }
+        event = eev[ev].data.ptr;
+        if (event->processq)
+            continue;
+        event->processq = &events;
+        TAILQ_INSERT_TAIL(&events, event, link);
+    }
+
+#ifndef LIBIMG
+#ifdef DEBUG_WAITOBJECTS
+    if (trace_waitobjects) {
+        t2 = os_get_clock();
+        trace_waitobjects_print("wait for events %d: pcount %"PRIx64
+                                "/%x\n", w->num, (t2 - t1) / SCALE_MS,
+                                *timeout);
+    }
+    t2 = os_get_clock();
+    if ((t2 - t1) / SCALE_MS > *timeout + 1)
+        delay_log("W %05"PRId64" - late %"PRId64" past %"PRId64
+                  " tout %d\n", (t2 / SCALE_MS) % 100000,
+                  ((t2 - t1) / SCALE_MS) - *timeout,
+                  ((t1 / SCALE_MS) + *timeout) % 10000,
+                  *timeout);
+#endif
+    if (active_timers) {
+        run_timers(active_timers, vm_clock);
+        run_timers(active_timers, rt_clock);
+    }
+#ifdef DEBUG_WAITOBJECTS
+    t3 = os_get_clock();
+#endif
+#endif
+    if (ret > 0) {
+        ioh_event *event;
+
+        w->del_state = WO_PROTECT;
+        for (ev = 0; ev < ret; ev++) {
+            int num, fd;
+
+            if (!(eev[ev].data.u64 & IOH_EPOLL_FD))
+                continue;
+            fd = eev[ev].data.u64 >> 1;
+            num = fd_index_get(w, fd);
+            if (num < 0 || w->desc[num].del)
+                continue;
+            w->events[num].revents = epoll_to_poll(eev[ev].events,
+                                                   w->events[num].events);
+            if (!w->events[num].revents)
+                continue;
+#ifdef DEBUG_WAITOBJECTS
+            trace_waitobjects_print("event fn %p/%s\n", w->desc[num].func,
+                                    w->desc[num].func_name);
+            w->desc[num].triggered++;
+#endif
+            if (w->desc[num].func2)
+                w->desc[num].func2(w->desc[num].opaque,
+                                   w->events[num].revents);
+#ifdef DEBUG_WAITOBJECTS
+            t4 = os_get_clock();
+            if ((t4 - t3) > SCALE_MS)
+                delay_log("F %05"PRId64" - callback %s took %"PRId64
+                          ".%03"PRId64"\n",
+                          (t4 / SCALE_MS) % 100000, w->desc[num].func_name,
+                          ((t4 - t3) / SCALE_MS) % 10000,
+                          ((t4 - t3) / SCALE_US) % 1000);
+#endif
+        }
+        while ((event = TAILQ_FIRST(&events))) {
+            TAILQ_REMOVE(&events, event, link);
+            event->processq = NULL;
+#ifdef DEBUG_WAITOBJECTS
+            trace_waitobjects_print("event fn %p/%s\n", event->func,
+                                    event->func_name);
+#endif
+            ioh_event_reset(event);
+            if (event->func)
+                event->func(event->opaque);
+#ifdef DEBUG_WAITOBJECTS
+            t4 = os_get_clock();
+            if ((t4 - t3) > SCALE_MS)
+                delay_log("F %05"PRId64" - callback %s took %"PRId64
+                          ".%03"PRId64"\n",
+                          (t4 / SCALE_MS) % 100000, event->func_name,
+                          ((t4 - t3) / SCALE_MS) % 10000,
+                          ((t4 - t3) / SCALE_US) % 1000);
+#endif
+        }
+        if (w->del_state == WO_GC)
+            ioh_gc_del_fds(w);
+        w->del_state = WO_OK;
+    } else if (ret == 0) {
+        trace_waitobjects_print("timeout\n");
+    } else {
+        debug_printf("epoll_wait error %d\n", ret);
+        for (ev = 0; ev < w->num; ev++) {
+#ifndef DEBUG_WAITOBJECTS
+            debug_printf("object %d: fd %d cb %p\n", ev, w->events[ev].fd,
+                         w->desc[ev].func);
+#else
+            debug_printf("object %d: fd %d cb %p/%s\n", ev, w->events[ev].fd,
+                         w->desc[ev].func,
+                         w->desc[ev].func_name);
+#endif
+        }
+    }
+
+    /* remove deleted IO handlers */
+    if (iohq) {
+        critical_section_enter(&iohq->lock);
+        assert(iohq->wait_queue);
+        iohq->wait_queue = NULL;
+        TAILQ_FOREACH_SAFE(ioh, &iohq->queue, queue, next) {
+#if defined(CONFIG_NETEVENT)
+            if (ioh->deleted) {
+                TAILQ_REMOVE(&iohq->queue, ioh, queue);
+                if (ioh->object_events)
+                    ioh_del_wait_fd(ioh->fd, w);
+                free(ioh);
+            }
+#endif  /* CONFIG_NETEVENT */
+        }
+        critical_section_leave(&iohq->lock);
+    }
+    if (interrupted)
+        interrupt_reset(w);
+
+#ifndef LIBIMG
+    if (active_timers) {
+#ifdef DEBUG_WAITOBJECTS
+        t3 = os_get_clock();
+#endif
+        run_timers(active_timers, vm_clock);
+        run_timers(active_timers, rt_clock);
+#ifdef DEBUG_WAITOBJECTS
+        t4 = os_get_clock();
+        if ((t4 - t3) > 2 * SCALE_MS)
+            delay_log("T %05"PRId64" - tail timers took %"PRId64
+                      ".%03"PRId64"\n",
+                      (t4 / SCALE_MS) % 100000, ((t4 - t3) / SCALE_MS) % 10000,
+                      ((t4 - t3) / SCALE_US) % 1000);
+#endif
+    }
+#endif
+}
+
+void host_main_loop_wait(int *timeout)
+{
+
+#ifndef LIBIMG
+    ioh_wait_for_objects(&io_handlers, &wait_objects, main_active_timers, timeout, NULL);
+#else
+    ioh_wait_for_objects(&io_handlers, &wait_objects, NULL, timeout, NULL);
+#endif
+
+#ifndef LIBIMG
+    async_op_process(NULL);
+#endif
+}
+
+#ifdef DEBUG_WAITOBJECTS
+void
+ic_wo(struct Monitor *mon)
+{
+    int i;
+    WaitObjects *w = &wait_objects;
+
+    for (i = 0; i < w->num; i++) {
+        debug_printf("wo %d fn %p %30s triggered %10d\n", i, w->desc[i].func,
+                     w->desc[i].func_name, w->desc[i].triggered);
+    }
+}
+
+static void
+clear_wo(void)
+{
+    int i;
+    WaitObjects *w = &wait_objects;
+
+    for (i = 0; i < w->num; i++) {
+        w->desc[i].triggered = 0;
+    }
+}
+
+#ifdef MONITOR
+void
+mc_clear_stats(Monitor *mon, const dict args)
+{
+    void ioreqstat_clear(void);
+
+    clear_wo();
+    ioreqstat_clear();
+}
+#endif  /* MONITOR */
+
+#endif	/* DEBUG_WAITOBJECTS */
@@ -269,6 +269,28 @@ void ioh_del_wait_fd(int fd, WaitObjects *w)
     }
 }
 
+int ioh_mod_wait_fd(int fd, int events, WaitObjects *w)
+{
+    int i;
+
+    if (w == NULL)
+        w = &wait_objects;
+
+    for (i = 0; i < w->num; i++)
+        if (!w->desc[i].del && w->events[i].fd == fd)
+            break;
+
+    if (i == w->num) {
+        debug_printf("%s: fd %d not found in %s\n", __FUNCTION__,
+                     fd, w == &wait_objects ? "main" : "block");
+        return -1;
+    }
+
+    w->events[i].events = events;
+
+    return 0;
+}
+
 void ioh_del_wait_object(ioh_event *event, WaitObjects *w)
 {
     struct kevent kev;
@@ -72,9 +72,13 @@ struct WaitObjects {
     ioh_wait_event *events;
     WaitObjectsDesc *desc;
     int max;
-#ifdef __APPLE__
+#if defined(__APPLE__) || defined(__linux__)
     int queue_fd;
     int queue_len;
+#endif
+#ifdef __linux__
+    int *fd_index;
+    int fd_index_max;
 #endif
     uintptr_t interrupt;
     critical_section lock;
@@ -152,6 +156,7 @@ int ioh_add_wait_fd(int fd, int events, WaitObjectFunc2 *func2, void *opaque,
                     WaitObjects *w);
 void ioh_del_wait_object(ioh_event *event, WaitObjects *w);
 void ioh_del_wait_fd(int fd, WaitObjects *w);
+int ioh_mod_wait_fd(int fd, int events, WaitObjects *w);
 
 int ioh_set_np_handler2(ioh_handle np,
                          IOCanRWHandler *np_read_poll,
@@ -118,7 +118,7 @@ mmio_compare_key(void *ctx, const void *b, const void *key)
 	(fhp->addr >= pnp->mmio_addr &&
 	 fhp->addr + fhp->size < pnp->mmio_addr + pnp->mmio_size))
 	return 0;
-    return pnp->mmio_addr - fhp->addr;
+    return pnp->mmio_addr < fhp->addr ? -1 : 1;
 }
 
 static int
@@ -130,6 +130,8 @@ mmio_compare_nodes(void *ctx, const void *parent, const void *node)
 }
 
 static rb_tree_t mmio_rbtree;
+/* bumped whenever regions are (un)registered, for users caching lookups */
+unsigned int mmio_generation = 0;
 static const rb_tree_ops_t mmio_rbtree_ops = {
     .rbto_compare_nodes = mmio_compare_nodes,
     .rbto_compare_key = mmio_compare_key,
@@ -137,11 +139,122 @@ static const rb_tree_ops_t mmio_rbtree_ops = {
     .rbto_context = NULL
 };
 
+/* The regions in address order, rebuilt from the rbtree whenever it
+ * changes, for lookups by binary search behind a small cache of the
+ * regions last hit, indexed by page.  Cache entries are checked against
+ * the region they point at, so they need no invalidation. */
+struct mmio_range {
+    uint64_t start;
+    uint64_t end;
+    int index;
+};
+
+#define MMIO_HIT_CACHE_SHIFT 6
+#define MMIO_HIT_CACHE (1 << MMIO_HIT_CACHE_SHIFT)
+
+static struct mmio_range *mmio_ranges = NULL;
+static int nr_mmio_ranges = 0;
+static int mmio_hit_cache[MMIO_HIT_CACHE];
+
+static int
+mmio_range_compare(const void *a, const void *b)
+{
+    const struct mmio_range *ra = a, *rb = b;
+
+    return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+static void
+mmio_ranges_rebuild(void)
+{
+    struct mmio_range *ranges, *old;
+    struct mmio *mmio;
+    int nr = 0;
+
+    RB_TREE_FOREACH(mmio, &mmio_rbtree)
+        nr++;
+    ranges = calloc(nr ? nr : 1, sizeof(*ranges));
+    if (ranges == NULL)
+        err(1, "calloc");
+    nr = 0;
+    RB_TREE_FOREACH(mmio, &mmio_rbtree) {
+        ranges[nr].start = mmio->mmio_addr;
+        ranges[nr].end = mmio->mmio_addr + mmio->mmio_size;
+        ranges[nr].index = mmio->mmio_index;
+        nr++;
+    }
+    qsort(ranges, nr, sizeof(*ranges), mmio_range_compare);
+
+    old = mmio_ranges;
+    mmio_ranges = ranges;
+    nr_mmio_ranges = nr;
+    free(old);
+
+    mmio_generation++;
+}
+
+/* Return the range containing addr, or NULL with *pos set to the first
+ * range above addr. */
+static inline struct mmio_range *
+mmio_range_find(uint64_t addr, int *pos)
+{
+    /* BARs are aligned alike, hash the page to spread them */
+    int *hit = &mmio_hit_cache[((addr >> 12) * 0x9e3779b97f4a7c15ULL) >>
+                               (64 - MMIO_HIT_CACHE_SHIFT)];
+    struct mmio_range *r;
+    int n = nr_mmio_ranges, half;
+
+    if (*hit < n) {
+        r = &mmio_ranges[*hit];
+        if (addr >= r->start && addr < r->end)
+            return r;
+    }
+    if (!n) {
+        *pos = 0;
+        return NULL;
+    }
+
+    /* last range starting at or below addr, without branching on the
+     * comparisons */
+    r = mmio_ranges;
+    while (n > 1) {
+        half = n / 2;
+        r = r[half].start <= addr ? r + half : r;
+        n -= half;
+    }
+    if (r->start > addr) {
+        *pos = 0;
+        return NULL;
+    }
+    if (addr >= r->end) {
+        *pos = r - mmio_ranges + 1;
+        return NULL;
+    }
+
+    *hit = r - mmio_ranges;
+    return r;
+}
+
+/* as the rbtree lookup with a (addr, width) key did */
+static inline struct mmio_range *
+mmio_range_access(uint64_t addr, uint32_t width)
+{
+    struct mmio_range *r;
+    int pos;
+
+    r = mmio_range_find(addr, &pos);
+    if (r && addr + width >= r->end)
+        r = NULL;
+
+    return r;
+}
+
 void
 mmio_init(void)
 {
 
     rb_tree_init(&mmio_rbtree, &mmio_rbtree_ops);
+    mmio_ranges_rebuild();
 }
 
 void
@@ -163,19 +276,19 @@ register_mmio(uint64_t addr, uint64_t size, int index)
     if (mmio->mmio_addr != addr)
 	errx(1, "register_mmio addr mismatch");
     mmio->mmio_index = index;
+
+    mmio_ranges_rebuild();
 }
 
 int
 mmio_index(uint64_t addr)
 {
-    struct mmio_key mmio_key;
-    struct mmio *mmio;
+    struct mmio_range *r;
+    int pos;
 
-    mmio_key.addr = addr;
-    mmio_key.size = 0;
-    mmio = rb_tree_find_node(&mmio_rbtree, &mmio_key);
+    r = mmio_range_find(addr, &pos);
 
-    return mmio ? mmio->mmio_index : -1;
+    return r ? r->index : -1;
 }
 
 void
@@ -190,6 +303,7 @@ unregister_mmio(uint64_t addr)
     if (mmio) {
 	rb_tree_remove_node(&mmio_rbtree, mmio);
 	free(mmio);
+	mmio_ranges_rebuild();
     } else
 	warnx("unregister_mmio(%"PRIx64") not found", addr);
 }
@@ -197,16 +311,12 @@ unregister_mmio(uint64_t addr)
 int
 mmio_write(uint64_t addr, uint32_t val, uint32_t width)
 {
-    struct mmio_key mmio_key;
-    struct mmio *mmio;
+    struct mmio_range *r;
 
-    mmio_key.addr = addr;
-    mmio_key.size = width;
-    mmio = rb_tree_find_node(&mmio_rbtree, &mmio_key);
-    if (mmio) {
-	assert(mmio->mmio_index < max_iomem);
-	iomem[mmio->mmio_index].write[width](iomem[mmio->mmio_index].opaque,
-					     addr, val);
+    r = mmio_range_access(addr, width);
+    if (r) {
+	assert(r->index < max_iomem);
+	iomem[r->index].write[width](iomem[r->index].opaque, addr, val);
 	return 0;
     } else {
 	//warnx("mmio_write(%"PRIx64"/%d, %x) not found", addr, width, val);
@@ -217,19 +327,53 @@ mmio_write(uint64_t addr, uint32_t val, uint32_t width)
 int
 mmio_read(uint64_t addr, uint32_t width, uint32_t *val)
 {
-    struct mmio_key mmio_key;
-    struct mmio *mmio;
+    struct mmio_range *r;
 
-    mmio_key.addr = addr;
-    mmio_key.size = width;
-    mmio = rb_tree_find_node(&mmio_rbtree, &mmio_key);
-    if (mmio) {
-	assert(mmio->mmio_index < max_iomem);
-	*val = iomem[mmio->mmio_index].
-	  read[width](iomem[mmio->mmio_index].opaque, addr);
+    r = mmio_range_access(addr, width);
+    if (r) {
+	assert(r->index < max_iomem);
+	*val = iomem[r->index].read[width](iomem[r->index].opaque, addr);
 	return 0;
     } else {
 	// warnx("mmio_read(%"PRIx64"/%d) not found", addr, width);
 	return -1;
     }
 }
+
+/* Find the MMIO region containing addr and return its index, with
+ * [*start, *end) set to the region.  If there is none, return -1 with
+ * [*start, *end) set to the gap between the regions around addr. */
+int
+mmio_extent(uint64_t addr, uint64_t *start, uint64_t *end)
+{
+    struct mmio_range *r;
+    int pos;
+
+    r = mmio_range_find(addr, &pos);
+    if (r) {
+        *start = r->start;
+        *end = r->end;
+        return r->index;
+    }
+
+    *start = pos ? mmio_ranges[pos - 1].end : 0;
+    *end = pos < nr_mmio_ranges ? mmio_ranges[pos].start : UINT64_MAX;
+    return -1;
+}
+
+/* accesses to a region already looked up with mmio_extent() */
+void
+mmio_region_write(int index, uint64_t addr, uint32_t val, uint32_t width)
+{
+
+    assert(index < max_iomem);
+    iomem[index].write[width](iomem[index].opaque, addr, val);
+}
+
+uint32_t
+mmio_region_read(int index, uint64_t addr, uint32_t width)
+{
+
+    assert(index < max_iomem);
+    return iomem[index].read[width](iomem[index].opaque, addr);
+}
@@ -16,12 +16,17 @@ void unregister_iomem(int index);
 
 IOMemWriteFunc **get_iomem_write(int index);
 
+extern unsigned int mmio_generation;
+
 void mmio_init(void);
 void register_mmio(uint64_t addr, uint64_t size, int index);
 int mmio_index(uint64_t addr);
 void unregister_mmio(uint64_t addr);
 int mmio_write(uint64_t addr, uint32_t val, uint32_t width);
 int mmio_read(uint64_t addr, uint32_t width, uint32_t *val);
+int mmio_extent(uint64_t addr, uint64_t *start, uint64_t *end);
+void mmio_region_write(int index, uint64_t addr, uint32_t val, uint32_t width);
+uint32_t mmio_region_read(int index, uint64_t addr, uint32_t width);
 
 struct iomem_region {
     IOMemReadFunc *read[3];
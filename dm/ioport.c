@@ -7,12 +7,13 @@
 #include "config.h"
 
 #include <err.h>
+#include <stdarg.h>
 #include <stdint.h>
 
 #include "compiler.h"
+#include "mr.h"
 #include "ioport.h"
 #include "lib.h"
-#include "mr.h"
 #include "xen.h"
 
 #include "rbtree.h"
@@ -64,6 +65,11 @@ ioport_compare_nodes(void *ctx, const void *parent, const void *node)
 }
 
 static rb_tree_t ioport_rbtree;
+/* ports indexed directly for ioport_read/ioport_write, the rbtree is
+ * kept for walks over neighbouring ports */
+static struct ioport *ioport_table[MAX_IOPORTS];
+/* bumped whenever ports are (un)registered, for users caching lookups */
+unsigned int ioport_generation = 0;
 static const rb_tree_ops_t ioport_rbtree_ops = {
     .rbto_compare_nodes = ioport_compare_nodes,
     .rbto_compare_key = ioport_compare_key,
@@ -139,7 +145,7 @@ ioport_read(ioport_width_t width, uint32_t address)
     };
     struct ioport *ioport;
 
-    ioport = rb_tree_find_node(&ioport_rbtree, &address);
+    ioport = address < MAX_IOPORTS ? ioport_table[address] : NULL;
     if (ioport && ioport->ioport_read_table[width])
 	return (ioport->ioport_read_table[width])(ioport->opaque, address);
     return default_fn[width](NULL, address);
@@ -155,13 +161,47 @@ ioport_write(ioport_width_t width, uint32_t address, uint32_t data)
     };
     struct ioport *ioport;
 
-    ioport = rb_tree_find_node(&ioport_rbtree, &address);
+    ioport = address < MAX_IOPORTS ? ioport_table[address] : NULL;
     if (ioport && ioport->ioport_write_table[width])
 	return (ioport->ioport_write_table[width])(ioport->opaque, address,
 						   data);
     return default_fn[width](NULL, address, data);
 }
 
+/* Find the ports around address which share its handlers' opaque, less
+ * than a dword apart, and return 0 with [*start, *end) set to them.  If
+ * address is unclaimed, return -1 with [*start, *end) set to the gap
+ * between the ports around it. */
+int
+ioport_extent(uint32_t address, uint32_t *start, uint32_t *end)
+{
+    struct ioport *ioport, *next;
+
+    ioport = rb_tree_find_node(&ioport_rbtree, &address);
+    if (ioport == NULL) {
+        next = rb_tree_find_node_leq(&ioport_rbtree, &address);
+        *start = next ? next->ioport + 1 : 0;
+        next = rb_tree_find_node_geq(&ioport_rbtree, &address);
+        *end = next ? next->ioport : MAX_IOPORTS;
+        return -1;
+    }
+
+    *start = ioport->ioport;
+    next = ioport;
+    while ((next = rb_tree_iterate(&ioport_rbtree, next, RB_DIR_LEFT)) &&
+           next->opaque == ioport->opaque && *start - next->ioport <= 4)
+        *start = next->ioport;
+
+    *end = ioport->ioport;
+    next = ioport;
+    while ((next = rb_tree_iterate(&ioport_rbtree, next, RB_DIR_RIGHT)) &&
+           next->opaque == ioport->opaque && next->ioport - *end <= 4)
+        *end = next->ioport;
+    (*end)++;
+
+    return 0;
+}
+
 static int
 register_ioport_fn(uint32_t start, uint32_t length, uint32_t size,
 		   void *func, void *opaque, int is_write)
@@ -173,6 +213,8 @@ register_ioport_fn(uint32_t start, uint32_t length, uint32_t size,
     bsize = ioport_width(size, "register_ioport_%s: invalid size",
 			 is_write ? "write" : "read");
 
+    ioport_generation++;
+
     for (address = start; address < start + length; address += size) {
 	ioport = rb_tree_find_node(&ioport_rbtree, &address);
 	if (ioport == NULL) {
@@ -181,6 +223,8 @@ register_ioport_fn(uint32_t start, uint32_t length, uint32_t size,
 		err(1, "calloc");
 	    ioport->ioport = address;
 	    rb_tree_insert_node(&ioport_rbtree, ioport);
+	    if (address < MAX_IOPORTS)
+		ioport_table[address] = ioport;
 	}
 	if (is_write)
 	    ioport->ioport_write_table[bsize] = func;
@@ -212,9 +256,13 @@ unregister_ioport_ops(uint32_t start, uint32_t length)
     uint32_t address;
     struct ioport *ioport;
 
+    ioport_generation++;
+
     for (address = start; address < start + length; address++) {
 	ioport = rb_tree_find_node(&ioport_rbtree, &address);
 	if (ioport) {
+	    if (address < MAX_IOPORTS)
+		ioport_table[address] = NULL;
 	    rb_tree_remove_node(&ioport_rbtree, ioport);
 	    free(ioport);
 	}
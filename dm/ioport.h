@@ -37,9 +37,12 @@ struct ioport_region_list {
 typedef enum ioport_width { IOPORT_WIDTH0 = 0, IOPORT_WIDTH1 = 1,
 			    IOPORT_WIDTH2 = 2 } ioport_width_t;
 
+extern unsigned int ioport_generation;
+
 void ioport_init(void);
 uint32_t ioport_read(ioport_width_t width, uint32_t address);
 void ioport_write(ioport_width_t width, uint32_t address, uint32_t data);
+int ioport_extent(uint32_t address, uint32_t *start, uint32_t *end);
 
 int register_ioport_ops(uint32_t start, uint32_t length, uint32_t size,
 			IOPortOps *ops, void *opaque);
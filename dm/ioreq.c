@@ -9,15 +9,19 @@
 #include <err.h>
 #include <stdint.h>
 
+#include "dict.h"
 #include "dm.h"
 #include "introspection.h"
+#include "iomem.h"
 #include "ioh.h"
 #include "ioport.h"
 #include "ioreq.h"
 #include "mapcache.h"
 #include "memory.h"
 #include "monitor.h"
+#include "queue.h"
 #include "timer.h"
+#include "trace.h"
 #include "uxen.h"
 #include "vm.h"
 
@@ -88,6 +92,7 @@ ioreqstat_clear(void)
     LIST_FOREACH(isp, &ioreqstat_list, is_list)
 	isp->is_triggered = 0;
     ioreq_count = 0;
+    ioreq_stats_clear();
 }
 
 void
@@ -127,6 +132,28 @@ ioreqstat_update(ioreq_t *req)
     }
 }
 
+void
+ic_ioreq_stats(Monitor *mon)
+{
+    dict d;
+    char *buf;
+    size_t len, off, n;
+
+    d = ioreq_stats_dict();
+    if (!d)
+        return;
+    if (!dict_write_buf(d, &buf, &len)) {
+        /* monitor_printf truncates at 4k */
+        for (off = 0; off < len; off += n) {
+            n = len - off < 2048 ? len - off : 2048;
+            monitor_printf(mon, "%.*s", (int)n, buf + off);
+        }
+        monitor_printf(mon, "\n");
+        free(buf);
+    }
+    dict_free(d);
+}
+
 void
 ic_ioreq(Monitor *mon)
 {
@@ -155,12 +182,299 @@ ic_ioreq(Monitor *mon)
 }
 #endif  /* MONITOR */
 
+/*
+ * Always-on per-device statistics: requests are attributed to the port
+ * range or MMIO region handling them, and counted per vcpu with a log2
+ * histogram of the time spent handling them.  A vcpu only ever has one
+ * request in flight, so its counters are updated without locking; the
+ * lock only covers looking up and creating devices, which each vcpu
+ * mostly avoids with a small cache of the devices it last hit.
+ */
+
+#define IOREQ_HIST_BUCKETS 32   /* [2^i, 2^(i+1)) ns, last is open ended */
+#define IOREQ_DEV_CACHE 4
+
+enum ioreq_dev_type {
+    IOREQ_DEV_PIO,
+    IOREQ_DEV_MMIO,
+    IOREQ_DEV_PCI_CONFIG,
+    IOREQ_DEV_INTROSPECTION,
+    IOREQ_DEV_TYPES
+};
+
+static const char *ioreq_dev_type_name[IOREQ_DEV_TYPES] = {
+    [IOREQ_DEV_PIO] = "pio",
+    [IOREQ_DEV_MMIO] = "mmio",
+    [IOREQ_DEV_PCI_CONFIG] = "pci-config",
+    [IOREQ_DEV_INTROSPECTION] = "introspection",
+};
+
+struct ioreq_dev_vcpu {
+    uint64_t count;
+    uint64_t ns;
+    uint64_t max_ns;
+    uint64_t hist[IOREQ_HIST_BUCKETS];
+};
+
+struct ioreq_dev {
+    int type;
+    int claimed;
+    uint64_t start;
+    uint64_t end;
+    LIST_ENTRY(ioreq_dev) link;
+    struct ioreq_dev_vcpu vcpu[];
+};
+
+struct ioreq_dev_cache {
+    struct ioreq_dev *dev;
+    int type;
+    unsigned int gen;
+    uint64_t start;
+    uint64_t end;
+};
+
+static LIST_HEAD(, ioreq_dev) ioreq_devs = LIST_HEAD_INITIALIZER(&ioreq_devs);
+static critical_section ioreq_devs_lock;
+static struct ioreq_dev_cache (*ioreq_dev_cache)[IOREQ_DEV_CACHE];
+static unsigned int ioreq_nr_vcpus;
+
+static unsigned int
+ioreq_dev_gen(int type)
+{
+
+    switch (type) {
+    case IOREQ_DEV_PIO:
+        return ioport_generation;
+    case IOREQ_DEV_MMIO:
+        return mmio_generation;
+    default:
+        return 0;
+    }
+}
+
+static struct ioreq_dev *
+ioreq_dev_lookup(int type, uint64_t addr, uint64_t *start, uint64_t *end)
+{
+    struct ioreq_dev *dev;
+    uint32_t pstart, pend;
+    int claimed;
+
+    switch (type) {
+    case IOREQ_DEV_PIO:
+        claimed = ioport_extent(addr, &pstart, &pend) == 0;
+        *start = pstart;
+        *end = pend;
+        break;
+    case IOREQ_DEV_MMIO:
+        claimed = mmio_extent(addr, start, end) != -1;
+        break;
+    default:
+        claimed = 1;
+        *start = 0;
+        *end = UINT64_MAX;
+        break;
+    }
+
+    /* unclaimed accesses of a type all go to one device, whatever gap
+     * between devices they fall in */
+    LIST_FOREACH(dev, &ioreq_devs, link)
+        if (dev->type == type && dev->claimed == claimed &&
+            (!claimed || (dev->start == *start && dev->end == *end)))
+            return dev;
+
+    dev = calloc(1, sizeof(*dev) +
+                 ioreq_nr_vcpus * sizeof(struct ioreq_dev_vcpu));
+    if (!dev)
+        return NULL;
+    dev->type = type;
+    dev->claimed = claimed;
+    dev->start = claimed ? *start : 0;
+    dev->end = claimed ? *end : 0;
+    LIST_INSERT_HEAD(&ioreq_devs, dev, link);
+
+    return dev;
+}
+
+static void
+ioreq_stats_update(unsigned int vcpu, ioreq_t *req, uint64_t ns)
+{
+    struct ioreq_dev_cache *c;
+    struct ioreq_dev_vcpu *v;
+    unsigned int gen;
+    int type, i, b;
+
+    if (vcpu >= ioreq_nr_vcpus)
+        return;
+
+    switch (req->type) {
+    case IOREQ_TYPE_PIO:
+        type = IOREQ_DEV_PIO;
+        break;
+    case IOREQ_TYPE_COPY:
+        type = IOREQ_DEV_MMIO;
+        break;
+    case IOREQ_TYPE_PCI_CONFIG:
+        type = IOREQ_DEV_PCI_CONFIG;
+        break;
+    case IOREQ_TYPE_INTROSPECTION:
+        type = IOREQ_DEV_INTROSPECTION;
+        break;
+    default:
+        return;
+    }
+
+    gen = ioreq_dev_gen(type);
+    c = ioreq_dev_cache[vcpu];
+    for (i = 0; i < IOREQ_DEV_CACHE; i++)
+        if (c[i].dev && c[i].type == type && c[i].gen == gen &&
+            req->addr >= c[i].start && req->addr < c[i].end)
+            break;
+    if (i == IOREQ_DEV_CACHE) {
+        /* miss, replace the least recently hit entry */
+        i = IOREQ_DEV_CACHE - 1;
+        critical_section_enter(&ioreq_devs_lock);
+        c[i].dev = ioreq_dev_lookup(type, req->addr, &c[i].start, &c[i].end);
+        critical_section_leave(&ioreq_devs_lock);
+        if (!c[i].dev)
+            return;
+        c[i].type = type;
+        c[i].gen = gen;
+    }
+    if (i) {
+        struct ioreq_dev_cache hit = c[i];
+
+        memmove(&c[1], &c[0], i * sizeof(c[0]));
+        c[0] = hit;
+    }
+
+    v = &c[0].dev->vcpu[vcpu];
+    v->count++;
+    v->ns += ns;
+    if (ns > v->max_ns)
+        v->max_ns = ns;
+    b = ns ? 63 - __builtin_clzll(ns) : 0;
+    v->hist[b < IOREQ_HIST_BUCKETS ? b : IOREQ_HIST_BUCKETS - 1]++;
+}
+
+/* counters are read racily against the vcpus updating them, each
+ * value is consistent but they may be off by a request from each other */
+static int
+ioreq_dev_vcpu_put(dict d, const struct ioreq_dev_vcpu *v)
+{
+    dict hist;
+    int i, n;
+
+    dict_put_integer(d, "count", v->count);
+    dict_put_integer(d, "time-ns", v->ns);
+    dict_put_integer(d, "max-ns", v->max_ns);
+
+    hist = dict_array_new();
+    if (!hist)
+        return -1;
+    for (n = IOREQ_HIST_BUCKETS; n && !v->hist[n - 1]; n--)
+        ;
+    for (i = 0; i < n; i++)
+        _dict_array_put(hist, yajl_tree_new_integer(v->hist[i]));
+    _dict_put(d, "histogram", hist);
+
+    return 0;
+}
+
+dict
+ioreq_stats_dict(void)
+{
+    struct ioreq_dev *dev;
+    struct ioreq_dev_vcpu total;
+    dict d, devs, dd, vcpus, vd;
+    unsigned int vcpu;
+    int i;
+
+    d = dict_new();
+    devs = dict_array_new();
+    if (!d || !devs)
+        goto err;
+    _dict_put(d, "devices", devs);
+    dict_put_integer(d, "histogram-buckets", IOREQ_HIST_BUCKETS);
+    dict_put_string(d, "histogram-unit", "log2-ns");
+
+    critical_section_enter(&ioreq_devs_lock);
+    LIST_FOREACH(dev, &ioreq_devs, link) {
+        dd = dict_new();
+        vcpus = dict_array_new();
+        if (!dd || !vcpus) {
+            critical_section_leave(&ioreq_devs_lock);
+            dict_free(dd);
+            dict_free(vcpus);
+            goto err;
+        }
+        _dict_array_put(devs, dd);
+        dict_put_string(dd, "type", ioreq_dev_type_name[dev->type]);
+        if (!dev->claimed)
+            dict_put_boolean(dd, "unclaimed", true);
+        else if (dev->type == IOREQ_DEV_PIO || dev->type == IOREQ_DEV_MMIO) {
+            dict_put_stringf(dd, "start", "0x%"PRIx64, dev->start);
+            dict_put_stringf(dd, "end", "0x%"PRIx64, dev->end);
+        }
+
+        memset(&total, 0, sizeof(total));
+        for (vcpu = 0; vcpu < ioreq_nr_vcpus; vcpu++) {
+            const struct ioreq_dev_vcpu *v = &dev->vcpu[vcpu];
+
+            total.count += v->count;
+            total.ns += v->ns;
+            if (v->max_ns > total.max_ns)
+                total.max_ns = v->max_ns;
+            for (i = 0; i < IOREQ_HIST_BUCKETS; i++)
+                total.hist[i] += v->hist[i];
+
+            vd = dict_new();
+            if (!vd)
+                continue;
+            dict_put_integer(vd, "vcpu", vcpu);
+            ioreq_dev_vcpu_put(vd, v);
+            _dict_array_put(vcpus, vd);
+        }
+        ioreq_dev_vcpu_put(dd, &total);
+        _dict_put(dd, "vcpus", vcpus);
+    }
+    critical_section_leave(&ioreq_devs_lock);
+
+    return d;
+
+  err:
+    warnx("%s: allocation failed", __FUNCTION__);
+    if (d)
+        dict_free(d);
+    else if (devs)
+        dict_free(devs);
+    return NULL;
+}
+
+void
+ioreq_stats_clear(void)
+{
+    struct ioreq_dev *dev;
+
+    critical_section_enter(&ioreq_devs_lock);
+    LIST_FOREACH(dev, &ioreq_devs, link)
+        memset(dev->vcpu, 0, ioreq_nr_vcpus * sizeof(struct ioreq_dev_vcpu));
+    critical_section_leave(&ioreq_devs_lock);
+}
+
 void
 ioreq_init(void)
 {
+
+    critical_section_init(&ioreq_devs_lock);
+
     if (whpx_enable)
         return;
 
+    ioreq_dev_cache = calloc(vm_vcpus, sizeof(*ioreq_dev_cache));
+    if (ioreq_dev_cache == NULL)
+        err(1, "calloc");
+    ioreq_nr_vcpus = vm_vcpus;
+
     default_ioreq_state = ioreq_new_server();
     if (default_ioreq_state == NULL)
         errx(1, "ioreq_new_server failed");
@@ -306,42 +620,227 @@ static void ioreq_pio(ioreq_t *req)
     }
 }
 
+/* rep movs/stos are done a run of elements at a time, where a run is
+ * as many elements as lie in one MMIO region, or in RAM that can be
+ * mapped in one go, so that the mapping or region lookup is done once
+ * per run rather than once per element */
+#define IOREQ_MOVE_RUN_MAX (64 * UXEN_PAGE_SIZE)
+
+struct move_run {
+    uint64_t lo, hi;            /* RAM of the run */
+    uint64_t map_len;
+    uint8_t *ptr;
+    int mmio;                   /* iomem index, or -1 for RAM */
+};
+
+/* Start a run of at most n elements of size bytes, the first at addr and
+ * the following going up or down by size.  Returns the number of
+ * elements in the run, or 0 if the element at addr needs to go through
+ * vm_memory_rw(). */
+static uint32_t
+move_run_start(struct move_run *r, uint64_t addr, int sign, uint32_t size,
+               uint32_t n)
+{
+    uint64_t start, end;
+
+    r->mmio = mmio_extent(addr, &start, &end);
+    if (addr + size > end)
+        return 0;
+    if (sign > 0)
+        n = MIN(n, (end - addr) / size);
+    else
+        n = MIN(n, (addr + size - start) / size);
+
+    if (r->mmio != -1) {
+        /* vm_memory_rw() splits 64 bit and unaligned accesses */
+        if (size > sizeof(uint32_t) || (size & (size - 1)) ||
+            (addr & (size - 1)))
+            return 0;
+        return n;
+    }
+
+    n = MIN(n, IOREQ_MOVE_RUN_MAX / size);
+    r->lo = sign > 0 ? addr : addr + size - (uint64_t)n * size;
+    r->hi = r->lo + (uint64_t)n * size;
+    r->map_len = r->hi - r->lo;
+    r->ptr = mapcache_map(r->lo, &r->map_len, 0);
+    if (!r->ptr)
+        return 0;
+    if (r->map_len < r->hi - r->lo) {
+        /* a short mapping only covers the start of a run going up */
+        if (sign < 0 || r->map_len < size) {
+            mapcache_unmap(r->ptr, r->lo, r->map_len, 0);
+            return 0;
+        }
+        n = r->map_len / size;
+        r->hi = r->lo + (uint64_t)n * size;
+    }
+
+    return n;
+}
+
+static void
+move_run_end(struct move_run *r, int is_write)
+{
+
+    if (r->mmio != -1)
+        return;
+
+    mapcache_unmap(r->ptr, r->lo, r->map_len, 0);
+    if (is_write && xen_logdirty_enabled)
+        xc_hvm_modified_memory(xc_handle, vm_id, r->lo >> UXEN_PAGE_SHIFT,
+                               ((r->hi - 1) >> UXEN_PAGE_SHIFT) -
+                               (r->lo >> UXEN_PAGE_SHIFT) + 1);
+}
+
+/* single accesses of the element size, like memcpy_words() in
+ * vm_memory_rw(), so the guest doesn't see torn elements */
+static uint64_t
+move_run_read(struct move_run *r, uint64_t addr, uint32_t size)
+{
+    uint8_t *p;
+    uint64_t val = 0;
+
+    /* MMIO runs are of 1, 2 or 4 byte elements, width 0, 1 or 2 */
+    if (r->mmio != -1)
+        return mmio_region_read(r->mmio, addr, size >> 1);
+
+    p = r->ptr + (addr - r->lo);
+    switch (size) {
+    case 1:
+        val = *(volatile uint8_t *)p;
+        break;
+    case 2:
+        val = *(volatile uint16_t *)p;
+        break;
+    case 4:
+        val = *(volatile uint32_t *)p;
+        break;
+    case 8:
+        val = *(volatile uint64_t *)p;
+        break;
+    default:
+        memcpy(&val, p, size);
+        break;
+    }
+
+    return val;
+}
+
+static void
+move_run_write(struct move_run *r, uint64_t addr, uint32_t size, uint64_t val)
+{
+    uint8_t *p;
+
+    if (r->mmio != -1) {
+        mmio_region_write(r->mmio, addr, val & (0xffffffffU >> (32 - 8 * size)),
+                          size >> 1);
+        return;
+    }
+
+    p = r->ptr + (addr - r->lo);
+    switch (size) {
+    case 1:
+        *(volatile uint8_t *)p = val;
+        break;
+    case 2:
+        *(volatile uint16_t *)p = val;
+        break;
+    case 4:
+        *(volatile uint32_t *)p = val;
+        break;
+    case 8:
+        *(volatile uint64_t *)p = val;
+        break;
+    default:
+        memcpy(p, &val, size);
+        break;
+    }
+}
+
 static void ioreq_move(ioreq_t *req)
 {
-    int i, sign;
+    struct move_run src, dest;
+    uint64_t src_addr = 0, dest_addr = 0, tmp;
+    uint32_t i, j, n, ns, nd, size = req->size, misses = 0;
+    int sign, has_src, has_dest;
 
     if (req->size > sizeof(req->data))
         errx(1, "MMIO: bad size (%u)", req->size);
+    if (!req->size)
+        return;
 
     sign = req->df ? -1 : 1;
 
+    /* without data_is_ptr, one side is req->data itself */
     if (!req->data_is_ptr) {
-        if (req->dir == IOREQ_READ) {
-            for (i = 0; i < req->count; i++) {
-                read_physical(req->addr + (sign * i * req->size),
-                              req->size, &req->data);
-            }
-        } else if (req->dir == IOREQ_WRITE) {
-            for (i = 0; i < req->count; i++) {
-                write_physical(req->addr + (sign * i * req->size),
-                               req->size, &req->data);
-            }
-        }
+        if (req->dir == IOREQ_READ)
+            src_addr = req->addr;
+        else if (req->dir == IOREQ_WRITE)
+            dest_addr = req->addr;
+        else
+            return;
+        has_src = req->dir == IOREQ_READ;
+        has_dest = req->dir == IOREQ_WRITE;
     } else {
-        uint64_t tmp, src, dest;
-
         if (req->dir == IOREQ_READ) {
-            src = req->addr;
-            dest = req->data;
+            src_addr = req->addr;
+            dest_addr = req->data;
         } else if (req->dir == IOREQ_WRITE) {
-            src = req->data;
-            dest = req->addr;
+            src_addr = req->data;
+            dest_addr = req->addr;
         } else
             return;
-        for (i = 0; i < req->count; i++) {
-            read_physical(src + (sign * i * req->size), req->size, &tmp);
-            write_physical(dest + (sign * i * req->size), req->size, &tmp);
+        has_src = has_dest = 1;
+    }
+
+    for (i = 0; i < req->count; i += n) {
+        uint64_t s = src_addr + (int64_t)sign * i * size;
+        uint64_t d = dest_addr + (int64_t)sign * i * size;
+
+        /* back off from runs where the memory can't be mapped, trying
+         * one again at doubling intervals in case the rest of the
+         * request is back in RAM -- a run that maps resets misses */
+        n = misses < 2 || !(misses & (misses - 1)) ? req->count - i : 1;
+        ns = nd = 0;
+        if (n > 1 && has_src)
+            n = ns = move_run_start(&src, s, sign, size, n);
+        if (n > 1 && has_dest)
+            n = nd = move_run_start(&dest, d, sign, size, n);
+        if (n <= 1) {
+            misses++;
+            if (ns)
+                move_run_end(&src, 0);
+            if (nd)
+                move_run_end(&dest, 1);
+            /* single element, or one not in RAM or a known region */
+            n = 1;
+            tmp = req->data;
+            if (has_src)
+                read_physical(s, size, &tmp);
+            if (has_dest)
+                write_physical(d, size, &tmp);
+            else
+                req->data = tmp;
+            continue;
+        }
+
+        for (j = 0; j < n; j++) {
+            tmp = has_src ?
+                move_run_read(&src, s + (int64_t)sign * j * size, size) :
+                req->data;
+            if (has_dest)
+                move_run_write(&dest, d + (int64_t)sign * j * size, size,
+                               tmp);
         }
+        if (!has_dest)
+            memcpy(&req->data, &tmp, size);
+        misses = 0;
+
+        if (has_src)
+            move_run_end(&src, 0);
+        if (has_dest)
+            move_run_end(&dest, 1);
     }
 }
 
@@ -388,15 +887,15 @@ static void __handle_ioreq(ioreq_t *req)
 
 /* running time without periods spent in sleep state */
 static uint64_t
-unbiased_time_ms(void)
+unbiased_time_ns(void)
 {
 #if 0
     extern WINAPI BOOL QueryUnbiasedInterruptTime(PULONGLONG);
     ULONGLONG t = 0;
     QueryUnbiasedInterruptTime(&t);
-    return t / 10000;
+    return t * 100;
 #else
-    return os_get_clock() / SCALE_MS;
+    return os_get_clock();
 #endif
 }
 
@@ -411,12 +910,17 @@ handle_ioreq(void *opaque)
 
     if (req) {
         ioreq_t copy = *req;
-        t0 = unbiased_time_ms();
+        t0 = unbiased_time_ns();
 
         xen_rmb();
+        TRACE_BEGIN(TRACE_IOREQ_HANDLE, copy.addr, copy.type);
         __handle_ioreq(&copy);
+        TRACE_END(TRACE_IOREQ_HANDLE, 0, 0);
         req->data = copy.data;
 
+        t1 = unbiased_time_ns();
+        ioreq_stats_update(vcpu, &copy, t1 - t0);
+
         if (req->state != STATE_IOREQ_INPROCESS) {
             warnx("Badness in I/O request ... not in service?!: "
                   "%x, ptr: %x, port: %"PRIx64", "
@@ -433,12 +937,11 @@ handle_ioreq(void *opaque)
         uxen_user_notification_event_set(&ev->completed);
 	ioreq_count++;
 
-        t1 = unbiased_time_ms();
-        if (t1 - t0 >= LONG_IOREQ_MS)
+        if (t1 - t0 >= LONG_IOREQ_MS * SCALE_MS)
             debug_printf("long I/O request: %dms, dir=%d, "
                          "ptr: %x, port: %"PRIx64", "
                          "data: %"PRIx64", count: %u, size: %u\n",
-                         (int)(t1-t0),
+                         (int)((t1 - t0) / SCALE_MS),
                          req->dir, req->data_is_ptr, req->addr,
                          req->data, req->count, req->size);
     }
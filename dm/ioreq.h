@@ -7,6 +7,8 @@
 #ifndef _IOREQ_H_
 #define _IOREQ_H_
 
+#include "dict.h"
+
 #define NR_IOREQ_SERVERS 2
 
 struct ioreq_state;
@@ -32,4 +34,7 @@ void ioreq_init(void);
 struct ioreq_state *ioreq_new_server(void);
 void ioreq_wait_server_events(struct ioreq_state *);
 
+dict ioreq_stats_dict(void);
+void ioreq_stats_clear(void);
+
 #endif	/* _IOREQ_H_ */
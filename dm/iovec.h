@@ -9,11 +9,18 @@
 
 #include "os.h"
 
+#if defined(__linux__)
+#include <limits.h>
+#include <sys/uio.h>
+#else
 struct iovec {
     void *iov_base;
     size_t iov_len;
 };
+#endif
+#ifndef IOV_MAX
 #define IOV_MAX 1024
+#endif
 
 typedef struct IOVector {
     struct iovec *iov;
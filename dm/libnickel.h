@@ -56,9 +56,12 @@ void ni_vm_unpause(void);
 #ifndef _WIN32
 int ni_add_wait_fd(struct nickel *ni, int fd, int events, WaitObjectFunc2 *func2, void *opaque);
 void ni_del_wait_fd(struct nickel *ni, int fd);
+int ni_mod_wait_fd(struct nickel *ni, int fd, int events);
 #endif
 int ni_schedule_bh(struct nickel *ni, void (*async_cb)(void *), void (*finish_cb)(void *),
         void *opaque);
+int ni_schedule_bh_high(struct nickel *ni, void (*async_cb)(void *),
+        void (*finish_cb)(void *), void *opaque);
 int ni_schedule_bh_permanent(struct nickel *ni, void (*cb)(void *), void *opaque);
 int ni_rpc_ac_event(void *opaque, const char *id, const char *opt,
         dict d, void *command_opaque);
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _LINUX_H_
+#define _LINUX_H_
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <err.h>
+
+#include "queue.h"
+#include "typedef.h"
+
+static inline void *
+align_alloc(size_t alignment, size_t size)
+{
+    void *ptr;
+    int ret;
+
+    ret = posix_memalign(&ptr, alignment, size);
+    if (ret) {
+	warn("%s", __FUNCTION__);
+	return NULL;
+    }
+
+    return ptr;
+}
+
+static inline void
+align_free(void *ptr)
+{
+
+    free(ptr);
+}
+
+#define ALIGN_PAGE_ALIGN 0x1000
+#define page_align_alloc(size) align_alloc(ALIGN_PAGE_ALIGN, size)
+
+#define closesocket(s) close(s)
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define PRIdSIZE "zd"
+#define PRIuSIZE "zu"
+#define PRIxSIZE "zx"
+
+#define Werr(eval, fmt, ...) err(eval, fmt, ## __VA_ARGS__)
+#define Wwarn(fmt, ...) warn(fmt, ## __VA_ARGS__)
+
+#include <pthread.h>
+typedef pthread_mutex_t critical_section;
+void critical_section_init(critical_section *cs);
+void critical_section_enter(critical_section *cs);
+void critical_section_leave(critical_section *cs);
+void critical_section_free(critical_section *cs);
+
+/* events are eventfds, which stay readable from ioh_event_set() until
+ * ioh_event_reset() drains them, and are registered edge-triggered with
+ * the epoll set of each WaitObjects they are added to */
+#include <poll.h>
+typedef int ioh_handle;
+struct ioh_event_queue;
+typedef struct ioh_event {
+    int fd;
+    WaitObjectFunc *func;
+    void *opaque;
+    critical_section lock;
+    int signaled;
+    int valid;
+    const char *func_name;
+    struct ioh_event_queue *processq;
+    TAILQ_ENTRY(ioh_event) link;
+} ioh_event;
+
+typedef TAILQ_HEAD(ioh_event_queue, ioh_event) ioh_event_queue;
+
+typedef struct pollfd ioh_wait_event;
+
+#include <assert.h>
+#define assert_always(cond) assert(cond)
+
+void ioh_event_init(ioh_event *ev);
+void ioh_event_set(ioh_event *ev);
+void ioh_event_reset(ioh_event *ev);
+void ioh_event_wait(ioh_event *ev);
+void ioh_event_close(ioh_event *ev);
+
+static inline int ioh_event_valid(ioh_event *ev) {
+    return (ev->valid != 0);
+}
+int set_nofides(void);
+
+int file_exists(const char *path);
+
+typedef void *window_handle;
+
+typedef pthread_t uxen_thread;
+
+#define create_thread(thread, fn, arg) (({                              \
+                int ret = pthread_create(thread, NULL, fn, arg);        \
+                if (ret)                                                \
+                    *(thread) = 0;                                      \
+                ret;                                                    \
+            }))
+#define setcancel_thread() (({                                          \
+            int oldstate;                                               \
+            int ret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,     \
+                                             &oldstate);                \
+            if (!ret)                                                   \
+                ret = pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED,    \
+                                            &oldstate);                 \
+            ret;                                                        \
+            }))
+#define cancel_thread(thread) pthread_cancel(thread)
+#define elevate_thread(thread) do {} while(0)
+#define wait_thread(thread) pthread_join(thread, 0)
+#define detach_thread(thread) pthread_detach(thread)
+#define close_thread_handle(thread) do { } while(0)
+
+int generate_random_bytes(void *buf, size_t len);
+void cpu_usage(float *user, float *kernel, uint64_t *user_total_ms,
+               uint64_t *kernel_total_ms);
+
+#endif	/* _LINUX_H_ */
@@ -27,18 +27,96 @@
 #include <dm/qemu_glue.h>
 #include <dm/whpx/whpx.h>
 
-static HashTable ht;
-static LruCache lru;
-static critical_section cs;
-const int lru_cache_lines = 10;
+/*
+ * Guest memory is mapped in aligned windows of MAPCACHE_WINDOW_PAGES, each
+ * mapped once and shared by all requests falling inside it.  Requests
+ * straddling a window boundary, and requests in windows which could not
+ * be mapped whole (holes in guest memory), get a mapping of their exact
+ * page range instead.  Windows are spread over MAPCACHE_SHARDS shards by
+ * address, each with its own lock, hashtable and LRU.
+ */
+
+#define MAPCACHE_WINDOW_SHIFT 9         /* 2MB windows */
+#define MAPCACHE_WINDOW_PAGES (1 << MAPCACHE_WINDOW_SHIFT)
+#define MAPCACHE_SHARDS 16
+#define MAPCACHE_MIN_LOG_LINES 4
+#define MAPCACHE_MAX_LOG_LINES 16
+/* cap on address space used for mappings */
+#define MAPCACHE_MAX_MAPPED_MB (sizeof(void *) == 4 ? 512 : 65536)
+
+struct mapcache_shard {
+    critical_section cs;
+    HashTable ht;
+    LruCache lru;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t exact_maps;
+    uint64_t evictions;
+    uint64_t map_failures;
+    int pages_in_use;
+    int max_pages_in_use;
+};
+
+static struct mapcache_shard shards[MAPCACHE_SHARDS];
+static int lru_cache_lines;
+
+static inline int
+log2_roundup(uint64_t n)
+{
+    int l = 0;
+
+    while ((1ULL << l) < n)
+        l++;
+    return l;
+}
+
+static inline int
+log2_rounddown(uint64_t n)
+{
+    int l = 0;
+
+    while ((2ULL << l) <= n)
+        l++;
+    return l;
+}
 
 int
 mapcache_init(uint64_t mem_mb)
 {
+    uint64_t windows;
+    int i, max_lines;
+
+    if (!mem_mb)
+        mem_mb = vm_mem_mb;
+    if (mem_mb > MAPCACHE_MAX_MAPPED_MB)
+        mem_mb = MAPCACHE_MAX_MAPPED_MB;
+
+    /* enough lines to map all of guest ram in windows, with a quarter
+     * spare for exact mappings */
+    windows = (mem_mb << (20 - UXEN_PAGE_SHIFT)) >> MAPCACHE_WINDOW_SHIFT;
+    windows += windows / 4;
+    lru_cache_lines = log2_roundup((windows + MAPCACHE_SHARDS - 1) /
+                                   MAPCACHE_SHARDS);
+    if (lru_cache_lines < MAPCACHE_MIN_LOG_LINES)
+        lru_cache_lines = MAPCACHE_MIN_LOG_LINES;
+    if (lru_cache_lines > MAPCACHE_MAX_LOG_LINES)
+        lru_cache_lines = MAPCACHE_MAX_LOG_LINES;
+    /* every line may hold a whole window, keep them all within the cap */
+    max_lines = log2_rounddown(
+        (((uint64_t)MAPCACHE_MAX_MAPPED_MB << (20 - UXEN_PAGE_SHIFT)) >>
+         MAPCACHE_WINDOW_SHIFT) / MAPCACHE_SHARDS);
+    if (lru_cache_lines > max_lines)
+        lru_cache_lines = max_lines;
+
+    for (i = 0; i < MAPCACHE_SHARDS; i++) {
+        critical_section_init(&shards[i].cs);
+        hashtable_init(&shards[i].ht, NULL, NULL);
+        if (lru_cache_init(&shards[i].lru, lru_cache_lines))
+            return -1;
+    }
 
-    critical_section_init(&cs);
-    hashtable_init(&ht, NULL, NULL);
-    lru_cache_init(&lru, lru_cache_lines);
+    debug_printf("%s: %d shards of %d lines of %d pages\n", __FUNCTION__,
+                 MAPCACHE_SHARDS, 1 << lru_cache_lines, MAPCACHE_WINDOW_PAGES);
 
     return 0;
 }
@@ -66,133 +144,180 @@ mapcache_get_params(uint32_t *end_low_pfn,
         *end_high_pfn = 0;
 }
 
-static int debug_memcache_global_count = 0;
-static int debug_memcache_concurrent_count = 0;
-static int debug_memcache_max_count = 0;
-static int debug_memcache_map_count = 0;
-static int debug_memcache_cache_count = 0;
+/* Keys are the first page's address with the number of pages in the low
+ * bits, windows and exact ranges never collide since a range with the
+ * size and alignment of a window always fits in it. */
+static inline uint64_t
+mapcache_key(uint32_t pfn, int num_pages)
+{
 
-#if 0
-int
-mapcache_flush(void)
+    return ((uint64_t)pfn << UXEN_PAGE_SHIFT) | num_pages;
+}
+
+static inline struct mapcache_shard *
+mapcache_shard(uint32_t pfn)
 {
+
+    return &shards[(pfn >> MAPCACHE_WINDOW_SHIFT) % MAPCACHE_SHARDS];
+}
+
+/* find a line to reuse, unmapping what it held, NULL if all are in use */
+static LruCacheLine *
+mapcache_evict(struct mapcache_shard *s, uint64_t *line)
+{
+    LruCacheLine *cl;
     int i;
 
     for (i = 0; i < (1 << lru_cache_lines); i++) {
-        LruCacheLine *cl = &lru.lines[i];
-        if (cl->key) {
-            if (cl->value & (UXEN_PAGE_SIZE - 1))
-                continue;
-            assert(!(cl->value & (UXEN_PAGE_SIZE - 1)));
-            hashtable_delete(&ht, cl->key);
-            xc_munmap(xc_handle, vm_id, (void *)(cl->value & UXEN_PAGE_MASK),
-                      XC_PAGE_SIZE * (cl->key & (UXEN_PAGE_SIZE - 1)));
+        *line = lru_cache_evict_line(&s->lru);
+        cl = lru_cache_touch_line(&s->lru, *line);
+        if (!cl->key)
+            return cl;
+        if (!cl->users) {
+            hashtable_delete(&s->ht, cl->key);
+            if (cl->value)
+                xc_munmap(xc_handle, vm_id, (void *)cl->value,
+                          XC_PAGE_SIZE * (cl->key & (UXEN_PAGE_SIZE - 1)));
             cl->key = cl->value = 0;
+            s->evictions++;
+            return cl;
         }
     }
 
-    return 0;
+    return NULL;
+}
+
+static LruCacheLine *
+mapcache_lookup(struct mapcache_shard *s, uint32_t pfn, int num_pages,
+                int is_window)
+{
+    uint64_t key = mapcache_key(pfn, num_pages);
+    uint64_t line;
+    LruCacheLine *cl;
+
+    if (hashtable_find(&s->ht, key, &line)) {
+        cl = lru_cache_touch_line(&s->lru, line);
+        /* a window which failed to map stays cached as a hole */
+        if (cl->value)
+            s->hits++;
+        return cl;
+    }
+
+    cl = mapcache_evict(s, &line);
+    if (!cl) {
+        warnx("%s: cache too small", __FUNCTION__);
+        return NULL;
+    }
+
+    cl->key = key;
+    cl->users = 0;
+    cl->value = (uintptr_t)xc_map_foreign_range(xc_handle, vm_id,
+                                                XC_PAGE_SIZE * num_pages,
+                                                PROT_READ|PROT_WRITE, pfn);
+    if (!cl->value && !is_window) {
+        /* left uncached, so the next lookup tries to map it again */
+        s->map_failures++;
+        cl->key = 0;
+        return cl;
+    }
+    if (cl->value)
+        s->misses++;
+    hashtable_insert(&s->ht, key, line);
+
+    return cl;
 }
-#endif
 
 static uint8_t *
 uxen_mapcache_map(uint64_t phys_addr, uint64_t *len, uint8_t lock)
 {
     uint8_t *va = NULL;
-    uint8_t *mapping;
     uint32_t pfn = phys_addr >> UXEN_PAGE_SHIFT;
     uint32_t end_pfn = ((phys_addr + (*len) - 1) >> UXEN_PAGE_SHIFT) + 1;
+    uint32_t window = pfn & ~(MAPCACHE_WINDOW_PAGES - 1);
     int num_pages = end_pfn - pfn;
-    uint64_t key = (phys_addr & UXEN_PAGE_MASK) | num_pages;
-    uint64_t line;
+    struct mapcache_shard *s = mapcache_shard(pfn);
     LruCacheLine *cl;
-    int i;
 
     assert(!lock);
     // debug_printf("%s %"PRIx64" %"PRIx64"\n", __FUNCTION__, phys_addr, *len);
 
-    critical_section_enter(&cs);
-
-    if (hashtable_find(&ht, key, &line)) {
-        cl = lru_cache_touch_line(&lru, line);
-        va = (uint8_t *)(cl->value & UXEN_PAGE_MASK) +
-            (phys_addr & (UXEN_PAGE_SIZE - 1));
-        cl->value++;
-        debug_memcache_cache_count += num_pages;
-        if ((cl->value & (UXEN_PAGE_SIZE - 1)) > debug_memcache_max_count)
-            debug_memcache_max_count = cl->value & (UXEN_PAGE_SIZE - 1);
-    } else {
-        for (i = 0; i < (1 << lru_cache_lines); i++) {
-            line = lru_cache_evict_line(&lru);
-            cl = lru_cache_touch_line(&lru, line);
-            if (cl->key) {
-                if ((cl->value & (UXEN_PAGE_SIZE - 1)) == 0) {
-                    hashtable_delete(&ht, cl->key);
-                    xc_munmap(xc_handle, vm_id,
-                              (void *)(cl->value & UXEN_PAGE_MASK),
-                              XC_PAGE_SIZE * (cl->key & (UXEN_PAGE_SIZE - 1)));
-                    break;
-                }
-            } else
-                break;
-        }
-        if (i >= (1 << lru_cache_lines)) {
-            warn("%s: cache too small\n", __FUNCTION__);
-            goto out;
-        }
+    critical_section_enter(&s->cs);
 
-        mapping = xc_map_foreign_range(xc_handle, vm_id,
-                                       XC_PAGE_SIZE * num_pages,
-                                       PROT_READ|PROT_WRITE, pfn);
-        if (!mapping) {
-            warn("%s: unable to map %"PRIx64" len %"PRIx64"\n",
-                 __FUNCTION__, phys_addr, *len);
+    if (end_pfn - window <= MAPCACHE_WINDOW_PAGES) {
+        cl = mapcache_lookup(s, window, MAPCACHE_WINDOW_PAGES, 1);
+        if (cl && cl->value) {
+            cl->users++;
+            va = (uint8_t *)cl->value +
+                ((phys_addr - ((uint64_t)window << UXEN_PAGE_SHIFT)));
             goto out;
         }
-
-        cl->key = key;
-        cl->value = ((uintptr_t)mapping) |  1; /* initial refcount */
-        debug_memcache_map_count += num_pages;
-
-        hashtable_insert(&ht, key, line);
-        va = mapping + (phys_addr & (UXEN_PAGE_SIZE - 1));
     }
 
-    debug_memcache_global_count += num_pages;
-    if (debug_memcache_global_count > debug_memcache_concurrent_count)
-        debug_memcache_concurrent_count = debug_memcache_global_count;
+    s->exact_maps++;
+    cl = mapcache_lookup(s, pfn, num_pages, 0);
+    if (!cl || !cl->value) {
+        warn("%s: unable to map %"PRIx64" len %"PRIx64"\n",
+             __FUNCTION__, phys_addr, *len);
+        goto out;
+    }
+    cl->users++;
+    va = (uint8_t *)cl->value + (phys_addr & (UXEN_PAGE_SIZE - 1));
 
   out:
-    critical_section_leave(&cs);
+    if (va) {
+        s->pages_in_use += num_pages;
+        if (s->pages_in_use > s->max_pages_in_use)
+            s->max_pages_in_use = s->pages_in_use;
+    }
+    critical_section_leave(&s->cs);
 
-    return (uint8_t *)va;
+    return va;
 }
 
-
 static void
-uxen_mapcache_unmap(uint64_t phys_addr, uint64_t len, uint8_t lock)
+uxen_mapcache_unmap(void *ptr, uint64_t phys_addr, uint64_t len, uint8_t lock)
 {
     uint32_t pfn = phys_addr >> UXEN_PAGE_SHIFT;
     uint32_t end_pfn = ((phys_addr + len - 1) >> UXEN_PAGE_SHIFT) + 1;
+    uint32_t window = pfn & ~(MAPCACHE_WINDOW_PAGES - 1);
     int num_pages = end_pfn - pfn;
-    uint64_t key = (phys_addr & UXEN_PAGE_MASK) | num_pages;
+    struct mapcache_shard *s = mapcache_shard(pfn);
     uint64_t line;
-    LruCacheLine *cl;
+    LruCacheLine *cl = NULL;
 
     assert(!lock);
 
-    critical_section_enter(&cs);
-
-    if (hashtable_find(&ht, key, &line)) {
-        cl = &lru.lines[line];
-        (cl->value)--;
-    } else
+    critical_section_enter(&s->cs);
+
+    /* the window and an exact mapping of the same range can both be in
+     * use, release the one the pointer handed out by map points into */
+    if (end_pfn - window <= MAPCACHE_WINDOW_PAGES &&
+        hashtable_find(&s->ht, mapcache_key(window, MAPCACHE_WINDOW_PAGES),
+                       &line)) {
+        cl = &s->lru.lines[line];
+        if (!cl->value ||
+            (uintptr_t)ptr - cl->value >=
+            ((uintptr_t)MAPCACHE_WINDOW_PAGES << UXEN_PAGE_SHIFT))
+            cl = NULL;
+    }
+    if (!cl && hashtable_find(&s->ht, mapcache_key(pfn, num_pages), &line)) {
+        cl = &s->lru.lines[line];
+        if (!cl->value ||
+            (uintptr_t)ptr - cl->value >=
+            ((uintptr_t)num_pages << UXEN_PAGE_SHIFT))
+            cl = NULL;
+    }
+    if (!cl || !cl->users) {
         warnx("%s: unmap of missing mapping: %"PRIx64" len %"PRIx64"\n",
               __FUNCTION__, phys_addr, len);
+        goto out;
+    }
 
-    debug_memcache_global_count -= num_pages;
+    cl->users--;
+    s->pages_in_use -= num_pages;
 
-    critical_section_leave(&cs);
+  out:
+    critical_section_leave(&s->cs);
 }
 
 uint8_t *
@@ -203,10 +328,10 @@ mapcache_map(uint64_t phys_addr, uint64_t *len, uint8_t lock)
 }
 
 void
-mapcache_unmap(uint64_t phys_addr, uint64_t len, uint8_t lock)
+mapcache_unmap(void *ptr, uint64_t phys_addr, uint64_t len, uint8_t lock)
 {
     if (!whpx_enable)
-        uxen_mapcache_unmap(phys_addr, len, lock);
+        uxen_mapcache_unmap(ptr, phys_addr, len, lock);
     /* no-op on WHPX */
 }
 
@@ -214,31 +339,57 @@ mapcache_unmap(uint64_t phys_addr, uint64_t len, uint8_t lock)
 void
 ic_memcache(Monitor *mon)
 {
-    int i;
-    int mapped = 0;
+    struct mapcache_shard *s;
+    uint64_t hits = 0, misses = 0, exact_maps = 0, evictions = 0;
+    uint64_t map_failures = 0;
+    int i, j, mapped, holes, pinned, pages_in_use = 0, max_pages_in_use = 0;
 
-    for (i = 0; i < (1 << lru_cache_lines); i++) {
-        LruCacheLine *cl = &lru.lines[i];
-        if (cl->key) {
-            mapped++;
-            if (cl->value & (UXEN_PAGE_SIZE - 1))
+    for (i = 0; i < MAPCACHE_SHARDS; i++) {
+        s = &shards[i];
+        mapped = holes = pinned = 0;
+
+        critical_section_enter(&s->cs);
+        for (j = 0; j < (1 << lru_cache_lines); j++) {
+            LruCacheLine *cl = &s->lru.lines[j];
+
+            if (!cl->key)
+                continue;
+            if (!cl->value)
+                holes++;
+            else
+                mapped++;
+            if (cl->users) {
+                pinned++;
                 monitor_printf(mon, "memcache pfn %06x/%x count: %d\n",
                                (uint32_t)(cl->key >> UXEN_PAGE_SHIFT),
                                (uint32_t)(cl->key & (UXEN_PAGE_SIZE - 1)),
-                               (uint32_t)(cl->value & (UXEN_PAGE_SIZE - 1)));
+                               cl->users);
+            }
         }
+        hits += s->hits;
+        misses += s->misses;
+        exact_maps += s->exact_maps;
+        evictions += s->evictions;
+        map_failures += s->map_failures;
+        pages_in_use += s->pages_in_use;
+        max_pages_in_use += s->max_pages_in_use;
+        critical_section_leave(&s->cs);
+
+        monitor_printf(mon, "memcache shard %2d: %d mapped %d holes "
+                       "%d in use\n", i, mapped, holes, pinned);
     }
 
-    monitor_printf(mon, "memcache     global count: %d\n",
-                   debug_memcache_global_count);
-    monitor_printf(mon, "memcache concurrent count: %d\n",
-                   debug_memcache_concurrent_count);
-    monitor_printf(mon, "memcache        max count: %d\n",
-                   debug_memcache_max_count);
-    monitor_printf(mon, "memcache     mapped count: %d\n", mapped);
-    monitor_printf(mon, "memcache        map count: %d\n",
-                   debug_memcache_map_count);
-    monitor_printf(mon, "memcache      cache count: %d\n",
-                   debug_memcache_cache_count);
+    monitor_printf(mon, "memcache      lines/shard: %d of %d pages\n",
+                   1 << lru_cache_lines, MAPCACHE_WINDOW_PAGES);
+    monitor_printf(mon, "memcache     pages in use: %d\n", pages_in_use);
+    monitor_printf(mon, "memcache max pages in use: %d\n", max_pages_in_use);
+    monitor_printf(mon, "memcache             hits: %"PRIu64"\n", hits);
+    monitor_printf(mon, "memcache           misses: %"PRIu64"\n", misses);
+    monitor_printf(mon, "memcache         hit rate: %.2f%%\n",
+                   hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+    monitor_printf(mon, "memcache       exact maps: %"PRIu64"\n", exact_maps);
+    monitor_printf(mon, "memcache        evictions: %"PRIu64"\n", evictions);
+    monitor_printf(mon, "memcache     map failures: %"PRIu64"\n",
+                   map_failures);
 }
 #endif
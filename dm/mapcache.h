@@ -15,7 +15,8 @@ void mapcache_get_params(uint32_t *end_low_pfn,
                          uint32_t *start_high_pfn,
                          uint32_t *end_high_pfn);
 uint8_t *mapcache_map(uint64_t phys_addr, uint64_t *len, uint8_t lock);
-void mapcache_unmap(uint64_t phys_addr, uint64_t len, uint8_t lock);
+/* ptr is what mapcache_map returned for the range */
+void mapcache_unmap(void *ptr, uint64_t phys_addr, uint64_t len, uint8_t lock);
 
 extern int mapcache_lock_cnt;
 
@@ -92,7 +92,7 @@ void vm_memory_rw(uint64_t addr, uint8_t *buf,
 		    l = map_len;
 		    /* Writing to RAM */
 		    memcpy_words(ptr, buf, l);
-		    mapcache_unmap(addr, map_len, 0);
+		    mapcache_unmap(ptr, addr, map_len, 0);
 
 		    if (xen_logdirty_enabled)
 			xc_hvm_modified_memory(xc_handle, vm_id,
@@ -127,7 +127,7 @@ void vm_memory_rw(uint64_t addr, uint8_t *buf,
 		    l = map_len;
 		    /* Reading from RAM */
 		    memcpy_words(buf, ptr, l);
-		    mapcache_unmap(addr, map_len, 0);
+		    mapcache_unmap(ptr, addr, map_len, 0);
 		} else {
 		    /* Neither RAM nor known MMIO space */
 		    memset(buf, 0xff, l); 
@@ -163,7 +163,7 @@ void vm_memory_rw_direct(uint64_t addr, uint8_t *buf,
 		l = map_len;
 		/* Writing to RAM */
 		memcpy_words(ptr, buf, l);
-		mapcache_unmap(addr, map_len, 0);
+		mapcache_unmap(ptr, addr, map_len, 0);
 
 		if (xen_logdirty_enabled)
 		    xc_hvm_modified_memory(xc_handle, vm_id,
@@ -176,7 +176,7 @@ void vm_memory_rw_direct(uint64_t addr, uint8_t *buf,
 		l = map_len;
 		/* Reading from RAM */
 		memcpy_words(buf, ptr, l);
-		mapcache_unmap(addr, map_len, 0);
+		mapcache_unmap(ptr, addr, map_len, 0);
 	    } else {
 		/* Neither RAM nor known MMIO space */
 		memset(buf, 0xff, l); 
@@ -219,7 +219,7 @@ vm_memory_unmap(uint64_t phys_addr, uint64_t len, int is_write, int lock,
 		void *map_addr, uint64_t access_len)
 {
 
-    mapcache_unmap(phys_addr, len, lock);
+    mapcache_unmap(map_addr, phys_addr, len, lock);
 }
 
 uint8_t *
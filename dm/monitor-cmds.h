@@ -27,6 +27,8 @@ void mc_vm_audio_mute(Monitor *mon, const dict args);
 void mc_touch_unplug(Monitor *mon, const dict args);
 void mc_touch_plug(Monitor *mon, const dict args);
 void mc_vm_throttle(Monitor *mon, const dict args);
+void mc_trace_categories(Monitor *mon, const dict args);
+void mc_trace_dump(Monitor *mon, const dict args);
 
 void ic_network(Monitor *mon);
 void ic_chr(Monitor *mon);
@@ -35,8 +37,10 @@ void ic_blockstats(Monitor *mon);
 void ic_uuid(Monitor *mon);
 void ic_slirp(Monitor *mon);
 void ic_ioreq(Monitor *mon);
+void ic_ioreq_stats(Monitor *mon);
 void ic_wo(Monitor *mon);
 void ic_memcache(Monitor *mon);
 void ic_physinfo(Monitor *mon);
+void ic_slab(Monitor *mon);
 
 #endif  /* _MONITOR_CMDS_H_ */
@@ -350,6 +350,15 @@ static mon_cmd_t mon_cmds[] = {
 #endif
     { .name = "throttle", .mhandler.cmd = mc_vm_throttle,
       .args_type = "n:period,n:rate", .help = "throttle VM execution" },
+#ifdef CONFIG_TRACE
+    { .name = "trace-categories", .mhandler.cmd = mc_trace_categories,
+      .args_type = "?s:categories",
+      .help = "show or set traced categories: ioreq,swap,dubtree,nickel,"
+              "timer, all or none" },
+    { .name = "trace-dump", .mhandler.cmd = mc_trace_dump,
+      .args_type = "s:filename",
+      .help = "write trace events as Chrome trace-event JSON" },
+#endif
 };
 
 static void ic_version(Monitor *mon);
@@ -371,6 +380,8 @@ static mon_cmd_t info_cmds[] = {
       .help = "show the current VM UUID" },
     { .name = "ioreq", .mhandler.info = ic_ioreq,
       .help = "show ioreq statistics" },
+    { .name = "ioreq-stats", .mhandler.info = ic_ioreq_stats,
+      .help = "show per-device ioreq counters and latencies as JSON" },
 #ifdef DEBUG_WAITOBJECTS
     { .name = "wo", .mhandler.info = ic_wo,
       .help = "show WaitObjects statistics" },
@@ -379,6 +390,12 @@ static mon_cmd_t info_cmds[] = {
       .help = "show memcache statistics" },
     { .name = "physinfo", .mhandler.info = ic_physinfo,
       .help = "show system physinfo" },
+    { .name = "slab", .mhandler.info = ic_slab,
+      .help = "show slab allocator size class counters" },
+#ifdef CONFIG_NICKEL
+    { .name = "slirp", .mhandler.info = ic_slirp,
+      .help = "show nickel connections, throughput and windows" },
+#endif
 };
 
 static int
@@ -11,6 +11,7 @@
 
 #include "access-control.h"
 #include "dns/dns.h"
+#include "dns/dns-cache.h"
 #include "dns/dns-fake.h"
 #include "log.h"
 #include "nickel.h"
@@ -211,6 +212,7 @@ static void rpc_on_event(void *opaque)
         if (!r->ni->ac_enabled)
             goto out;
 
+        dns_cache_flush();
         val = dict_get_integer_default(r->d, "policy", -1);
         if (val != -1)
             set_policy_type(r->ni, val);
@@ -1047,6 +1049,8 @@ void ac_set_policy_type(struct nickel *ni, int policy)
     if (!ni->ac_enabled)
         return;
 
+    if (policy != ni->ac_prev_policy)
+        dns_cache_flush();
     set_policy_type(ni, policy);
 }
 
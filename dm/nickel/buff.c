@@ -20,7 +20,7 @@
 #include <wchar.h>
 #endif
 
-static struct buff * _buff_new(struct buff **pbuf, bool priv, size_t l)
+static struct buff * _buff_new(struct buff **pbuf, bool priv, bool zero, size_t l)
 {
     struct buff *buf = NULL;
 
@@ -29,18 +29,22 @@ static struct buff * _buff_new(struct buff **pbuf, bool priv, size_t l)
                 (unsigned long) MAX_BUFF_LEN);
         goto cleanup;
     }
-    buf = calloc(1, sizeof(struct buff));
+    if (priv)
+        buf = ni_priv_calloc(1, sizeof(struct buff));
+    else
+        buf = calloc(1, sizeof(struct buff));
     if (!buf)
         goto cleanup;
     if (priv)
         buf->priv_heap = 1;
 
     if (buf->priv_heap)
-        buf->data = ni_priv_calloc(1, l + 1);
+        buf->data = zero ? ni_priv_calloc(1, l + 1) : ni_priv_malloc(l + 1);
     else
         buf->data = calloc(1, l + 1);
     if (!buf->data)
         goto cleanup;
+    buf->data[0] = 0;
     buf->refcnt = 1;
 
     if (pbuf)
@@ -54,23 +58,31 @@ static struct buff * _buff_new(struct buff **pbuf, bool priv, size_t l)
 out:
     return buf;
 cleanup:
-    if (buf && buf->priv_heap)
+    if (buf && buf->priv_heap) {
         ni_priv_free(buf->data);
-    else if (buf && !buf->priv_heap)
+        ni_priv_free(buf);
+    } else if (buf && !buf->priv_heap) {
         free(buf->data);
-    free(buf);
+        free(buf);
+    }
     buf = NULL;
     goto out;
 }
 
 struct buff * buff_new(struct buff **pbuf, size_t l)
 {
-    return _buff_new(pbuf, false, l);
+    return _buff_new(pbuf, false, true, l);
 }
 
 struct buff * buff_new_priv(struct buff **pbuf, size_t l)
 {
-    return _buff_new(pbuf, true, l);
+    return _buff_new(pbuf, true, true, l);
+}
+
+/* data not zeroed, for buffers that are only ever filled by reads */
+struct buff * buff_new_priv_raw(struct buff **pbuf, size_t l)
+{
+    return _buff_new(pbuf, true, false, l);
 }
 
 void buff_get(struct buff *buf)
@@ -84,11 +96,15 @@ void buff_put(struct buff *buf)
     if (!atomic_dec_and_test(&buf->refcnt))
         return;
 
-    if (buf->priv_heap)
+    if (buf->sg_bf)
+        buff_put(buf->sg_bf);
+    if (buf->priv_heap) {
         ni_priv_free(buf->data);
-    else
+        ni_priv_free(buf);
+    } else {
         free(buf->data);
-    free(buf);
+        free(buf);
+    }
 }
 
 void buff_free(struct buff **pbuf)
@@ -160,6 +176,18 @@ out:
     return ret;
 }
 
+void buff_sg_attach(struct buff *bf, struct buff *data_bf, const uint8_t *data,
+                    size_t len)
+{
+    assert(!bf->sg_bf);
+    assert(data >= data_bf->data && data + len <= data_bf->data + data_bf->size);
+
+    buff_get(data_bf);
+    bf->sg_bf = data_bf;
+    bf->sg_data = data;
+    bf->sg_len = len;
+}
+
 int buff_gc_consume(struct buff *b, size_t lb)
 {
     size_t consumed;
@@ -33,10 +33,17 @@ struct buff {
     uint32_t refcnt;
 
     int priv_heap;
+
+    /* frames only: payload that follows the headers in m, referenced in
+     * another buff rather than copied */
+    struct buff *sg_bf;
+    const uint8_t *sg_data;
+    size_t sg_len;
 };
 
 struct buff * buff_new(struct buff **pbuf, size_t l);
 struct buff * buff_new_priv(struct buff **pbuf, size_t l);
+struct buff * buff_new_priv_raw(struct buff **pbuf, size_t l);
 void buff_free(struct buff **pbuf);
 void buff_get(struct buff *buf);
 void buff_put(struct buff *buf);
@@ -45,6 +52,8 @@ int buff_append(struct buff *buf, const char *c, size_t len);
 int __attribute__ ((__format__ (printf, 2, 3)))
 buff_appendf(struct buff *bf, const char *fmt, ...);
 int buff_gc_consume(struct buff *b, size_t l);
+void buff_sg_attach(struct buff *bf, struct buff *data_bf, const uint8_t *data,
+                    size_t len);
 
 #define BUFF_NEW(buf, pbuf, l) ((buf) = buff_new(pbuf, l))
 #define BUFF_NEW_PRIV(buf, pbuf, l) ((buf) = buff_new_priv(pbuf, l))
@@ -86,6 +95,7 @@ int buff_gc_consume(struct buff *b, size_t l);
 #define BUFF_WR_ADVANCE(b, l) do { (b)->wr_len += l; } while(0)
 #define BUFF_WR_GC(b) do { buff_gc_consume(b, (b)->wr_len); (b)->wr_len = 0; } while(0)
 #define BUFF_OFF(b) ((b)->m - (b)->data)
+#define BUFF_SG_LEN(b) ((b)->len + (b)->sg_len)
 #define BUFF_RESET(b) do { if (!(b)) break; (b)->m = (b)->data; (b)->len = 0;                   \
                             (b)->prev_len = 0; *((b)->data) = 0; (b)->wr_len = 0; } while(0)
 #define BUFF_APPENDSTR(buf, str) buff_append(buf, str, strlen(str))
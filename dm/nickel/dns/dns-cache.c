@@ -0,0 +1,352 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#include <dm/config.h>
+
+#include <ctype.h>
+
+#include <dm/monitor.h>
+#include <log.h>
+
+#include "dns.h"
+#include "dns-cache.h"
+
+/*
+ * Resolver answers shared by guest DNS queries, containment lookups and
+ * the http proxy.  Only the resolution is cached, access control still
+ * checks every answer handed out, and the cache is flushed when the
+ * policy changes.  Lookups run on the async op threads, hence the lock.
+ */
+
+#define DNS_CACHE_BUCKETS           256
+
+/* names asked for at least this often get refreshed in the background
+ * in the last quarter of their ttl, so they do not expire under use */
+#define DNS_CACHE_PREFETCH_HITS     2
+#define DNS_CACHE_PREFETCH_FRACTION 4
+#define DNS_CACHE_PREFETCH_RETRY_MS 5000
+
+struct dns_cache_entry {
+    LIST_ENTRY(dns_cache_entry) hentry;
+    TAILQ_ENTRY(dns_cache_entry) lru_entry;
+    uint32_t hash;
+    char *name;
+    char *canon_name;
+    struct net_addr *a;     /* NULL for a negative entry */
+    int err;
+    int64_t expire_ms;
+    int64_t ttl_ms;
+    int64_t prefetch_ms;
+    unsigned int hits;
+};
+
+static bool cache_init_ok = false;
+static unsigned int cache_users;    /* nickel instances, one cache for all */
+static critical_section cache_lk;
+static LIST_HEAD(, dns_cache_entry) cache_tbl[DNS_CACHE_BUCKETS];
+static TAILQ_HEAD(dns_cache_lru, dns_cache_entry) cache_lru;
+static unsigned int cache_n_entries;
+static uint32_t cache_gen;
+
+static unsigned int cache_size = DNS_CACHE_DEFAULT_SIZE;
+static int64_t cache_ttl_ms = DNS_CACHE_DEFAULT_TTL_S * 1000;
+static int64_t cache_neg_ttl_ms = DNS_CACHE_DEFAULT_NEG_TTL_S * 1000;
+
+static struct {
+    uint64_t hits;
+    uint64_t neg_hits;
+    uint64_t misses;
+    uint64_t expired;
+    uint64_t evictions;
+    uint64_t prefetches;
+    uint64_t flushes;
+} cache_stats;
+
+/* FNV-1a, case insensitive as the names are */
+static uint32_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261U;
+
+    while (*name) {
+        h ^= (uint8_t) tolower((unsigned char) *name++);
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+static struct dns_cache_entry *entry_find(const char *name, uint32_t hash)
+{
+    struct dns_cache_entry *e;
+
+    LIST_FOREACH(e, &cache_tbl[hash % DNS_CACHE_BUCKETS], hentry) {
+        if (e->hash == hash && !strcasecmp(e->name, name))
+            return e;
+    }
+
+    return NULL;
+}
+
+static void entry_free(struct dns_cache_entry *e)
+{
+    free(e->name);
+    free(e->canon_name);
+    free(e->a);
+    free(e);
+}
+
+static void entry_remove(struct dns_cache_entry *e)
+{
+    LIST_REMOVE(e, hentry);
+    TAILQ_REMOVE(&cache_lru, e, lru_entry);
+    cache_n_entries--;
+    entry_free(e);
+}
+
+static void cache_trim(unsigned int size)
+{
+
+    while (cache_n_entries > size)
+        entry_remove(TAILQ_LAST(&cache_lru, dns_cache_lru));
+}
+
+/* only the answer that a name does not exist is worth remembering,
+ * anything else may be gone on the next try */
+static bool err_cacheable(int err)
+{
+    if (!err || err == EAI_NONAME)
+        return true;
+#ifdef EAI_NODATA
+    if (err == EAI_NODATA)
+        return true;
+#endif
+
+    return false;
+}
+
+bool dns_cache_lookup(const char *name, struct dns_response *resp,
+                      uint32_t *gen, bool *prefetch)
+{
+    struct dns_cache_entry *e;
+    struct net_addr *a = NULL;
+    char *canon_name = NULL;
+    uint32_t hash;
+    int64_t now;
+    bool hit = false;
+
+    *gen = 0;
+    if (prefetch)
+        *prefetch = false;
+    if (!cache_init_ok || !name)
+        return false;
+
+    hash = name_hash(name);
+    now = os_get_clock_ms();
+
+    critical_section_enter(&cache_lk);
+    *gen = cache_gen;
+    e = entry_find(name, hash);
+    if (!e)
+        goto miss;
+    if (e->expire_ms <= now) {
+        cache_stats.expired++;
+        entry_remove(e);
+        goto miss;
+    }
+
+    if (e->a && !(a = dns_ips_dup(e->a)))
+        goto miss;
+    if (e->canon_name && !(canon_name = strdup(e->canon_name))) {
+        free(a);
+        goto miss;
+    }
+    resp->a = a;
+    resp->canon_name = canon_name;
+    resp->err = e->err;
+
+    e->hits++;
+    TAILQ_REMOVE(&cache_lru, e, lru_entry);
+    TAILQ_INSERT_HEAD(&cache_lru, e, lru_entry);
+    if (e->a)
+        cache_stats.hits++;
+    else
+        cache_stats.neg_hits++;
+
+    if (prefetch && e->a && e->hits >= DNS_CACHE_PREFETCH_HITS &&
+        e->expire_ms - now < e->ttl_ms / DNS_CACHE_PREFETCH_FRACTION &&
+        now - e->prefetch_ms > DNS_CACHE_PREFETCH_RETRY_MS) {
+
+        e->prefetch_ms = now;
+        *prefetch = true;
+        cache_stats.prefetches++;
+    }
+
+    hit = true;
+    goto out;
+
+miss:
+    cache_stats.misses++;
+out:
+    critical_section_leave(&cache_lk);
+    return hit;
+}
+
+void dns_cache_insert(const char *name, const struct dns_response *resp,
+                      uint32_t gen, int64_t ttl_ms)
+{
+    struct dns_cache_entry *e, *old;
+    int64_t max_ttl_ms;
+    bool negative;
+    size_t i;
+
+    if (!cache_init_ok || !name || !err_cacheable(resp->err))
+        return;
+
+    negative = resp->err || !resp->a || !resp->a[0].family;
+    max_ttl_ms = negative ? cache_neg_ttl_ms : cache_ttl_ms;
+    if (!ttl_ms || ttl_ms > max_ttl_ms)
+        ttl_ms = max_ttl_ms;
+    if (ttl_ms <= 0)
+        return;
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        goto mem_err;
+    e->name = strdup(name);
+    if (!e->name)
+        goto mem_err;
+    if (resp->canon_name && !(e->canon_name = strdup(resp->canon_name)))
+        goto mem_err;
+    if (!negative) {
+        e->a = dns_ips_dup(resp->a);
+        if (!e->a)
+            goto mem_err;
+        for (i = 0; e->a[i].family; i++)
+            e->a[i].ts_hyb = 0;
+    }
+    e->err = resp->err;
+    e->hash = name_hash(name);
+    e->ttl_ms = ttl_ms;
+    e->expire_ms = os_get_clock_ms() + ttl_ms;
+
+    critical_section_enter(&cache_lk);
+    /* resolved across a flush, the answer may predate the new policy */
+    if (gen != cache_gen || !cache_size) {
+        critical_section_leave(&cache_lk);
+        entry_free(e);
+        return;
+    }
+    old = entry_find(name, e->hash);
+    if (old) {
+        e->hits = old->hits;
+        e->prefetch_ms = old->prefetch_ms;
+        entry_remove(old);
+    }
+    LIST_INSERT_HEAD(&cache_tbl[e->hash % DNS_CACHE_BUCKETS], e, hentry);
+    TAILQ_INSERT_HEAD(&cache_lru, e, lru_entry);
+    cache_n_entries++;
+    if (cache_n_entries > cache_size) {
+        cache_stats.evictions += cache_n_entries - cache_size;
+        cache_trim(cache_size);
+    }
+    critical_section_leave(&cache_lk);
+
+    return;
+
+mem_err:
+    warnx("%s: memory error", __FUNCTION__);
+    if (e)
+        entry_free(e);
+}
+
+void dns_cache_flush(void)
+{
+
+    if (!cache_init_ok)
+        return;
+
+    critical_section_enter(&cache_lk);
+    cache_gen++;
+    if (cache_n_entries)
+        cache_stats.flushes++;
+    cache_trim(0);
+    critical_section_leave(&cache_lk);
+}
+
+void dns_cache_config(unsigned size, unsigned ttl_s, unsigned neg_ttl_s)
+{
+
+    if (!cache_init_ok)
+        return;
+
+    critical_section_enter(&cache_lk);
+    cache_size = size;
+    cache_ttl_ms = (int64_t) ttl_s * 1000;
+    cache_neg_ttl_ms = (int64_t) neg_ttl_s * 1000;
+    critical_section_leave(&cache_lk);
+
+    /* entries were resolved under the old settings */
+    dns_cache_flush();
+
+    if (cache_size && cache_ttl_ms)
+        NETLOG("(dns) cache of %u names, ttl %us, negative ttl %us",
+               size, ttl_s, neg_ttl_s);
+    else
+        NETLOG("(dns) cache disabled");
+}
+
+void dns_cache_info(Monitor *mon)
+{
+
+    if (!cache_init_ok)
+        return;
+
+    critical_section_enter(&cache_lk);
+    monitor_printf(mon, "DNS cache: %u/%u names, hits %"PRIu64" negative %"PRIu64
+                   " misses %"PRIu64" expired %"PRIu64" evicted %"PRIu64
+                   " prefetched %"PRIu64" flushed %"PRIu64"\n",
+                   cache_n_entries, cache_size, cache_stats.hits,
+                   cache_stats.neg_hits, cache_stats.misses, cache_stats.expired,
+                   cache_stats.evictions, cache_stats.prefetches,
+                   cache_stats.flushes);
+    critical_section_leave(&cache_lk);
+}
+
+void dns_cache_init(struct nickel *ni)
+{
+    int i;
+
+    if (cache_users++)
+        return;
+
+    critical_section_init(&cache_lk);
+    for (i = 0; i < DNS_CACHE_BUCKETS; i++)
+        LIST_INIT(&cache_tbl[i]);
+    TAILQ_INIT(&cache_lru);
+
+    cache_init_ok = true;
+}
+
+/* the last instance to exit frees the cache, after every instance's
+ * async ops are done with it */
+void dns_cache_exit(struct nickel *ni)
+{
+
+    if (!cache_users || --cache_users)
+        return;
+    if (!cache_init_ok)
+        return;
+
+    NETLOG("(dns) cache hits %"PRIu64" negative %"PRIu64" misses %"PRIu64
+           " prefetched %"PRIu64, cache_stats.hits, cache_stats.neg_hits,
+           cache_stats.misses, cache_stats.prefetches);
+
+    critical_section_enter(&cache_lk);
+    cache_trim(0);
+    critical_section_leave(&cache_lk);
+    critical_section_free(&cache_lk);
+
+    cache_init_ok = false;
+}
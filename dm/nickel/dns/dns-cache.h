@@ -0,0 +1,31 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _DNS_CACHE_H_
+#define _DNS_CACHE_H_
+
+#define DNS_CACHE_DEFAULT_SIZE      1024
+#define DNS_CACHE_DEFAULT_TTL_S     60
+#define DNS_CACHE_DEFAULT_NEG_TTL_S 10
+
+struct nickel;
+struct dns_response;
+
+void dns_cache_init(struct nickel *ni);
+void dns_cache_exit(struct nickel *ni);
+void dns_cache_config(unsigned size, unsigned ttl_s, unsigned neg_ttl_s);
+
+/* on a hit resp gets copies of the cached answer, on a miss *gen is what
+ * to pass to dns_cache_insert once resolved.  *prefetch, if not NULL, is
+ * set when the caller should refresh the entry before it expires */
+bool dns_cache_lookup(const char *name, struct dns_response *resp,
+                      uint32_t *gen, bool *prefetch);
+/* ttl_ms 0 for the configured ttl, record ttls are capped by it */
+void dns_cache_insert(const char *name, const struct dns_response *resp,
+                      uint32_t gen, int64_t ttl_ms);
+void dns_cache_flush(void);
+void dns_cache_info(Monitor *mon);
+
+#endif
@@ -0,0 +1,1083 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#include <dm/config.h>
+
+#include <ctype.h>
+
+#include <dm/timer.h>
+#include <nickel.h>
+#include <socket.h>
+#include <log.h>
+
+#if defined(_WIN32)
+#include <iphlpapi.h>
+#endif
+
+#include "dns.h"
+#include "dns-resolver.h"
+
+/*
+ * Stub resolver asking the host's DNS servers directly, over the nickel
+ * socket layer, so that guest lookups neither block nor tie up an async
+ * op thread for the length of a getaddrinfo.  A and AAAA go out in
+ * parallel, every attempt at a question goes out on a udp socket of its
+ * own under a random id, so that a forged answer has to guess the source
+ * port the host gave that socket as well as the id (RFC 5452(9.2)), and
+ * an answer is only taken from the server it was asked of, for the
+ * question it was asked.
+ * Timeouts and server failures move on to the next server, truncated
+ * answers are asked again over tcp.
+ */
+
+#define DNS_PORT                53
+#define DNS_HDR_LEN             12
+#define DNS_UDP_MAXLEN          512
+#define DNS_MSG_MAXLEN          4096    /* servers may exceed 512 anyway */
+#define DNS_NAME_MAXLEN         255
+#define DNS_LABEL_MAXLEN        63
+#define DNS_MAX_JUMPS           32      /* compression pointers in a name */
+#define DNS_MAX_CNAMES          8
+#define DNS_MAX_RRS             64
+#define DNS_SERVERS_REFRESH_MS  (30 * 1000)
+
+#define DNS_TYPE_A              1
+#define DNS_TYPE_CNAME          5
+#define DNS_TYPE_AAAA           28
+#define DNS_CLASS_IN            1
+
+#define DNS_FLAG_QR             0x8000
+#define DNS_FLAG_OPCODE         0x7800
+#define DNS_FLAG_TC             0x0200
+#define DNS_FLAG_RD             0x0100
+#define DNS_RCODE(flags)        ((flags) & 0xf)
+#define DNS_RCODE_NOERROR       0
+#define DNS_RCODE_NXDOMAIN      3
+
+/* question states */
+#define QS_WAIT     0       /* until its socket is connected */
+#define QS_SENT     1
+#define QS_TCP      2
+#define QS_DONE     3
+
+/* question results */
+#define QR_NONE     0
+#define QR_DATA     1
+#define QR_NODATA   2
+#define QR_NXDOMAIN 3
+#define QR_FAIL     4
+
+struct dns_server {
+    LIST_ENTRY(dns_server) entry;       /* retired servers */
+    struct dns_resolver *r;
+    struct net_addr addr;
+    bool retired;
+    unsigned int refcnt;                /* questions asked here */
+};
+
+struct dns_tcp {
+    struct socket *so;
+    uint8_t *wbuf;
+    size_t wlen, woff;
+    uint8_t rhdr[2];
+    size_t rhdr_off;
+    uint8_t *rbuf;
+    size_t rlen, roff;
+};
+
+struct dns_question {
+    struct dns_query *q;
+    struct dns_server *server;
+    struct socket *so;                  /* udp, for this attempt only */
+    int server_idx;
+    uint16_t type;
+    uint16_t id;
+    int state;
+    int result;
+    int tries;
+    int64_t sent_ms;
+    struct net_addr *a;
+    size_t n_a;
+    char *canon_name;
+    uint32_t ttl;
+    struct dns_tcp tcp;
+};
+
+struct dns_query {
+    LIST_ENTRY(dns_query) entry;
+    struct dns_resolver *r;
+    char *name;
+    dns_resolver_cb cb;
+    void *opaque;
+    struct dns_question qs[2];
+    int n_qs;
+    Timer *timer;
+    int64_t start_ms;
+};
+
+struct dns_resolver {
+    struct nickel *ni;
+    struct dns_resolver_config config;
+    uint16_t port;
+    int max_tries;
+    bool system_servers;
+    int64_t servers_ms;
+    struct dns_server *servers[DNS_RES_MAX_SERVERS];
+    int n_servers;
+    LIST_HEAD(, dns_server) retired;
+    LIST_HEAD(, dns_query) queries;
+    uint8_t rbuf[DNS_MSG_MAXLEN];
+
+    uint64_t n_lookups;
+    uint64_t n_retries;
+    uint64_t n_tcp;
+    uint64_t n_failed;
+    uint64_t n_stray;
+};
+
+/* an answer as taken apart, before it is given to its question */
+struct dns_answer {
+    int rcode;
+    bool tc;
+    struct net_addr *a;
+    size_t n_a;
+    char *canon_name;
+    uint32_t ttl;
+};
+
+static void question_send(struct dns_question *qs);
+static void query_check(struct dns_query *q);
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t rd32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+           ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline void wr16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static int addr_parse(const char *str, struct net_addr *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET, str, &addr->ipv4) == 1) {
+        addr->family = AF_INET;
+        return 0;
+    }
+    if (inet_pton(AF_INET6, str, &addr->ipv6) == 1) {
+        addr->family = AF_INET6;
+        return 0;
+    }
+
+    return -1;
+}
+
+static bool addr_equal(const struct net_addr *a1, const struct net_addr *a2)
+{
+    if (a1->family != a2->family)
+        return false;
+    if (a1->family == AF_INET)
+        return a1->ipv4.s_addr == a2->ipv4.s_addr;
+
+    return !memcmp(&a1->ipv6, &a2->ipv6, sizeof(a1->ipv6));
+}
+
+#if defined(_WIN32)
+static int system_servers(struct net_addr *servers, int max)
+{
+    FIXED_INFO *info;
+    ULONG len = sizeof(*info);
+    IP_ADDR_STRING *ip;
+    int n = 0;
+
+    info = malloc(len);
+    if (!info)
+        goto out;
+    if (GetNetworkParams(info, &len) == ERROR_BUFFER_OVERFLOW) {
+        free(info);
+        info = malloc(len);
+        if (!info)
+            goto out;
+    }
+    if (GetNetworkParams(info, &len) != ERROR_SUCCESS)
+        goto out;
+
+    for (ip = &info->DnsServerList; ip && n < max; ip = ip->Next) {
+        if (addr_parse(ip->IpAddress.String, &servers[n]) == 0)
+            n++;
+    }
+
+out:
+    free(info);
+    return n;
+}
+#else
+static int system_servers(struct net_addr *servers, int max)
+{
+    FILE *f;
+    char line[512], str[256];
+    int n = 0;
+
+    f = fopen("/etc/resolv.conf", "r");
+    if (!f)
+        return 0;
+
+    while (n < max && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "nameserver %255s", str) != 1)
+            continue;
+        if (addr_parse(str, &servers[n]) == 0)
+            n++;
+    }
+    fclose(f);
+
+    return n;
+}
+#endif
+
+static void server_free(struct dns_server *s)
+{
+    free(s);
+}
+
+static void server_get(struct dns_server *s)
+{
+    s->refcnt++;
+}
+
+static void server_put(struct dns_server *s)
+{
+    assert(s->refcnt);
+    if (--s->refcnt || !s->retired)
+        return;
+
+    LIST_REMOVE(s, entry);
+    server_free(s);
+}
+
+/* servers still asked are kept until their questions are done with them */
+static void server_retire(struct dns_server *s)
+{
+    if (!s->refcnt) {
+        server_free(s);
+        return;
+    }
+
+    s->retired = true;
+    LIST_INSERT_HEAD(&s->r->retired, s, entry);
+}
+
+static void servers_load(struct dns_resolver *r)
+{
+    struct net_addr addrs[DNS_RES_MAX_SERVERS];
+    char netabuf[NETADDR_MAXSTRLEN];
+    struct dns_server *s;
+    int i, n;
+
+    if (r->system_servers) {
+        n = system_servers(addrs, DNS_RES_MAX_SERVERS);
+        r->servers_ms = get_clock_ms(rt_clock);
+    } else {
+        n = r->config.n_servers;
+        memcpy(addrs, r->config.servers, n * sizeof(addrs[0]));
+    }
+
+    if (n == r->n_servers) {
+        for (i = 0; i < n; i++) {
+            if (!addr_equal(&addrs[i], &r->servers[i]->addr))
+                break;
+        }
+        if (i == n)
+            return;
+    }
+
+    for (i = 0; i < r->n_servers; i++)
+        server_retire(r->servers[i]);
+    r->n_servers = 0;
+
+    for (i = 0; i < n; i++) {
+        s = calloc(1, sizeof(*s));
+        if (!s) {
+            warnx("%s: memory error", __FUNCTION__);
+            break;
+        }
+        s->r = r;
+        s->addr = addrs[i];
+        r->servers[r->n_servers++] = s;
+        NETLOG("(dns) resolver server %d %s", i,
+               NETADDR_STR(&s->addr, netabuf, sizeof(netabuf)));
+    }
+
+    if (!r->n_servers)
+        NETLOG("(dns) resolver has no servers");
+    r->max_tries = r->config.attempts * MAX(r->n_servers, 1);
+}
+
+/* see RFC 1035(4.1.1, 4.1.2) */
+static int query_build(struct dns_question *qs, uint8_t *msg, size_t size)
+{
+    const char *label, *dot;
+    size_t off, l;
+
+    if (size < DNS_HDR_LEN)
+        return -1;
+
+    memset(msg, 0, DNS_HDR_LEN);
+    wr16(msg, qs->id);
+    wr16(msg + 2, DNS_FLAG_RD);
+    wr16(msg + 4, 1);
+    off = DNS_HDR_LEN;
+
+    for (label = qs->q->name; *label; label = dot + 1) {
+        dot = strchr(label, '.');
+        if (!dot)
+            dot = label + strlen(label);
+        l = dot - label;
+        if (!l || l > DNS_LABEL_MAXLEN || off + 1 + l + 1 + 4 > size)
+            return -1;
+        msg[off++] = (uint8_t) l;
+        memcpy(msg + off, label, l);
+        off += l;
+        if (!*dot)
+            break;
+    }
+    msg[off++] = 0;
+    wr16(msg + off, qs->type);
+    wr16(msg + off + 2, DNS_CLASS_IN);
+    off += 4;
+
+    return (int) off;
+}
+
+/* expands a possibly compressed name at *off, and moves *off past it */
+static int name_read(const uint8_t *msg, size_t len, size_t *off, char *name)
+{
+    size_t o = *off, n = 0;
+    int jumps = 0;
+    bool jumped = false;
+    uint8_t l;
+
+    for (;;) {
+        if (o >= len)
+            return -1;
+        l = msg[o];
+        if ((l & 0xc0) == 0xc0) {
+            if (o + 1 >= len || ++jumps > DNS_MAX_JUMPS)
+                return -1;
+            if (!jumped)
+                *off = o + 2;
+            jumped = true;
+            o = ((l & 0x3f) << 8) | msg[o + 1];
+            continue;
+        }
+        if (l & 0xc0)
+            return -1;
+        o++;
+        if (!l)
+            break;
+        if (o + l > len || n + l + 1 > DNS_NAME_MAXLEN)
+            return -1;
+        if (n)
+            name[n++] = '.';
+        memcpy(name + n, msg + o, l);
+        n += l;
+        o += l;
+    }
+    name[n] = 0;
+    if (!jumped)
+        *off = o;
+
+    return 0;
+}
+
+/* labels of 1 to 63 characters, in at most 255 */
+static bool name_askable(const char *name, size_t len)
+{
+    size_t i, l = 0;
+
+    if (!len || len > DNS_NAME_MAXLEN)
+        return false;
+    for (i = 0; i < len; i++) {
+        if (name[i] != '.') {
+            if (++l > DNS_LABEL_MAXLEN)
+                return false;
+            continue;
+        }
+        if (!l)
+            return false;
+        l = 0;
+    }
+
+    return l > 0;
+}
+
+/* only hostname characters make it to the guest as a cname */
+static bool name_valid(const char *name)
+{
+    const char *p;
+
+    if (!*name)
+        return false;
+    for (p = name; *p; p++) {
+        if (!isalnum((unsigned char) *p) && *p != '-' && *p != '_' && *p != '.')
+            return false;
+    }
+
+    return true;
+}
+
+static bool name_equal(const uint8_t *msg, size_t len, size_t off,
+                       const char *name)
+{
+    char owner[DNS_NAME_MAXLEN + 1];
+
+    return name_read(msg, len, &off, owner) == 0 && !strcasecmp(owner, name);
+}
+
+static int answer_add(struct dns_answer *ans, uint16_t type,
+                      const uint8_t *rdata)
+{
+    struct net_addr addr;
+    size_t i;
+
+    memset(&addr, 0, sizeof(addr));
+    if (type == DNS_TYPE_A) {
+        addr.family = AF_INET;
+        memcpy(&addr.ipv4, rdata, sizeof(addr.ipv4));
+    } else {
+        addr.family = AF_INET6;
+        memcpy(&addr.ipv6, rdata, sizeof(addr.ipv6));
+    }
+
+    for (i = 0; i < ans->n_a; i++) {
+        if (addr_equal(&ans->a[i], &addr))
+            return 0;
+    }
+
+    if (!ans->a) {
+        ans->a = calloc(DNS_MAX_RRS, sizeof(*ans->a));
+        if (!ans->a)
+            return -1;
+    }
+    ans->a[ans->n_a++] = addr;
+
+    return 0;
+}
+
+/*
+ * Takes apart msg as the answer to qs, anything that is not, or does not
+ * parse, is ignored -- the question then times out and is asked again.
+ */
+static int answer_parse(struct dns_question *qs, const uint8_t *msg,
+                        size_t len, struct dns_answer *ans)
+{
+    struct {
+        size_t owner;
+        uint16_t type;
+        uint32_t ttl;
+        size_t rdata;
+        uint16_t rdlen;
+    } rrs[DNS_MAX_RRS];
+    char name[DNS_NAME_MAXLEN + 1], target[DNS_NAME_MAXLEN + 1];
+    uint16_t flags, ancount, class, rdlen;
+    size_t off, n_rrs = 0, i;
+    int hops;
+
+    memset(ans, 0, sizeof(*ans));
+    if (len < DNS_HDR_LEN || rd16(msg) != qs->id)
+        return -1;
+    flags = rd16(msg + 2);
+    if (!(flags & DNS_FLAG_QR) || (flags & DNS_FLAG_OPCODE) || rd16(msg + 4) != 1)
+        return -1;
+    ancount = rd16(msg + 6);
+
+    off = DNS_HDR_LEN;
+    if (name_read(msg, len, &off, name) < 0 || off + 4 > len)
+        return -1;
+    if (strcasecmp(name, qs->q->name) || rd16(msg + off) != qs->type ||
+        rd16(msg + off + 2) != DNS_CLASS_IN)
+        return -1;
+    off += 4;
+
+    ans->rcode = DNS_RCODE(flags);
+    ans->tc = !!(flags & DNS_FLAG_TC);
+    if (ans->tc || ans->rcode != DNS_RCODE_NOERROR)
+        return 0;
+
+    for (i = 0; i < ancount && n_rrs < DNS_MAX_RRS; i++) {
+        size_t owner = off;
+
+        if (name_read(msg, len, &off, name) < 0 || off + 10 > len)
+            return -1;
+        class = rd16(msg + off + 2);
+        rdlen = rd16(msg + off + 8);
+        if (off + 10 + rdlen > len)
+            return -1;
+        if (class == DNS_CLASS_IN) {
+            rrs[n_rrs].owner = owner;
+            rrs[n_rrs].type = rd16(msg + off);
+            rrs[n_rrs].ttl = rd32(msg + off + 4) & 0x7fffffff;
+            rrs[n_rrs].rdata = off + 10;
+            rrs[n_rrs].rdlen = rdlen;
+            n_rrs++;
+        }
+        off += 10 + rdlen;
+    }
+
+    ans->ttl = UINT32_MAX;
+    strcpy(target, qs->q->name);
+    for (hops = 0; hops < DNS_MAX_CNAMES; hops++) {
+        for (i = 0; i < n_rrs; i++) {
+            off = rrs[i].rdata;
+            if (rrs[i].type == DNS_TYPE_CNAME &&
+                name_equal(msg, len, rrs[i].owner, target) &&
+                name_read(msg, len, &off, name) == 0)
+                break;
+        }
+        if (i == n_rrs)
+            break;
+        ans->ttl = MIN(ans->ttl, rrs[i].ttl);
+        strcpy(target, name);
+    }
+
+    for (i = 0; i < n_rrs; i++) {
+        if (rrs[i].type != qs->type ||
+            rrs[i].rdlen != (qs->type == DNS_TYPE_A ? 4 : 16) ||
+            !name_equal(msg, len, rrs[i].owner, target))
+            continue;
+        if (answer_add(ans, rrs[i].type, msg + rrs[i].rdata) < 0)
+            goto mem_err;
+        ans->ttl = MIN(ans->ttl, rrs[i].ttl);
+    }
+
+    if (!ans->n_a) {
+        ans->ttl = 0;
+        return 0;
+    }
+    if (hops && name_valid(target) && !(ans->canon_name = strdup(target)))
+        goto mem_err;
+
+    return 0;
+
+mem_err:
+    warnx("%s: memory error", __FUNCTION__);
+    free(ans->a);
+    ans->a = NULL;
+    ans->n_a = 0;
+    return -1;
+}
+
+static void tcp_close(struct dns_question *qs)
+{
+    struct dns_tcp *t = &qs->tcp;
+
+    if (t->so)
+        so_close(t->so);
+    free(t->wbuf);
+    free(t->rbuf);
+    memset(t, 0, sizeof(*t));
+}
+
+/* takes qs off wherever it was asked */
+static void question_unlink(struct dns_question *qs)
+{
+    if (qs->so) {
+        /* a late answer to this attempt is not taken any more */
+        so_close(qs->so);
+        qs->so = NULL;
+    }
+    if (qs->state == QS_TCP)
+        tcp_close(qs);
+    if (qs->server) {
+        server_put(qs->server);
+        qs->server = NULL;
+    }
+}
+
+static void question_done(struct dns_question *qs, int result)
+{
+    question_unlink(qs);
+    qs->state = QS_DONE;
+    qs->result = result;
+}
+
+static void question_retry(struct dns_question *qs)
+{
+    if (qs->tries < qs->q->r->max_tries) {
+        qs->q->r->n_retries++;
+        question_send(qs);
+    } else {
+        question_done(qs, QR_FAIL);
+    }
+}
+
+static int question_write(struct dns_question *qs)
+{
+    uint8_t msg[DNS_UDP_MAXLEN];
+    int len;
+
+    len = query_build(qs, msg, sizeof(msg));
+    if (len < 0)
+        return -1;
+
+    return so_write(qs->so, msg, len) == len ? 0 : -1;
+}
+
+static bool answer_input(struct dns_question *qs, const uint8_t *msg,
+                         size_t len, bool udp);
+
+/* true once an answer was handed on, qs may then be gone */
+static bool udp_read(struct dns_question *qs)
+{
+    struct dns_resolver *r = qs->q->r;
+    size_t len;
+
+    while (qs->so && (len = so_read(qs->so, r->rbuf, sizeof(r->rbuf)))) {
+        if (len < DNS_HDR_LEN)
+            continue;
+        if (rd16(r->rbuf) != qs->id) {
+            r->n_stray++;
+            NETLOG5("(dns) resolver stray answer id 0x%x",
+                    (unsigned int) rd16(r->rbuf));
+            continue;
+        }
+        if (answer_input(qs, r->rbuf, len, true))
+            return true;
+    }
+
+    return false;
+}
+
+static void udp_event(void *opaque, uint32_t evt, int err)
+{
+    struct dns_question *qs = opaque;
+
+    /* a question whose write failed is left to time out */
+    if ((evt & SO_EVT_CONNECTED) && qs->state == QS_WAIT) {
+        qs->state = QS_SENT;
+        question_write(qs);
+    }
+    if ((evt & SO_EVT_READ) && udp_read(qs))
+        return;
+    if ((evt & SO_EVT_CLOSING) && qs->so) {
+        NETLOG4("(dns) resolver udp socket closing, err %d", err);
+        so_close(qs->so);
+        qs->so = NULL;
+    }
+}
+
+/*
+ * Every attempt goes to the next server, under a new id and from a new
+ * source port: each socket is bound afresh by the host, which hands out
+ * ephemeral ports at random.
+ */
+static void question_send(struct dns_question *qs)
+{
+    struct dns_resolver *r = qs->q->r;
+    struct dns_server *s;
+
+    question_unlink(qs);
+    if (!r->n_servers) {
+        question_done(qs, QR_FAIL);
+        return;
+    }
+    if (qs->tries)
+        qs->server_idx++;
+    qs->server_idx %= r->n_servers;
+    qs->tries++;
+    qs->sent_ms = get_clock_ms(rt_clock);
+
+    s = r->servers[qs->server_idx];
+    server_get(s);
+    qs->server = s;
+    generate_random_bytes(&qs->id, sizeof(qs->id));
+    qs->state = QS_WAIT;
+
+    /* one that cannot be sent is left to time out */
+    qs->so = so_create(r->ni, true, udp_event, qs);
+    if (qs->so && so_connect(qs->so, &s->addr, r->port) < 0) {
+        so_close(qs->so);
+        qs->so = NULL;
+    }
+}
+
+static void tcp_write(struct dns_question *qs)
+{
+    struct dns_tcp *t = &qs->tcp;
+    size_t n;
+
+    while (t->woff < t->wlen) {
+        n = so_write(t->so, t->wbuf + t->woff, t->wlen - t->woff);
+        if (!n)
+            break;
+        t->woff += n;
+    }
+}
+
+/* true once an answer was handed on, qs may then be gone */
+static bool tcp_read(struct dns_question *qs)
+{
+    struct dns_tcp *t = &qs->tcp;
+    size_t n;
+
+    while (t->so) {
+        if (t->rhdr_off < sizeof(t->rhdr)) {
+            n = so_read(t->so, t->rhdr + t->rhdr_off,
+                        sizeof(t->rhdr) - t->rhdr_off);
+            if (!n)
+                break;
+            t->rhdr_off += n;
+            if (t->rhdr_off < sizeof(t->rhdr))
+                continue;
+            t->rlen = rd16(t->rhdr);
+            if (t->rlen < DNS_HDR_LEN || !(t->rbuf = malloc(t->rlen))) {
+                question_retry(qs);
+                query_check(qs->q);
+                return true;
+            }
+            continue;
+        }
+
+        n = so_read(t->so, t->rbuf + t->roff, t->rlen - t->roff);
+        if (!n)
+            break;
+        t->roff += n;
+        if (t->roff == t->rlen) {
+            answer_input(qs, t->rbuf, t->rlen, false);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void tcp_event(void *opaque, uint32_t evt, int err)
+{
+    struct dns_question *qs = opaque;
+
+    if (evt & (SO_EVT_CONNECTED | SO_EVT_WRITE))
+        tcp_write(qs);
+    if ((evt & SO_EVT_READ) && tcp_read(qs))
+        return;
+    if (evt & SO_EVT_CLOSING) {
+        NETLOG4("(dns) resolver tcp closing, err %d", err);
+        question_retry(qs);
+        query_check(qs->q);
+    }
+}
+
+/* asks the server that truncated the answer again, over tcp */
+static void tcp_start(struct dns_question *qs)
+{
+    struct dns_resolver *r = qs->q->r;
+    struct dns_tcp *t = &qs->tcp;
+    struct net_addr addr = qs->server->addr;
+    int len;
+
+    question_unlink(qs);
+    qs->state = QS_TCP;
+    qs->sent_ms = get_clock_ms(rt_clock);
+    r->n_tcp++;
+
+    t->wbuf = malloc(DNS_UDP_MAXLEN + 2);
+    if (!t->wbuf)
+        goto err;
+    len = query_build(qs, t->wbuf + 2, DNS_UDP_MAXLEN);
+    if (len < 0)
+        goto err;
+    wr16(t->wbuf, len);
+    t->wlen = len + 2;
+
+    t->so = so_create(r->ni, false, tcp_event, qs);
+    if (!t->so)
+        goto err;
+    if (so_connect(t->so, &addr, r->port) < 0)
+        goto err;
+
+    return;
+
+err:
+    question_retry(qs);
+}
+
+/* false if msg was ignored, otherwise qs may be gone */
+static bool answer_input(struct dns_question *qs, const uint8_t *msg,
+                         size_t len, bool udp)
+{
+    struct dns_query *q = qs->q;
+    struct dns_answer ans;
+
+    if (answer_parse(qs, msg, len, &ans) < 0) {
+        NETLOG4("(dns) resolver ignoring a bad answer for %s", q->name);
+        return false;
+    }
+
+    if (ans.tc) {
+        if (udp)
+            tcp_start(qs);
+        else
+            question_retry(qs);
+        goto out;
+    }
+
+    switch (ans.rcode) {
+    case DNS_RCODE_NOERROR:
+        question_done(qs, ans.n_a ? QR_DATA : QR_NODATA);
+        qs->a = ans.a;
+        qs->n_a = ans.n_a;
+        qs->canon_name = ans.canon_name;
+        qs->ttl = ans.ttl;
+        ans.a = NULL;
+        ans.canon_name = NULL;
+        break;
+    case DNS_RCODE_NXDOMAIN:
+        question_done(qs, QR_NXDOMAIN);
+        break;
+    default:
+        /* SERVFAIL, REFUSED and the like say nothing about the name */
+        NETLOG4("(dns) resolver rcode %d for %s", ans.rcode, q->name);
+        question_retry(qs);
+        break;
+    }
+
+out:
+    free(ans.a);
+    free(ans.canon_name);
+    query_check(q);
+
+    return true;
+}
+
+static void query_free(struct dns_query *q)
+{
+    int i;
+
+    for (i = 0; i < q->n_qs; i++) {
+        question_unlink(&q->qs[i]);
+        free(q->qs[i].a);
+        free(q->qs[i].canon_name);
+    }
+    if (q->timer)
+        free_timer(q->timer);
+    LIST_REMOVE(q, entry);
+    free(q->name);
+    free(q);
+}
+
+/*
+ * Addresses if there are any, A before AAAA.  Without, the name only
+ * does not exist if no server failed us, otherwise the caller should
+ * ask elsewhere.
+ */
+static void query_finish(struct dns_query *q)
+{
+    struct dns_resolver *r = q->r;
+    struct dns_response resp;
+    struct dns_question *qs;
+    dns_resolver_cb cb = q->cb;
+    void *opaque = q->opaque;
+    uint32_t ttl = UINT32_MAX;
+    size_t n = 0;
+    bool nx = false, fail = false;
+    int i;
+
+    memset(&resp, 0, sizeof(resp));
+    for (i = 0; i < q->n_qs; i++) {
+        qs = &q->qs[i];
+        n += qs->n_a;
+        nx = nx || qs->result == QR_NXDOMAIN;
+        fail = fail || qs->result == QR_FAIL;
+    }
+
+    if (n && q->qs[0].result != QR_FAIL) {
+        resp.a = calloc(n + 1, sizeof(*resp.a));
+        if (!resp.a) {
+            warnx("%s: memory error", __FUNCTION__);
+            resp.err = EAI_MEMORY;
+            goto out;
+        }
+        n = 0;
+        for (i = 0; i < q->n_qs; i++) {
+            qs = &q->qs[i];
+            if (!qs->n_a)
+                continue;
+            memcpy(resp.a + n, qs->a, qs->n_a * sizeof(*resp.a));
+            n += qs->n_a;
+            ttl = MIN(ttl, qs->ttl);
+            if (!resp.canon_name) {
+                resp.canon_name = qs->canon_name;
+                qs->canon_name = NULL;
+            }
+        }
+    } else if (nx || !fail) {
+        resp.err = EAI_NONAME;
+        ttl = 0;
+    } else {
+        resp.err = EAI_AGAIN;
+        ttl = 0;
+        r->n_failed++;
+    }
+
+out:
+    resp.cost_ms = get_clock_ms(rt_clock) - q->start_ms;
+    NETLOG5("(dns) resolver %s err %d, %u addresses in %"PRId64" ms",
+            q->name, resp.err, (unsigned int) n, resp.cost_ms);
+    query_free(q);
+    cb(opaque, &resp, resp.err ? 0 : MAX((int64_t) ttl * 1000, 1000));
+}
+
+static void query_check(struct dns_query *q)
+{
+    int64_t next = INT64_MAX;
+    int i;
+
+    for (i = 0; i < q->n_qs; i++) {
+        if (q->qs[i].state != QS_DONE)
+            next = MIN(next, q->qs[i].sent_ms + q->r->config.timeout_ms);
+    }
+
+    if (next == INT64_MAX)
+        query_finish(q);
+    else
+        mod_timer(q->timer, next);
+}
+
+static void query_timer(void *opaque)
+{
+    struct dns_query *q = opaque;
+    struct dns_question *qs;
+    int64_t now = get_clock_ms(rt_clock);
+    int i;
+
+    for (i = 0; i < q->n_qs; i++) {
+        qs = &q->qs[i];
+        if (qs->state == QS_DONE ||
+            now - qs->sent_ms < q->r->config.timeout_ms)
+            continue;
+        NETLOG5("(dns) resolver timeout for %s, try %d", q->name, qs->tries);
+        question_retry(qs);
+    }
+    query_check(q);
+}
+
+int dns_resolver_lookup(struct dns_resolver *r, const char *name, bool ipv6,
+                        dns_resolver_cb cb, void *opaque)
+{
+    struct dns_query *q = NULL;
+    size_t len;
+    int i;
+
+    if (r->system_servers &&
+        get_clock_ms(rt_clock) - r->servers_ms > DNS_SERVERS_REFRESH_MS)
+        servers_load(r);
+    if (!r->n_servers)
+        goto err;
+
+    len = strlen(name);
+    if (len && name[len - 1] == '.')
+        len--;
+    if (!name_askable(name, len))
+        goto err;
+
+    q = calloc(1, sizeof(*q));
+    if (!q)
+        goto mem_err;
+    q->name = malloc(len + 1);
+    if (!q->name)
+        goto mem_err;
+    memcpy(q->name, name, len);
+    q->name[len] = 0;
+    q->timer = ni_new_rt_timer(r->ni, r->config.timeout_ms, query_timer, q);
+    if (!q->timer)
+        goto mem_err;
+    q->r = r;
+    q->cb = cb;
+    q->opaque = opaque;
+    q->start_ms = get_clock_ms(rt_clock);
+    q->qs[q->n_qs++].type = DNS_TYPE_A;
+    if (ipv6)
+        q->qs[q->n_qs++].type = DNS_TYPE_AAAA;
+    LIST_INSERT_HEAD(&r->queries, q, entry);
+    r->n_lookups++;
+
+    for (i = 0; i < q->n_qs; i++) {
+        q->qs[i].q = q;
+        question_send(&q->qs[i]);
+    }
+
+    return 0;
+
+mem_err:
+    warnx("%s: memory error", __FUNCTION__);
+    if (q) {
+        if (q->timer)
+            free_timer(q->timer);
+        free(q->name);
+        free(q);
+    }
+err:
+    return -1;
+}
+
+struct dns_resolver *dns_resolver_new(struct nickel *ni,
+                                      const struct dns_resolver_config *config)
+{
+    struct dns_resolver *r;
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        warnx("%s: memory error", __FUNCTION__);
+        return NULL;
+    }
+
+    r->ni = ni;
+    r->config = *config;
+    if (r->config.n_servers > DNS_RES_MAX_SERVERS)
+        r->config.n_servers = DNS_RES_MAX_SERVERS;
+    if (r->config.timeout_ms <= 0)
+        r->config.timeout_ms = DNS_RES_DEFAULT_TIMEOUT_MS;
+    if (r->config.attempts <= 0)
+        r->config.attempts = DNS_RES_DEFAULT_ATTEMPTS;
+    r->port = r->config.port ? r->config.port : htons(DNS_PORT);
+    r->system_servers = !r->config.n_servers;
+    LIST_INIT(&r->retired);
+    LIST_INIT(&r->queries);
+
+    servers_load(r);
+
+    NETLOG("(dns) resolver timeout %d ms, %d attempts", r->config.timeout_ms,
+           r->config.attempts);
+
+    return r;
+}
+
+void dns_resolver_free(struct dns_resolver *r)
+{
+    struct dns_query *q, *q_next;
+    struct dns_server *s, *s_next;
+    int i;
+
+    if (!r)
+        return;
+
+    NETLOG("(dns) resolver lookups %"PRIu64" retries %"PRIu64" tcp %"PRIu64
+           " failed %"PRIu64" stray %"PRIu64, r->n_lookups, r->n_retries,
+           r->n_tcp, r->n_failed, r->n_stray);
+
+    LIST_FOREACH_SAFE(q, &r->queries, entry, q_next)
+        query_free(q);
+    for (i = 0; i < r->n_servers; i++)
+        server_free(r->servers[i]);
+    LIST_FOREACH_SAFE(s, &r->retired, entry, s_next)
+        server_free(s);
+    free(r);
+}
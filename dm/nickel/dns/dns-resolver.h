@@ -0,0 +1,46 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _DNS_RESOLVER_H_
+#define _DNS_RESOLVER_H_
+
+#include "dns.h"
+
+#define DNS_RES_MAX_SERVERS         3
+#define DNS_RES_DEFAULT_TIMEOUT_MS  1000
+#define DNS_RES_DEFAULT_ATTEMPTS    2
+
+struct nickel;
+struct dns_response;
+struct dns_resolver;
+
+struct dns_resolver_config {
+    /* none to use the servers the host is configured with */
+    struct net_addr servers[DNS_RES_MAX_SERVERS];
+    int n_servers;
+    uint16_t port;          /* network order, 0 for 53 */
+    int timeout_ms;         /* per attempt */
+    int attempts;           /* rounds over the servers */
+};
+
+/*
+ * Called on the nickel thread once the lookup is done, resp is the
+ * callee's to free.  err is 0 or EAI_NONAME when the servers gave an
+ * answer -- ttl_ms is then the record ttl, 0 if there is none -- and
+ * EAI_AGAIN when they did not.
+ */
+typedef void (*dns_resolver_cb)(void *opaque, struct dns_response *resp,
+                                int64_t ttl_ms);
+
+struct dns_resolver *dns_resolver_new(struct nickel *ni,
+                                      const struct dns_resolver_config *config);
+/* lookups in flight are dropped without their callbacks */
+void dns_resolver_free(struct dns_resolver *r);
+/* A, and AAAA when ipv6, queried in parallel -- fails if the lookup
+ * could not be started */
+int dns_resolver_lookup(struct dns_resolver *r, const char *name, bool ipv6,
+                        dns_resolver_cb cb, void *opaque);
+
+#endif
@@ -15,7 +15,9 @@
 #include <nickel.h>
 #include <log.h>
 #include "dns.h"
+#include "dns-cache.h"
 #include "dns-fake.h"
+#include "dns-resolver.h"
 #include "lava.h"
 
 
@@ -44,6 +46,9 @@ static int disable_dns_queries = 0;
 static unsigned max_pending_dns_queries = DEFAULT_MAX_SCHED_DNS_QUERIES;
 static unsigned pending_dns_queries = 0;
 
+static int native_resolver = 0;
+static struct dns_resolver_config resolver_config;
+
 static void ndns_close(CharDriverState *chr);
 
 struct dns_chr_t {
@@ -94,6 +99,7 @@ struct ndns_data {
     int failure;
     uint16_t connection_port;
     int guest_lookup;
+    uint32_t cache_gen;
     struct dns_response response;
     union {
         struct {
@@ -231,12 +237,59 @@ static void dns_config(yajl_val config)
     no_proxy_mode = yajl_object_get_bool_default(config, "no-proxy-mode", 0);
     NETLOG("(dns) no-proxy-mode is %s", no_proxy_mode ? "ON" : "OFF");
 
+    dns_cache_config(yajl_object_get_integer_default(config, "cache-size",
+                                                     DNS_CACHE_DEFAULT_SIZE),
+                     yajl_object_get_integer_default(config, "cache-ttl",
+                                                     DNS_CACHE_DEFAULT_TTL_S),
+                     yajl_object_get_integer_default(config, "cache-negative-ttl",
+                                                     DNS_CACHE_DEFAULT_NEG_TTL_S));
+
     max_pending_dns_queries = yajl_object_get_integer_default(config, "max-sched-dns-queries",
                                                            DEFAULT_MAX_SCHED_DNS_QUERIES);
     if (max_pending_dns_queries)
         NETLOG("(dns) max-sched-dns-queries set to %u", max_pending_dns_queries);
     else
         NETLOG("(dns) no limit for the number of scheduled DNS queries");
+
+    native_resolver = yajl_object_get_bool_default(config, "native-resolver", 0);
+    NETLOG("(dns) native-resolver is %s", native_resolver ? "ON" : "OFF");
+    if (native_resolver) {
+        yajl_val servers, v;
+        int i, n = 0;
+
+        memset(&resolver_config, 0, sizeof(resolver_config));
+        servers = yajl_object_get(config, "resolver-servers");
+        if (servers) {
+            YAJL_FOREACH_ARRAY_OR_OBJECT(v, servers, i) {
+                struct net_addr *a = &resolver_config.servers[n];
+                const char *str = YAJL_GET_STRING(v);
+
+                if (n == DNS_RES_MAX_SERVERS)
+                    break;
+                if (!str) {
+                    warnx("%s: resolver-servers: expect strings", __FUNCTION__);
+                    continue;
+                }
+                memset(a, 0, sizeof(*a));
+                if (inet_pton(AF_INET, str, &a->ipv4) == 1)
+                    a->family = AF_INET;
+                else if (inet_pton(AF_INET6, str, &a->ipv6) == 1)
+                    a->family = AF_INET6;
+                else {
+                    warnx("%s: resolver-servers: invalid address %s", __FUNCTION__, str);
+                    continue;
+                }
+                n++;
+            }
+        }
+        resolver_config.n_servers = n;
+        resolver_config.port = htons(yajl_object_get_integer_default(config, "resolver-port",
+                                                                     53));
+        resolver_config.timeout_ms = yajl_object_get_integer_default(config,
+                "resolver-timeout-ms", DNS_RES_DEFAULT_TIMEOUT_MS);
+        resolver_config.attempts = yajl_object_get_integer_default(config,
+                "resolver-attempts", DNS_RES_DEFAULT_ATTEMPTS);
+    }
 }
 
 bool dns_is_nickel_domain_name(const char *domain)
@@ -249,7 +302,7 @@ void dns_http_proxy_enabled(void)
     http_proxy_enabled = true;
 }
 
-struct dns_response dns_lookup(const char *cname)
+static struct dns_response dns_resolve(const char *cname)
 {
     int64_t cost_ms;
     struct dns_response ret;
@@ -353,6 +406,87 @@ out:
     return ret;
 }
 
+struct dns_prefetch {
+    char *dname;
+    uint32_t gen;
+};
+
+static void dns_prefetch_run(void *opaque)
+{
+    struct dns_prefetch *p = opaque;
+    struct dns_response resp;
+
+    DDNS(p, "prefetch %s", p->dname);
+    resp = dns_resolve(p->dname);
+    dns_cache_insert(p->dname, &resp, p->gen, 0);
+    dns_response_free(&resp);
+}
+
+static void dns_prefetch_done(void *opaque)
+{
+    struct dns_prefetch *p = opaque;
+
+    ni_priv_free(p->dname);
+    free(p);
+}
+
+static struct dns_prefetch *dns_prefetch_new(const char *cname, uint32_t gen)
+{
+    struct dns_prefetch *p;
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        goto mem_err;
+    p->dname = ni_priv_strdup(cname);
+    if (!p->dname)
+        goto mem_err;
+    p->gen = gen;
+    return p;
+
+mem_err:
+    warnx("%s: memory error", __FUNCTION__);
+    free(p);
+    return NULL;
+}
+
+static void dns_prefetch(struct nickel *ni, const char *cname, uint32_t gen)
+{
+    struct dns_prefetch *p;
+
+    p = dns_prefetch_new(cname, gen);
+    if (!p)
+        return;
+    if (ni_schedule_bh(ni, dns_prefetch_run, dns_prefetch_done, p)) {
+        warnx("%s: ni_schedule_bh failure", __FUNCTION__);
+        dns_prefetch_done(p);
+    }
+}
+
+/* answers come from the cache when they can, popular names are refreshed
+ * in the background on ni's async op threads */
+struct dns_response dns_lookup(struct nickel *ni, const char *cname)
+{
+    int64_t cost_ms;
+    struct dns_response ret;
+    uint32_t gen;
+    bool prefetch = false;
+
+    cost_ms = os_get_clock_ms();
+    memset(&ret, 0, sizeof(ret));
+    if (dns_cache_lookup(cname, &ret, &gen, ni ? &prefetch : NULL)) {
+        ret.cname = cname;
+        DDNS(&ret, "cached %s err %d", cname, ret.err);
+        if (prefetch)
+            dns_prefetch(ni, cname, gen);
+        ret.cost_ms = os_get_clock_ms() - cost_ms;
+        return ret;
+    }
+
+    ret = dns_resolve(cname);
+    dns_cache_insert(cname, &ret, gen, 0);
+    return ret;
+}
+
 void dns_response_free(struct dns_response *resp)
 {
     free(resp->canon_name);
@@ -431,20 +565,15 @@ const struct net_addr * dns_hyb_addr(struct net_addr *a)
     return found ? a + j : NULL;
 }
 
-static void dns_lookup_check(void *opaque)
+/* what access control makes of the answer in dstate->response */
+static void dns_response_check(struct ndns_data *dstate)
 {
     struct net_addr *ips = NULL;
     char *ret_mask = NULL;
-    struct ndns_data *dstate = opaque;
 
     size_t len46, len;
     int i, j, k = 0;
 
-    DDNS(dstate, "");
-
-    dstate->response = dns_lookup(dstate->dname);
-
-    DDNS(dstate, "dns_lookup err %d", dstate->response.err);
     if (!dstate->ni || !dstate->ni->ac_enabled)
         goto out;
 
@@ -544,6 +673,18 @@ out:
     return;
 }
 
+static void dns_lookup_check(void *opaque)
+{
+    struct ndns_data *dstate = opaque;
+
+    DDNS(dstate, "");
+
+    dstate->response = dns_lookup(dstate->ni, dstate->dname);
+
+    DDNS(dstate, "dns_lookup err %d", dstate->response.err);
+    dns_response_check(dstate);
+}
+
 static void dns_lookup_check_continue(void *opaque)
 {
     struct ndns_data *dstate = opaque;
@@ -584,6 +725,97 @@ static void dns_sync_query(void *opaque)
     dns_lookup_check(dstate);
 }
 
+/*
+ * Guest lookups through the native resolver run on the nickel thread, only
+ * the access control name check, which may need an RPC, goes to an async op
+ * thread.  Answers the servers could not give are asked of getaddrinfo.
+ */
+static struct dns_resolver *dns_native_resolver(struct nickel *ni)
+{
+    if (!ni->native_resolver)
+        ni->native_resolver = dns_resolver_new(ni, &resolver_config);
+
+    return ni->native_resolver;
+}
+
+static void dns_native_prefetched(void *opaque, struct dns_response *resp, int64_t ttl_ms)
+{
+    struct dns_prefetch *p = opaque;
+
+    if (resp->err != EAI_AGAIN)
+        dns_cache_insert(p->dname, resp, p->gen, ttl_ms);
+    dns_response_free(resp);
+    dns_prefetch_done(p);
+}
+
+static void dns_native_fallback(struct ndns_data *dstate)
+{
+    if (ni_schedule_bh_high(dstate->ni, dns_lookup_check, dns_input_continue,
+                            dstate)) {
+        warnx("%s: ni_schedule_bh failure", __FUNCTION__);
+        dstate->failure = 1;
+        dns_input_continue(dstate);
+    }
+}
+
+static void dns_native_done(void *opaque, struct dns_response *resp, int64_t ttl_ms)
+{
+    struct ndns_data *dstate = opaque;
+
+    DDNS(dstate, "native lookup err %d in %"PRId64" ms", resp->err, resp->cost_ms);
+    if (resp->err == EAI_AGAIN) {
+        dns_response_free(resp);
+        dns_native_fallback(dstate);
+        return;
+    }
+
+    dstate->response = *resp;
+    dstate->response.cname = dstate->dname;
+    dns_cache_insert(dstate->dname, &dstate->response, dstate->cache_gen, ttl_ms);
+    dns_response_check(dstate);
+    dns_input_continue(dstate);
+}
+
+static void dns_native_lookup(struct ndns_data *dstate)
+{
+    struct dns_resolver *r = dns_native_resolver(dstate->ni);
+    struct dns_prefetch *p;
+    bool prefetch = false;
+
+    if (dns_cache_lookup(dstate->dname, &dstate->response, &dstate->cache_gen, &prefetch)) {
+        dstate->response.cname = dstate->dname;
+        DDNS(dstate, "cached %s err %d", dstate->dname, dstate->response.err);
+        if (prefetch && r && (p = dns_prefetch_new(dstate->dname, dstate->cache_gen)) &&
+            dns_resolver_lookup(r, p->dname, ipv6_allowed, dns_native_prefetched, p))
+            dns_prefetch_done(p);
+        dns_response_check(dstate);
+        dns_input_continue(dstate);
+        return;
+    }
+
+    if (!r || dns_resolver_lookup(r, dstate->dname, ipv6_allowed, dns_native_done, dstate))
+        dns_native_fallback(dstate);
+}
+
+static void dns_native_name_check(void *opaque)
+{
+    struct ndns_data *dstate = opaque;
+
+    // blocking check name here ...
+    if (!ac_is_dnsname_allowed(dstate->ni, dstate->dname))
+        dstate->denied = 1;
+}
+
+static void dns_native_name_check_continue(void *opaque)
+{
+    struct ndns_data *dstate = opaque;
+
+    if (dstate->denied)
+        dns_input_continue(dstate);
+    else
+        dns_native_lookup(dstate);
+}
+
 struct dns_response dns_lookup_containment(struct nickel *ni, const char *name, uint16_t port,
                                            int proxy_on)
 {
@@ -722,8 +954,8 @@ process:
             ndstate->dname = ni_priv_strdup(dstate->dname);
             ndstate->fake_ip = *faddr;
             ndstate->guest_lookup = 1;
-            if (ni_schedule_bh(ndstate->ni, dns_lookup_check, dns_lookup_check_continue,
-                        ndstate)) {
+            if (ni_schedule_bh_high(ndstate->ni, dns_lookup_check,
+                        dns_lookup_check_continue, ndstate)) {
 
                 warnx("%s: nickel_schedule_bh failure", __FUNCTION__);
                 ni_priv_free(ndstate->dname);
@@ -997,8 +1229,22 @@ ndns_chr_write(CharDriverState *chr, const uint8_t *buf, int blen)
 
     dstate->scheduled = 1;
     pending_dns_queries++;
+    if (native_resolver && dstate->ni && !dstate->ni->ac_enabled) {
+        dns_native_lookup(dstate);
+        return 0;
+    }
+    if (native_resolver && dstate->ni) {
+        if (ni_schedule_bh_high(dstate->ni, dns_native_name_check,
+                                dns_native_name_check_continue, dstate)) {
+            pending_dns_queries--;
+            dstate->scheduled = 0;
+            goto cleanup;
+        }
+        return 0;
+    }
     // non proxy async dns lookup
-    if (ni_schedule_bh(dstate->ni, dns_sync_query, dns_input_continue, dstate)) {
+    if (ni_schedule_bh_high(dstate->ni, dns_sync_query, dns_input_continue,
+                            dstate)) {
         pending_dns_queries--;
         dstate->scheduled = 0;
         goto cleanup;
@@ -104,7 +104,7 @@ struct dns_response {
 
 bool dns_is_nickel_domain_name(const char *domain);
 void dns_http_proxy_enabled(void);
-struct dns_response dns_lookup(const char *dname);
+struct dns_response dns_lookup(struct nickel *ni, const char *dname);
 struct dns_response dns_lookup_containment(struct nickel *ni, const char *name, uint16_t port,
                                            int proxy_on);
 void dns_hyb_update(struct net_addr *a, struct net_addr cn_addr);
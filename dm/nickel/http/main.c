@@ -39,6 +39,7 @@
 
 #define NTLM_MAKE_USERNAME_UPPERCASE
 #define HP_IDLE_MAX_TIMEOUT         (60 * 1000) /* 60 secs */
+#define HP_PROXY_IDLE_TIMEOUT       (30 * 1000) /* 30 secs */
 #define HPD_DEBUG_CHECK_MS          (4 * 1000) /* 4 secs */
 #define MAX_RETRY_HTTP_REQ          3
 
@@ -238,12 +239,6 @@ static const char *hp_states[] = {
 #define CXF_HTTP_COMPLETE       U64BF(34)
 #define CXF_MIN_GUEST_BUFLEN    U64BF(35)
 
-#define LIST_REMOVE_NULL(elm, field) do {   \
-            LIST_REMOVE(elm, field);        \
-            (elm)->field.le_prev = NULL;    \
-        } while (1 == 0)
-#define LIST_IN_LIST(elm, field) ((elm)->field.le_prev != NULL)
-
 struct hpd_t;
 RLIST_HEAD(http_ctx_list, http_ctx);
 struct http_ctx {
@@ -270,6 +265,9 @@ struct http_ctx {
 
     uint32_t refcnt;
     int64_t idle_ts;
+    struct proxy_idle pool;
+    int pool_pending;
+    int pool_tunnel;
 
 #if VERBSTATS
     int64_t srv_ts;
@@ -303,6 +301,8 @@ struct hpd_t {
 
 static int64_t prx_refresh_id = 0;
 static int max_socket_per_proxy = 12;
+static int max_idle_per_proxy = 6;
+static int64_t proxy_idle_timeout = HP_PROXY_IDLE_TIMEOUT;
 static char *webdav_host_dir = NULL;
 static Timer *hp_idle_timer = NULL;
 static int disable_crl_check = 0;
@@ -378,6 +378,8 @@ static int cx_srv_fin(struct clt_ctx *cx);
 static int cx_dbg(int log_level, struct clt_ctx *cx);
 static int cx_webdav_process(struct clt_ctx *cx, const uint8_t *buf, int len_buf);
 static void hp_close(struct http_ctx *hp);
+static void hp_pool_remove(struct http_ctx *hp);
+static void hp_pool_close(struct proxy_idle *pi);
 static int hp_connecting_containment(struct http_ctx *hp, const struct net_addr *a, uint16_t port);
 static int hp_cx_connect_buffs(struct http_ctx *hp, bool sep_out);
 static int hp_cx_connect_next(struct http_ctx *hp, struct proxy_t *proxy);
@@ -1208,7 +1210,7 @@ static struct http_ctx * hp_create(struct nickel *ni)
 {
     struct http_ctx *hp = NULL;
 
-    hp = calloc(1, sizeof(*hp));
+    hp = ni_priv_calloc(1, sizeof(*hp));
     if (!hp)
         goto mem_err;
     hp->ni = ni;
@@ -1223,7 +1225,7 @@ mem_err:
     warnx("%s: malloc", __FUNCTION__);
     if (hp) {
         LIST_REMOVE_NULL(hp, entry);
-        free(hp);
+        ni_priv_free(hp);
         hp = NULL;
     }
     goto out;
@@ -1258,6 +1260,7 @@ static void hp_close(struct http_ctx *hp)
     hp->flags &= (~HF_RESTARTABLE & ~HF_REUSABLE);
     if (LIST_IN_LIST(hp, entry))
         LIST_REMOVE_NULL(hp, entry);
+    hp_pool_remove(hp);
 #if VERBSTATS
     if (hp->srv_lat_idx) {
         char tmp_buf[(12 + 1) * 2 * LAT_STAT_NUMBER + 1];
@@ -1341,7 +1344,7 @@ static void hp_free(struct http_ctx *hp)
         buff_put(hp->clt_out);
     hp->clt_out = NULL;
 
-    free(hp);
+    ni_priv_free(hp);
 }
 
 static int hp_connect_reinit(struct http_ctx *hp)
@@ -1551,7 +1554,8 @@ static int hp_dns_proxy_check_domain(struct http_ctx *hp)
         goto mem_err;
 
     hp_get(hp);
-    if (ni_schedule_bh(hp->ni, dns_lookup_sync, hp_dns_proxy_check_domain_cb, dns)) {
+    if (ni_schedule_bh_high(hp->ni, dns_lookup_sync,
+                            hp_dns_proxy_check_domain_cb, dns)) {
         HLOG("unet_schedule_bh FAILURE");
         hp_put(hp);
         free(dns->domain);
@@ -1589,20 +1593,25 @@ static void hp_gc_idle_sockets(int64_t now, bool close)
     struct http_ctx *hp, *hp_next;
     int64_t timeout = -1;
 
-    LIST_FOREACH_SAFE(hp, &http_list, entry, hp_next) {
-        int64_t diff;
+    int64_t diff;
 
-        if (hp->cx || !hp->idle_ts)
+    LIST_FOREACH_SAFE(hp, &http_list, entry, hp_next) {
+        /* idle connections to a proxy are on its pool */
+        if (hp->cx || !hp->idle_ts || hp->proxy)
             continue;
         diff = now - hp->idle_ts;
         if (close && diff >= HP_IDLE_MAX_TIMEOUT) {
-            HLOG5("HP_IDLE_MAX_TIMEOUT");
+            HLOG5("idle for %" PRId64 " ms, closing", diff);
             hp_close(hp);
-        } else if (timeout < 0 || timeout > diff) {
-            timeout = diff;
+        } else if (timeout < 0 || timeout > MAX(HP_IDLE_MAX_TIMEOUT - diff, 0)) {
+            timeout = MAX(HP_IDLE_MAX_TIMEOUT - diff, 0);
         }
     }
 
+    diff = proxy_pool_expire(now, proxy_idle_timeout, close ? hp_pool_close : NULL);
+    if (diff >= 0 && (timeout < 0 || timeout > diff))
+        timeout = diff;
+
     if (timeout >= 0)
         mod_timer(hp_idle_timer, now + timeout);
 }
@@ -1614,18 +1623,69 @@ static void hp_idle_timer_cb(void *unused)
 
 static int hp_set_idle_timer(struct http_ctx *hp)
 {
-    int now = get_clock_ms(rt_clock);
+    int64_t now = get_clock_ms(rt_clock);
 
-    hp->idle_ts = now;
+    if (!hp->proxy)
+        hp->idle_ts = now;
     if (!hp_idle_timer) {
         hp_idle_timer = ni_new_rt_timer(hp->ni, HP_IDLE_MAX_TIMEOUT, hp_idle_timer_cb, NULL);
-        return hp_idle_timer ? 0 : -1;
+        if (!hp_idle_timer)
+            return -1;
     }
 
     hp_gc_idle_sockets(now, false);
     return 0;
 }
 
+/* the pool itself is in proxy.c */
+static void hp_pool_remove(struct http_ctx *hp)
+{
+    if (hp->proxy)
+        proxy_pool_remove(hp->proxy, &hp->pool);
+}
+
+static int hp_pool_add(struct http_ctx *hp)
+{
+    assert(hp->proxy && !hp->cx);
+    if (LIST_IN_LIST(&hp->pool, entry))
+        return 0;
+    if (proxy_pool_add(hp->proxy, &hp->pool, max_idle_per_proxy, get_clock_ms(rt_clock)) < 0)
+        return -1;
+    return hp_set_idle_timer(hp);
+}
+
+static bool hp_pool_usable(struct proxy_idle *pi, void *opaque)
+{
+    struct http_ctx *hp = container_of(pi, struct http_ctx, pool);
+    bool tunnel = *(bool *) opaque;
+
+    assert(!hp->cx);
+    if ((hp->flags & (HF_CLOSING | HF_CLOSED)) || !(hp->flags & HF_REUSE_READY))
+        return false;
+    /* a CONNECT is only worth sending on an already authenticated session */
+    if (tunnel && (!hp->auth || !hp->auth->authorized))
+        return false;
+    return true;
+}
+
+static struct http_ctx * hp_pool_get(struct proxy_t *proxy, bool tunnel)
+{
+    struct proxy_idle *pi;
+
+    pi = proxy_pool_get(proxy, hp_pool_usable, &tunnel);
+    return pi ? container_of(pi, struct http_ctx, pool) : NULL;
+}
+
+static void hp_pool_close(struct proxy_idle *pi)
+{
+    hp_close(container_of(pi, struct http_ctx, pool));
+}
+
+static void hp_pool_flush(struct proxy_t *proxy)
+{
+    proxy_pool_flush(proxy, hp_pool_close);
+}
+
 static struct http_ctx *
 cx_hp_connect_proxy(struct clt_ctx *cx)
 {
@@ -1655,6 +1715,7 @@ cx_hp_connect_proxy(struct clt_ctx *cx)
     hp->h.daddr.sin_port = cx->h.daddr.sin_port;
 
     hp->proxy = cx->proxy;
+    hp->pool.cred_gen = proxy_cred_gen;
     if (!(cx->flags & CXF_GUEST_PROXY)) {
         hp->h.daddr.sin_family = AF_INET;
         hp->h.daddr.sin_addr = cx->h.daddr.sin_addr;
@@ -1720,6 +1781,7 @@ static int cx_hp_connect(struct clt_ctx *cx, bool *connect_now)
     int ret = 0;
     struct http_ctx *hp = NULL;
     int n_all = 0, n_http = 0, n_alone = 0;
+    bool tunnel;
 
     if ((cx->flags & CXF_CLOSED))
         goto out;
@@ -1822,42 +1884,40 @@ static int cx_hp_connect(struct clt_ctx *cx, bool *connect_now)
     }
 
     /* proxy */
-    if ((cx->flags & (CXF_TLS | CXF_BINARY | CXF_TUNNEL_GUEST))) {
-        hp = cx_hp_connect_proxy(cx);
-        goto out;
-    }
-
-    LIST_FOREACH(hp, &http_list, entry) {
-        n_all++;
-        if (hp->proxy != cx->proxy ||
-            (hp->flags & (HF_HTTP_CLOSE | HF_TLS | HF_BINARY_STREAM | HF_TUNNEL | HF_PINNED))) {
-
-            continue;
-        }
-        n_http++;
-        if (hp->cx)
-            continue;
-        n_alone++;
-        if ((hp->flags & HF_REUSE_READY))
-            break;
-    }
-    CXL5("ALL %d HTTP %d ALONE %d, proxy %"PRIxPTR", hp found %"PRIxPTR, n_all, n_http,
-         n_alone, (uintptr_t) cx->proxy, (uintptr_t) hp);
+    tunnel = (cx->flags & (CXF_TLS | CXF_BINARY | CXF_TUNNEL_GUEST)) != 0;
+    hp = hp_pool_get(cx->proxy, tunnel);
+    CXL5("proxy %"PRIxPTR" idle %d, hp found %"PRIxPTR, (uintptr_t) cx->proxy,
+         cx->proxy->nr_idle, (uintptr_t) hp);
 
     if (hp) {
         assert(!hp->cx);
 
         free(hp->h.sv_name);
+        hp->h.sv_name = NULL;
         if (cx->h.sv_name)
             hp->h.sv_name = strdup(cx->h.sv_name);
         hp->h.daddr.sin_port = cx->h.daddr.sin_port;
+        if (!(cx->flags & CXF_GUEST_PROXY)) {
+            hp->h.daddr.sin_family = AF_INET;
+            hp->h.daddr.sin_addr = cx->h.daddr.sin_addr;
+        }
         if (hp_dns_proxy_check_domain(hp) < 0) {
             CXL4("ac DENIED while reusing the proxy socket");
             cx_proxy_response(cx, HMSG_CONNECT_DENIED, true);
+            if (hp_pool_add(hp) < 0)
+                hp_close(hp);
             hp = NULL;
             goto out;
         }
 
+        if (tunnel) {
+            /* the session becomes the tunnel, as a fresh CONNECT would */
+            hp->flags &= (~HF_REUSABLE & ~HF_REUSE_READY & ~HF_RESTARTABLE &
+                          ~HF_RESTART_OK & ~HF_MONITOR_407);
+            hp->pool_pending = 1;
+            hp->pool_tunnel = 1;
+        }
+
         if (!hp->cx) {
             cx_get(cx);
             hp->cx = cx;
@@ -1874,10 +1934,30 @@ static int cx_hp_connect(struct clt_ctx *cx, bool *connect_now)
             goto out;
         *connect_now = true;
 
-        CXL5("HP REUSED from LIST  proxy %"PRIxPTR, (uintptr_t) cx->proxy);
+        CXL5("HP REUSED from POOL proxy %"PRIxPTR"%s", (uintptr_t) cx->proxy,
+             tunnel ? " for CONNECT" : "");
+        goto out;
+    }
+
+    if (tunnel) {
+        hp = cx_hp_connect_proxy(cx);
         goto out;
     }
 
+    LIST_FOREACH(hp, &http_list, entry) {
+        n_all++;
+        if (hp->proxy != cx->proxy ||
+            (hp->flags & (HF_HTTP_CLOSE | HF_TLS | HF_BINARY_STREAM | HF_TUNNEL | HF_PINNED))) {
+
+            continue;
+        }
+        n_http++;
+        if (!hp->cx)
+            n_alone++;
+    }
+    CXL5("ALL %d HTTP %d ALONE %d, proxy %"PRIxPTR, n_all, n_http, n_alone,
+         (uintptr_t) cx->proxy);
+
     if (n_http >= max_socket_per_proxy) {
         cx_get(cx);
         RLIST_INSERT_TAIL(&cx->proxy->w_list, cx, w_list);
@@ -1912,18 +1992,16 @@ static void proxy_connect_cx_next(struct proxy_t *proxy)
         return;
 
     PRXL5("WLIST NOT EMPTY N %d", proxy_number_waiting(proxy));
-    LIST_FOREACH(hp, &http_list, entry) {
-        if (hp->proxy != proxy ||
-            (hp->flags & (HF_HTTP_CLOSE | HF_TLS | HF_BINARY_STREAM | HF_TUNNEL | HF_PINNED))) {
+    hp = hp_pool_get(proxy, false);
+    if (!hp) {
+        LIST_FOREACH(hp, &http_list, entry) {
+            if (hp->proxy != proxy ||
+                (hp->flags & (HF_HTTP_CLOSE | HF_TLS | HF_BINARY_STREAM | HF_TUNNEL | HF_PINNED))) {
 
-            continue;
+                continue;
+            }
+            n_sockets++;
         }
-
-        n_sockets++;
-        if (hp->cx)
-            continue;
-        if ((hp->flags & HF_REUSE_READY))
-            break;
     }
 
     PRXL5("n_sockets %d", n_sockets);
@@ -1931,6 +2009,9 @@ static void proxy_connect_cx_next(struct proxy_t *proxy)
         return;
 
     hp_cx_connect_next(hp, proxy);
+    /* nobody was left waiting for it */
+    if (hp && !hp->cx && !(hp->flags & (HF_CLOSING | HF_CLOSED)) && hp_pool_add(hp) < 0)
+        hp_close(hp);
 }
 
 void proxy_wakeup_list(struct proxy_t *proxy)
@@ -2053,6 +2134,12 @@ static int cx_hp_disconnect_ex(struct clt_ctx *cx, bool no_cx_close)
         goto out;
     }
 
+    if (hp_pool_add(hp) < 0) {
+        hp_close(hp);
+        hp = NULL;
+        goto out;
+    }
+
 out:
     CXL5("HP_DISCONNECTED, hp %"PRIxPTR, (uintptr_t) hp);
     if (hp)
@@ -2211,6 +2298,7 @@ static int srv_reconnect(struct http_ctx *hp)
     if (hp->clt_out)
         BUFF_UNCONSUME(hp->clt_out);
 
+    hp->pool.cred_gen = proxy_cred_gen;
     hp->cstate = S_RECONNECT;
     HLOG3("so_reconnect");
     return so_reconnect(hp->so);
@@ -2247,6 +2335,7 @@ static int srv_reconnect_bad_proxy(struct http_ctx *hp)
     alternative_proxies = hp->cx->alternative_proxies;
     hp->cx->alternative_proxies = NULL;
     http_auth_free(&hp->auth);
+    hp_pool_flush(hp->proxy);
     proxy_reset(hp->proxy);
     if (hp->cx->out) {
         BUFF_RESET(hp->cx->out);
@@ -2456,6 +2545,22 @@ static void srv_tls_check_timeout_cb(void *opaque)
     }
 }
 
+/* tcpip grows its windows as the connection shows it can use them,
+ * follow with the server data we buffer and the host socket's */
+static void cx_tune(struct clt_ctx *cx)
+{
+    size_t vm_max, so_max;
+
+    if (!cx->ni_opaque)
+        return;
+
+    ni_buf_limits(cx->ni_opaque, &vm_max, &so_max);
+    cx->vm_buf_max = MAX(cx->vm_buf_max, vm_max);
+    cx->srv_buf_max = MAX(cx->srv_buf_max, so_max);
+    if (cx->hp && cx->hp->so)
+        so_set_bufsize(cx->hp->so, cx->vm_buf_max, cx->srv_buf_max);
+}
+
 static int srv_read(struct http_ctx *hp)
 {
     int ret = 0;
@@ -2490,12 +2595,14 @@ static int srv_read(struct http_ctx *hp)
     if (!hp->cx->out && !buff_new_priv(&hp->cx->out, SO_READBUFLEN))
         goto out;
 
+    cx_tune(hp->cx);
     len = BUFF_FREEDOM(hp->cx->out);
-    max_allowed = (ssize_t) MAX_SRV_BUFLEN - (ssize_t) BUFF_BUFFERED(hp->cx->out);
+    max_allowed = (ssize_t) hp->cx->srv_buf_max - (ssize_t) BUFF_BUFFERED(hp->cx->out);
     if (max_allowed < 0)
         max_allowed = 0;
     if (!len && max_allowed <= 0) {
-        HLOG5("WARNING - MAX_SRV_BUFLEN %d reached", MAX_SRV_BUFLEN);
+        HLOG5("WARNING - srv_buf_max %u reached",
+              (unsigned int) hp->cx->srv_buf_max);
         goto out_pending;
     }
 
@@ -2661,6 +2768,14 @@ static int srv_closing(struct http_ctx *hp, int err)
             lava_event_tcp_socket_error(lv, err);
     }
 
+    if (hp->pool_pending && hp->cx && IS_TUNNEL(hp)) {
+        /* the proxy dropped the idle session as we handed it the CONNECT */
+        hp->pool_pending = 0;
+        HLOG3("pooled connection closed before the CONNECT response, reconnecting");
+        if (srv_reconnect(hp) == 0)
+            goto out;
+    }
+
     if (hp->cstate == S_CONNECTED && hp->cx && !(hp->cx->flags & CXF_GUEST_PROXY)) {
         if (hp->cx->out && BUFF_BUFFERED(hp->cx->out)) {
             hp->cx->flags |= CXF_FLUSH_CLOSE;
@@ -3141,6 +3256,7 @@ static int hp_srv_process(struct http_ctx *hp)
         bool parse_error = false;
         struct lava_event *lv;
 
+        hp->pool_pending = 0;
         lparsed = HTTP_PARSE_BUFF(hp->cx->srv_parser, hp->cx->out);
         needs_consume = true;
         if (lparsed != hp->cx->out->len)
@@ -3414,6 +3530,15 @@ static int hp_srv_process(struct http_ctx *hp)
         goto err;
     }
 
+    if (auth_state == AUTH_RESTART && IS_TUNNEL(hp) && hp->pool_tunnel) {
+        /* a pooled session lost its authentication, the CONNECT has no body
+         * so it is simply sent again with a new handshake, once */
+        HLOG3("CONNECT on a reused connection needs to authenticate again");
+        hp->pool_tunnel = 0;
+        http_auth_reset(hp->auth);
+        auth_state = AUTH_PROGRESS;
+    }
+
     if (auth_state == AUTH_RESTART) {
         struct clt_ctx *cx;
 
@@ -3766,7 +3891,7 @@ static void dns_lookup_sync(void *opaque)
     if (dns->containment_check)
         dns->response = dns_lookup_containment(dns->hp->ni, dns->domain, dns->port, dns->proxy_on);
     else
-        dns->response = dns_lookup(dns->domain);
+        dns->response = dns_lookup(dns->hp->ni, dns->domain);
 }
 
 static void dns_proxy_connect_cb(void *opaque)
@@ -3905,7 +4030,8 @@ static int dns_connect_proxy_async(struct http_ctx *hp)
         goto mem_err;
 
     hp_get(hp);
-    if (ni_schedule_bh(hp->ni, dns_lookup_sync, dns_proxy_connect_cb, dns)) {
+    if (ni_schedule_bh_high(hp->ni, dns_lookup_sync, dns_proxy_connect_cb,
+                            dns)) {
         hp_put(hp);
         HLOG("unet_schedule_bh FAILURE");
         goto cleanup;
@@ -3943,7 +4069,8 @@ static int srv_connect_dns_direct(struct http_ctx *hp)
         goto mem_err;
 
     hp_get(hp);
-    if (ni_schedule_bh(hp->ni, dns_lookup_sync, dns_direct_connect_cb, dns)) {
+    if (ni_schedule_bh_high(hp->ni, dns_lookup_sync, dns_direct_connect_cb,
+                            dns)) {
         hp_put(hp);
         HLOG("ERROR - unet_schedule_bh failure");
         goto cleanup;
@@ -4356,6 +4483,18 @@ static void set_settings(struct nickel *ni, yajl_val config)
     NETLOG("%s: max-conn-per-proxy (or host) set to %d %s", __FUNCTION__, max_socket_per_proxy,
             s_max_n_socks ? "(config set)" : "(default)");
 
+    max_n_socks = dict_get_integer_default(config, "max-idle-conn-per-proxy", -1);
+    if (max_n_socks >= 0)
+        max_idle_per_proxy = (int) max_n_socks;
+    proxy_idle_timeout = dict_get_integer_default(config, "proxy-idle-timeout-ms",
+                                                  HP_PROXY_IDLE_TIMEOUT);
+    if (proxy_idle_timeout <= 0) {
+        NETLOG("%s: WARNING - proxy-idle-timeout-ms should be positive", __FUNCTION__);
+        proxy_idle_timeout = HP_PROXY_IDLE_TIMEOUT;
+    }
+    NETLOG("%s: max-idle-conn-per-proxy %d, proxy-idle-timeout-ms %" PRId64, __FUNCTION__,
+            max_idle_per_proxy, proxy_idle_timeout);
+
     ni->http_evt_cb = rpc_on_event;
 
     if (hc_prx_addr)
@@ -4482,13 +4621,16 @@ static void rpc_connect_proxy_cb(void *opaque, dict d)
     if ((tmp = dict_get_string(d, "last_refresh")))
         sscanf(tmp, "%" PRId64, &last_refresh);
 
-    if (last_refresh > 0)
+    if (last_refresh > 0 && last_refresh != prx_refresh_id) {
         prx_refresh_id = last_refresh;
+        proxy_creds_changed(hp_pool_close);
+    }
 
     cancelled = dict_get_integer_default(d, "cancelled", 0);
     if (cancelled) {
         hp->flags |= HF_407_MESSAGE;
         proxy_cache_reset();
+        proxy_creds_changed(hp_pool_close);
     }
 
     if (hp->cx && hp->cx->alternative_proxies) {
@@ -4593,10 +4735,12 @@ static void rpc_on_event(void *opaque)
         if ((tmp = dict_get_string(r->d, "last_refresh")))
             sscanf(tmp, "%" PRId64, &prx_refresh_id);
 
+        proxy_creds_changed(hp_pool_close);
         refresh_prompt_cred_states(cancel);
         goto out;
     } else if (!strcmp(command, "nc_ProxyCacheFlush")) {
         proxy_cache_reset();
+        proxy_foreach(hp_pool_flush);
         goto out;
     }
 
@@ -4912,13 +5056,14 @@ cx_create(struct nickel *ni)
     if (!BUFF_NEW_MX_PRIV(&bf, BUF_CHUNK, MAX_GUEST_BUF))
         goto mem_err;
 
-    cx = calloc(1, sizeof(*cx));
+    cx = ni_priv_calloc(1, sizeof(*cx));
     if (!cx)
         goto mem_err;
 
     cx->refcnt = 1;
     cx->ni = ni;
     cx->in = bf;
+    cx->srv_buf_max = MAX_SRV_BUFLEN;
     RLIST_INIT(cx, w_list);
     RLIST_INIT(cx, direct_cx_list);
 
@@ -5050,7 +5195,7 @@ static void cx_free(struct clt_ctx *cx)
     free(cx->alternative_proxies);
     cx->alternative_proxies = NULL;
 
-    free(cx);
+    ni_priv_free(cx);
 }
 
 static int cx_closing_response(struct clt_ctx *cx)
@@ -5160,6 +5305,7 @@ static int cx_chr_can_write(void *opaque)
     if (!cx->in)
         return 0;
 
+    cx_tune(cx);
     max_available = BUFF_FREEDOM(cx->in) + cx->in->mx_size - cx->in->size;
     if (!(cx->flags & CXF_MIN_GUEST_BUFLEN) || !cx->hp || cx->in != cx->hp->clt_out)
         return max_available;
@@ -5540,13 +5686,16 @@ static void cx_rpc_proxy_by_url_cb(void *opaque, dict d)
     if ((tmp = dict_get_string(d, "last_refresh")))
         sscanf(tmp, "%" PRId64, &last_refresh);
 
-    if (last_refresh > 0)
+    if (last_refresh > 0 && last_refresh != prx_refresh_id) {
         prx_refresh_id = last_refresh;
+        proxy_creds_changed(hp_pool_close);
+    }
 
     cancelled = dict_get_integer_default(d, "cancelled", 0);
     if (cancelled) {
         cx->flags |= CXF_407_MESSAGE;
         proxy_cache_reset();
+        proxy_creds_changed(hp_pool_close);
     }
 
     if (cx->alternative_proxies)
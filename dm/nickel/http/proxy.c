@@ -102,6 +102,107 @@ out:
     return ret;
 }
 
+/*
+ * Idle connections to a proxy, most recently used first.  They are keyed
+ * by the proxy they belong to and by the generation of the credentials
+ * they were authenticated with, so that NTLM/Kerberos sessions established
+ * once are handed to later requests -- CONNECTs included -- instead of
+ * doing TCP and the auth handshake all over again.
+ */
+uint32_t proxy_cred_gen = 0;
+
+int proxy_pool_add(struct proxy_t *proxy, struct proxy_idle *pi, int max_idle, int64_t now)
+{
+    if (LIST_IN_LIST(pi, entry))
+        return 0;
+
+    if (pi->cred_gen != proxy_cred_gen) {
+        PRXL4("credentials changed since the connection was made");
+        return -1;
+    }
+    if (proxy->nr_idle >= max_idle && RLIST_EMPTY(&proxy->w_list, w_list)) {
+        PRXL5("max-idle-conn-per-proxy %d reached", max_idle);
+        return -1;
+    }
+
+    LIST_INSERT_HEAD(&proxy->idle_list, pi, entry);
+    proxy->nr_idle++;
+    pi->ts = now;
+    return 0;
+}
+
+void proxy_pool_remove(struct proxy_t *proxy, struct proxy_idle *pi)
+{
+    if (!LIST_IN_LIST(pi, entry))
+        return;
+
+    assert(proxy->nr_idle > 0);
+    LIST_REMOVE_NULL(pi, entry);
+    proxy->nr_idle--;
+}
+
+struct proxy_idle *
+proxy_pool_get(struct proxy_t *proxy, bool (*usable)(struct proxy_idle *pi, void *opaque),
+               void *opaque)
+{
+    struct proxy_idle *pi;
+
+    LIST_FOREACH(pi, &proxy->idle_list, entry) {
+        if (pi->cred_gen != proxy_cred_gen)
+            continue;
+        if (usable && !usable(pi, opaque))
+            continue;
+        break;
+    }
+
+    if (pi)
+        proxy_pool_remove(proxy, pi);
+    return pi;
+}
+
+void proxy_pool_flush(struct proxy_t *proxy, void (*close)(struct proxy_idle *pi))
+{
+    struct proxy_idle *pi;
+
+    while ((pi = LIST_FIRST(&proxy->idle_list))) {
+        proxy_pool_remove(proxy, pi);
+        close(pi);
+    }
+}
+
+/* closes the connections idle for max_idle ms or more, if close is set, and
+ * returns the ms until the next one is due, or -1 if none is idle */
+int64_t proxy_pool_expire(int64_t now, int64_t max_idle, void (*close)(struct proxy_idle *pi))
+{
+    struct proxy_t *proxy;
+    struct proxy_idle *pi, *pi_next;
+    int64_t diff, timeout = -1;
+
+    LIST_FOREACH(proxy, &proxy_list, entry) {
+        LIST_FOREACH_SAFE(pi, &proxy->idle_list, entry, pi_next) {
+            diff = now - pi->ts;
+            if (close && diff >= max_idle) {
+                PRXL5("idle for %" PRId64 " ms, closing", diff);
+                proxy_pool_remove(proxy, pi);
+                close(pi);
+            } else if (timeout < 0 || timeout > MAX(max_idle - diff, 0)) {
+                timeout = MAX(max_idle - diff, 0);
+            }
+        }
+    }
+
+    return timeout;
+}
+
+void proxy_creds_changed(void (*close)(struct proxy_idle *pi))
+{
+    struct proxy_t *proxy;
+
+    proxy_cred_gen++;
+    LIST_FOREACH(proxy, &proxy_list, entry)
+        proxy_pool_flush(proxy, close);
+}
+
 /* cache */
 #define MAX_NUMBER_CACHE_ENTRIES    128
 #define CACHE_PURGE_TIMEOUT_MS  (30*1000)
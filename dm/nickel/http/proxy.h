@@ -11,6 +11,7 @@
 #include <netinet/in.h>
 #endif
 
+#include <stdbool.h>
 #include <dm/queue2.h>
 #include <dns/dns.h>
 
@@ -19,6 +20,12 @@
 #define VERBSTATS   1
 #define LAT_STAT_NUMBER         10
 
+#define LIST_REMOVE_NULL(elm, field) do {   \
+            LIST_REMOVE(elm, field);        \
+            (elm)->field.le_prev = NULL;    \
+        } while (1 == 0)
+#define LIST_IN_LIST(elm, field) ((elm)->field.le_prev != NULL)
+
 struct nickel;
 
 struct clt_ctx;
@@ -47,6 +54,7 @@ struct clt_ctx {
     uint64_t flags;
     struct buff *in;
     struct buff *out;
+    size_t vm_buf_max, srv_buf_max;
     char *connect_header_lines;
     uint8_t bf_tls_ck[QUICK_HTTP_PARSE_LEN + 1];
     int bf_tls_ck_len;
@@ -70,6 +78,12 @@ struct clt_ctx {
 
     uint32_t refcnt;
 };
+/* a connection idle on its proxy's pool, embedded in the connection */
+struct proxy_idle {
+    LIST_ENTRY(proxy_idle) entry;
+    uint32_t cred_gen;          /* of the credentials it authenticated with */
+    int64_t ts;                 /* idle since */
+};
 struct proxy_t {
     LIST_ENTRY(proxy_t) entry;
     struct clt_ctx w_list;
@@ -82,8 +96,11 @@ struct proxy_t {
     int ct;
     int wakeup_list;
     char *realm;
+    LIST_HEAD(, proxy_idle) idle_list;
+    int nr_idle;
 };
 extern struct proxy_t proxy_direct;
+extern uint32_t proxy_cred_gen;
 
 #define PROXY_IS_DIRECT(proxy)  ((proxy) == &proxy_direct)
 
@@ -106,4 +123,11 @@ void proxy_cache_add(struct nickel *ni, const char *schema, const char *domain,
 struct proxy_t * proxy_cache_find(const char *schema, const char *domain, int port);
 void proxy_cache_reset(void);
 int proxy_number_waiting(struct proxy_t *proxy);
+int proxy_pool_add(struct proxy_t *proxy, struct proxy_idle *pi, int max_idle, int64_t now);
+void proxy_pool_remove(struct proxy_t *proxy, struct proxy_idle *pi);
+struct proxy_idle * proxy_pool_get(struct proxy_t *proxy,
+        bool (*usable)(struct proxy_idle *pi, void *opaque), void *opaque);
+void proxy_pool_flush(struct proxy_t *proxy, void (*close)(struct proxy_idle *pi));
+int64_t proxy_pool_expire(int64_t now, int64_t max_idle, void (*close)(struct proxy_idle *pi));
+void proxy_creds_changed(void (*close)(struct proxy_idle *pi));
 #endif
@@ -22,9 +22,7 @@
 
 #include <dm/async-op.h>
 #include <dm/char.h>
-#if NEXT_STAGE
 #include <dm/monitor.h>
-#endif
 #include <dm/ns.h>
 #include <dm/opts.h>
 #include <dm/qemu_glue.h>
@@ -32,6 +30,8 @@
 #include <dm/queue2.h>
 #include <dm/base64.h>
 #include <dm/priv-heap.h>
+#include <dm/slab.h>
+#include <dm/trace.h>
 
 #include <dm/libnickel.h>
 #include "buff.h"
@@ -43,6 +43,8 @@
 #include "log.h"
 #include "rpc.h"
 #include "socket.h"
+#include "dns/dns-cache.h"
+#include "dns/dns-resolver.h"
 #include "dns/dns-fake.h"
 
 #if defined(__APPLE__)
@@ -65,6 +67,7 @@ int ni_log_level = 1;
 
 static heap_t ni_priv_heap;
 static unsigned int ni_priv_heap_err;
+static struct slab_heap *ni_slab;
 unsigned slirp_mru = NI_DEFAULT_MTU, slirp_mtu = NI_DEFAULT_MTU;
 
 #define MAX_ALLOC_LEN    ((size_t) (((size_t)(-1)) >> 1))
@@ -485,6 +488,7 @@ void vbsfSaveHandleTable(QEMUFile *f);
 int vbsfLoadHandleTable(QEMUFile *f);
 #endif
 
+static void suspend_thread(struct nickel *ni);
 static void suspend_flush(struct nickel *ni);
 static void resume(struct nickel *ni);
 
@@ -507,8 +511,10 @@ state_save(QEMUFile *f, void *opaque)
         if (bf->len) {
             n++;
             qemu_put_byte(f, 1); /* is a buff */
-            qemu_put_be32(f, bf->len);
+            qemu_put_be32(f, BUFF_SG_LEN(bf));
             qemu_put_buffer(f, bf->m, bf->len);
+            if (bf->sg_len)
+                qemu_put_buffer(f, bf->sg_data, bf->sg_len);
         }
         buff_free(&bf);
     }
@@ -592,34 +598,57 @@ out:
     return ret;
 }
 
+static void * ni_slab_backing_alloc(void *opaque, size_t size)
+{
+    return priv_malloc(ni_priv_heap, size);
+}
+
+static void ni_slab_backing_free(void *opaque, void *ptr)
+{
+    priv_free(ni_priv_heap, ptr);
+}
+
 void * ni_priv_calloc(size_t nmemb, size_t size)
 {
-    return priv_calloc(ni_priv_heap, nmemb, size);
+    return slab_calloc(ni_slab, nmemb, size);
 }
 
 void * ni_priv_malloc(size_t nmemb)
 {
-    return priv_malloc(ni_priv_heap, nmemb);
+    return slab_malloc(ni_slab, nmemb);
 }
 
 void * ni_priv_realloc(void *ptr, size_t size)
 {
-    return priv_realloc(ni_priv_heap, ptr, size);
+    return slab_realloc(ni_slab, ptr, size);
 }
 
 void ni_priv_free(void *ptr)
 {
-    return priv_free(ni_priv_heap, ptr);
+    slab_free(ni_slab, ptr);
 }
 
 char * ni_priv_strdup(const char *s)
 {
-    return priv_strdup(ni_priv_heap, s);
+    return s ? ni_priv_strndup(s, strlen(s)) : NULL;
 }
 
 char * ni_priv_strndup(const char *s, size_t n)
 {
-    return priv_strndup(ni_priv_heap, s, n);
+    char *ret;
+    size_t len;
+
+    if (!s)
+        return NULL;
+    len = strlen(s);
+    if (len > n)
+        len = n;
+    ret = slab_malloc(ni_slab, len + 1);
+    if (!ret)
+        return NULL;
+    memcpy(ret, s, len);
+    ret[len] = 0;
+    return ret;
 }
 
 struct buff *
@@ -655,6 +684,15 @@ static void ni_input(struct nickel *ni, const uint8_t *buf, size_t len)
 }
 
 
+static void count_output(struct nickel *ni, int pkt_len)
+{
+    atomic_inc(&ni->n_pkt_rx);
+    atomic_add(&ni->if_rx, (uint32_t) pkt_len);
+    ni->s_pkt_rx += (uint64_t) pkt_len;
+
+    TRACE_INSTANT(TRACE_NICKEL_OUT, pkt_len, 0);
+}
+
 void ni_output(struct nickel *ni, const uint8_t *pkt, int pkt_len)
 {
     struct nc_nickel_s *snc = (struct nc_nickel_s *) ni->nc_opaque;
@@ -663,13 +701,45 @@ void ni_output(struct nickel *ni, const uint8_t *pkt, int pkt_len)
         debug_dmp(ni, pkt, pkt_len, false);
     dump_packet(ni, pkt, pkt_len);
 
-    atomic_inc(&ni->n_pkt_rx);
-    atomic_add(&ni->if_rx, (uint32_t) pkt_len);
-    ni->s_pkt_rx += (uint64_t) pkt_len;
-
+    count_output(ni, pkt_len);
     qemu_send_packet(&snc->nc, pkt, pkt_len);
 }
 
+/* frames with their payload in another buff go out as headers + payload,
+ * the NIC makes the one copy there is */
+static void output_buff(struct nickel *ni, struct buff *bf)
+{
+    struct nc_nickel_s *snc = (struct nc_nickel_s *) ni->nc_opaque;
+    struct iovec iov[2];
+    uint8_t *pkt;
+
+    if (!bf->sg_len) {
+        ni_output(ni, bf->m, bf->len);
+        return;
+    }
+
+    /* the dumps want the frame in one piece */
+    if (ni->debug_dns_udp_icmp || ni->pcapf || ni->pcap_user_duration) {
+        pkt = ni_priv_malloc(BUFF_SG_LEN(bf));
+        if (!pkt) {
+            warnx("%s: malloc failure", __FUNCTION__);
+            return;
+        }
+        memcpy(pkt, bf->m, bf->len);
+        memcpy(pkt + bf->len, bf->sg_data, bf->sg_len);
+        ni_output(ni, pkt, BUFF_SG_LEN(bf));
+        ni_priv_free(pkt);
+        return;
+    }
+
+    iov[0].iov_base = bf->m;
+    iov[0].iov_len = bf->len;
+    iov[1].iov_base = (void *) bf->sg_data;
+    iov[1].iov_len = bf->sg_len;
+    count_output(ni, BUFF_SG_LEN(bf));
+    qemu_sendv_packet(&snc->nc, iov, 2);
+}
+
 #if defined(NICKEL_THREADED)
 static void queue_input(struct nickel *ni, struct buff *bf)
 {
@@ -950,25 +1020,42 @@ vmfwd(struct nickel *ni, const yajl_val object)
     return -1;
 }
 
-#if NEXT_STAGE
 #ifdef MONITOR
 void
 ic_slirp(Monitor *mon)
 {
-    SlirpState *s;
+    struct nc_nickel_s *nc;
 
-    QTAILQ_FOREACH(s, &nickel_stacks, entry) {
-        monitor_printf(mon, "VLAN %d (%s):\n",
-                       s->nc.vlan ? s->nc.vlan->id : -1,
-                       s->nc.name);
-        ni_connection_info(s->slirp, mon);
+    QTAILQ_FOREACH(nc, &nc_list, entry) {
+        struct nickel *ni = nc->ni;
+        struct async_op_stats as;
+        uint64_t ops;
+
+        assert(ni);
+        monitor_printf(mon, "VLAN %d (%s): rx %u %.03fMiB, tx %u %.03fMiB\n",
+                       nc->nc.vlan ? nc->nc.vlan->id : -1, nc->nc.name,
+                       (unsigned int) ni->n_pkt_rx,
+                       ((double) (ni->s_pkt_rx >> 10)) / 1024,
+                       (unsigned int) ni->n_pkt_tx,
+                       ((double) (ni->s_pkt_tx >> 10)) / 1024);
+        async_op_get_stats(ni->async_op_ctx, &as);
+        ops = as.ops ? as.ops : 1;
+        monitor_printf(mon, "  async ops %"PRIu64" (%"PRIu64" stolen), "
+                       "queued %d max %d, threads %d max %d, "
+                       "wait avg %"PRId64" max %"PRId64" us, "
+                       "run avg %"PRId64" max %"PRId64" us\n",
+                       as.ops, as.steals, as.queued, as.max_queued,
+                       as.threads, as.max_threads_seen,
+                       as.wait_ns / (int64_t)ops / 1000, as.max_wait_ns / 1000,
+                       as.run_ns / (int64_t)ops / 1000, as.max_run_ns / 1000);
+        /* the socket lists belong to the nickel thread */
+        suspend_thread(ni);
+        tcpip_connection_info(mon, ni);
+        resume(ni);
     }
-#ifdef SLIRP_THREADED
-    monitor_printf(mon, "nickel threaded: queue max depth in:%lu, out:%lu\n", inq_max, outq_max);
-#endif
+    dns_cache_info(mon);
 }
 #endif  /* MONITOR */
-#endif
 
 static int ac_config(struct nickel *ni, const yajl_val d)
 {
@@ -1038,6 +1125,11 @@ config_option(const char *name, const yajl_val arg, void *opaque)
             ni->tcp_disable_window_scale = 1;
         else if (YAJL_IS_FALSE(arg))
             ni->tcp_disable_window_scale = 0;
+    } else if (!strcmp(name, "tcp-coalesce")) {
+        if (YAJL_IS_TRUE(arg))
+            ni->tcp_coalesce = 1;
+        else if (YAJL_IS_FALSE(arg))
+            ni->tcp_coalesce = 0;
     } else if (!strcmp(name, "tcpdump")) {
         if (pcap_config(ni, arg))
             /* ignore -- goto error */;
@@ -1136,6 +1228,15 @@ int ni_schedule_bh(struct nickel *ni, void (*async_cb)(void *), void (*finish_cb
     return async_op_add(ni->async_op_ctx, opaque, &ni->event, async_cb, finish_cb);
 }
 
+/* for work the guest is waiting on, dns lookups foremost, which runs
+ * ahead of queued ni_schedule_bh() work */
+int ni_schedule_bh_high(struct nickel *ni, void (*async_cb)(void *),
+        void (*finish_cb)(void *), void *opaque)
+{
+    return async_op_add_prio(ni->async_op_ctx, ASOP_PRIO_HIGH, opaque,
+                             &ni->event, async_cb, finish_cb);
+}
+
 int ni_schedule_bh_permanent(struct nickel *ni, void (*cb)(void *), void *opaque)
 {
     return async_op_add_bh(ni->async_op_ctx, opaque, cb);
@@ -1231,6 +1332,22 @@ void ni_recv(void *opaque, const uint8_t *buf, int size)
     tcpip_output(so, buf, size);
 }
 
+/* as ni_recv, buf is inside bf, which is referenced instead of copied --
+ * the caller must leave bf unchanged while it is shared */
+void ni_recv_buff(void *opaque, struct buff *bf, const uint8_t *buf, int size)
+{
+    struct ni_socket *so = opaque;
+
+    tcpip_output_buff(so, bf, buf, size);
+}
+
+void ni_buf_limits(void *opaque, size_t *snd, size_t *rcv)
+{
+    struct ni_socket *so = opaque;
+
+    tcpip_buf_limits(so, snd, rcv);
+}
+
 void ni_buf_change(void *opaque)
 {
     struct ni_socket *so = opaque;
@@ -1280,7 +1397,7 @@ static void output(struct nickel *ni, struct buff *bf0, bool send)
         RLIST_REMOVE(bf, entry);
         unlock_outq(ni);
 
-        ni_output(ni, bf->m, bf->len);
+        output_buff(ni, bf);
 
         free_or_sent(bf);
     }
@@ -1290,7 +1407,7 @@ static void output(struct nickel *ni, struct buff *bf0, bool send)
 
     if (send) {
 
-        ni_output(ni, bf0->m, bf0->len);
+        output_buff(ni, bf0);
 
         free_or_sent(bf0);
         return;
@@ -1485,6 +1602,11 @@ void ni_del_wait_fd(struct nickel *ni, int fd)
 {
     ioh_del_wait_fd(fd, &ni->wait_objects);
 }
+
+int ni_mod_wait_fd(struct nickel *ni, int fd, int events)
+{
+    return ioh_mod_wait_fd(fd, events, &ni->wait_objects);
+}
 #endif
 
 void ni_prepare(struct nickel *ni, int *timeout)
@@ -1582,6 +1704,9 @@ void ni_exit(void)
         ac_exit(ni);
         tcpip_exit(ni);
         fakedns_exit(ni);
+        dns_cache_exit(ni);
+        dns_resolver_free(ni->native_resolver);
+        ni->native_resolver = NULL;
         if (ni->pcapf)
             fflush(ni->pcapf);
 
@@ -1593,7 +1718,7 @@ void ni_exit(void)
     fflush(stderr);
 }
 
-static void suspend_flush(struct nickel *ni)
+static void suspend_thread(struct nickel *ni)
 {
 
 #if defined(NICKEL_THREADED)
@@ -1605,6 +1730,12 @@ static void suspend_flush(struct nickel *ni)
         ioh_event_wait(&ni->suspend_ok_ev);
     }
 #endif
+}
+
+static void suspend_flush(struct nickel *ni)
+{
+
+    suspend_thread(ni);
     tcpip_flush(ni);
     output(ni, NULL, true);
     lava_flush(ni);
@@ -1683,7 +1814,9 @@ static ssize_t net_nickel_receive(VLANClientState *nc, const uint8_t *buf, size_
     atomic_add(&ni->if_tx, (uint32_t) size);
     ni->s_pkt_tx += (uint64_t) size;
 
+    TRACE_BEGIN(TRACE_NICKEL_IN, size, 0);
     ni_input(ni, buf, size);
+    TRACE_END(TRACE_NICKEL_IN, 0, 0);
 
     return size;
 }
@@ -1801,11 +1934,17 @@ int net_init_nickel(QemuOpts *opts, Monitor *mon, const char *name, VLANState *v
         goto out;
     }
 #endif
+    if (ni_slab == NULL) {
+        warnx("%s: slab_heap_create FAILED", __FUNCTION__);
+        ret = -1;
+        goto out;
+    }
 
     if (!buff_new(&ni->bf_dbg, 256))
         goto mem_err;
     LIST_INIT(&ni->sock_list);
     LIST_INIT(&ni->defered_list);
+    LIST_INIT(&ni->so_dirty);
     RLIST_INIT(&ni->output_list, entry);
     RLIST_INIT(&ni->noarp_output_list, entry);
     LIST_INIT(&ni->tcp);
@@ -1864,6 +2003,7 @@ int net_init_nickel(QemuOpts *opts, Monitor *mon, const char *name, VLANState *v
     so_init(ni);
     ac_init(ni);
     fakedns_init(ni);
+    dns_cache_init(ni);
 
     register_savevm(NULL, "nickel", 0, 16,
                     state_save, state_load, ni);
@@ -1906,6 +2046,8 @@ int net_init_nickel(QemuOpts *opts, Monitor *mon, const char *name, VLANState *v
 
     if (ni->tcp_disable_window_scale)
         NETLOG("%s: TCP window scale option DISABLED", __FUNCTION__);
+    if (ni->tcp_coalesce)
+        NETLOG("%s: TCP segment coalescing enabled", __FUNCTION__);
 
     if (ni->async_op_max_threads)
         NETLOG("max number of asop threads set to %d", ni->async_op_max_threads);
@@ -1937,4 +2079,6 @@ mem_err:
 initcall(nickel_static_init)
 {
     ni_priv_heap_err = priv_heap_create(&ni_priv_heap);
+    ni_slab = slab_heap_create("nickel", ni_slab_backing_alloc,
+                               ni_slab_backing_free, NULL);
 }
@@ -33,6 +33,19 @@ LIST_HEAD(tcp_vmfwd_list, tcp_vmfwd);
 LIST_HEAD(udp_vmfwd_list, udp_vmfwd);
 LIST_HEAD(prx_fwd_list, prx_fwd);
 
+struct ni_socket;
+LIST_HEAD(ni_socket_list, ni_socket);
+/* 4-tuple index over the tcp/udp socket lists, grown incrementally: while
+ * old is set, buckets below old_pos have been moved to tbl */
+struct ni_socket_hash {
+    struct ni_socket_list *tbl;
+    struct ni_socket_list *old;
+    uint32_t mask;
+    uint32_t old_mask;
+    uint32_t old_pos;
+    uint32_t n;
+};
+
 extern int ni_log_level;
 struct nickel {
     /* aligned data */
@@ -76,6 +89,7 @@ struct nickel {
     ioh_event deqout_ev;
     struct async_op_ctx *async_op_ctx;
     int async_op_max_threads;
+    struct dns_resolver *native_resolver;
 #if defined(_WIN32)
     ioh_event so_event;
 #endif
@@ -114,6 +128,7 @@ struct nickel {
     int tcp_service_ok;
     int webdav_svc_ok;
     int tcp_disable_window_scale;
+    int tcp_coalesce;
 
     int ac_enabled;
     int ac_event_log_enabled;
@@ -146,6 +161,7 @@ struct nickel {
     /* socket */
     LIST_HEAD(, socket) sock_list;
     LIST_HEAD(, socket) defered_list;
+    LIST_HEAD(, socket) so_dirty;
     uint32_t number_remote_sockets;
     uint32_t number_total_remote_sockets;
 
@@ -153,13 +169,17 @@ struct nickel {
     LIST_HEAD(, ni_socket) tcp;
     LIST_HEAD(, ni_socket) udp;
     LIST_HEAD(, ni_socket) gc_tcpip;
+    LIST_HEAD(, ni_socket) tcp_corked;
     uint16_t g_last_ip;
     uint64_t us_max_ping_rtt;
     int64_t ping_sent_ts;
     int ping_warn;
     int ping_probe_n;
     int64_t tcpip_stats_ts;
+    int tcpip_timer_deferred;
     struct ni_socket *tcp_lst_so;
+    struct ni_socket_hash tcp_hash;
+    struct ni_socket_hash udp_hash;
     uint16_t tcp_free_port_base; /* host order */
     uint16_t tcp_last_free_port;
     uint16_t tcp_free_port_end; /* host order */
@@ -193,6 +213,8 @@ struct in_addr ni_get_addr(void);
 int64_t ni_get_pcap_ts(uint32_t *sec, uint32_t *usec);
 size_t ni_can_recv(void *opaque);
 void ni_recv(void *opaque, const uint8_t *buf, int size);
+void ni_recv_buff(void *opaque, struct buff *bf, const uint8_t *buf, int size);
+void ni_buf_limits(void *opaque, size_t *snd, size_t *rcv);
 void ni_buf_change(void *opaque);
 void ni_close(void *opaque);
 void ni_event(void *opaque, int event);
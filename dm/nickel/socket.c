@@ -34,6 +34,7 @@
 #endif
 
 #include <err.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -62,12 +63,14 @@
 
 #define update_fdevents(so, _events) do {                       \
         if (so->events != (_events)) {                          \
-            if (so->events)                                     \
+            if (so->events && (_events))                        \
+                ni_mod_wait_fd(so->ni, so->s, (_events));       \
+            else if (so->events)                                \
                 ni_del_wait_fd(so->ni, so->s);                  \
-            so->events = _events;                               \
-            if (so->events)                                     \
-                ni_add_wait_fd(so->ni, so->s, so->events,       \
+            else                                                \
+                ni_add_wait_fd(so->ni, so->s, (_events),        \
                                 fd_events_poll, so);            \
+            so->events = _events;                               \
         }                                                       \
     } while (0)
 
@@ -132,9 +135,11 @@
 #define SF_A_CONNECTING      0x2
 #define SF_SOCK_READ         0x4
 #define SF_SOCK_WRITE        0x8
+#define SF_DIRTY             0x10
 
 struct socket {
     LIST_ENTRY(socket) entry;
+    LIST_ENTRY(socket) dirty_entry;
     struct nickel *ni;
     int is_udp;
     int s;
@@ -161,6 +166,10 @@ struct socket {
     uint16_t clt_port;
 
     uint32_t refcnt;
+
+    /* requested SO_SNDBUF/SO_RCVBUF, 0 leaves the OS default */
+    size_t snd_buf;
+    size_t rcv_buf;
 };
 
 static void events_poll(void *opaque);
@@ -203,6 +212,18 @@ static void fd_events_poll(void *opaque, int revents)
 }
 #endif
 
+/* so_prepare only looks at sockets whose state, flags or interest set
+ * changed since it last ran, readiness itself is delivered per socket
+ * by the wait objects */
+static void so_dirty(struct socket *so)
+{
+    if ((so->flags & SF_DIRTY))
+        return;
+
+    so->flags |= SF_DIRTY;
+    LIST_INSERT_HEAD(&so->ni->so_dirty, so, dirty_entry);
+}
+
 static void so_get(struct socket *so)
 {
     if (!so)
@@ -219,6 +240,7 @@ static void so_put(struct socket *so)
 
     if (atomic_dec_and_test(&so->refcnt)) {
         assert(so->del);
+        so_dirty(so);
         ni_wakeup_loop(so->ni);
     }
 }
@@ -253,13 +275,15 @@ void so_free(struct socket *so)
     _so_close(so, false);
     if (so->entry.le_prev)
         LIST_REMOVE(so, entry);
+    if ((so->flags & SF_DIRTY))
+        LIST_REMOVE(so, dirty_entry);
 
 #if VERBSTATS
     atomic_dec(&so->ni->number_remote_sockets);
     so_stats(so->ni);
 #endif
 
-    free(so);
+    ni_priv_free(so);
 }
 
 int so_dbg(struct buff *bf, struct socket *so)
@@ -305,6 +329,7 @@ static void so_closing(struct socket *so)
 
     if (so->state != NSO_SS_RECONNECTING)
         so->state = NSO_SS_CLOSING;
+    so_dirty(so);
     if (event && so->evt_cb) {
         int err = get_so_error(so);
 
@@ -387,6 +412,7 @@ static void list_connect_connecting(struct socket *so)
 
     so->state = NSO_SS_CREATED;
     so->flags |= SF_A_CONNECTING;
+    so_dirty(so);
 }
 
 static void list_connect_connected(struct socket *cso)
@@ -466,7 +492,7 @@ struct socket * so_create(struct nickel *ni, bool udp, so_event_t cb, void *opaq
 {
     struct socket *so = NULL;
 
-    so = calloc(1, sizeof(*so));
+    so = ni_priv_calloc(1, sizeof(*so));
     if (!so)
         goto out;
     so->refcnt = 1;
@@ -477,6 +503,7 @@ struct socket * so_create(struct nickel *ni, bool udp, so_event_t cb, void *opaq
     if (udp)
         so->is_udp = 1;
     LIST_INSERT_HEAD(&ni->defered_list, so, entry);
+    so_dirty(so);
 #if VERBSTATS
     atomic_inc(&so->ni->number_remote_sockets);
     if (so->ni->number_remote_sockets > so->ni->number_total_remote_sockets)
@@ -532,6 +559,7 @@ int so_reconnect(struct socket *so)
 {
     list_connect_free(so);
     so->state = NSO_SS_RECONNECTING;
+    so_dirty(so);
     if (so->s < 0)
         _so_close(so, true);
     return 0;
@@ -602,6 +630,7 @@ int so_listen(struct socket *so, const struct net_addr *addr, uint16_t port, so_
     so->accept_cb = accept_cb;
     so->accept_opaque = accept_opaque;
     so->state = NSO_SS_LISTENING;
+    so_dirty(so);
     ni_wakeup_loop(so->ni);
 
     ret = 0;
@@ -659,8 +688,10 @@ size_t so_read(struct socket *so, const uint8_t *buf, size_t len)
     if ((so->flags & SF_FLUSH_CLOSE))
         wakeup = true;
 out:
-    if (wakeup)
+    if (wakeup) {
+        so_dirty(so);
         ni_wakeup_loop(so->ni);
+    }
 
     assert(ret >= 0);
     if (ret < 0)
@@ -725,8 +756,10 @@ size_t so_write(struct socket *so, const uint8_t *buf, size_t len)
     }
 
 out:
-    if (wakeup)
+    if (wakeup) {
+        so_dirty(so);
         ni_wakeup_loop(so->ni);
+    }
 
     assert(ret >= 0);
     if (ret < 0)
@@ -747,9 +780,52 @@ void so_buf_ready(struct socket *so)
 #endif
 
     NETLOG5("SO %"PRIxPTR" so_buf_ready", (uintptr_t) so);
+    so_dirty(so);
     ni_wakeup_loop(so->ni);
 }
 
+/* only ever grow the buffers, the OS may have auto-tuned them past
+ * what we ask for */
+static void so_grow_buf(struct socket *so, int opt, size_t size)
+{
+    int val = 0;
+    socklen_t valsize = sizeof(val);
+
+    if (!size)
+        return;
+    if (size > INT_MAX)
+        size = INT_MAX;
+    if (!getsockopt(so->s, SOL_SOCKET, opt, (void *) &val, &valsize) &&
+        val >= (int) size)
+        return;
+
+    val = (int) size;
+    if (setsockopt(so->s, SOL_SOCKET, opt, (char *) &val, sizeof(val)) < 0)
+        NETLOG4("%s: so %"PRIxPTR" setsockopt %d %d failed, err %d",
+                __FUNCTION__, (uintptr_t) so, opt, val, errno);
+}
+
+static void so_apply_bufsize(struct socket *so)
+{
+
+    so_grow_buf(so, SO_SNDBUF, so->snd_buf);
+    so_grow_buf(so, SO_RCVBUF, so->rcv_buf);
+}
+
+void so_set_bufsize(struct socket *so, size_t snd, size_t rcv)
+{
+
+    if (!so || so->del)
+        return;
+    if (snd == so->snd_buf && rcv == so->rcv_buf)
+        return;
+
+    so->snd_buf = snd;
+    so->rcv_buf = rcv;
+    if (so->s >= 0)
+        so_apply_bufsize(so);
+}
+
 int so_close(struct socket *so)
 {
     if (so->del)
@@ -757,6 +833,7 @@ int so_close(struct socket *so)
 
     ni_wakeup_loop(so->ni);
     so->del = SDEL_CLOSING;
+    so_dirty(so);
     so->evt_cb = NULL;
     so->evt_opaque = NULL;
     so_put(so);
@@ -777,6 +854,7 @@ int so_closesocket(struct socket *so)
         return -1;
 
     so->state = NSO_SS_CLOSING;
+    so_dirty(so);
     ni_wakeup_loop(so->ni);
     return 0;
 }
@@ -820,6 +898,7 @@ static void _so_connect(struct socket *so)
     if (!so->is_udp) {
         opt = 1;
         setsockopt(so->s, IPPROTO_TCP, TCP_NODELAY, (char *)&opt, sizeof(opt));
+        so_apply_bufsize(so);
     }
 
     r = 0;
@@ -852,6 +931,7 @@ static void _so_connect(struct socket *so)
     if (so->is_udp)
         ni_wakeup_loop(so->ni);
 out:
+    so_dirty(so);
     return;
 }
 
@@ -876,6 +956,7 @@ static void so_connected(struct socket *so)
     }
 
     so->state = NSO_SS_CONNECTED;
+    so_dirty(so);
 
     if (so->addr.family == AF_INET)
         laddrlen = sizeof(struct sockaddr_in);
@@ -955,6 +1036,7 @@ err:
 static void so_reading(struct socket *so)
 {
     so->flags |= SF_SOCK_READ;
+    so_dirty(so);
     if (so->evt_cb)
         so->evt_cb(so->evt_opaque, SO_EVT_READ, so->last_err);
 }
@@ -962,6 +1044,7 @@ static void so_reading(struct socket *so)
 static void so_writing(struct socket *so)
 {
     so->flags |= SF_SOCK_WRITE;
+    so_dirty(so);
     if (so->evt_cb)
         so->evt_cb(so->evt_opaque, SO_EVT_WRITE, so->last_err);
 }
@@ -1086,13 +1169,24 @@ void so_update_event(struct socket *so, so_event_t cb, void *opaque)
 void so_prepare(struct nickel *ni, int *timeout)
 {
     struct socket *so, *ns_next;
+    LIST_HEAD(, socket) dirty;
 
     LIST_FOREACH_SAFE(so, &ni->defered_list, entry, ns_next) {
         LIST_REMOVE(so, entry);
         LIST_INSERT_HEAD(&ni->sock_list, so, entry);
     }
 
-    LIST_FOREACH_SAFE(so, &ni->sock_list, entry, ns_next) {
+    /* sockets marked while this pass runs are left for the next one */
+    LIST_INIT(&dirty);
+    while ((so = LIST_FIRST(&ni->so_dirty))) {
+        LIST_REMOVE(so, dirty_entry);
+        LIST_INSERT_HEAD(&dirty, so, dirty_entry);
+    }
+
+    while ((so = LIST_FIRST(&dirty))) {
+        LIST_REMOVE(so, dirty_entry);
+        so->flags &= ~SF_DIRTY;
+
         if (so->del)
             goto check_closing;
 
@@ -39,6 +39,7 @@ int so_listen(struct socket *so, const struct net_addr *addr, uint16_t port, so_
         void *accept_opaque);
 int so_reconnect(struct socket *so);
 void so_buf_ready(struct socket *so);
+void so_set_bufsize(struct socket *so, size_t snd, size_t rcv);
 int so_dbg(struct buff *bf, struct socket *so);
 size_t so_read(struct socket *so, const uint8_t *buf, size_t len);
 unsigned long so_read_available(struct socket *so);
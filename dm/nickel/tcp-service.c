@@ -62,6 +62,7 @@ struct cx_ctx {
     struct socket *so;
     struct ni_socket *ni_opaque;
     struct buff *b_vm, *b_so;
+    size_t vm_buf_max, so_buf_max;
     uint32_t flags;
 };
 
@@ -107,6 +108,26 @@ static void wakeup_vm(struct cx_ctx *cx)
         ni_buf_change(cx->ni_opaque);
 }
 
+/* tcpip grows its windows as the connection shows it can use them,
+ * follow with our buffers and the host socket's */
+static void cx_tune(struct cx_ctx *cx)
+{
+    size_t vm_max, so_max;
+
+    if (!cx->ni_opaque || !cx->so)
+        return;
+
+    ni_buf_limits(cx->ni_opaque, &vm_max, &so_max);
+    if (vm_max <= cx->vm_buf_max && so_max <= cx->so_buf_max)
+        return;
+
+    cx->vm_buf_max = MAX(cx->vm_buf_max, vm_max);
+    cx->so_buf_max = MAX(cx->so_buf_max, so_max);
+    CXL5("buffers vm %u so %u", (unsigned int) cx->vm_buf_max,
+         (unsigned int) cx->so_buf_max);
+    so_set_bufsize(cx->so, cx->vm_buf_max, cx->so_buf_max);
+}
+
 static int cx_vm_can_read(void *opaque)
 {
     struct cx_ctx *cx = opaque;
@@ -121,6 +142,25 @@ static void cx_vm_read(void *opaque, const uint8_t *buf, int size)
     ni_recv(cx->ni_opaque, buf, size);
 }
 
+/* b_so is shared with the frames that reference what was written from it,
+ * so what is left goes to a new buffer rather than being moved down */
+static int cx_so_unshare(struct cx_ctx *cx, size_t written)
+{
+    struct buff *bf = NULL;
+    size_t l = BUFF_BUFFERED(cx->b_so) - written;
+
+    if (l) {
+        if (!buff_new_priv_raw(&bf, MAX(l, SO_READBUFLEN)))
+            return -1;
+        memcpy(bf->data, cx->b_so->data + written, l);
+        bf->m = bf->data + l;
+    }
+    buff_free(&cx->b_so);
+    cx->b_so = bf;
+
+    return 0;
+}
+
 static int cx_vm_try_write(struct cx_ctx *cx)
 {
     int ret = 0;
@@ -144,13 +184,19 @@ static int cx_vm_try_write(struct cx_ctx *cx)
             break;
         if (r > l)
             r = l;
-        qemu_chr_read(&cx->chr, p, r);
+        ni_recv_buff(cx->ni_opaque, cx->b_so, p, r);
         p += r;
         l -= r;
         ret += r;
     }
     if (ret > 0) {
-        buff_gc_consume(cx->b_so, ret);
+        if (cx->b_so->refcnt == 1) {
+            buff_gc_consume(cx->b_so, ret);
+        } else if (cx_so_unshare(cx, ret) < 0) {
+            warnx("%s: malloc failure", __FUNCTION__);
+            cx_close(cx);
+            goto out;
+        }
         if ((cx->flags & CXF_SO_READ_PENDING) && cx->so) {
             cx->flags &= ~(CXF_SO_READ_PENDING);
             so_buf_ready(cx->so);
@@ -172,15 +218,16 @@ static void cx_so_try_read(struct cx_ctx *cx)
     if (!cx->so)
         goto out;
 
-    if (!cx->b_so && !buff_new_priv(&cx->b_so, SO_READBUFLEN))
+    if (!cx->b_so && !buff_new_priv_raw(&cx->b_so, SO_READBUFLEN))
         goto out;
 
+    cx_tune(cx);
     len = BUFF_FREEDOM(cx->b_so);
-    max_allowed = (ssize_t) MAX_SRV_BUFLEN - (ssize_t) BUFF_BUFFERED(cx->b_so);
+    max_allowed = (ssize_t) cx->so_buf_max - (ssize_t) BUFF_BUFFERED(cx->b_so);
     if (max_allowed < 0)
         max_allowed = 0;
     if (!len && max_allowed <= 0) {
-        CXL5("MAX_SRV_BUFLEN %d reached", MAX_SRV_BUFLEN);
+        CXL5("so_buf_max %u reached", (unsigned int) cx->so_buf_max);
         goto out_pending;
     }
 
@@ -244,7 +291,7 @@ static int cx_so_try_write(struct cx_ctx *cx, const uint8_t *buf, int len_buf)
     written += r;
 out:
     if (len_buf > 0 && buf) {
-        if (!cx->b_vm && !BUFF_NEW_MX_PRIV(&cx->b_vm, len_buf, MX_GUEST_IN_LEN))
+        if (!cx->b_vm && !BUFF_NEW_MX_PRIV(&cx->b_vm, len_buf, cx->vm_buf_max))
             goto mem_error;
         if (buff_append(cx->b_vm, (const char *) buf, len_buf) < 0)
             goto mem_error;
@@ -287,8 +334,13 @@ static int cx_chr_can_write(void *opaque)
 {
     struct cx_ctx *cx = opaque;
 
-    return cx->b_vm ? (BUFF_FREEDOM(cx->b_vm) + cx->b_vm->mx_size -
-            cx->b_vm->size) : MX_GUEST_IN_LEN;
+    cx_tune(cx);
+    if (!cx->b_vm)
+        return cx->vm_buf_max;
+    if (BUFF_BUFFERED(cx->b_vm) >= cx->vm_buf_max)
+        return 0;
+
+    return cx->vm_buf_max - BUFF_BUFFERED(cx->b_vm);
 }
 
 static void cx_vm_on_event(CharDriverState *chr, int event)
@@ -416,6 +468,8 @@ cx_open(void *opaque, struct nickel *ni, struct sockaddr_in saddr, struct sockad
     chr = &cx->chr;
     chr->refcnt = 1;
     cx->ni_opaque = opaque;
+    cx->vm_buf_max = MX_GUEST_IN_LEN;
+    cx->so_buf_max = MAX_SRV_BUFLEN;
 
     qemu_chr_add_handlers(chr, cx_vm_can_read, cx_vm_read, NULL, cx);
     chr->chr_write = cx_chr_write;
@@ -461,6 +515,8 @@ cx_accept(void *opaque, struct nickel *ni, struct socket *so)
     chr = &cx->chr;
     chr->refcnt = 1;
     cx->ni_opaque = opaque;
+    cx->vm_buf_max = MX_GUEST_IN_LEN;
+    cx->so_buf_max = MAX_SRV_BUFLEN;
 
     cx->so = so;
     so_update_event(so, cx_so_on_event, cx);
@@ -6,6 +6,8 @@
 
 #include <dm/config.h>
 #include <dm/char.h>
+#include <dm/cksum.h>
+#include <dm/monitor.h>
 #include <dm/timer.h>
 #include "nickel.h"
 #include "proto.h"
@@ -20,6 +22,7 @@
 #define HFWD_EOF_POLL_MS      200
 #define GC_TIMER    (1 * 60 * 1000)     /* 1 mins */
 #define UDP_SOCK_EXPIRE (2 * 60 * 1000) /* 2 mins */
+#define UDP_CLOSE_RETRY (1 * 1000) /* 1 sec */
 #define TCP_FIN_WAIT    (2 * 1000) /* 2 sec */
 #define MAX_COUNT_FIN_WAIT     4
 #define STATS_MS        (4 * 1000) /* 4 sec */
@@ -34,8 +37,17 @@
 
 #define MAX_RETRANSMIT_PER_PACKET   10
 
+#define SO_HASH_MIN_BUCKETS     64
+
 #define MAX_16_WIN  (64 * 1024 - 2)
-#define SND_WIN_SHIFT   1
+#define SND_WIN_SHIFT   6
+#define TCP_WIN_MAX     (MAX_16_WIN << SND_WIN_SHIFT) /* ~4MB */
+#define TCP_SND_WIN_MIN (MAX_16_WIN << 1) /* the fixed window, before tuning */
+#define TCP_RCV_BUF_MIN (128 * 1024)
+
+#define TCP_TUNE_PERIOD_MS      100
+#define TCP_TUNE_MIN_RTT_US     1000 /* 1ms */
+#define TCP_TUNE_IDLE_MS        1000
 
 #define WST_UNKN    0
 #define WST_SENT    1
@@ -53,6 +65,8 @@
 
 struct ni_socket {
     LIST_ENTRY(ni_socket) entry;
+    LIST_ENTRY(ni_socket) hentry;
+    uint32_t hash;
     uint8_t type;
     uint8_t state;
     uint32_t flags;
@@ -60,6 +74,8 @@ struct ni_socket {
     int64_t ts_closed;
     struct nickel *ni;
     CharDriverState *chr;
+    Timer *tmr;
+    int64_t tmr_ts;
 
     /* network order */
     struct sockaddr_in faddr;
@@ -78,6 +94,7 @@ struct ni_socket {
     uint32_t chr_win;
     size_t bufd_len;
     uint8_t *bufd_data;
+    LIST_ENTRY(ni_socket) cork_entry; /* sub-MSS tail held in bufd_data */
     /* host order */
     uint32_t rcv_iss;
     uint32_t rcv_off_ack; /* offset from G we acked */
@@ -93,6 +110,18 @@ struct ni_socket {
     int g_use_win_scaling;
     int n_fin_retransmit;
 
+    /* window auto-tuning */
+    uint32_t snd_win_max; /* cap on the window we advertise to G */
+    int snd_win_capped; /* the windows sent this period were near the cap */
+    uint32_t rcv_buf_max; /* host data we buffer on the way to G */
+    int64_t tune_ts;
+    uint64_t tune_rx, tune_tx;
+    uint32_t rate_rx, rate_tx; /* bytes/s over the last tune period */
+
+    /* payload bytes, G -> host and host -> G */
+    uint64_t n_rx;
+    uint64_t n_tx;
+
     /* LAVA */
     struct lava_event *lv;
 };
@@ -122,6 +151,8 @@ struct ni_socket {
 #define TF_RETRANSMISSION_RST   0x8000
 #define TF_FREED                0x10000
 #define TF_FIN_ACKED            0x20000
+#define TF_TIMER_RUN            0x40000
+#define TF_TIMER_DEFER          0x80000
 
 #define IS_DEL(so)              (!!((so)->flags & TF_DELETE))
 
@@ -141,6 +172,10 @@ static void fwd_connect_cb(void *opaque);
 static uint16_t tcp_get_free_port(struct nickel *ni);
 static inline void get_bf_seq_len(struct ni_socket *so, struct buff *bf, uint32_t *seq, uint32_t *len);
 static void remove_buff(struct ni_socket *so, struct buff *bf);
+static void so_timer_arm(struct ni_socket *so, int64_t ts);
+static void so_uncork(struct ni_socket *so);
+static void tcp_send_bufd_data(struct ni_socket *so);
+#define so_timer_kick(so) so_timer_arm((so), get_clock_ms(vm_clock))
 
 static uint32_t get_iss(void)
 {
@@ -185,22 +220,146 @@ static void socket_reset(struct ni_socket *so)
         }
         remove_buff(so, bf);
     }
+    so_uncork(so);
     ni_priv_free(so->bufd_data);
     so->bufd_data = NULL;
     so->bufd_len = 0;
 }
 
+static inline uint32_t
+so_hash_tuple(uint32_t gaddr, uint16_t gport, uint32_t faddr, uint16_t fport)
+{
+    uint64_t h;
+
+    h = (((uint64_t) gaddr << 32) | faddr) * 0x9e3779b97f4a7c15ULL;
+    h ^= (((uint64_t) gport << 16) | fport) * 0xc2b2ae3d27d4eb4fULL;
+    return (uint32_t) (h >> 32);
+}
+
+static void
+so_hash_init(struct ni_socket_hash *h)
+{
+    h->tbl = ni_priv_calloc(SO_HASH_MIN_BUCKETS, sizeof(*h->tbl));
+    if (!h->tbl) {
+        warnx("%s: malloc failure, falling back to list lookups",
+              __FUNCTION__);
+        return;
+    }
+    h->mask = SO_HASH_MIN_BUCKETS - 1;
+}
+
+/* move one bucket of the old table, so that a resize costs O(1) per
+ * operation instead of stalling the nickel thread on a full rehash */
+static void
+so_hash_step(struct ni_socket_hash *h)
+{
+    struct ni_socket *so;
+
+    if (!h->old)
+        return;
+
+    while ((so = LIST_FIRST(&h->old[h->old_pos]))) {
+        LIST_REMOVE(so, hentry);
+        LIST_INSERT_HEAD(&h->tbl[so->hash & h->mask], so, hentry);
+    }
+
+    if (++h->old_pos > h->old_mask) {
+        ni_priv_free(h->old);
+        h->old = NULL;
+    }
+}
+
+/* buckets of the old table not moved yet still own their hashes */
+static inline struct ni_socket_list *
+so_hash_bucket(struct ni_socket_hash *h, uint32_t hash)
+{
+    if (h->old && (hash & h->old_mask) >= h->old_pos)
+        return &h->old[hash & h->old_mask];
+
+    return &h->tbl[hash & h->mask];
+}
+
+static void
+so_hash_grow(struct ni_socket_hash *h)
+{
+    struct ni_socket_list *tbl;
+    uint32_t nb = (h->mask + 1) * 2;
+
+    tbl = ni_priv_calloc(nb, sizeof(*tbl));
+    if (!tbl)
+        return;
+
+    h->old = h->tbl;
+    h->old_mask = h->mask;
+    h->old_pos = 0;
+    h->tbl = tbl;
+    h->mask = nb - 1;
+}
+
+static void
+so_hash_insert(struct ni_socket_hash *h, struct ni_socket *so)
+{
+    if (!h->tbl)
+        return;
+
+    so_hash_step(h);
+    so->hash = so_hash_tuple(so->gaddr.sin_addr.s_addr, so->gaddr.sin_port,
+                             so->faddr.sin_addr.s_addr, so->faddr.sin_port);
+    LIST_INSERT_HEAD(so_hash_bucket(h, so->hash), so, hentry);
+    h->n++;
+
+    if (!h->old && h->n > 2 * (h->mask + 1))
+        so_hash_grow(h);
+}
+
+static void
+so_hash_remove(struct ni_socket_hash *h, struct ni_socket *so)
+{
+    if (!so->hentry.le_prev)
+        return;
+
+    LIST_REMOVE(so, hentry);
+    so->hentry.le_prev = NULL;
+    h->n--;
+    so_hash_step(h);
+}
+
+static struct ni_socket *
+so_hash_find(struct ni_socket_hash *h, uint32_t gaddr, uint16_t gport,
+             uint32_t faddr, uint16_t fport)
+{
+    struct ni_socket *so;
+    uint32_t hash;
+
+    so_hash_step(h);
+    hash = so_hash_tuple(gaddr, gport, faddr, fport);
+    LIST_FOREACH(so, so_hash_bucket(h, hash), hentry) {
+        if (so->hash == hash && !IS_DEL(so) &&
+                so->gaddr.sin_port == gport &&
+                so->faddr.sin_addr.s_addr == faddr &&
+                so->faddr.sin_port == fport &&
+                so->gaddr.sin_addr.s_addr == gaddr)
+            break;
+    }
+
+    return so;
+}
+
 static struct ni_socket *
 socket_create(struct nickel *ni, uint8_t type, bool queue)
 {
     struct ni_socket *so = NULL;
 
-    so = calloc(1, sizeof(*so));
+    so = ni_priv_calloc(1, sizeof(*so));
     if (!so)
         goto out;
     so->ni = ni;
     so->type = type;
     so->ts_created = get_clock_ms(vm_clock);
+    so->snd_win_max = TCP_SND_WIN_MIN;
+    so->snd_win_capped = 1;
+    so->rcv_buf_max = TCP_RCV_BUF_MIN;
+    so->tune_ts = so->ts_created;
 
     if (type == IPPROTO_TCP) {
         if (queue)
@@ -252,10 +411,15 @@ socket_free(struct ni_socket *so)
         LIST_REMOVE(so, entry);
         queued = true;
     }
+    so_hash_remove(so->type == IPPROTO_TCP ? &so->ni->tcp_hash :
+                   &so->ni->udp_hash, so);
 
     if (so->fwd_timer)
         free_timer(so->fwd_timer);
     so->fwd_timer = NULL;
+    if (so->tmr)
+        free_timer(so->tmr);
+    so->tmr = NULL;
 
     if (so->type == IPPROTO_TCP) {
         NETLOG4("%s: s:%"PRIxPTR" c:%"PRIxPTR" (G:%hu -> %s:%hu) -- TCP last rcv_win %u snd_off_nxt %u snd_off_ack %u",
@@ -301,7 +465,7 @@ static void socket_gc(void *opaque)
 
     LIST_FOREACH_SAFE(so, &ni->gc_tcpip, entry, so_next) {
         LIST_REMOVE(so, entry);
-        free(so);
+        ni_priv_free(so);
     }
 }
 
@@ -320,6 +484,11 @@ find_socket_tcp(struct nickel *ni, uint32_t gaddr, uint16_t gport, uint32_t fadd
 
     }
 
+    if (ni->tcp_hash.tbl) {
+        so = so_hash_find(&ni->tcp_hash, gaddr, gport, faddr, fport);
+        goto out;
+    }
+
     LIST_FOREACH(so, &ni->tcp, entry) {
         if (so != ni->tcp_lst_so && !IS_DEL(so) &&
                 so->gaddr.sin_port == gport &&
@@ -329,6 +498,7 @@ find_socket_tcp(struct nickel *ni, uint32_t gaddr, uint16_t gport, uint32_t fadd
             break;
     }
 
+out:
     if (so)
         ni->tcp_lst_so = so;
 
@@ -341,6 +511,9 @@ find_socket_udp(struct nickel *ni, uint32_t gaddr, uint16_t gport, uint32_t fadd
 {
     struct ni_socket *so = NULL;
 
+    if (ni->udp_hash.tbl)
+        return so_hash_find(&ni->udp_hash, gaddr, gport, faddr, fport);
+
     LIST_FOREACH(so, &ni->udp, entry) {
         if (!IS_DEL(so) && so->faddr.sin_addr.s_addr == faddr &&
                 so->gaddr.sin_addr.s_addr == gaddr &&
@@ -369,8 +542,10 @@ static int tcp_close_socket(struct ni_socket *so, bool rst)
     }
     if (so->chr)
         send_close(so, rst);
-    else
+    else {
         so->flags |= TF_CLOSED;
+        so_timer_kick(so);
+    }
 out:
     return 0;
 }
@@ -386,8 +561,11 @@ static uint32_t get_snd_win(struct ni_socket *so)
     if (so->chr->chr_can_write)
         s = qemu_chr_can_write(so->chr);
 
-    if (so->g_use_win_scaling)
+    if (so->g_use_win_scaling) {
         max <<= so->snd_win_shift;
+        if (max > so->snd_win_max)
+            max = so->snd_win_max;
+    }
 
     if (s > max)
         s = max;
@@ -395,30 +573,61 @@ out:
     return s;
 }
 
-static uint32_t get_rcv_win(struct ni_socket *so, struct tcp *tcp)
+static uint32_t tcp_tune_win(uint32_t rate, uint64_t rtt_us, uint32_t cur)
 {
-    return so->g_use_win_scaling ? (((uint32_t) (NI_NTOHS(tcp->th_win))) << so->rcv_win_shift)
-                                 : (uint32_t) NI_NTOHS(tcp->th_win);
+    uint64_t w;
+
+    w = 2 * (uint64_t) rate * rtt_us / 1000000;
+    if (w > TCP_WIN_MAX)
+        w = TCP_WIN_MAX;
+
+    return w > cur ? (uint32_t) w : cur;
 }
 
-static uint16_t checksum(uint32_t start, uint8_t *b, size_t len)
+/* every TCP_TUNE_PERIOD_MS, grow the windows to twice what was drained
+ * in one guest RTT, as probed by the ping -- a connection held back by
+ * its window doubles it each period, one that is not keeps it.  The ping
+ * RTT is well below what G sees on a busy connection, so the window G
+ * sends into also counts as holding it back when the host had room
+ * past the cap all period and G still went through a whole window */
+static void tcp_autotune(struct ni_socket *so)
 {
-    register uint32_t sum = 0;
+    int64_t now, dt;
+    uint64_t rtt_us;
 
-    sum += start;
-    while (len > 1) {
-        sum += *((uint16_t *)b);
-        b += 2;
-        len -= 2;
-    }
+    now = get_clock_ms(vm_clock);
+    dt = now - so->tune_ts;
+    if (dt < TCP_TUNE_PERIOD_MS)
+        return;
+
+    so->rate_rx = (uint32_t) MIN((so->n_rx - so->tune_rx) * 1000 / dt, UINT32_MAX);
+    so->rate_tx = (uint32_t) MIN((so->n_tx - so->tune_tx) * 1000 / dt, UINT32_MAX);
+    so->tune_rx = so->n_rx;
+    so->tune_tx = so->n_tx;
+    so->tune_ts = now;
 
-    if (len > 0)
-        sum += *b;
+    rtt_us = MAX(so->ni->us_max_ping_rtt, TCP_TUNE_MIN_RTT_US);
+    if (so->g_use_win_scaling) {
+        if (so->snd_win_capped &&
+            (uint64_t) so->rate_rx * TCP_TUNE_PERIOD_MS / 1000 >=
+            so->snd_win_max)
+            so->snd_win_max = MIN((uint64_t) so->snd_win_max << 1,
+                                  TCP_WIN_MAX);
+        so->snd_win_max = tcp_tune_win(so->rate_rx, rtt_us, so->snd_win_max);
+    }
+    so->snd_win_capped = 1;
+    so->rcv_buf_max = tcp_tune_win(so->rate_tx, rtt_us, so->rcv_buf_max);
+}
 
-    while (sum >> 16)
-        sum = (sum & 0xffff) + (sum >> 16);
+static uint32_t get_rcv_win(struct ni_socket *so, struct tcp *tcp)
+{
+    return so->g_use_win_scaling ? (((uint32_t) (NI_NTOHS(tcp->th_win))) << so->rcv_win_shift)
+                                 : (uint32_t) NI_NTOHS(tcp->th_win);
+}
 
-    return (uint16_t) (~sum & 0xffff);
+static uint16_t checksum(uint32_t start, uint8_t *b, size_t len)
+{
+    return cksum_fold(cksum_partial(b, len, start));
 }
 
 static void ip_checksum(struct ip *ip, size_t tlen)
@@ -427,40 +636,25 @@ static void ip_checksum(struct ip *ip, size_t tlen)
     ip->ip_sum = checksum(0, (uint8_t*)ip, sizeof(*ip));
 }
 
-static void tcp_checksum(struct ip *ip, struct tcp *tcp, size_t tlen)
+/* the payload, after hlen bytes of header, is already summed in dsum */
+static void tcp_checksum_data(struct ip *ip, struct tcp *tcp, size_t tlen,
+        size_t hlen, uint32_t dsum)
 {
-    uint32_t sum = 0;
-    uint8_t prot[2];
-
-    prot[0] = 0; // zeros
-    prot[1] = ip->ip_p; // protocol from IP header
-
-    sum += ((uint16_t*) (&ip->ip_src))[0];
-    sum += ((uint16_t*) (&ip->ip_src))[1];
-    sum += ((uint16_t*) (&ip->ip_dst))[0];
-    sum += ((uint16_t*) (&ip->ip_dst))[1];
-    sum += *((uint16_t*) prot);
-    sum += NI_HTONS(tlen);
     tcp->th_sum = 0;
-    tcp->th_sum = checksum(sum, (uint8_t*)tcp, tlen);
+    tcp->th_sum = checksum(cksum_pseudo(ip->ip_src, ip->ip_dst, ip->ip_p, tlen) + dsum,
+            (uint8_t*)tcp, hlen);
 }
 
-static void udp_checksum(struct ip *ip, struct udp *udp, size_t ulen)
+static void tcp_checksum(struct ip *ip, struct tcp *tcp, size_t tlen)
 {
-    uint32_t sum = 0;
-    uint8_t prot[2];
-
-    prot[0] = 0; // zeros
-    prot[1] = ip->ip_p; // protocol from IP header
+    tcp_checksum_data(ip, tcp, tlen, tlen, 0);
+}
 
-    sum += ((uint16_t*) (&ip->ip_src))[0];
-    sum += ((uint16_t*) (&ip->ip_src))[1];
-    sum += ((uint16_t*) (&ip->ip_dst))[0];
-    sum += ((uint16_t*) (&ip->ip_dst))[1];
-    sum += *((uint16_t*) prot);
-    sum += NI_HTONS(ulen);
+static void udp_checksum(struct ip *ip, struct udp *udp, size_t ulen)
+{
     udp->uh_sum = 0;
-    udp->uh_sum = checksum(sum, (uint8_t*)udp, ulen);
+    udp->uh_sum = checksum(cksum_pseudo(ip->ip_src, ip->ip_dst, ip->ip_p, ulen),
+            (uint8_t*)udp, ulen);
 }
 
 static size_t eth_write(struct nickel *ni, uint8_t *b)
@@ -685,8 +879,10 @@ static void buff_output(struct nickel *ni, struct buff *bf)
         RLIST_INSERT_TAIL(&ni->noarp_output_list, bf, entry);
 }
 
+/* with dbf the payload is not copied, the frame references it in dbf */
 static int
-tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
+tcp_send_buff(struct ni_socket *so, int flags, struct buff *dbf,
+              const uint8_t *data, size_t len)
 {
     int ret = -1;
     uint8_t *pkt;
@@ -696,6 +892,7 @@ tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
     size_t opt_len = 0;
     struct buff *bf = NULL;
     uint16_t win = 0;
+    uint32_t dsum = 0;
 
     if (!data)
         len = 0;
@@ -712,7 +909,7 @@ tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
 
     pkt_len = ETH_HLEN + sizeof(struct ip) + sizeof(struct tcp) +
                 opt_len + len;
-    bf = ni_netbuff(so->ni, pkt_len);
+    bf = ni_netbuff(so->ni, pkt_len - (dbf ? len : 0));
     if (!bf)
         goto out;
     pkt = bf->m;
@@ -743,6 +940,9 @@ tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
     tcp->th_off = (sizeof(*tcp) + opt_len) >> 2;
 
     so->snd_win = get_snd_win(so);
+    /* with room for less than 3/4 of the cap the host holds G back */
+    if (so->snd_win < so->snd_win_max - so->snd_win_max / 4)
+        so->snd_win_capped = 0;
     win = MAX(so->snd_win, MAX_16_WIN);
     if (!(flags & TH_SYN))
         win = (uint16_t) (so->g_use_win_scaling ? (so->snd_win >> so->snd_win_shift) : so->snd_win);
@@ -795,12 +995,18 @@ tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
             atomic_add(&so->ni->tcp_nav_rx, (uint32_t) len);
         }
 
-        memcpy(pkt + off, data, len);
+        if (dbf) {
+            dsum = cksum_partial(data, len, 0);
+            buff_sg_attach(bf, dbf, data, len);
+        } else
+            dsum = cksum_copy(pkt + off, data, len, 0);
         so->ack_2_ts = now;
 
         bf->ts = now;
         bf->state = BFS_SOCKET;
         RLIST_INSERT_TAIL(&so->sent_q, bf, so_entry);
+        so_timer_arm(so, now + ((so->flags & TF_RETRANSMISSION) ?
+                                RETRANSMIT_REPEAT : RETRANSMIT_TIMEOUT));
     }
     so->snd_off_nxt += (uint32_t) len;
 
@@ -808,8 +1014,9 @@ tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
     if (flags & TH_ACK)
         so->flags &= ~(TF_DELAYED_ACK);
 
-    /* checksum */
-    tcp_checksum(ip, tcp, tcp_l);
+    /* checksum, the header is a multiple of 4 bytes so the data sum
+     * composes */
+    tcp_checksum_data(ip, tcp, tcp_l, tcp_l - len, dsum);
     ip_checksum(ip, ip_l);
 
     buff_output(so->ni, bf);
@@ -818,6 +1025,12 @@ out:
     return ret;
 }
 
+static int
+tcp_send(struct ni_socket *so, int flags, const uint8_t *data, size_t len)
+{
+    return tcp_send_buff(so, flags, NULL, data, len);
+}
+
 static int tcp_rst(struct ni_socket *so)
 {
     int ret;
@@ -955,7 +1168,7 @@ static inline void get_bf_seq_len(struct ni_socket *so, struct buff *bf, uint32_
     struct tcp *tcp = (struct tcp *) (bf->m + ETH_HLEN + sizeof(struct ip));
 
     *seq = (uint32_t) NI_NTOHL(tcp->th_seq) - so->snd_iss;
-    *len = (uint32_t) (bf->len - (ETH_HLEN + sizeof(struct ip) + ((uint32_t) (tcp->th_off) << 2)));
+    *len = (uint32_t) (BUFF_SG_LEN(bf) - (ETH_HLEN + sizeof(struct ip) + ((uint32_t) (tcp->th_off) << 2)));
 
 }
 
@@ -977,6 +1190,8 @@ static void retransmit_packet(struct ni_socket *so, struct buff *bf)
 {
     struct ip *ip;
     struct tcp *tcp;
+    uint16_t old16, new16;
+    uint32_t old32;
 
     assert(so->type == IPPROTO_TCP);
     assert(so->state == TS_ESTABLISHED);
@@ -985,26 +1200,35 @@ static void retransmit_packet(struct ni_socket *so, struct buff *bf)
     ip = (struct ip*) (bf->m + ETH_HLEN);
     tcp = (struct tcp *) (bf->m + ETH_HLEN + sizeof(struct ip));
 
+    /* only a few header fields change, update the checksums for those
+     * rather than summing the whole segment again */
+    old16 = ip->ip_id;
     ip->ip_id = NI_HTONS(so->ni->ip_id++);
+    ip->ip_sum = cksum_update16(ip->ip_sum, old16, ip->ip_id);
+    memcpy(&old16, &ip->ip_ttl, sizeof(old16));
     ip->ip_ttl = 34;
+    memcpy(&new16, &ip->ip_ttl, sizeof(new16));
+    ip->ip_sum = cksum_update16(ip->ip_sum, old16, new16);
 
+    old16 = tcp->th_win;
     tcp->th_win = NI_HTONS((uint16_t) (so->g_use_win_scaling ?
                 (so->snd_win >> so->snd_win_shift) : so->snd_win));
+    tcp->th_sum = cksum_update16(tcp->th_sum, old16, tcp->th_win);
+    old32 = tcp->th_ack;
     tcp->th_ack =  NI_HTONL(so->rcv_iss + so->rcv_off_ack);
-
-    tcp_checksum(ip, tcp, bf->len - ETH_HLEN - sizeof(struct ip));
-    ip_checksum(ip, bf->len - ETH_HLEN);
+    tcp->th_sum = cksum_update32(tcp->th_sum, old32, tcp->th_ack);
 
 #if DEBUG_RETRANSMIT
     NETLOG4("%s: so %"PRIxPTR" seq %u len %u", __FUNCTION__,
             (uintptr_t) so, NI_NTOHL(tcp->th_seq) - so->snd_iss,
-            (unsigned int) (bf->len - ETH_HLEN - sizeof(struct ip) - sizeof(struct tcp)));
+            (unsigned int) (BUFF_SG_LEN(bf) - ETH_HLEN - sizeof(struct ip) - sizeof(struct tcp)));
 #endif
 
     bf->retransmit ++;
     bf->ts = get_clock_ms(vm_clock);
     bf->state = BFS_SOCKET;
     so->flags |= TF_RETRANSMISSION;
+    so_timer_kick(so);
     buff_output(so->ni, bf);
 }
 
@@ -1102,7 +1326,7 @@ static void retransmit_queue(struct ni_socket *so, bool sack, uint32_t sack_to)
         if (!bf->retransmit || now - bf->ts > RETRANSMIT_REPEAT) {
 #if DEBUG_RETRANSMIT
             NETLOG4("%s: so %"PRIxPTR" retransmission pkt len %lu", __FUNCTION__, 
-                    (uintptr_t) so, bf->len);
+                    (uintptr_t) so, BUFF_SG_LEN(bf));
 #endif
             retransmit_packet(so, bf);
             if (!sack)
@@ -1113,9 +1337,14 @@ static void retransmit_queue(struct ni_socket *so, bool sack, uint32_t sack_to)
 
 static void tcp_send_fin(struct ni_socket *so, CharDriverState *chr_saved)
 {
+    /* a coalesced tail goes out ahead of the FIN */
+    if (so->cork_entry.le_prev && !(so->flags & TF_RETRANSMISSION))
+        tcp_send_bufd_data(so);
+
     if (!RLIST_EMPTY(&so->sent_q, so_entry)) {
         so->ts_closed = get_clock_ms(vm_clock);
         so->flags |= (TF_RETRANSMISSION | TF_RETRANSMISSION_FIN);
+        so_timer_kick(so);
         NETLOG4("%s: s:%"PRIxPTR" c:%"PRIxPTR"/%"PRIxPTR" (G:%hu -> %s:%hu) -- retransmission FIN",
                 __FUNCTION__,
                 (uintptr_t) so, (uintptr_t) so->chr, (uintptr_t) chr_saved,
@@ -1166,9 +1395,12 @@ static void fwd_connect_cb(void *opaque)
         socket_reset(so);
         so->snd_iss = get_iss();
         port = tcp_get_free_port(so->ni);
-        if (port)
+        if (port) {
+            so_hash_remove(&so->ni->tcp_hash, so);
             so->faddr.sin_port = port;
-        else
+            if (so->entry.le_prev)
+                so_hash_insert(&so->ni->tcp_hash, so);
+        } else
             NETLOG("%s: failed to obtain free port", __FUNCTION__);
 
         tcp_send(so, TH_SYN, NULL, 0);
@@ -1188,155 +1420,243 @@ free_timer:
     so->fwd_timer = NULL;
 }
 
-static void tcpip_timer(struct nickel *ni, int64_t now, int *timeout)
+static inline void so_timer_wait(int64_t *wait, int64_t diff)
+{
+    if (diff > 0 && (!*wait || *wait > diff))
+        *wait = diff;
+}
+
+/* returns ms until the socket needs looking at again, 0 if nothing is
+ * pending, or -1 if it was freed */
+static int64_t udp_socket_timer(struct ni_socket *so, int64_t now)
 {
-    struct ni_socket *so, *so_n;
     int64_t diff;
 
-    if (ni->ping_sent_ts && now - ni->ping_sent_ts > PING_RTT_LAT_WARN_MS) {
-        if (!ni->ping_warn) {
-            NETLOG("%s: PING rtt timeout > %u ms", __FUNCTION__, PING_RTT_LAT_WARN_MS);
-            ni->ping_warn = 1;
-        }
-        if (now - ni->ping_sent_ts > PING_PROBE_PERIOD_MS) {
-            ni->ping_sent_ts = 0;
-            ni->ping_warn = 0;
-            if (ni->ping_probe_n > PING_PROBE_RESET_N) {
-                ni->ping_probe_n = 0;
-                ni->us_max_ping_rtt = 0;
-            }
-        }
+    if (IS_DEL(so) || (so->flags & TF_CLOSED) || !so->chr) {
+        socket_free(so);
+        return -1;
     }
 
-    LIST_FOREACH_SAFE(so, &ni->udp, entry, so_n) {
-        if (IS_DEL(so) || (so->flags & TF_CLOSED) || !so->chr) {
-            so = socket_free(so);
-            continue;
-        }
-        diff = so->ts_created + UDP_SOCK_EXPIRE - now;
-        if (diff <= 0)
-            send_close(so, false);
-        else if ((int64_t) (*timeout) > diff)
-            *timeout = (int) diff;
-    }
+    diff = so->ts_created + UDP_SOCK_EXPIRE - now;
+    if (diff > 0)
+        return diff;
 
-    LIST_FOREACH_SAFE(so, &ni->tcp, entry, so_n) {
-        if (IS_DEL(so)) {
+    send_close(so, false);
+    return UDP_CLOSE_RETRY;
+}
 
-            so = socket_free(so);
-            continue;
-        }
+static int64_t tcp_socket_timer(struct ni_socket *so, int64_t now)
+{
+    int64_t diff, wait = 0;
 
-        /* delayed ACK */
-        if (so->state == TS_ESTABLISHED && (so->flags & TF_DELAYED_ACK)) {
-            diff = so->delay_ac_ts - now;
-            if (diff <= DELAY_ACK_MIN_MS)
-                tcp_send(so, TH_ACK, NULL, 0);
-            else if ((int64_t) (*timeout) > diff)
-                *timeout = diff;
-        }
+    if (IS_DEL(so)) {
+        socket_free(so);
+        return -1;
+    }
 
-        /* retransmission */
-        if (so->state == TS_ESTABLISHED && !RLIST_EMPTY(&so->sent_q, so_entry)) {
-            struct buff *bf;
-            int tmo = (so->flags & TF_RETRANSMISSION) ? RETRANSMIT_REPEAT :
-                                                        RETRANSMIT_TIMEOUT;
-
-            RLIST_FOREACH(bf, &so->sent_q, so_entry) {
-                diff = now - bf->ts;
-                if (bf->retransmit > MAX_RETRANSMIT_PER_PACKET) {
-                    uint32_t seq = 0, len = 0;
-
-                    get_bf_seq_len(so, bf, &seq, &len);
-                    NETLOG2("%s: s:%"PRIxPTR" c:%"PRIxPTR" (G:%hu -> %s:%hu) "
-                            "-- MAX_RETRANSMIT_PER_PACKET bf seq %u "
-                            "len %u rcv_win %u/%d snd_off_nxt %u snd_off_ack %u",
-                            __FUNCTION__,
-                            (uintptr_t)so, (uintptr_t)so->chr, NI_NTOHS(so->gaddr.sin_port),
-                            inet_ntoa(so->faddr.sin_addr),
-                            NI_NTOHS(so->faddr.sin_port),
-                            (unsigned int) seq, (unsigned int) len,
-                            (unsigned int) so->rcv_win,
-                            (int) (so->g_use_win_scaling ? so->rcv_win_shift : -1),
-                            (unsigned int) so->snd_off_nxt,
-                            (unsigned int) so->snd_off_ack);
-
-                    bf->retransmit = 1;
-                    so->flags &= ~TF_RETRANSMISSION;
-                    tcp_send(so, TH_ACK, NULL, 0);
-                    break;
-                }
-                if ((!bf->retransmit && (so->flags & TF_RETRANSMISSION)) || diff >= tmo) {
+    /* delayed ACK */
+    if (so->state == TS_ESTABLISHED && (so->flags & TF_DELAYED_ACK)) {
+        diff = so->delay_ac_ts - now;
+        if (diff <= DELAY_ACK_MIN_MS)
+            tcp_send(so, TH_ACK, NULL, 0);
+        else
+            so_timer_wait(&wait, diff - DELAY_ACK_MIN_MS);
+    }
 
-                    if (bf->state == BFS_SENT)
-                        retransmit_packet(so, bf);
-                    break;
-                }
+    /* retransmission */
+    if (so->state == TS_ESTABLISHED && !RLIST_EMPTY(&so->sent_q, so_entry)) {
+        struct buff *bf;
+        int tmo = (so->flags & TF_RETRANSMISSION) ? RETRANSMIT_REPEAT :
+                                                    RETRANSMIT_TIMEOUT;
 
-                diff = tmo - diff;
-                if (diff > 0 && (int64_t) (*timeout) > diff)
-                   *timeout = (int) diff;
+        RLIST_FOREACH(bf, &so->sent_q, so_entry) {
+            diff = now - bf->ts;
+            if (bf->retransmit > MAX_RETRANSMIT_PER_PACKET) {
+                uint32_t seq = 0, len = 0;
+
+                get_bf_seq_len(so, bf, &seq, &len);
+                NETLOG2("%s: s:%"PRIxPTR" c:%"PRIxPTR" (G:%hu -> %s:%hu) "
+                        "-- MAX_RETRANSMIT_PER_PACKET bf seq %u "
+                        "len %u rcv_win %u/%d snd_off_nxt %u snd_off_ack %u",
+                        __FUNCTION__,
+                        (uintptr_t)so, (uintptr_t)so->chr, NI_NTOHS(so->gaddr.sin_port),
+                        inet_ntoa(so->faddr.sin_addr),
+                        NI_NTOHS(so->faddr.sin_port),
+                        (unsigned int) seq, (unsigned int) len,
+                        (unsigned int) so->rcv_win,
+                        (int) (so->g_use_win_scaling ? so->rcv_win_shift : -1),
+                        (unsigned int) so->snd_off_nxt,
+                        (unsigned int) so->snd_off_ack);
 
+                bf->retransmit = 1;
+                so->flags &= ~TF_RETRANSMISSION;
+                tcp_send(so, TH_ACK, NULL, 0);
+                so_timer_wait(&wait, RETRANSMIT_REPEAT);
                 break;
             }
+            if ((!bf->retransmit && (so->flags & TF_RETRANSMISSION)) || diff >= tmo) {
+
+                if (bf->state == BFS_SENT)
+                    retransmit_packet(so, bf);
+                so_timer_wait(&wait, RETRANSMIT_REPEAT);
+                break;
+            }
+
+            so_timer_wait(&wait, tmo - diff);
+
+            break;
         }
+    }
 
-        if ((so->flags & TF_RST_PENDING))
-            tcp_rst(so);
+    if ((so->flags & TF_RST_PENDING))
+        tcp_rst(so);
 
-        if ((so->flags & TF_CLOSED)) {
-            if (so->state == TS_CONN_RST) {
+    if ((so->flags & TF_CLOSED)) {
+        if (so->state == TS_CONN_RST) {
+            socket_free(so);
+            return -1;
+        }
 
-                so = socket_free(so);
-                continue;
-            }
+        if (so->n_fin_retransmit > MAX_COUNT_FIN_WAIT) {
+            tcp_send(so, TH_RST, NULL, 0);
+            NETLOG4("%s: s:%"PRIxPTR" c:%"PRIxPTR" (G:%hu -> %s:%hu) -- RST sent FINACKED=%d",
+                    __FUNCTION__,
+                    (uintptr_t) so, (uintptr_t) so->chr, NI_NTOHS(so->gaddr.sin_port),
+                    inet_ntoa(so->faddr.sin_addr),
+                    NI_NTOHS(so->faddr.sin_port), (int) !!(so->flags & TF_FIN_ACKED));
 
-            if (so->n_fin_retransmit > MAX_COUNT_FIN_WAIT) {
-                tcp_send(so, TH_RST, NULL, 0);
-                NETLOG4("%s: s:%"PRIxPTR" c:%"PRIxPTR" (G:%hu -> %s:%hu) -- RST sent FINACKED=%d",
+            socket_free(so);
+            return -1;
+        }
+        diff = so->ts_closed + TCP_FIN_WAIT - now;
+        if (diff <= 0) {
+            so->n_fin_retransmit++;
+            if (!(so->flags & TF_FIN_ACKED)) {
+                NETLOG2("%s: s:%"PRIxPTR" c:%"PRIxPTR" (G:%hu -> %s:%hu) -- FIN sent %s",
                         __FUNCTION__,
                         (uintptr_t) so, (uintptr_t) so->chr, NI_NTOHS(so->gaddr.sin_port),
                         inet_ntoa(so->faddr.sin_addr),
-                        NI_NTOHS(so->faddr.sin_port), (int) !!(so->flags & TF_FIN_ACKED));
+                        NI_NTOHS(so->faddr.sin_port),
+                        (so->flags & TF_FIN_SENT) ? "retransmission" : "");
+                if ((so->flags & TF_FIN_SENT))
+                    so->snd_off_nxt--;
+                tcp_send(so, TH_FIN|TH_ACK, NULL, 0);
+                so->flags |= TF_FIN_SENT;
+                so->snd_off_nxt += 1;
+            }
+            so->ts_closed = now;
+            diff = TCP_FIN_WAIT;
+        }
+        so_timer_wait(&wait, diff);
+    }
 
-                so = socket_free(so);
-                continue;
+    if (so->poll_eof_ts && so->state == TS_ESTABLISHED) {
+        diff = so->poll_eof_ts + HFWD_EOF_POLL_MS - now;
+        if (diff <= 0) {
+            if (so_chr_is_eof(so)) {
+                DBG4(so, "host peer hung up");
+                so->poll_eof_ts = 0;
+                qemu_chr_send_event(so->chr, CHR_EVENT_NI_CLOSE);
+            } else {
+                so->poll_eof_ts = now;
+                diff = HFWD_EOF_POLL_MS;
             }
-            diff = so->ts_closed + TCP_FIN_WAIT - now;
-            if (diff <= 0) {
-                so->n_fin_retransmit++;
-                if (!(so->flags & TF_FIN_ACKED)) {
-                    NETLOG2("%s: s:%"PRIxPTR" c:%"PRIxPTR" (G:%hu -> %s:%hu) -- FIN sent %s",
-                            __FUNCTION__,
-                            (uintptr_t) so, (uintptr_t) so->chr, NI_NTOHS(so->gaddr.sin_port),
-                            inet_ntoa(so->faddr.sin_addr),
-                            NI_NTOHS(so->faddr.sin_port),
-                            (so->flags & TF_FIN_SENT) ? "retransmission" : "");
-                    if ((so->flags & TF_FIN_SENT))
-                        so->snd_off_nxt--;
-                    tcp_send(so, TH_FIN|TH_ACK, NULL, 0);
-                    so->flags |= TF_FIN_SENT;
-                    so->snd_off_nxt += 1;
-                }
-                so->ts_closed = now;
-            } else if ((int64_t) (*timeout) > diff)
-                *timeout = (int) diff;
+       }
+       so_timer_wait(&wait, diff);
+    }
+
+    return wait;
+}
+
+static void so_timer_cb(void *opaque)
+{
+    struct ni_socket *so = opaque;
+    int64_t now, wait;
+
+    /* picked up again by tcpip_timer once the vm runs */
+    if (so->ni->vm_paused) {
+        so->flags |= TF_TIMER_DEFER;
+        so->ni->tcpip_timer_deferred = 1;
+        return;
+    }
+
+    now = get_clock_ms(vm_clock);
+    so->flags |= TF_TIMER_RUN;
+    if (so->type == IPPROTO_TCP)
+        wait = tcp_socket_timer(so, now);
+    else
+        wait = udp_socket_timer(so, now);
+    if (wait < 0)
+        return;
+    so->flags &= ~TF_TIMER_RUN;
+
+    if (wait)
+        so_timer_arm(so, now + wait);
+}
+
+/* each socket has a single timer, armed for the earliest of its
+ * retransmit, delayed ACK, FIN wait, EOF poll or expiry deadlines, so
+ * that only sockets with something due are looked at */
+static void so_timer_arm(struct ni_socket *so, int64_t ts)
+{
+    if ((so->flags & TF_FREED))
+        return;
+
+    /* re-armed from its own callback, wait for the next tick rather
+     * than run again in the same pass */
+    if ((so->flags & TF_TIMER_RUN)) {
+        int64_t now = get_clock_ms(vm_clock);
+
+        if (ts <= now)
+            ts = now + 1;
+    }
+
+    if (!so->tmr) {
+        so->tmr = ni_new_vm_timer(so->ni, 0, so_timer_cb, so);
+        if (!so->tmr) {
+            warnx("%s: malloc failure", __FUNCTION__);
+            return;
         }
+    } else if (timer_pending(so->tmr) && so->tmr_ts <= ts)
+        return;
 
-        if (so->poll_eof_ts && so->state == TS_ESTABLISHED) {
-            diff = so->poll_eof_ts + HFWD_EOF_POLL_MS - now;
-            if (diff <= 0) {
-                if (so_chr_is_eof(so)) {
-                    DBG4(so, "host peer hung up");
-                    so->poll_eof_ts = 0;
-                    qemu_chr_send_event(so->chr, CHR_EVENT_NI_CLOSE);
-                } else {
-                    so->poll_eof_ts = now;
-                    diff = HFWD_EOF_POLL_MS;
-                }
-           }
-           if (diff > 0 && (int64_t) (*timeout) > diff)
-                *timeout = (int) diff;
+    so->tmr_ts = ts;
+    mod_timer(so->tmr, ts);
+}
+
+static void tcpip_timer(struct nickel *ni, int64_t now, int *timeout)
+{
+    struct ni_socket *so;
+
+    if (ni->ping_sent_ts && now - ni->ping_sent_ts > PING_RTT_LAT_WARN_MS) {
+        if (!ni->ping_warn) {
+            NETLOG("%s: PING rtt timeout > %u ms", __FUNCTION__, PING_RTT_LAT_WARN_MS);
+            ni->ping_warn = 1;
+        }
+        if (now - ni->ping_sent_ts > PING_PROBE_PERIOD_MS) {
+            ni->ping_sent_ts = 0;
+            ni->ping_warn = 0;
+            if (ni->ping_probe_n > PING_PROBE_RESET_N) {
+                ni->ping_probe_n = 0;
+                ni->us_max_ping_rtt = 0;
+            }
+        }
+    }
+
+    if (ni->tcpip_timer_deferred) {
+        ni->tcpip_timer_deferred = 0;
+
+        LIST_FOREACH(so, &ni->udp, entry) {
+            if ((so->flags & TF_TIMER_DEFER)) {
+                so->flags &= ~TF_TIMER_DEFER;
+                so_timer_arm(so, now);
+            }
+        }
+        LIST_FOREACH(so, &ni->tcp, entry) {
+            if ((so->flags & TF_TIMER_DEFER)) {
+                so->flags &= ~TF_TIMER_DEFER;
+                so_timer_arm(so, now);
+            }
         }
     }
 }
@@ -1425,6 +1745,7 @@ tcp_listen_create(struct nickel *ni, CharDriverState *chr, uint32_t faddr, uint1
     so->gaddr.sin_addr.s_addr = gaddr;
     so->gaddr.sin_port = gport;
     so->faddr.sin_port = fport;
+    so_hash_insert(&ni->tcp_hash, so);
     so->snd_iss = get_iss();
     so->snd_win = MAX_16_WIN;
     so->rcv_mss = 1460;
@@ -1448,6 +1769,12 @@ struct sockaddr_in tcpip_get_gaddr(void *so_opaque)
     return so->gaddr;
 }
 
+void tcpip_buf_limits(struct ni_socket *so, size_t *snd, size_t *rcv)
+{
+    *snd = so->snd_win_max;
+    *rcv = so->rcv_buf_max;
+}
+
 void tcpip_event(struct ni_socket *so, int event)
 {
     if (so->type != IPPROTO_TCP)
@@ -1510,6 +1837,7 @@ void tcpip_close(struct ni_socket *so)
 
     so->flags |= TF_CLOSED;
     so->ts_closed = get_clock_ms(vm_clock);
+    so_timer_kick(so);
 
     if (so->fwd_timer) {
         free_timer(so->fwd_timer);
@@ -1556,10 +1884,13 @@ size_t tcpip_can_output(struct ni_socket *so)
 
         if (so->win_state == WST_SENT)
             goto win_out;
-        if ((uint32_t) (so->snd_off_nxt - so->snd_off_ack) >= so->rcv_win)
+        /* outside retransmission, bufd_data only holds a coalesced tail
+         * that is as good as sent */
+        if ((uint32_t) (so->snd_off_nxt - so->snd_off_ack) + so->bufd_len >= so->rcv_win)
             goto win_out;
 
-        ret = so->rcv_win - ((uint32_t) (so->snd_off_nxt - so->snd_off_ack));
+        ret = so->rcv_win - ((uint32_t) (so->snd_off_nxt - so->snd_off_ack)) -
+            (uint32_t) so->bufd_len;
         if (so->win_state == WST_UNKN) {
             size_t mx = so->rcv_win;
 
@@ -1578,6 +1909,7 @@ size_t tcpip_can_output(struct ni_socket *so)
             if ((so->flags & TF_HOSTFWD) && !so->poll_eof_ts && so->chr && so->chr->chr_eof) {
                 DBG4(so, "zero win - starting eof poll timer");
                 so->poll_eof_ts = get_clock_ms(vm_clock);
+                so_timer_arm(so, so->poll_eof_ts + HFWD_EOF_POLL_MS);
             }
         }
         goto out;
@@ -1591,7 +1923,8 @@ out:
     return ret;
 }
 
-static void tcp_send_data(struct ni_socket *so, const uint8_t *data, int size)
+static void tcp_send_data(struct ni_socket *so, struct buff *dbf,
+                          const uint8_t *data, int size)
 {
     size_t mss = MIN(so->rcv_mss, so->ni->tcp_mss);
     bool split_pkt = (so->win_state == WST_UNKN);
@@ -1607,14 +1940,15 @@ static void tcp_send_data(struct ni_socket *so, const uint8_t *data, int size)
         if (split_pkt) {
             size_t l = chunk / 2;
 
-            tcp_send(so, TH_ACK, data, l);
+            tcp_send_buff(so, TH_ACK, dbf, data, l);
             data += l;
             size -= l;
             chunk -= l;
 
             split_pkt = false;
         }
-        tcp_send(so, TH_ACK | ((size <= mss) ? TH_PUSH : 0), data, chunk);
+        tcp_send_buff(so, TH_ACK | ((size <= mss) ? TH_PUSH : 0), dbf, data,
+                      chunk);
         data += chunk;
         size -= chunk;
     }
@@ -1622,6 +1956,7 @@ static void tcp_send_data(struct ni_socket *so, const uint8_t *data, int size)
 
 static void tcp_send_bufd_data(struct ni_socket *so)
 {
+    so_uncork(so);
     if (!so->bufd_data)
         return;
 
@@ -1633,14 +1968,87 @@ static void tcp_send_bufd_data(struct ni_socket *so)
                 (unsigned int) so->bufd_len);
 #endif
 
-        tcp_send_data(so, so->bufd_data, so->bufd_len);
+        tcp_send_data(so, NULL, so->bufd_data, so->bufd_len);
     }
     ni_priv_free(so->bufd_data);
     so->bufd_data = NULL;
     so->bufd_len = 0;
 }
 
-void tcpip_output(struct ni_socket *so, const uint8_t *data, int size)
+static void so_cork(struct ni_socket *so)
+{
+    if (!so->cork_entry.le_prev)
+        LIST_INSERT_HEAD(&so->ni->tcp_corked, so, cork_entry);
+}
+
+static void so_uncork(struct ni_socket *so)
+{
+    if (!so->cork_entry.le_prev)
+        return;
+
+    LIST_REMOVE(so, cork_entry);
+    so->cork_entry.le_prev = NULL;
+}
+
+static int so_bufd_append(struct ni_socket *so, const uint8_t *data, size_t size)
+{
+    uint8_t *tmp;
+
+    tmp = ni_priv_realloc(so->bufd_data, so->bufd_len + size);
+    if (!tmp)
+        return -1;
+    so->bufd_data = tmp;
+    memcpy(so->bufd_data + so->bufd_len, data, size);
+    so->bufd_len += size;
+
+    return 0;
+}
+
+/*
+ * tcp-coalesce: the host side hands us data in whatever pieces the socket
+ * reads return, and each piece would otherwise end in a short segment.
+ * Only whole MSS segments are sent, the tail is held in bufd_data, topped
+ * up by the next write and sent by tcpip_prepare at the latest, before
+ * the loop waits.
+ */
+static void tcp_send_coalesced(struct ni_socket *so, struct buff *dbf,
+                               const uint8_t *data, int size)
+{
+    size_t mss = MIN(so->rcv_mss, so->ni->tcp_mss);
+    size_t l;
+
+    if (so->bufd_len) {
+        l = MIN((size_t) size, mss > so->bufd_len ? mss - so->bufd_len : 0);
+        if (l && so_bufd_append(so, data, l) < 0) {
+            warnx("%s: malloc failure", __FUNCTION__);
+            tcp_send_bufd_data(so);
+            tcp_send_data(so, dbf, data, size);
+            return;
+        }
+        data += l;
+        size -= (int) l;
+        if (so->bufd_len < mss)
+            return;
+        tcp_send_bufd_data(so);
+    }
+
+    l = (size_t) size % mss;
+    tcp_send_data(so, dbf, data, size - (int) l);
+    if (!l)
+        return;
+
+    if (so_bufd_append(so, data + size - l, l) < 0) {
+        warnx("%s: malloc failure", __FUNCTION__);
+        tcp_send_data(so, dbf, data + size - l, (int) l);
+        return;
+    }
+    so_cork(so);
+}
+
+/* data is in bf, if not NULL, and is referenced by the frames sent
+ * rather than copied -- bf must not change until it is released */
+void tcpip_output_buff(struct ni_socket *so, struct buff *bf,
+                       const uint8_t *data, int size)
 {
     if (size < 0 || !data)
         goto out;
@@ -1654,10 +2062,17 @@ void tcpip_output(struct ni_socket *so, const uint8_t *data, int size)
             goto out;
         }
 
+        so->n_tx += size;
+        tcp_autotune(so);
+
         if (!(so->flags & TF_RETRANSMISSION)) {
-            if (so->bufd_len)
-                tcp_send_bufd_data(so);
-            tcp_send_data(so, data, size);
+            if (so->ni->tcp_coalesce && so->win_state != WST_UNKN) {
+                tcp_send_coalesced(so, bf, data, size);
+            } else {
+                if (so->bufd_len)
+                    tcp_send_bufd_data(so);
+                tcp_send_data(so, bf, data, size);
+            }
         } else {
             /* at retransmission time we buffer the data we promised we have space for */
             uint8_t *tmp;
@@ -1686,6 +2101,7 @@ void tcpip_output(struct ni_socket *so, const uint8_t *data, int size)
     }
 
     if (so->type == IPPROTO_UDP) {
+        so->n_tx += size;
         udp_respond(so, data, size);
 
         goto out;
@@ -1695,13 +2111,22 @@ out:
     return;
 }
 
+void tcpip_output(struct ni_socket *so, const uint8_t *data, int size)
+{
+    tcpip_output_buff(so, NULL, data, size);
+}
+
 void tcpip_win_update(struct ni_socket *so)
 {
+    uint8_t shift;
+
     if (so->type != IPPROTO_TCP)
         return;
     if (so->state != TS_ESTABLISHED)
         return;
-    if (so->snd_win != get_snd_win(so))
+    /* only worth an ACK if G would see a different window */
+    shift = so->g_use_win_scaling ? so->snd_win_shift : 0;
+    if ((so->snd_win >> shift) != (get_snd_win(so) >> shift))
         tcp_send(so, TH_ACK, NULL, 0);
 }
 
@@ -1769,6 +2194,7 @@ static int tcp_input(struct nickel *ni, struct ip *ip, const uint8_t *pkt, size_
         so->gaddr.sin_addr.s_addr = saddr;
         so->gaddr.sin_port = tcp->th_sport;
         so->faddr.sin_port = tcp->th_dport;
+        so_hash_insert(&ni->tcp_hash, so);
         so->snd_iss = get_iss();
         so->snd_win = MAX_16_WIN;
         so->rcv_mss = 1460;
@@ -1894,6 +2320,7 @@ static int tcp_input(struct nickel *ni, struct ip *ip, const uint8_t *pkt, size_
         so->rcv_off_ack = 1;
         tcp_send(so, TH_ACK, NULL, 0);
         so->state = TS_ESTABLISHED;
+        so_timer_kick(so);
         NETLOG4("%s: s:%"PRIxPTR" c:%"PRIxPTR
                 " (G:%hu -> %s:%hu) ip_id %hu/%hu rwin %u rwshift %d mss %u "
                 "swin %u swshift %d mss %u "
@@ -1965,6 +2392,7 @@ static int tcp_input(struct nickel *ni, struct ip *ip, const uint8_t *pkt, size_
             goto out;
         so->rcv_win = get_rcv_win(so, tcp);
         so->state = TS_ESTABLISHED;
+        so_timer_kick(so);
         NETLOG4("%s: s:%"PRIxPTR" c:%"PRIxPTR
                 " (G:%hu -> %s:%hu) ip_id %hu/%hu win %u wshift %d mss %u -- "
                 "connection established %lu ms",
@@ -2059,8 +2487,10 @@ static int tcp_input(struct nickel *ni, struct ip *ip, const uint8_t *pkt, size_
                     if (ol >= 4 + 4) {
                         sack = true;
                         sack_to = sack_received(so, off_ack, po, (size_t) ol);
-                        if (!RLIST_EMPTY(&so->sent_q, so_entry))
+                        if (!RLIST_EMPTY(&so->sent_q, so_entry)) {
                             so->flags |= TF_RETRANSMISSION;
+                            so_timer_kick(so);
+                        }
                     }
                     break;
                 }
@@ -2234,6 +2664,8 @@ static int tcp_input(struct nickel *ni, struct ip *ip, const uint8_t *pkt, size_
                 int64_t delta = 0;
 
                 so->rcv_off_ack += (uint32_t) sent;
+                so->n_rx += sent;
+                tcp_autotune(so);
 
                 if (so->ack_1_ts > 0 && so->ack_2_ts > 0) {
                     delta = so->ack_2_ts - so->ack_1_ts;
@@ -2247,6 +2679,7 @@ static int tcp_input(struct nickel *ni, struct ip *ip, const uint8_t *pkt, size_
 
                     so->flags |= TF_DELAYED_ACK;
                     so->delay_ac_ts = now + DELAY_ACK_MAX_MS;
+                    so_timer_arm(so, so->delay_ac_ts - DELAY_ACK_MIN_MS);
                     q_send_ack = false;
                 }
             }
@@ -2382,6 +2815,8 @@ udp_socket_create(struct nickel *ni, struct udp *udp, uint32_t saddr,
     so->faddr.sin_addr.s_addr = daddr;
     so->gaddr.sin_port = udp->uh_sport;
     so->faddr.sin_port = udp->uh_dport;
+    so_hash_insert(&ni->udp_hash, so);
+    so_timer_arm(so, so->ts_created + UDP_SOCK_EXPIRE);
 out:
     return so;
 }
@@ -2453,6 +2888,8 @@ static int udp_input(struct nickel *ni, const uint8_t *pkt, size_t len,
     ret = 0;
     if (so->chr)
         ret = qemu_chr_write(so->chr, pkt, len);
+    if (ret > 0)
+        so->n_rx += ret;
 out:
     if (lv) {
         lava_event_complete(lv, true);
@@ -2620,8 +3057,10 @@ static void tcp_socket_save(QEMUFile *f, struct ni_socket *so, uint32_t *n_sbf,
 
         RLIST_FOREACH(bf, &so->sent_q, so_entry) {
             qemu_put_byte(f, 1);
-            qemu_put_be32(f, (uint32_t) bf->len);
+            qemu_put_be32(f, (uint32_t) BUFF_SG_LEN(bf));
             qemu_put_buffer(f, bf->m, (uint32_t) bf->len);
+            if (bf->sg_len)
+                qemu_put_buffer(f, bf->sg_data, (uint32_t) bf->sg_len);
             (*n_sbf)++;
         }
     }
@@ -2658,6 +3097,7 @@ static int tcp_socket_load(QEMUFile *f, struct nickel *ni, int version_id, uint3
 
     so->state = qemu_get_byte(f);
     so->flags = qemu_get_be32(f);
+    so->flags &= ~(TF_TIMER_RUN | TF_TIMER_DEFER);
     so->flags |= TF_INPUT;
     if (!(so->flags & TF_VMFWD))
         so->flags |= (TF_RST_PENDING | TF_CLOSED);
@@ -2781,6 +3221,11 @@ static int tcp_socket_load(QEMUFile *f, struct nickel *ni, int version_id, uint3
                 (so->flags & TF_RST_PENDING) ? "RST" : "resumed");
 
         LIST_INSERT_HEAD(&ni->tcp, so, entry);
+        so_hash_insert(&ni->tcp_hash, so);
+        so_timer_kick(so);
+        /* a coalesced tail saved with the socket */
+        if (so->bufd_len && !(so->flags & TF_RETRANSMISSION))
+            so_cork(so);
         atomic_inc(&ni->number_tcp_sockets);
         atomic_inc(&ni->number_total_tcp_sockets);
     }
@@ -2862,6 +3307,15 @@ int tcpip_load(QEMUFile *f, struct nickel *ni, int version_id)
 
 void tcpip_prepare(struct nickel *ni, int *timeout)
 {
+    struct ni_socket *so, *so_next;
+
+    LIST_FOREACH_SAFE(so, &ni->tcp_corked, cork_entry, so_next) {
+        if ((so->flags & TF_RETRANSMISSION))
+            so_uncork(so); /* sent once the retransmission is over */
+        else
+            tcp_send_bufd_data(so);
+    }
+
     if (!ni->vm_paused)
         tcpip_timer(ni, get_clock_ms(vm_clock), timeout);
     lava_timer(ni, get_clock_ms(rt_clock));
@@ -2872,6 +3326,8 @@ void tcpip_init(struct nickel *ni)
     ni->tcp_free_port_base = 20000;
     ni->tcp_free_port_end = 40000;
     ni->tcp_last_free_port = ni->tcp_free_port_base + 1;
+    so_hash_init(&ni->tcp_hash);
+    so_hash_init(&ni->udp_hash);
 
     ni_schedule_bh_permanent(ni, socket_gc, ni);
 }
@@ -2909,6 +3365,56 @@ void tcpip_flush(struct nickel *ni)
     }
 }
 
+#ifdef MONITOR
+static void so_connection_info(Monitor *mon, struct ni_socket *so, int64_t now)
+{
+    static const char *states[] = {
+        [TS_CLOSED] = "closed",
+        [TS_SYN_RECVD] = "syn-recvd",
+        [TS_SYNACK_SENT] = "synack-sent",
+        [TS_ESTABLISHED] = "established",
+        [TS_CONN_RST] = "reset",
+        [TS_SYN_SENT] = "syn-sent",
+    };
+    char gaddr[INET_ADDRSTRLEN];
+    uint32_t rate_rx = so->rate_rx, rate_tx = so->rate_tx;
+
+    snprintf(gaddr, sizeof(gaddr), "%s", inet_ntoa(so->gaddr.sin_addr));
+    if (now - so->tune_ts > TCP_TUNE_IDLE_MS)
+        rate_rx = rate_tx = 0;
+
+    monitor_printf(mon, "  %s %s:%hu -> %s:%hu", so->type == IPPROTO_TCP ?
+                   "tcp" : "udp", gaddr, NI_NTOHS(so->gaddr.sin_port),
+                   inet_ntoa(so->faddr.sin_addr), NI_NTOHS(so->faddr.sin_port));
+    if (so->type == IPPROTO_TCP)
+        monitor_printf(mon, " %s", so->state < ARRAY_SIZE(states) ?
+                       states[so->state] : "?");
+    monitor_printf(mon, " rx %"PRIu64"KiB %uKiB/s tx %"PRIu64"KiB %uKiB/s",
+                   so->n_rx >> 10, rate_rx >> 10, so->n_tx >> 10,
+                   rate_tx >> 10);
+    if (so->type == IPPROTO_TCP)
+        monitor_printf(mon, " win %u/%uKiB buf %uKiB",
+                       so->snd_win >> 10, so->snd_win_max >> 10,
+                       so->rcv_buf_max >> 10);
+    monitor_printf(mon, "\n");
+}
+
+void tcpip_connection_info(Monitor *mon, struct nickel *ni)
+{
+    struct ni_socket *so;
+    int64_t now = get_clock_ms(vm_clock);
+
+    monitor_printf(mon, "  %u tcp %u udp sockets, ping rtt %"PRIu64"us\n",
+                   (unsigned int) ni->number_tcp_sockets,
+                   (unsigned int) ni->number_udp_sockets,
+                   ni->us_max_ping_rtt);
+    LIST_FOREACH(so, &ni->tcp, entry)
+        so_connection_info(mon, so, now);
+    LIST_FOREACH(so, &ni->udp, entry)
+        so_connection_info(mon, so, now);
+}
+#endif  /* MONITOR */
+
 void tcpip_exit(struct nickel *ni)
 {
     struct ni_socket *so;
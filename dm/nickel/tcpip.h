@@ -27,6 +27,8 @@ void tcpip_prepare(struct nickel *ni, int *timeout);
 int tcpip_send_fin(struct ni_socket *so);
 size_t tcpip_can_output(struct ni_socket *so);
 void tcpip_output(struct ni_socket *so, const uint8_t *data, int size);
+void tcpip_output_buff(struct ni_socket *so, struct buff *bf,
+                       const uint8_t *data, int size);
 void tcpip_win_update(struct ni_socket *so);
 void tcpip_set_chr(struct ni_socket *so, CharDriverState *chr);
 void tcpip_set_sock_type(struct ni_socket *so, uint32_t typef);
@@ -36,4 +38,8 @@ void tcpip_close(struct ni_socket *so);
 void tcpip_save(QEMUFile *f, struct nickel *ni);
 int tcpip_load(QEMUFile *f, struct nickel *ni, int version_id);
 struct sockaddr_in tcpip_get_gaddr(void *so_opaque);
+void tcpip_buf_limits(struct ni_socket *so, size_t *snd, size_t *rcv);
+#ifdef MONITOR
+void tcpip_connection_info(Monitor *mon, struct nickel *ni);
+#endif
 #endif
@@ -28,6 +28,8 @@
 #include "win32.h"
 #elif defined(__APPLE__)
 #include "osx.h"
+#elif defined(__linux__)
+#include "linux.h"
 #endif
 
 int get_timeoffset(void);
@@ -0,0 +1,740 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * Size class allocator with per-thread magazine caches, layered over a
+ * backing allocator such as a private heap.
+ *
+ * Requests are rounded up to a power of two size class.  Each thread
+ * keeps a magazine of free objects per class and heap, so that allocs
+ * and frees only take the heap lock when a magazine runs empty or
+ * full, and then exchange a whole magazine with the heap's depot.
+ * Objects of small classes are carved out of larger chunks, which are
+ * only given back when the heap is drained with nothing allocated;
+ * objects of the larger classes are individually allocated, and freed
+ * back once the depot holds more than SLAB_DEPOT_BYTES of them.
+ *
+ * When a thread exits, its cached objects go back to the heap's shared
+ * cache and its caches are freed.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict.h"
+#include "monitor.h"
+#include "queue.h"
+#include "slab.h"
+
+#define SLAB_MIN_SHIFT 5
+#define SLAB_MAX_SHIFT 22
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_LARGE SLAB_CLASSES
+
+/* classes up to this size are carved out of chunks */
+#define SLAB_CARVE_SHIFT 11
+#define SLAB_CHUNK_SIZE (64 << 10)
+
+#define SLAB_MAG_MAX 32
+#define SLAB_MAG_BYTES (256 << 10)
+#define SLAB_DEPOT_BYTES (16 << 20)
+
+/* heaps with per-thread caches, the rest share one cache under the lock */
+#define SLAB_MAX_CACHED_HEAPS 16
+
+/* precedes every object, keeps the object 16 byte aligned */
+struct slab_hdr {
+    uint32_t cls;
+    uint32_t heap;
+    uint64_t size;
+};
+
+struct slab_magazine {
+    struct slab_magazine *next;
+    struct slab_hdr *objs[SLAB_MAG_MAX];
+};
+
+struct slab_tcache {
+    unsigned int heap_id;
+    struct slab_tcache *next;
+    struct {
+        int n;
+        uint64_t allocs;
+        uint64_t frees;
+        struct slab_hdr *objs[SLAB_MAG_MAX];
+    } c[SLAB_CLASSES];
+};
+
+struct slab_chunk {
+    struct slab_chunk *next;
+    uint64_t pad;
+};
+
+struct slab_class {
+    size_t size;
+    size_t stride;
+    int mag_size;
+    int depot_max;
+    struct slab_magazine *full;
+    int nr_full;
+    uint8_t *carve;
+    size_t carve_left;
+    uint64_t refills;
+    uint64_t flushes;
+    uint64_t backing_allocs;
+    uint64_t backing_frees;
+};
+
+struct slab_heap {
+    char name[32];
+    unsigned int id;
+    int slot;
+    slab_backing_alloc *alloc;
+    slab_backing_free *free;
+    void *opaque;
+    critical_section lock;
+    struct slab_class classes[SLAB_CLASSES];
+    struct slab_magazine *empty;
+    struct slab_chunk *chunks;
+    uint64_t chunk_bytes;
+    struct slab_tcache *tcaches;
+    struct slab_tcache shared;
+    uint64_t large_allocs;
+    uint64_t large_frees;
+    LIST_ENTRY(slab_heap) link;
+};
+
+static LIST_HEAD(, slab_heap) slab_heaps = LIST_HEAD_INITIALIZER(&slab_heaps);
+static critical_section slab_heaps_lock;
+static volatile int slab_heaps_lock_state = 0;
+static volatile unsigned int slab_heap_ids = 0;
+static volatile uint32_t slab_slots = 0;
+
+static __thread struct slab_tcache *slab_tcaches[SLAB_MAX_CACHED_HEAPS];
+
+/* set to slab_tcaches once a thread has caches, to run slab_thread_exit */
+#if defined(_WIN32)
+static DWORD slab_tls_key;
+#else
+static pthread_key_t slab_tls_key;
+#endif
+
+#if defined(_WIN32)
+static VOID WINAPI slab_thread_exit(void *opaque);
+#else
+static void slab_thread_exit(void *opaque);
+#endif
+
+/* heaps get created from initcalls, before anything else could init the
+ * lock */
+static void
+slab_heaps_lock_init(void)
+{
+
+    if (slab_heaps_lock_state == 2)
+        return;
+    if (__sync_bool_compare_and_swap(&slab_heaps_lock_state, 0, 1)) {
+        critical_section_init(&slab_heaps_lock);
+#if defined(_WIN32)
+        slab_tls_key = FlsAlloc(slab_thread_exit);
+        if (slab_tls_key == FLS_OUT_OF_INDEXES)
+            Werr(1, "%s: FlsAlloc", __FUNCTION__);
+#else
+        if (pthread_key_create(&slab_tls_key, slab_thread_exit))
+            err(1, "%s: pthread_key_create", __FUNCTION__);
+#endif
+        __sync_synchronize();
+        slab_heaps_lock_state = 2;
+    } else
+        while (slab_heaps_lock_state != 2)
+            __sync_synchronize();
+}
+
+static inline int
+slab_class_index(size_t size)
+{
+
+    if (size <= (1UL << SLAB_MIN_SHIFT))
+        return 0;
+    return 64 - __builtin_clzll((unsigned long long)size - 1) -
+        SLAB_MIN_SHIFT;
+}
+
+static inline int
+slab_class_carved(int cls)
+{
+
+    return cls + SLAB_MIN_SHIFT <= SLAB_CARVE_SHIFT;
+}
+
+struct slab_heap *
+slab_heap_create(const char *name, slab_backing_alloc *alloc,
+                 slab_backing_free *free, void *opaque)
+{
+    struct slab_heap *h;
+    uint32_t slots;
+    int i;
+
+    h = calloc(1, sizeof(*h));
+    if (!h) {
+        warnx("%s: calloc failed", __FUNCTION__);
+        return NULL;
+    }
+
+    strncpy(h->name, name, sizeof(h->name) - 1);
+    h->alloc = alloc;
+    h->free = free;
+    h->opaque = opaque;
+    critical_section_init(&h->lock);
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        struct slab_class *c = &h->classes[i];
+
+        c->size = 1UL << (i + SLAB_MIN_SHIFT);
+        c->stride = c->size + sizeof(struct slab_hdr);
+        c->mag_size = SLAB_MAG_BYTES / c->size;
+        if (c->mag_size > SLAB_MAG_MAX)
+            c->mag_size = SLAB_MAG_MAX;
+        if (c->mag_size < 1)
+            c->mag_size = 1;
+        c->depot_max = SLAB_DEPOT_BYTES / (c->mag_size * c->size);
+        if (c->depot_max < 1)
+            c->depot_max = 1;
+    }
+
+    do {
+        h->id = __sync_add_and_fetch(&slab_heap_ids, 1);
+    } while (!h->id);
+
+    h->slot = -1;
+    do {
+        slots = slab_slots;
+        if (slots == (uint32_t)((1ULL << SLAB_MAX_CACHED_HEAPS) - 1))
+            break;
+        h->slot = __builtin_ctz(~slots);
+    } while (!__sync_bool_compare_and_swap(&slab_slots, slots,
+                                           slots | (1U << h->slot)));
+    if (h->slot < 0)
+        debug_printf("%s: %s: no thread cache slot left\n", __FUNCTION__,
+                     name);
+    h->shared.heap_id = h->id;
+
+    slab_heaps_lock_init();
+    critical_section_enter(&slab_heaps_lock);
+    LIST_INSERT_HEAD(&slab_heaps, h, link);
+    critical_section_leave(&slab_heaps_lock);
+
+    return h;
+}
+
+/* the calling thread's cache for the heap, NULL if the heap has none */
+static inline struct slab_tcache *
+slab_tcache(struct slab_heap *h)
+{
+    struct slab_tcache *tc;
+
+    if (h->slot < 0)
+        return NULL;
+
+    tc = slab_tcaches[h->slot];
+    if (tc && tc->heap_id == h->id)
+        return tc;
+
+    /* first use by this thread, or the slot's last heap is gone */
+    if (!tc) {
+        tc = calloc(1, sizeof(*tc));
+        if (!tc)
+            return NULL;
+        slab_tcaches[h->slot] = tc;
+#if defined(_WIN32)
+        FlsSetValue(slab_tls_key, slab_tcaches);
+#else
+        pthread_setspecific(slab_tls_key, slab_tcaches);
+#endif
+    } else
+        memset(tc, 0, sizeof(*tc));
+
+    critical_section_enter(&h->lock);
+    tc->heap_id = h->id;
+    tc->next = h->tcaches;
+    h->tcaches = tc;
+    critical_section_leave(&h->lock);
+
+    return tc;
+}
+
+static void
+slab_backing_free_objs(struct slab_heap *h, int cls, struct slab_hdr **objs,
+                       int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        h->free(h->opaque, objs[i]);
+    h->classes[cls].backing_frees += n;
+}
+
+/* fill an empty thread magazine, with the heap lock held */
+static void
+slab_refill(struct slab_heap *h, struct slab_tcache *tc, int cls)
+{
+    struct slab_class *c = &h->classes[cls];
+    struct slab_magazine *m;
+    struct slab_chunk *chunk;
+    void *p;
+
+    if (c->full) {
+        m = c->full;
+        c->full = m->next;
+        c->nr_full--;
+        memcpy(tc->c[cls].objs, m->objs, c->mag_size * sizeof(m->objs[0]));
+        tc->c[cls].n = c->mag_size;
+        m->next = h->empty;
+        h->empty = m;
+        c->refills++;
+        return;
+    }
+
+    if (!slab_class_carved(cls)) {
+        p = h->alloc(h->opaque, c->stride);
+        if (p) {
+            tc->c[cls].objs[tc->c[cls].n++] = p;
+            c->backing_allocs++;
+        }
+        return;
+    }
+
+    while (tc->c[cls].n < c->mag_size) {
+        if (c->carve_left < c->stride) {
+            chunk = h->alloc(h->opaque, SLAB_CHUNK_SIZE);
+            if (!chunk)
+                break;
+            chunk->next = h->chunks;
+            h->chunks = chunk;
+            h->chunk_bytes += SLAB_CHUNK_SIZE;
+            c->carve = (uint8_t *)(chunk + 1);
+            c->carve_left = SLAB_CHUNK_SIZE - sizeof(*chunk);
+            c->backing_allocs++;
+        }
+        tc->c[cls].objs[tc->c[cls].n++] = (struct slab_hdr *)c->carve;
+        c->carve += c->stride;
+        c->carve_left -= c->stride;
+    }
+}
+
+/* empty a full thread magazine into the depot, with the heap lock held */
+static void
+slab_flush(struct slab_heap *h, struct slab_tcache *tc, int cls)
+{
+    struct slab_class *c = &h->classes[cls];
+    struct slab_magazine *m = NULL;
+
+    if (slab_class_carved(cls) || c->nr_full < c->depot_max) {
+        m = h->empty;
+        if (m)
+            h->empty = m->next;
+        else
+            m = calloc(1, sizeof(*m));
+    }
+
+    if (!m) {
+        if (slab_class_carved(cls))
+            /* nowhere to put them, better leak than to fail frees */
+            warnx("%s: %s: dropping %d objects", __FUNCTION__, h->name,
+                  tc->c[cls].n);
+        else
+            slab_backing_free_objs(h, cls, tc->c[cls].objs, tc->c[cls].n);
+        tc->c[cls].n = 0;
+        return;
+    }
+
+    memcpy(m->objs, tc->c[cls].objs, c->mag_size * sizeof(m->objs[0]));
+    m->next = c->full;
+    c->full = m;
+    c->nr_full++;
+    c->flushes++;
+    tc->c[cls].n = 0;
+}
+
+static inline void
+slab_depot_enter(struct slab_heap *h, struct slab_tcache *tc)
+{
+
+    if (tc != &h->shared)
+        critical_section_enter(&h->lock);
+}
+
+static inline void
+slab_depot_leave(struct slab_heap *h, struct slab_tcache *tc)
+{
+
+    if (tc != &h->shared)
+        critical_section_leave(&h->lock);
+}
+
+void *
+slab_malloc(struct slab_heap *h, size_t size)
+{
+    struct slab_tcache *tc;
+    struct slab_hdr *hdr = NULL;
+    int cls;
+
+    if (size > (1UL << SLAB_MAX_SHIFT)) {
+        if (size > SIZE_MAX - sizeof(*hdr))
+            return NULL;
+        hdr = h->alloc(h->opaque, sizeof(*hdr) + size);
+        if (!hdr)
+            return NULL;
+        __sync_fetch_and_add(&h->large_allocs, 1);
+        cls = SLAB_LARGE;
+        goto out;
+    }
+
+    cls = slab_class_index(size);
+    tc = slab_tcache(h);
+    if (!tc) {
+        tc = &h->shared;
+        critical_section_enter(&h->lock);
+    }
+
+    if (!tc->c[cls].n) {
+        slab_depot_enter(h, tc);
+        slab_refill(h, tc, cls);
+        slab_depot_leave(h, tc);
+    }
+    if (tc->c[cls].n) {
+        hdr = tc->c[cls].objs[--tc->c[cls].n];
+        tc->c[cls].allocs++;
+    }
+
+    if (tc == &h->shared)
+        critical_section_leave(&h->lock);
+    if (!hdr)
+        return NULL;
+
+  out:
+    hdr->cls = cls;
+    hdr->heap = h->id;
+    hdr->size = size;
+    return hdr + 1;
+}
+
+void *
+slab_calloc(struct slab_heap *h, size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (nmemb && size > SIZE_MAX / nmemb)
+        return NULL;
+
+    p = slab_malloc(h, nmemb * size);
+    if (p)
+        memset(p, 0, nmemb * size);
+    return p;
+}
+
+/* grown memory reads as zero, like priv_realloc on windows */
+void *
+slab_realloc(struct slab_heap *h, void *ptr, size_t size)
+{
+    struct slab_hdr *hdr;
+    void *p;
+
+    if (!ptr)
+        return slab_calloc(h, 1, size);
+
+    hdr = (struct slab_hdr *)ptr - 1;
+    if (hdr->cls != SLAB_LARGE && size <= h->classes[hdr->cls].size &&
+        (!hdr->cls || size > h->classes[hdr->cls - 1].size)) {
+        if (size > hdr->size)
+            memset((uint8_t *)ptr + hdr->size, 0, size - hdr->size);
+        hdr->size = size;
+        return ptr;
+    }
+
+    p = slab_malloc(h, size);
+    if (!p)
+        return NULL;
+    if (size > hdr->size) {
+        memcpy(p, ptr, hdr->size);
+        memset((uint8_t *)p + hdr->size, 0, size - hdr->size);
+    } else
+        memcpy(p, ptr, size);
+    slab_free(h, ptr);
+
+    return p;
+}
+
+void
+slab_free(struct slab_heap *h, void *ptr)
+{
+    struct slab_tcache *tc;
+    struct slab_hdr *hdr;
+    int cls;
+
+    if (!ptr)
+        return;
+
+    hdr = (struct slab_hdr *)ptr - 1;
+    assert(hdr->heap == h->id);
+    cls = hdr->cls;
+
+    if (cls == SLAB_LARGE) {
+        h->free(h->opaque, hdr);
+        __sync_fetch_and_add(&h->large_frees, 1);
+        return;
+    }
+
+    tc = slab_tcache(h);
+    if (!tc) {
+        tc = &h->shared;
+        critical_section_enter(&h->lock);
+    }
+
+    if (tc->c[cls].n == h->classes[cls].mag_size) {
+        slab_depot_enter(h, tc);
+        slab_flush(h, tc, cls);
+        slab_depot_leave(h, tc);
+    }
+    tc->c[cls].objs[tc->c[cls].n++] = hdr;
+    tc->c[cls].frees++;
+
+    if (tc == &h->shared)
+        critical_section_leave(&h->lock);
+}
+
+/* hand an exiting thread's cache over to the heap's shared cache, with
+ * the heap lock held */
+static void
+slab_tcache_release(struct slab_heap *h, struct slab_tcache *tc)
+{
+    struct slab_tcache **ptc;
+    int cls, i;
+
+    for (ptc = &h->tcaches; *ptc; ptc = &(*ptc)->next)
+        if (*ptc == tc) {
+            *ptc = tc->next;
+            break;
+        }
+
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        for (i = 0; i < tc->c[cls].n; i++) {
+            if (h->shared.c[cls].n == h->classes[cls].mag_size)
+                slab_flush(h, &h->shared, cls);
+            h->shared.c[cls].objs[h->shared.c[cls].n++] = tc->c[cls].objs[i];
+        }
+        h->shared.c[cls].allocs += tc->c[cls].allocs;
+        h->shared.c[cls].frees += tc->c[cls].frees;
+    }
+}
+
+#if defined(_WIN32)
+static VOID WINAPI
+#else
+static void
+#endif
+slab_thread_exit(void *opaque)
+{
+    struct slab_tcache **tcaches = opaque;
+    struct slab_tcache *tc;
+    struct slab_heap *h;
+    int slot;
+
+    critical_section_enter(&slab_heaps_lock);
+    for (slot = 0; slot < SLAB_MAX_CACHED_HEAPS; slot++) {
+        tc = tcaches[slot];
+        if (!tc)
+            continue;
+        tcaches[slot] = NULL;
+        /* the cache's heap, unless it's been destroyed */
+        LIST_FOREACH(h, &slab_heaps, link)
+            if (tc->heap_id && h->id == tc->heap_id)
+                break;
+        if (h) {
+            critical_section_enter(&h->lock);
+            slab_tcache_release(h, tc);
+            critical_section_leave(&h->lock);
+        }
+        free(tc);
+    }
+    critical_section_leave(&slab_heaps_lock);
+}
+
+/* objects allocated and not freed, exact only while the heap is idle */
+static uint64_t
+slab_in_use(struct slab_heap *h, int cls)
+{
+    struct slab_tcache *tc;
+    uint64_t allocs, frees;
+
+    allocs = h->shared.c[cls].allocs;
+    frees = h->shared.c[cls].frees;
+    for (tc = h->tcaches; tc; tc = tc->next) {
+        allocs += tc->c[cls].allocs;
+        frees += tc->c[cls].frees;
+    }
+
+    return allocs - frees;
+}
+
+static void
+__slab_drain(struct slab_heap *h, int free_chunks)
+{
+    struct slab_tcache *tc;
+    struct slab_magazine *m;
+    struct slab_chunk *chunk;
+    int cls;
+
+    for (cls = 0; cls < SLAB_CLASSES; cls++)
+        if (slab_class_carved(cls) && slab_in_use(h, cls))
+            break;
+    if (cls == SLAB_CLASSES)
+        free_chunks = 1;
+
+    for (cls = 0; cls < SLAB_CLASSES; cls++) {
+        struct slab_class *c = &h->classes[cls];
+
+        if (slab_class_carved(cls) && !free_chunks)
+            continue;
+
+        for (tc = h->tcaches; ; tc = tc->next) {
+            if (!tc)
+                tc = &h->shared;
+            if (!slab_class_carved(cls))
+                slab_backing_free_objs(h, cls, tc->c[cls].objs,
+                                       tc->c[cls].n);
+            tc->c[cls].n = 0;
+            if (tc == &h->shared)
+                break;
+        }
+
+        while ((m = c->full)) {
+            c->full = m->next;
+            if (!slab_class_carved(cls))
+                slab_backing_free_objs(h, cls, m->objs, c->mag_size);
+            free(m);
+        }
+        c->nr_full = 0;
+        c->carve = NULL;
+        c->carve_left = 0;
+    }
+
+    while ((m = h->empty)) {
+        h->empty = m->next;
+        free(m);
+    }
+
+    if (free_chunks) {
+        while ((chunk = h->chunks)) {
+            h->chunks = chunk->next;
+            h->free(h->opaque, chunk);
+        }
+        h->chunk_bytes = 0;
+    }
+}
+
+/* give cached objects back to the backing allocator -- no other thread
+ * may use the heap meanwhile, chunks are only released if no object of
+ * a carved class is allocated */
+void
+slab_heap_drain(struct slab_heap *h)
+{
+
+    critical_section_enter(&h->lock);
+    __slab_drain(h, 0);
+    critical_section_leave(&h->lock);
+}
+
+void
+slab_heap_destroy(struct slab_heap *h)
+{
+    struct slab_tcache *tc;
+    int cls;
+
+    if (!h)
+        return;
+
+    critical_section_enter(&slab_heaps_lock);
+    LIST_REMOVE(h, link);
+    critical_section_leave(&slab_heaps_lock);
+
+    critical_section_enter(&h->lock);
+    for (cls = 0; cls < SLAB_CLASSES; cls++)
+        if (slab_in_use(h, cls))
+            debug_printf("%s: %s: %"PRIu64" objects of %"PRIu64" bytes "
+                         "leaked\n", __FUNCTION__, h->name,
+                         slab_in_use(h, cls),
+                         (uint64_t)h->classes[cls].size);
+    __slab_drain(h, 1);
+    /* thread caches stay with their thread, for the slot's next heap */
+    for (tc = h->tcaches; tc; tc = tc->next)
+        tc->heap_id = 0;
+    critical_section_leave(&h->lock);
+
+    if (h->slot >= 0)
+        __sync_fetch_and_and(&slab_slots, ~(1U << h->slot));
+    critical_section_free(&h->lock);
+    free(h);
+}
+
+#ifdef MONITOR
+static uint64_t
+slab_cached(struct slab_heap *h, int cls)
+{
+    struct slab_tcache *tc;
+    uint64_t n;
+
+    n = h->shared.c[cls].n + h->classes[cls].nr_full *
+        h->classes[cls].mag_size;
+    for (tc = h->tcaches; tc; tc = tc->next)
+        n += tc->c[cls].n;
+
+    return n;
+}
+
+void
+ic_slab(Monitor *mon)
+{
+    struct slab_heap *h;
+    int cls;
+
+    slab_heaps_lock_init();
+    critical_section_enter(&slab_heaps_lock);
+    LIST_FOREACH(h, &slab_heaps, link) {
+        critical_section_enter(&h->lock);
+        monitor_printf(mon, "%s: chunks %"PRIu64" KB, large allocs %"PRIu64
+                       " frees %"PRIu64"%s\n", h->name, h->chunk_bytes >> 10,
+                       h->large_allocs, h->large_frees,
+                       h->slot < 0 ? ", no thread caches" : "");
+        monitor_printf(mon, "  %8s %10s %12s %8s %10s %10s %10s %10s\n",
+                       "size", "in-use", "allocs", "cached", "refills",
+                       "flushes", "backing", "released");
+        for (cls = 0; cls < SLAB_CLASSES; cls++) {
+            struct slab_class *c = &h->classes[cls];
+            struct slab_tcache *tc;
+            uint64_t allocs = h->shared.c[cls].allocs;
+
+            for (tc = h->tcaches; tc; tc = tc->next)
+                allocs += tc->c[cls].allocs;
+            if (!allocs)
+                continue;
+            monitor_printf(mon, "  %8"PRIu64" %10"PRId64" %12"PRIu64" %8"PRIu64
+                           " %10"PRIu64" %10"PRIu64" %10"PRIu64" %10"PRIu64
+                           "\n", (uint64_t)c->size,
+                           (int64_t)slab_in_use(h, cls),
+                           allocs, slab_cached(h, cls), c->refills,
+                           c->flushes, c->backing_allocs, c->backing_frees);
+        }
+        critical_section_leave(&h->lock);
+    }
+    critical_section_leave(&slab_heaps_lock);
+}
+#endif  /* MONITOR */
@@ -0,0 +1,30 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+/* backing allocator, typically a private heap -- objects handed out by
+ * a slab heap always come from its backing allocator, so heap isolation
+ * is preserved */
+typedef void *(slab_backing_alloc)(void *opaque, size_t size);
+typedef void (slab_backing_free)(void *opaque, void *ptr);
+
+struct slab_heap;
+
+struct slab_heap *slab_heap_create(const char *name,
+                                   slab_backing_alloc *alloc,
+                                   slab_backing_free *free, void *opaque);
+void slab_heap_destroy(struct slab_heap *h);
+void slab_heap_drain(struct slab_heap *h);
+
+void *slab_malloc(struct slab_heap *h, size_t size);
+void *slab_calloc(struct slab_heap *h, size_t nmemb, size_t size);
+void *slab_realloc(struct slab_heap *h, void *ptr, size_t size);
+void slab_free(struct slab_heap *h, void *ptr);
+
+#endif  /* _SLAB_H_ */
@@ -0,0 +1,299 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * async-op-test: run ops through dm/async-op.c and check that each one
+ * runs and completes exactly once, with a capped pool, with the
+ * default unbounded pool, through async_op_exit_wait(), that
+ * ASOP_PRIO_HIGH ops overtake queued normal ones, and that
+ * async_op_free() doesn't wait for a busy worker.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "async-op.h"
+
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+struct op {
+    int idx;
+    int prio;
+    int ran;
+    int processed;
+    int seq;                    /* order run in */
+};
+
+static struct op *ops;
+static ioh_event done_ev;
+
+static volatile int gate;       /* ops spin while set */
+static volatile int started, run_seq;
+static int nr_processed;
+static int spin_until;          /* started count to wait for, if any */
+
+static void
+op_async(void *opaque)
+{
+    struct op *o = opaque;
+    double t;
+
+    __sync_fetch_and_add(&o->ran, 1);
+    o->seq = __sync_fetch_and_add(&run_seq, 1);
+    __sync_fetch_and_add(&started, 1);
+
+    t = rtc();
+    while ((gate || (spin_until && started < spin_until)) && rtc() - t < 10)
+        usleep(100);
+}
+
+static void
+op_process(void *opaque)
+{
+    struct op *o = opaque;
+
+    o->processed++;
+    nr_processed++;
+}
+
+static void
+reset(int n)
+{
+
+    memset(ops, 0, n * sizeof(ops[0]));
+    gate = 0;
+    started = run_seq = 0;
+    nr_processed = 0;
+    spin_until = 0;
+}
+
+static int
+add(struct async_op_ctx *ctx, int i, int prio)
+{
+
+    ops[i].idx = i;
+    ops[i].prio = prio;
+    return async_op_add_prio(ctx, prio, &ops[i], &done_ev, op_async,
+                             op_process);
+}
+
+/* process completions until n have been, or nothing completes for 10s */
+static void
+process(struct async_op_ctx *ctx, int n)
+{
+    struct pollfd pfd = { .fd = done_ev.fd, .events = POLLIN };
+
+    while (nr_processed < n) {
+        if (poll(&pfd, 1, 10000) != 1) {
+            check(0, "timed out with %d of %d processed", nr_processed, n);
+            return;
+        }
+        ioh_event_reset(&done_ev);
+        async_op_process(ctx);
+    }
+}
+
+static void
+check_once(const char *name, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        check(ops[i].ran == 1 && ops[i].processed == 1,
+              "%s: op %d ran %d processed %d", name, i, ops[i].ran,
+              ops[i].processed);
+}
+
+static void
+test_capped(int n, int max_threads)
+{
+    struct async_op_ctx *ctx = async_op_init();
+    struct async_op_stats st;
+    double t;
+    int i;
+
+    reset(n);
+    async_op_set_prop(ctx, NULL, max_threads, 0, 0);
+
+    t = rtc();
+    for (i = 0; i < n; i++)
+        check(!add(ctx, i, i % 3 ? ASOP_PRIO_NORMAL : ASOP_PRIO_HIGH),
+              "capped: add %d failed", i);
+    process(ctx, n);
+    t = rtc() - t;
+
+    check_once("capped", n);
+    async_op_get_stats(ctx, &st);
+    check(st.ops == n, "capped: %"PRIu64" ops counted", st.ops);
+    check(st.max_threads_seen <= max_threads, "capped: %d threads",
+          st.max_threads_seen);
+    check(st.queued == 0, "capped: %d still queued", st.queued);
+    printf("capped   %d ops, %d threads: %.0f ns/op, %"PRIu64" stolen, "
+           "max queued %d\n", n, st.max_threads_seen, t * 1e9 / n, st.steals,
+           st.max_queued);
+
+    async_op_free(ctx);
+}
+
+/* without max_threads the pool grows to run every blocked op at once,
+ * past the 64 workers it was once capped at */
+static void
+test_unbounded(int n)
+{
+    struct async_op_ctx *ctx = async_op_init();
+    struct async_op_stats st;
+    int i;
+
+    reset(n);
+    spin_until = n;
+    for (i = 0; i < n; i++)
+        check(!add(ctx, i, ASOP_PRIO_NORMAL), "unbounded: add %d failed", i);
+    process(ctx, n);
+
+    check_once("unbounded", n);
+    async_op_get_stats(ctx, &st);
+    check(st.max_threads_seen >= n, "unbounded: %d threads for %d ops",
+          st.max_threads_seen, n);
+    printf("unbounded %d ops, %d threads\n", n, st.max_threads_seen);
+
+    async_op_free(ctx);
+}
+
+/* with one worker held up by the first op, high priority ops queued
+ * after normal ones still run first */
+static void
+test_priority(int n)
+{
+    struct async_op_ctx *ctx = async_op_init();
+    double t;
+    int i, j;
+
+    reset(n);
+    async_op_set_prop(ctx, NULL, 1, 0, 0);
+
+    gate = 1;
+    check(!add(ctx, 0, ASOP_PRIO_NORMAL), "priority: add 0 failed");
+    t = rtc();
+    while (!started && rtc() - t < 10)
+        usleep(100);
+    for (i = 1; i < n; i++)
+        check(!add(ctx, i, i < n / 2 ? ASOP_PRIO_NORMAL : ASOP_PRIO_HIGH),
+              "priority: add %d failed", i);
+    gate = 0;
+    process(ctx, n);
+
+    check_once("priority", n);
+    for (i = 1; i < n; i++)
+        for (j = 1; j < n; j++)
+            if (ops[i].prio == ASOP_PRIO_HIGH &&
+                ops[j].prio == ASOP_PRIO_NORMAL)
+                check(ops[i].seq < ops[j].seq,
+                      "priority: high op %d ran after normal op %d", i, j);
+    printf("priority %d ops %s\n", n, failures ? "FAILED" : "ok");
+
+    async_op_free(ctx);
+}
+
+/* ops still queued at exit are run and their completions processed */
+static void
+test_exit_wait(int n)
+{
+    struct async_op_ctx *ctx = async_op_init();
+    int i;
+
+    reset(n);
+    async_op_set_prop(ctx, NULL, 2, 0, 0);
+    for (i = 0; i < n; i++)
+        check(!add(ctx, i, i & 1 ? ASOP_PRIO_HIGH : ASOP_PRIO_NORMAL),
+              "exit: add %d failed", i);
+    process(ctx, n / 2);
+    async_op_exit_wait(ctx);
+
+    for (i = 0; i < n; i++)
+        check(ops[i].ran <= 1 && ops[i].processed == ops[i].ran,
+              "exit: op %d ran %d processed %d", i, ops[i].ran,
+              ops[i].processed);
+    printf("exit     %d ops, %d processed by exit\n", n, nr_processed);
+}
+
+/* freeing the ctx doesn't wait for a worker busy with an op */
+static void
+test_free_busy(void)
+{
+    struct async_op_ctx *ctx = async_op_init();
+    double t;
+
+    reset(1);
+    gate = 1;
+    check(!add(ctx, 0, ASOP_PRIO_NORMAL), "free: add failed");
+    t = rtc();
+    while (!started && rtc() - t < 10)
+        usleep(100);
+
+    t = rtc();
+    async_op_free(ctx);
+    t = rtc() - t;
+    gate = 0;
+
+    check(t < 1, "free: waited %.1fs for a busy worker", t);
+    printf("free     busy worker, %.0f us\n", t * 1e6);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n ops] [-t threads]\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int c, n = 100000, threads = 4;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "n:t:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (n < 100 || threads < 1)
+        usage(argv[0]);
+
+    ops = calloc(n, sizeof(ops[0]));
+    if (!ops)
+        err(1, "calloc");
+    ioh_event_init(&done_ev);
+
+    test_capped(n, threads);
+    test_unbounded(80);
+    test_priority(100);
+    test_exit_wait(n);
+    test_free_busy();
+
+    ioh_event_close(&done_ev);
+    free(ops);
+
+    check_done();
+
+    return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * bh-test: schedule BHs through dm/bh.c and check that they run once
+ * each in the order they were scheduled, idle ones after the others,
+ * that a bh_poll nested in a callback, as aio_poll and qemu_aio_flush
+ * do, runs the BHs the outer bh_poll has already taken, and that BHs
+ * scheduled from other threads run.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bh.h"
+#include "ioh.h"
+
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+#define NR_BHS 8
+
+static BH *bhs[NR_BHS];
+static int runs[NR_BHS];
+static int order[64], nr_run;
+static int nest_idx = -1, nest_ret;
+
+static void
+bh_cb(void *opaque)
+{
+    int idx = (intptr_t)opaque;
+
+    runs[idx]++;
+    if (nr_run < sizeof(order) / sizeof(order[0]))
+        order[nr_run] = idx;
+    nr_run++;
+
+    if (idx == nest_idx)
+        nest_ret = bh_poll();
+}
+
+static void
+reset(void)
+{
+
+    memset(runs, 0, sizeof(runs));
+    nr_run = 0;
+    nest_idx = -1;
+    nest_ret = 0;
+}
+
+static void
+check_order(const char *name, const int *exp, int n)
+{
+    int i;
+
+    check(nr_run == n, "%s: %d run, expected %d", name, nr_run, n);
+    for (i = 0; i < n && i < nr_run; i++)
+        check(order[i] == exp[i], "%s: run %d was BH %d, expected %d", name,
+              i, order[i], exp[i]);
+}
+
+static void
+test_order(void)
+{
+    static const int exp[] = { 2, 0, 3, 1 };
+
+    reset();
+    bh_schedule_idle(bhs[1]);
+    bh_schedule(bhs[2]);
+    bh_schedule(bhs[0]);
+    bh_schedule(bhs[0]);
+    bh_schedule(bhs[3]);
+    check(bh_poll() == 1, "order: non-idle BHs ran, but poll returned 0");
+    check_order("order", exp, 4);
+    check(!bh_poll(), "order: nothing left, but poll returned 1");
+}
+
+/* the nested poll runs what the outer one has taken, and the outer one
+ * doesn't run it again */
+static void
+test_nested(void)
+{
+    static const int exp[] = { 0, 1, 2, 3 };
+
+    reset();
+    nest_idx = 0;
+    bh_schedule(bhs[0]);
+    bh_schedule(bhs[1]);
+    bh_schedule(bhs[2]);
+    bh_schedule_idle(bhs[3]);
+    bh_poll();
+    check(nest_ret == 1, "nested: poll returned %d", nest_ret);
+    check_order("nested", exp, 4);
+}
+
+/* a BH promoted from idle runs before the idle ones */
+static void
+test_promoted(void)
+{
+    static const int exp[] = { 4, 5 };
+
+    reset();
+    bh_schedule_idle(bhs[4]);
+    bh_cancel(bhs[4]);
+    bh_schedule(bhs[4]);
+    bh_schedule_idle(bhs[5]);
+    check(bh_poll() == 1, "promoted: poll returned 0");
+    check_order("promoted", exp, 2);
+}
+
+static void
+test_one_shot(void)
+{
+    void *data;
+    BH *bh;
+
+    reset();
+    bh = bh_new_with_data(bh_cb, 0, &data);
+    bh_delete(bh);
+    bh_schedule_one_shot(bhs[6]);
+    bh_poll();
+    check(runs[6] == 1, "one shot: ran %d times", runs[6]);
+    bhs[6] = bh_new(bh_cb, (void *)(intptr_t)6);
+}
+
+static volatile int sched_done;
+
+#if defined(_WIN32)
+static DWORD WINAPI
+sched_run(void *opaque)
+#else
+static void *
+sched_run(void *opaque)
+#endif
+{
+    int i, n = *(int *)opaque;
+
+    for (i = 0; i < n; i++)
+        bh_schedule(bhs[7]);
+    sched_done = 1;
+
+    return 0;
+}
+
+/* however often scheduled from another thread, a BH runs after the last
+ * bh_schedule, and at most once per poll */
+static void
+test_threads(int n)
+{
+    uxen_thread t;
+    int polls = 0, timeout;
+
+    reset();
+    if (create_thread(&t, sched_run, &n))
+        errx(1, "create_thread failed");
+    while (!sched_done) {
+        bh_poll();
+        polls++;
+    }
+    wait_thread(t);
+    close_thread_handle(t);
+    bh_poll();
+    polls++;
+
+    check(runs[7] >= 1 && runs[7] <= polls, "threads: ran %d times in %d "
+          "polls", runs[7], polls);
+    timeout = 1;
+    bh_update_timeout(&timeout);
+    check(timeout == 1, "threads: timeout %d with nothing scheduled",
+          timeout);
+    printf("threads %d scheduled, ran %d times in %d polls\n", n, runs[7],
+           polls);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n schedules]\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int c, i, n = 100000;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (n < 1)
+        usage(argv[0]);
+
+    ioh_init();
+    bh_init();
+    for (i = 0; i < NR_BHS; i++)
+        bhs[i] = bh_new(bh_cb, (void *)(intptr_t)i);
+
+    test_order();
+    test_nested();
+    test_promoted();
+    test_one_shot();
+    test_threads(n);
+
+    check_done();
+    printf("ok\n");
+
+    return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * cksum-test: checks every dm/cksum.c implementation the cpu supports
+ * against the scalar 16-bit word loop nickel and uxen_net used -- all
+ * lengths and alignments up to a few frames, copies, composed partial
+ * sums, buffers big enough to spill the vector lanes, and RFC 1624
+ * header updates -- then reports throughput.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cksum.h"
+
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+#define MAX_LEN     3000
+#define MAX_ALIGN   64
+#define BIG_LEN     (5 * 1024 * 1024)
+
+static const char *impls[] = { "generic", "sse2", "avx2" };
+
+static void
+fill(uint8_t *p, size_t len)
+{
+
+    while (len--)
+        *p++ = rnd();
+}
+
+/* as the scalar checksum() in dm/nickel/tcpip.c, with a sum wide enough
+ * not to overflow on the big buffers */
+static uint16_t
+ref_cksum(uint32_t start, const uint8_t *b, size_t len)
+{
+    uint64_t sum = start;
+    uint16_t w;
+
+    while (len > 1) {
+        memcpy(&w, b, sizeof(w));
+        sum += w;
+        b += 2;
+        len -= 2;
+    }
+    if (len > 0) {
+        w = 0;
+        memcpy(&w, b, 1);
+        sum += w;
+    }
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return (uint16_t) (~sum & 0xffff);
+}
+
+#define check_impl(cond, fmt, ...)                                      \
+    check(cond, "%s: " fmt, impl, ## __VA_ARGS__)
+
+static void
+test_lengths(const char *impl, uint8_t *src, uint8_t *dst)
+{
+    size_t len, align;
+    uint32_t start;
+    uint16_t want;
+
+    for (len = 0; len <= MAX_LEN; len++) {
+        for (align = 0; align < MAX_ALIGN; align++) {
+            start = rnd() & 0x3ffff;
+            want = ref_cksum(start, src + align, len);
+            check_impl(cksum_fold(cksum_partial(src + align, len,
+                                                start)) == want,
+                       "partial len %zu align %zu", len, align);
+
+            memset(dst, 0xa5, MAX_LEN + 2 * MAX_ALIGN);
+            check_impl(cksum_fold(cksum_copy(dst + MAX_ALIGN - align,
+                                             src + align, len, start)) == want,
+                       "copy len %zu align %zu", len, align);
+            check_impl(!memcmp(dst + MAX_ALIGN - align, src + align, len),
+                       "copy data len %zu align %zu", len, align);
+            check_impl(dst[MAX_ALIGN - align - 1] == 0xa5 &&
+                       dst[MAX_ALIGN - align + len] == 0xa5,
+                       "copy overrun len %zu align %zu", len, align);
+        }
+    }
+}
+
+/* header and payload summed apart, as tcp_send does */
+static void
+test_compose(const char *impl, uint8_t *src)
+{
+    size_t len, split;
+    uint32_t sum;
+    int i;
+
+    for (i = 0; i < 100000; i++) {
+        len = rnd() % MAX_LEN;
+        split = (rnd() % (len + 1)) & ~(size_t)1;
+        sum = cksum_partial(src, split, 0);
+        sum = cksum_partial(src + split, len - split, sum);
+        check_impl(cksum_fold(sum) == ref_cksum(0, src, len),
+                   "compose len %zu split %zu", len, split);
+    }
+}
+
+/* all ones maximises every lane, and the length is long enough to
+ * spill several times */
+static void
+test_big(const char *impl, uint8_t *big, uint8_t *big_dst)
+{
+    size_t len;
+
+    for (len = BIG_LEN - 3; len <= BIG_LEN; len++) {
+        memset(big, 0xff, BIG_LEN);
+        check_impl(cksum_fold(cksum_partial(big, len, 0xffff)) ==
+                   ref_cksum(0xffff, big, len), "ones len %zu", len);
+        fill(big, BIG_LEN);
+        check_impl(cksum_fold(cksum_copy(big_dst, big, len, 0)) ==
+                   ref_cksum(0, big, len), "random len %zu", len);
+    }
+}
+
+/* rewrite 16 and 32-bit fields of a header, the updated checksum must
+ * still verify */
+static void
+test_update(const char *impl)
+{
+    uint8_t hdr[20];
+    uint16_t *sum = (uint16_t *)&hdr[10], old16, new16;
+    uint32_t old32, new32;
+    int i, off;
+
+    for (i = 0; i < 1000000; i++) {
+        fill(hdr, sizeof(hdr));
+        *sum = 0;
+        *sum = cksum_fold(cksum_partial(hdr, sizeof(hdr), 0));
+
+        /* any word before the checksum field */
+        off = 2 * (rnd() % 5);
+        memcpy(&old16, hdr + off, sizeof(old16));
+        new16 = rnd();
+        memcpy(hdr + off, &new16, sizeof(new16));
+        *sum = cksum_update16(*sum, old16, new16);
+        check_impl(cksum_fold(cksum_partial(hdr, sizeof(hdr), 0)) == 0,
+                   "update16 off %d", off);
+
+        /* the addresses */
+        off = 12 + 4 * (rnd() % 2);
+        memcpy(&old32, hdr + off, sizeof(old32));
+        new32 = rnd();
+        memcpy(hdr + off, &new32, sizeof(new32));
+        *sum = cksum_update32(*sum, old32, new32);
+        check_impl(ref_cksum(0, hdr, sizeof(hdr)) == 0,
+                   "update32 off %d", off);
+    }
+}
+
+static double
+bench(int copy, uint8_t *src, uint8_t *dst, size_t len, int ref)
+{
+    volatile uint32_t sink = 0;
+    uint64_t bytes = 0, n = 0;
+    double t, dt;
+
+    t = rtc();
+    do {
+        for (n = 0; n < 64; n++) {
+            if (ref) {
+                if (copy)
+                    memcpy(dst, src, len);
+                sink += ref_cksum(0, src, len);
+            } else if (copy)
+                sink += cksum_copy(dst, src, len, 0);
+            else
+                sink += cksum_partial(src, len, 0);
+        }
+        bytes += 64 * len;
+        dt = rtc() - t;
+    } while (dt < 0.2);
+
+    return bytes / dt / (1 << 20);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-n]\n"
+            "  -s  random seed\n"
+            "  -n  skip the throughput run\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 64, 1500, 65536 };
+    uint8_t *src, *dst, *big, *big_dst;
+    int c, i, s, nobench = 0;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "s:n")) != -1) {
+        switch (c) {
+        case 's':
+            rnd_state = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 'n':
+            nobench = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    src = malloc(MAX_LEN + 2 * MAX_ALIGN);
+    dst = malloc(MAX_LEN + 2 * MAX_ALIGN);
+    big = malloc(BIG_LEN);
+    big_dst = malloc(BIG_LEN);
+    if (!src || !dst || !big || !big_dst)
+        err(1, "malloc");
+    fill(src, MAX_LEN + 2 * MAX_ALIGN);
+
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        const char *impl = impls[i];
+
+        if (cksum_select(impl)) {
+            printf("%-8s not supported\n", impl);
+            continue;
+        }
+        test_lengths(impl, src, dst);
+        test_compose(impl, src);
+        test_big(impl, big, big_dst);
+        test_update(impl);
+        printf("%-8s %s\n", impl, failures ? "FAILED" : "ok");
+    }
+    check_done();
+
+    if (nobench)
+        goto out;
+
+    printf("\n%-8s %8s %12s %12s\n", "", "bytes", "sum MiB/s", "copy MiB/s");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        printf("%-8s %8zu %12.0f %12.0f\n", "scalar", sizes[s],
+               bench(0, big, big_dst, sizes[s], 1),
+               bench(1, big, big_dst, sizes[s], 1));
+        for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+            if (cksum_select(impls[i]))
+                continue;
+            printf("%-8s %8zu %12.0f %12.0f\n", impls[i], sizes[s],
+                   bench(0, big, big_dst, sizes[s], 0),
+                   bench(1, big, big_dst, sizes[s], 0));
+        }
+    }
+
+out:
+    free(src);
+    free(dst);
+    free(big);
+    free(big_dst);
+    return 0;
+}
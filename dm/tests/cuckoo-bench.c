@@ -0,0 +1,673 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * cuckoo-bench: drive cuckoo_compress_vm() and cuckoo_reconstruct_vm()
+ * outside of uxendm, against raw page dumps or a synthetic template plus
+ * mutated clones, and report compression ratio, throughput and the
+ * breakdown of page types in the resulting index.
+ *
+ * The shared index (idx0/idx1) and pin sections are backed by files in the
+ * work directory, so repeated runs with -k see the same warm index a
+ * sequence of VM saves on one host would.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <fingerprint.h>
+
+#include "cuckoo.h"
+#include "filebuf.h"
+
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+#define MAX_BATCH_SIZE 1023
+#define MAX_CLONES 64
+
+/* no WHP backend here, cancelled restores undo populated pfns */
+uint64_t whpx_enable = 0;
+
+struct image {
+    uint8_t *pages;
+    uint64_t num_pages;
+};
+
+struct bench {
+    const char *dir;
+    struct image template;
+    /* Source for capture_pfns while compressing. */
+    const struct image *vm;
+    /* Target for populate_pfns while reconstructing. */
+    struct image out;
+    uint8_t *buffers[CUCKOO_MAX_THREADS];
+    void *mappings[cuckoo_num_sections];
+    size_t mapping_sizes[cuckoo_num_sections];
+    pthread_mutex_t mutexes[cuckoo_num_mutexes];
+};
+
+static const char *section_names[cuckoo_num_sections] = {
+    [cuckoo_section_idx0] = "idx0",
+    [cuckoo_section_idx1] = "idx1",
+    [cuckoo_section_pin] = "pin",
+};
+
+static char *
+section_path(struct bench *b, enum cuckoo_section_type t)
+{
+    char *path;
+
+    if (asprintf(&path, "%s/cuckoo-bench-%s", b->dir, section_names[t]) < 0)
+        err(1, "asprintf");
+    return path;
+}
+
+static int cancelled(void *opaque)
+{
+    return 0;
+}
+
+static void *map_section(void *opaque, enum cuckoo_section_type t, size_t sz)
+{
+    struct bench *b = opaque;
+    char *path = section_path(b, t);
+    struct stat st;
+    void *mapping;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        err(1, "%s: open(%s)", __FUNCTION__, path);
+    if (fstat(fd, &st) < 0)
+        err(1, "%s: fstat(%s)", __FUNCTION__, path);
+    /* Fresh sections read as zero, like a new anonymous file mapping. */
+    if (st.st_size < sz && ftruncate(fd, sz) < 0)
+        err(1, "%s: ftruncate(%s)", __FUNCTION__, path);
+    mapping = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+        err(1, "%s: mmap(%s, %zu)", __FUNCTION__, path, sz);
+    close(fd);
+    free(path);
+
+    b->mappings[t] = mapping;
+    b->mapping_sizes[t] = sz;
+    return mapping;
+}
+
+static void unmap_section(void *opaque, enum cuckoo_section_type t)
+{
+    struct bench *b = opaque;
+
+    if (munmap(b->mappings[t], b->mapping_sizes[t]) < 0)
+        warn("%s: munmap", __FUNCTION__);
+    b->mappings[t] = NULL;
+    b->mapping_sizes[t] = 0;
+}
+
+static void reset_section(void *opaque, void *ptr, size_t sz)
+{
+    /* Contents are don't-care after a reset, which a file mapping gives us
+     * for free. */
+}
+
+static void pin_section(void *opaque, enum cuckoo_section_type t, size_t size)
+{
+}
+
+static const uint8_t *
+image_page(const struct image *im, uint64_t pfn)
+{
+    static const uint8_t zero_page[PAGE_SIZE];
+
+    return pfn < im->num_pages ? &im->pages[pfn << PAGE_SHIFT] : zero_page;
+}
+
+static int capture_pfns(void *opaque, int tid, int n, void *out,
+                        uint64_t *pfns, uint32_t flags)
+{
+    struct bench *b = opaque;
+    uint8_t *p = out;
+    int i;
+
+    for (i = 0; i < n; ++i, p += PAGE_SIZE) {
+        uint64_t pfn = pfns[i];
+
+        if (pfn & CUCKOO_TEMPLATE_PFN)
+            memcpy(p, image_page(&b->template, pfn & ~CUCKOO_TEMPLATE_PFN),
+                   PAGE_SIZE);
+        else
+            memcpy(p, image_page(b->vm, pfn), PAGE_SIZE);
+    }
+    return 0;
+}
+
+static void *get_buffer(void *opaque, int tid, int *max)
+{
+    struct bench *b = opaque;
+
+    *max = MAX_BATCH_SIZE;
+    return b->buffers[tid];
+}
+
+static int populate_pfns(void *opaque, int tid, int n, uint64_t *pfns)
+{
+    struct bench *b = opaque;
+    const uint8_t *p = b->buffers[tid];
+    int i;
+
+    for (i = 0; i < n; ++i, p += PAGE_SIZE) {
+        if (pfns[i] >= b->out.num_pages) {
+            warnx("%s: pfn %"PRIx64" out of range", __FUNCTION__, pfns[i]);
+            return -1;
+        }
+        memcpy(&b->out.pages[pfns[i] << PAGE_SHIFT], p, PAGE_SIZE);
+    }
+    return 0;
+}
+
+static int undo_populate_pfns(void *opaque, int tid)
+{
+    return 0;
+}
+
+static void *alloc_mem(void *opaque, size_t sz)
+{
+    return sz ? malloc(sz) : NULL;
+}
+
+static void free_mem(void *opaque, void *ptr)
+{
+    free(ptr);
+}
+
+static int lock(void *opaque, enum cuckoo_mutex_type id)
+{
+    struct bench *b = opaque;
+
+    return pthread_mutex_lock(&b->mutexes[id]) ? -1 : 0;
+}
+
+static void unlock(void *opaque, enum cuckoo_mutex_type id)
+{
+    struct bench *b = opaque;
+
+    pthread_mutex_unlock(&b->mutexes[id]);
+}
+
+static int is_alive(void *opaque, const uuid_t uuid)
+{
+    /* Every clone's save file is kept around for the whole run. */
+    return 1;
+}
+
+static struct cuckoo_callbacks bench_ccb = {
+    cancelled,
+    map_section,
+    unmap_section,
+    reset_section,
+    pin_section,
+    capture_pfns,
+    get_buffer,
+    populate_pfns,
+    undo_populate_pfns,
+    alloc_mem,
+    free_mem,
+    lock,
+    unlock,
+    is_alive,
+};
+
+/* xorshift64*, good enough for generating page contents. */
+static inline uint64_t
+page_rnd(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static int
+page_is_zero(const uint8_t *p)
+{
+    const uint64_t *q = (const uint64_t *)p;
+    int i;
+
+    for (i = 0; i < PAGE_SIZE / sizeof(*q); i++)
+        if (q[i])
+            return 0;
+    return 1;
+}
+
+/* Fill a page with content that compresses roughly like typical guest
+ * memory: tables of small records with a few varying fields, some runs of
+ * low-entropy bytes, and a sprinkling of pointers. */
+static void
+gen_page(uint8_t *page, uint64_t seed)
+{
+    uint64_t s = seed * 0x9e3779b97f4a7c15ULL + 1;
+    uint32_t *w = (uint32_t *)page;
+    int i, kind = page_rnd(&s) % 4;
+    int stride = 2 + page_rnd(&s) % 14;
+    uint32_t base = page_rnd(&s);
+
+    for (i = 0; i < PAGE_SIZE / sizeof(*w); i++) {
+        switch (kind) {
+        case 0:
+            w[i] = (i % stride) ? base + i / stride : (uint32_t)page_rnd(&s);
+            break;
+        case 1:
+            w[i] = page_rnd(&s) & 0x3f3f3f3f;
+            break;
+        case 2:
+            w[i] = (page_rnd(&s) % 8) ? 0 : base + (i << 4);
+            break;
+        default:
+            w[i] = (i & 1) ? 0xffff8000 | (base >> 16) :
+                (uint32_t)(base + (page_rnd(&s) & 0xfff0));
+            break;
+        }
+    }
+}
+
+static void
+gen_template(struct image *im, uint64_t num_pages, double zero_ratio,
+             uint64_t seed)
+{
+    uint64_t s = seed, pfn;
+
+    im->num_pages = num_pages;
+    im->pages = calloc(num_pages, PAGE_SIZE);
+    if (!im->pages)
+        err(1, "calloc template");
+
+    for (pfn = 0; pfn < num_pages; pfn++) {
+        if ((page_rnd(&s) % 10000) < zero_ratio * 10000)
+            continue;
+        gen_page(&im->pages[pfn << PAGE_SHIFT], seed ^ (pfn << 20));
+    }
+}
+
+/* Derive a clone from the template.  A fraction of the pages is touched:
+ * most of those get small in-place edits (delta against the template),
+ * some are replaced by content common to every clone (candidates for shared
+ * refs), and the rest by content unique to this clone. */
+static void
+gen_clone(struct image *im, const struct image *t, double mutate_ratio,
+          uint64_t seed, int clone)
+{
+    uint64_t s = seed ^ (0x51ed270b27f4a3c1ULL * (clone + 1)), pfn;
+    uint64_t common = seed ^ 0xc0ffee;
+    int j;
+
+    im->num_pages = t->num_pages;
+    im->pages = malloc(t->num_pages << PAGE_SHIFT);
+    if (!im->pages)
+        err(1, "malloc clone");
+    memcpy(im->pages, t->pages, t->num_pages << PAGE_SHIFT);
+
+    for (pfn = 0; pfn < im->num_pages; pfn++) {
+        uint8_t *p = &im->pages[pfn << PAGE_SHIFT];
+        uint64_t r = page_rnd(&s) % 10000;
+        uint64_t c = page_rnd(&common) % 10000;
+
+        if (c < mutate_ratio * 2000) {
+            gen_page(p, (seed + 1) ^ (pfn << 20));
+        } else if (r < mutate_ratio * 7000) {
+            for (j = 1 + page_rnd(&s) % 16; j; j--)
+                ((uint32_t *)p)[page_rnd(&s) % (PAGE_SIZE / 4)] = page_rnd(&s);
+        } else if (r < mutate_ratio * 8000) {
+            gen_page(p, page_rnd(&s));
+        }
+    }
+}
+
+static void
+load_image(struct image *im, const char *fn)
+{
+    struct stat st;
+    int fd;
+    size_t off;
+    ssize_t r;
+
+    fd = open(fn, O_RDONLY);
+    if (fd < 0)
+        err(1, "open(%s)", fn);
+    if (fstat(fd, &st) < 0)
+        err(1, "fstat(%s)", fn);
+    if (st.st_size % PAGE_SIZE)
+        warnx("%s: ignoring trailing partial page", fn);
+
+    im->num_pages = st.st_size >> PAGE_SHIFT;
+    im->pages = malloc(im->num_pages << PAGE_SHIFT);
+    if (!im->pages)
+        err(1, "malloc(%s)", fn);
+    for (off = 0; off < im->num_pages << PAGE_SHIFT; off += r) {
+        r = pread(fd, im->pages + off, (im->num_pages << PAGE_SHIFT) - off,
+                  off);
+        if (r <= 0)
+            err(1, "read(%s)", fn);
+    }
+    close(fd);
+}
+
+static int
+fingerprint_image(const struct image *im, struct page_fingerprint **ret)
+{
+    struct page_fingerprint *fps;
+    uint64_t pfn;
+    uint16_t rotate;
+    int n = 0;
+
+    fps = calloc(im->num_pages ? im->num_pages : 1, sizeof(fps[0]));
+    if (!fps)
+        err(1, "calloc fingerprints");
+
+    /* Zero pages are never captured by the save path, skip them too. */
+    for (pfn = 0; pfn < im->num_pages; pfn++) {
+        const uint8_t *p = &im->pages[pfn << PAGE_SHIFT];
+
+        if (page_is_zero(p))
+            continue;
+        fps[n].pfn = pfn;
+        fps[n].hash = page_fingerprint(p, &rotate);
+        fps[n].rotate = rotate;
+        n++;
+    }
+    *ret = fps;
+    return n;
+}
+
+/* Check every captured page of the original against the reconstruction,
+ * returning the first mismatching pfn or -1. */
+static int
+verify_image(const struct image *out, const struct image *orig,
+             const struct page_fingerprint *fps, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (memcmp(image_page(out, fps[i].pfn), image_page(orig, fps[i].pfn),
+                   PAGE_SIZE))
+            return fps[i].pfn;
+    return -1;
+}
+
+struct type_counts {
+    int n[4];
+    uint32_t pin_brk;
+};
+
+/* Walk the most recently committed index and count the page types recorded
+ * for the VM with the given uuid.  A VM never owns template entries, so for
+ * ref_template count the VM's pages that are encoded against a template
+ * page instead, tracking the governing ref the same way create_plan() does.
+ * Each page lands in exactly one column. */
+static void
+count_types(struct bench *b, uuid_t uuid, struct type_counts *tc)
+{
+    const struct cuckoo_shared *s[2], *passive;
+    const struct cuckoo_page *p, *ref = NULL;
+    uint32_t vm = 0;
+    int i;
+
+    memset(tc, 0, sizeof(*tc));
+    s[0] = map_section(b, cuckoo_section_idx0, 128 << 20);
+    s[1] = map_section(b, cuckoo_section_idx1, 128 << 20);
+    passive = s[0]->version > s[1]->version ? s[0] : s[1];
+
+    for (i = 1; i < CUCKOO_MAX_VMS; i++) {
+        if (passive->vms[i].present &&
+            !memcmp(passive->vms[i].uuid, uuid, sizeof(uuid_t))) {
+            vm = i;
+            break;
+        }
+    }
+    tc->pin_brk = passive->pin_brk;
+    for (i = 0, p = passive->pages; vm && i < passive->num_pages;
+         i++, p = nextc(p)) {
+        if (is_shared(p) || is_template(p) || (is_local(p) && p->c.vm == vm))
+            ref = p;
+        if (p->c.vm != vm)
+            continue;
+        if (ref && is_template(ref))
+            tc->n[cuckoo_page_ref_template]++;
+        else
+            tc->n[p->c.type]++;
+    }
+
+    unmap_section(b, cuckoo_section_idx0);
+    unmap_section(b, cuckoo_section_idx1);
+}
+
+static void
+usage(const char *progname)
+{
+    fprintf(stderr,
+            "usage: %s [options] [-t template.raw] [vm.raw ...]\n"
+            "\n"
+            "  -d dir      work directory for index and save files (/tmp)\n"
+            "  -j threads  cuckoo threads (%d..%d)\n"
+            "  -k          keep the index from a previous run\n"
+            "  -S pages    generate a synthetic template of this many pages\n"
+            "  -c clones   number of synthetic clones (4)\n"
+            "  -m ratio    fraction of pages mutated per clone (0.1)\n"
+            "  -z ratio    fraction of zero pages in the template (0.25)\n"
+            "  -s seed     seed for synthetic data\n",
+            progname, CUCKOO_MIN_THREADS, CUCKOO_MAX_THREADS);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b = { .dir = "/tmp" };
+    struct cuckoo_context cc;
+    struct image vms[MAX_CLONES];
+    struct page_fingerprint *tfps = NULL, *fps;
+    const char *template_file = NULL;
+    uint64_t synth_pages = 0, seed = 1;
+    double mutate_ratio = 0.1, zero_ratio = 0.25;
+    int num_clones = 4, num_vms = 0, keep = 0, threads = 0;
+    int tn = 0, i, c;
+    uint64_t total_pages = 0, total_bytes = 0;
+    double total_ct = 0, total_rt = 0;
+    struct type_counts total_tc = { };
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "c:d:hj:km:S:s:t:z:")) != -1) {
+        switch (c) {
+        case 'c':
+            num_clones = atoi(optarg);
+            break;
+        case 'd':
+            b.dir = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'm':
+            mutate_ratio = atof(optarg);
+            break;
+        case 'S':
+            synth_pages = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            template_file = optarg;
+            break;
+        case 'z':
+            zero_ratio = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (threads) {
+        if (threads < CUCKOO_MIN_THREADS || threads > CUCKOO_MAX_THREADS)
+            errx(1, "threads must be in range %d..%d",
+                 CUCKOO_MIN_THREADS, CUCKOO_MAX_THREADS);
+        cuckoo_num_threads = threads;
+    }
+
+    if (synth_pages) {
+        if (template_file || argc)
+            errx(1, "-S cannot be combined with page dumps");
+        if (num_clones < 1 || num_clones > MAX_CLONES)
+            errx(1, "clones must be in range 1..%d", MAX_CLONES);
+        gen_template(&b.template, synth_pages, zero_ratio, seed);
+        for (num_vms = 0; num_vms < num_clones; num_vms++)
+            gen_clone(&vms[num_vms], &b.template, mutate_ratio, seed,
+                      num_vms);
+    } else {
+        if (!argc || argc > MAX_CLONES)
+            usage(argv[-optind]);
+        if (template_file)
+            load_image(&b.template, template_file);
+        for (num_vms = 0; num_vms < argc; num_vms++)
+            load_image(&vms[num_vms], argv[num_vms]);
+    }
+
+    if (!keep) {
+        for (i = 0; i < cuckoo_num_sections; i++) {
+            char *path = section_path(&b, i);
+            if (unlink(path) < 0 && errno != ENOENT)
+                err(1, "unlink(%s)", path);
+            free(path);
+        }
+    }
+
+    for (i = 0; i < cuckoo_num_mutexes; i++)
+        pthread_mutex_init(&b.mutexes[i], NULL);
+    for (i = 0; i < CUCKOO_MAX_THREADS; i++) {
+        b.buffers[i] = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+        if (!b.buffers[i])
+            err(1, "malloc buffers");
+    }
+
+    cuckoo_init(&cc);
+    printf("threads %d\n", cuckoo_num_threads);
+
+    if (b.template.num_pages)
+        tn = fingerprint_image(&b.template, &tfps);
+
+    printf("%-4s %9s %10s %7s %11s %11s %8s %8s %8s %8s\n",
+           "vm", "pages", "bytes", "ratio", "comp/s", "recon/s",
+           "delta", "tmpl", "shared", "local");
+
+    for (i = 0; i < num_vms; i++) {
+        struct filebuf *fb;
+        struct type_counts tc;
+        uuid_t uuid = { };
+        char *save_file;
+        double t0, ct, rt;
+        off_t bytes;
+        int n, j, ret;
+
+        n = fingerprint_image(&vms[i], &fps);
+        memcpy(uuid, &i, sizeof(i));
+        uuid[15] = 0xcb;
+
+        if (asprintf(&save_file, "%s/cuckoo-bench-%d.save", b.dir, i) < 0)
+            err(1, "asprintf");
+        fb = filebuf_open(save_file, "wb");
+        if (!fb)
+            err(1, "filebuf_open(%s)", save_file);
+
+        b.vm = &vms[i];
+        t0 = rtc();
+        ret = cuckoo_compress_vm(&cc, uuid, fb, tn, tfps, n, fps,
+                                 &bench_ccb, &b);
+        ct = rtc() - t0;
+        bytes = filebuf_tell(fb);
+        filebuf_close(fb);
+        if (ret < 0) {
+            check(0, "vm %d: cuckoo_compress_vm failed: %d", i, ret);
+            goto next;
+        }
+        count_types(&b, uuid, &tc);
+
+        /* Restore starts out from a clone of the template, and pages
+         * identical to the template at the same pfn are not populated. */
+        b.out.num_pages = vms[i].num_pages;
+        b.out.pages = calloc(b.out.num_pages ? b.out.num_pages : 1,
+                             PAGE_SIZE);
+        if (!b.out.pages)
+            err(1, "calloc reconstruct");
+        memcpy(b.out.pages, b.template.pages,
+               (b.template.num_pages < b.out.num_pages ?
+                b.template.num_pages : b.out.num_pages) << PAGE_SHIFT);
+        fb = filebuf_open(save_file, "rb");
+        if (!fb)
+            err(1, "filebuf_open(%s)", save_file);
+        t0 = rtc();
+        ret = cuckoo_reconstruct_vm(&cc, uuid, fb, 0, &bench_ccb, &b);
+        rt = rtc() - t0;
+        filebuf_close(fb);
+        if (ret < 0)
+            check(0, "vm %d: cuckoo_reconstruct_vm failed: %d", i, ret);
+        else if ((j = verify_image(&b.out, &vms[i], fps, n)) >= 0)
+            check(0, "vm %d: reconstructed pfn %x differs from original",
+                  i, j);
+        free(b.out.pages);
+        b.out.pages = NULL;
+
+        printf("%-4d %9d %10"PRId64" %6.2fx %11.0f %11.0f %8d %8d %8d %8d\n",
+               i, n, (int64_t)bytes,
+               bytes ? (double)n * PAGE_SIZE / bytes : 0.0,
+               ct > 0 ? n / ct : 0.0, rt > 0 ? n / rt : 0.0,
+               tc.n[cuckoo_page_delta], tc.n[cuckoo_page_ref_template],
+               tc.n[cuckoo_page_ref_shared], tc.n[cuckoo_page_ref_local]);
+
+        total_pages += n;
+        total_bytes += bytes;
+        total_ct += ct;
+        total_rt += rt;
+        for (c = 0; c < 4; c++)
+            total_tc.n[c] += tc.n[c];
+        total_tc.pin_brk = tc.pin_brk;
+  next:
+        free(save_file);
+        free(fps);
+    }
+
+    printf("%-4s %9"PRIu64" %10"PRIu64" %6.2fx %11.0f %11.0f %8d %8d %8d %8d\n",
+           "all", total_pages, total_bytes,
+           total_bytes ? (double)total_pages * PAGE_SIZE / total_bytes : 0.0,
+           total_ct > 0 ? total_pages / total_ct : 0.0,
+           total_rt > 0 ? total_pages / total_rt : 0.0,
+           total_tc.n[cuckoo_page_delta], total_tc.n[cuckoo_page_ref_template],
+           total_tc.n[cuckoo_page_ref_shared],
+           total_tc.n[cuckoo_page_ref_local]);
+    printf("pin %u bytes, %.2fx incl. pin\n", total_tc.pin_brk,
+           total_bytes + total_tc.pin_brk ?
+           (double)total_pages * PAGE_SIZE /
+           (total_bytes + total_tc.pin_brk) : 0.0);
+
+    check_done();
+
+    return 0;
+}
@@ -0,0 +1,448 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * dns-cache-test: runs dm/nickel/dns/dns-cache.c on a simulated clock --
+ * hits, case folding, positive and negative ttls, record ttls, what is
+ * not cached, LRU eviction, prefetch, flushes racing resolutions, the
+ * cache outliving all but the last instance -- then hammers it from
+ * several threads and reports the cost of a hit.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include "monitor.h"
+#include <log.h>
+#include "dns.h"
+#include "dns-cache.h"
+
+#define TEST_NETLOG
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+static int64_t sim_now = 1000000;
+static bool real_clock;
+
+/* the clock dm/clock.c would provide */
+int64_t
+_os_get_clock_ms(int clock)
+{
+
+    if (real_clock)
+        return (int64_t)(rtc() * 1000);
+    return sim_now;
+}
+
+void
+monitor_printf(Monitor *mon, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+/* as in dm/nickel/dns/dns.c */
+struct net_addr *
+dns_ips_dup(const struct net_addr *a)
+{
+    struct net_addr *ret = NULL;
+    size_t len = 0;
+
+    if (!a || !a[0].family)
+        goto out;
+
+    while (a[len].family)
+        len++;
+    ret = calloc(1, (len + 1) * sizeof(*ret));
+    if (!ret)
+        goto out;
+    memcpy(ret, a, len * sizeof(*ret));
+out:
+    return ret;
+}
+
+/* n IPv4 addresses, the first being base */
+static struct dns_response
+answer(uint32_t base, int n)
+{
+    struct dns_response r;
+    int i;
+
+    memset(&r, 0, sizeof(r));
+    r.a = calloc(n + 1, sizeof(*r.a));
+    if (!r.a)
+        err(1, "calloc");
+    for (i = 0; i < n; i++) {
+        r.a[i].family = AF_INET;
+        r.a[i].ipv4.s_addr = htonl(base + i);
+        r.a[i].ts_hyb = 1234;
+    }
+
+    return r;
+}
+
+static void
+resp_free(struct dns_response *r)
+{
+
+    free(r->canon_name);
+    free(r->a);
+    memset(r, 0, sizeof(*r));
+}
+
+static void
+put(const char *name, struct dns_response r, int64_t ttl_ms)
+{
+    struct dns_response miss;
+    uint32_t gen;
+
+    memset(&miss, 0, sizeof(miss));
+    dns_cache_lookup(name, &miss, &gen, NULL);
+    resp_free(&miss);
+    dns_cache_insert(name, &r, gen, ttl_ms);
+    resp_free(&r);
+}
+
+/* 1 hit, 0 miss, with the first address in *addr */
+static int
+get(const char *name, uint32_t *addr, int *err, bool *prefetch)
+{
+    struct dns_response r;
+    uint32_t gen;
+    int hit;
+
+    memset(&r, 0, sizeof(r));
+    hit = dns_cache_lookup(name, &r, &gen, prefetch);
+    if (addr)
+        *addr = r.a ? ntohl(r.a[0].ipv4.s_addr) : 0;
+    if (err)
+        *err = r.err;
+    if (hit && r.a)
+        check(r.a[0].ts_hyb == 0, "%s cached with hybrid state", name);
+    resp_free(&r);
+
+    return hit;
+}
+
+static void
+test_basic(void)
+{
+    struct dns_response r;
+    uint32_t addr, gen;
+    int err;
+
+    check(!get("example.com", NULL, NULL, NULL), "hit on empty cache");
+    put("example.com", answer(0x0a000001, 3), 0);
+    check(get("example.com", &addr, &err, NULL) && addr == 0x0a000001 &&
+          !err, "miss after insert");
+    check(get("EXAMPLE.Com", &addr, NULL, NULL) && addr == 0x0a000001,
+          "names are not case insensitive");
+    check(!get("example.org", NULL, NULL, NULL), "hit on other name");
+
+    /* the copy handed out is the caller's */
+    memset(&r, 0, sizeof(r));
+    dns_cache_lookup("example.com", &r, &gen, NULL);
+    r.a[0].ipv4.s_addr = 0;
+    resp_free(&r);
+    check(get("example.com", &addr, NULL, NULL) && addr == 0x0a000001,
+          "cached answer changed through a copy");
+
+    /* canonical names travel with the answer */
+    r = answer(0x0a000002, 1);
+    r.canon_name = strdup("cdn.example.net");
+    put("www.example.com", r, 0);
+    memset(&r, 0, sizeof(r));
+    check(dns_cache_lookup("www.example.com", &r, &gen, NULL) &&
+          r.canon_name && !strcmp(r.canon_name, "cdn.example.net"),
+          "canonical name lost");
+    resp_free(&r);
+
+    /* a newer answer replaces the old one */
+    put("example.com", answer(0x0a000009, 1), 0);
+    check(get("example.com", &addr, NULL, NULL) && addr == 0x0a000009,
+          "answer not replaced");
+}
+
+static void
+test_ttl(void)
+{
+    struct dns_response r;
+    uint32_t addr;
+    int err;
+
+    put("ttl.example", answer(0x0a000010, 1), 0);
+    sim_now += 60 * 1000 - 1;
+    check(get("ttl.example", &addr, NULL, NULL), "expired before ttl");
+    sim_now += 1;
+    check(!get("ttl.example", NULL, NULL, NULL), "not expired at ttl");
+
+    /* record ttls are kept when shorter, capped when longer */
+    put("short.example", answer(0x0a000011, 1), 5000);
+    put("long.example", answer(0x0a000012, 1), 3600 * 1000);
+    sim_now += 5000;
+    check(!get("short.example", NULL, NULL, NULL), "record ttl ignored");
+    check(get("long.example", NULL, NULL, NULL), "long record ttl lost");
+    sim_now += 55 * 1000;
+    check(!get("long.example", NULL, NULL, NULL), "record ttl not capped");
+
+    /* names that do not exist are remembered for the negative ttl */
+    memset(&r, 0, sizeof(r));
+    r.err = EAI_NONAME;
+    put("nx.example", r, 0);
+    check(get("nx.example", &addr, &err, NULL) && err == EAI_NONAME &&
+          !addr, "negative entry not cached");
+    sim_now += 10 * 1000;
+    check(!get("nx.example", NULL, NULL, NULL), "negative entry kept");
+
+    /* failures that may not repeat are not cached at all */
+    memset(&r, 0, sizeof(r));
+    r.err = EAI_AGAIN;
+    put("again.example", r, 0);
+    check(!get("again.example", NULL, NULL, NULL), "EAI_AGAIN cached");
+    r.err = EAI_FAIL;
+    put("fail.example", r, 0);
+    check(!get("fail.example", NULL, NULL, NULL), "EAI_FAIL cached");
+}
+
+static void
+test_lru(void)
+{
+    char name[64];
+    int i;
+
+    dns_cache_config(16, 60, 10);
+    for (i = 0; i < 16; i++) {
+        snprintf(name, sizeof(name), "lru%d.example", i);
+        put(name, answer(0x0a010000 + i, 1), 0);
+    }
+    /* lru0 is the oldest, but in use */
+    check(get("lru0.example", NULL, NULL, NULL), "lru0 missing");
+    put("lru16.example", answer(0x0a010010, 1), 0);
+    check(get("lru0.example", NULL, NULL, NULL), "recently used evicted");
+    check(!get("lru1.example", NULL, NULL, NULL), "least recently used kept");
+    for (i = 2; i <= 16; i++) {
+        snprintf(name, sizeof(name), "lru%d.example", i);
+        check(get(name, NULL, NULL, NULL), "%s evicted", name);
+    }
+
+    /* size 0 disables the cache */
+    dns_cache_config(0, 60, 10);
+    put("off.example", answer(0x0a020000, 1), 0);
+    check(!get("off.example", NULL, NULL, NULL), "disabled cache hit");
+    dns_cache_config(1024, 60, 10);
+}
+
+static void
+test_prefetch(void)
+{
+    bool prefetch;
+    int i, n;
+
+    put("pf.example", answer(0x0a030000, 1), 0);
+    check(get("pf.example", NULL, NULL, &prefetch) && !prefetch,
+          "prefetch too early");
+    check(get("pf.example", NULL, NULL, &prefetch) && !prefetch,
+          "prefetch with most of the ttl left");
+
+    /* in the last quarter */
+    sim_now += 46 * 1000;
+    check(get("pf.example", NULL, NULL, &prefetch) && prefetch,
+          "no prefetch near expiry");
+    /* one refresh at a time */
+    for (i = n = 0; i < 10; i++) {
+        get("pf.example", NULL, NULL, &prefetch);
+        n += prefetch;
+    }
+    check(!n, "prefetch repeated %d times", n);
+    /* and retried if it did not land */
+    sim_now += 5001;
+    check(get("pf.example", NULL, NULL, &prefetch) && prefetch,
+          "prefetch not retried");
+
+    /* landing the refresh restarts the ttl */
+    put("pf.example", answer(0x0a030001, 1), 0);
+    sim_now += 50 * 1000;
+    check(get("pf.example", NULL, NULL, NULL), "refreshed entry expired");
+
+    /* names asked for once are left to expire */
+    put("once.example", answer(0x0a030002, 1), 0);
+    sim_now += 50 * 1000;
+    check(get("once.example", NULL, NULL, &prefetch) && !prefetch,
+          "prefetch of a name asked for once");
+
+    /* nor are negative entries refreshed */
+    {
+        struct dns_response r;
+
+        memset(&r, 0, sizeof(r));
+        r.err = EAI_NONAME;
+        put("nxpf.example", r, 0);
+        sim_now += 9 * 1000;
+        for (i = n = 0; i < 3; i++) {
+            get("nxpf.example", NULL, NULL, &prefetch);
+            n += prefetch;
+        }
+        check(!n, "negative entry prefetched");
+    }
+}
+
+static void
+test_flush(void)
+{
+    struct dns_response r, miss;
+    uint32_t gen;
+
+    put("flush.example", answer(0x0a040000, 1), 0);
+    dns_cache_flush();
+    check(!get("flush.example", NULL, NULL, NULL), "hit after flush");
+
+    /* resolved before the flush, inserted after */
+    memset(&miss, 0, sizeof(miss));
+    dns_cache_lookup("race.example", &miss, &gen, NULL);
+    resp_free(&miss);
+    dns_cache_flush();
+    r = answer(0x0a040001, 1);
+    dns_cache_insert("race.example", &r, gen, 0);
+    resp_free(&r);
+    check(!get("race.example", NULL, NULL, NULL),
+          "answer from before the flush cached");
+}
+
+#define STRESS_THREADS 4
+#define STRESS_NAMES   512
+
+static int stress_stop;
+
+static void *
+stress_run(void *opaque)
+{
+    uintptr_t id = (uintptr_t)opaque;
+    char name[64];
+    uint32_t addr, x = id * 2654435761U + 1;
+    bool prefetch;
+    int n;
+
+    while (!__atomic_load_n(&stress_stop, __ATOMIC_RELAXED)) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        n = x % STRESS_NAMES;
+        snprintf(name, sizeof(name), "stress%d.example", n);
+        if (!get(name, &addr, NULL, &prefetch) || prefetch)
+            put(name, answer(0x0b000000 + n, 1 + n % 4), 0);
+        else
+            check(addr == 0x0b000000 + n, "%s wrong answer", name);
+        if (id == 0 && !(x % 10007))
+            dns_cache_flush();
+    }
+
+    return NULL;
+}
+
+static void
+test_threads(void)
+{
+    pthread_t t[STRESS_THREADS];
+    uintptr_t i;
+
+    real_clock = true;
+    dns_cache_config(STRESS_NAMES / 2, 1, 1);
+    for (i = 0; i < STRESS_THREADS; i++)
+        if (pthread_create(&t[i], NULL, stress_run, (void *)i))
+            errx(1, "pthread_create");
+    usleep(1500 * 1000);
+    __atomic_store_n(&stress_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < STRESS_THREADS; i++)
+        pthread_join(t[i], NULL);
+    real_clock = false;
+    dns_cache_config(1024, 60, 10);
+}
+
+static void
+bench(void)
+{
+    char name[64];
+    double t;
+    int i, n = 1000000;
+
+    for (i = 0; i < 1024; i++) {
+        snprintf(name, sizeof(name), "bench%d.example.com", i);
+        put(name, answer(0x0c000000 + i, 2), 0);
+    }
+    t = rtc();
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "bench%d.example.com", i & 1023);
+        get(name, NULL, NULL, NULL);
+    }
+    t = rtc() - t;
+    printf("hit %.0f ns\n", t * 1e9 / n);
+}
+
+/* the cache is shared by the nickel instances, kept until the last one
+ * exits */
+static void
+test_instances(void)
+{
+    uint32_t addr;
+
+    dns_cache_init(NULL);
+    put("shared.example.com", answer(0x0a000005, 1), 0);
+    dns_cache_exit(NULL);
+    check(get("shared.example.com", &addr, NULL, NULL) && addr == 0x0a000005,
+          "cache gone with another instance still up");
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n]\n"
+            "  -n  skip the timing run\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int c, nobench = 0;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "n")) != -1) {
+        switch (c) {
+        case 'n':
+            nobench = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    dns_cache_init(NULL);
+    dns_cache_config(1024, 60, 10);
+
+    test_basic();
+    test_ttl();
+    test_lru();
+    test_prefetch();
+    test_flush();
+    test_instances();
+    test_threads();
+    dns_cache_info(NULL);
+    check_done();
+    printf("ok\n");
+
+    if (!nobench)
+        bench();
+
+    dns_cache_exit(NULL);
+    return 0;
+}
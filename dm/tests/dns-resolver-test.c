@@ -0,0 +1,972 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * dns-resolver-test: runs dm/nickel/dns/dns-resolver.c, on dm/timer.c
+ * and a poll(2) stand-in for the nickel socket layer, against two stand-in
+ * DNS servers on 127.0.0.1 and 127.0.0.2 -- A and AAAA, cnames, missing
+ * names, lost and failed questions, truncation and tcp, answers out of
+ * order, forged and malformed answers, source ports, a server that is
+ * not there.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "timer.h"
+#include <nickel.h>
+#include <socket.h>
+#include <log.h>
+#include "dns.h"
+#include "dns-resolver.h"
+
+#define TEST_NETLOG
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+#define TEST_TIMEOUT_MS     100
+#define TEST_ATTEMPTS       2
+#define PIPE_N              16
+#ifndef MANY_N
+#define MANY_N              100
+#endif
+
+static inline uint16_t rd16(const uint8_t *p)
+{
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline void wr16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+/* save_timer() and load_timer() aren't exercised */
+void
+qemu_put_be64(QEMUFile *f, uint64_t v)
+{
+}
+
+uint64_t
+qemu_get_be64(QEMUFile *f)
+{
+
+    return 0;
+}
+
+/* rt timers, made as nickel.c makes them */
+Timer *
+ni_new_rt_timer(struct nickel *ni, int64_t delay_ms, void (*cb)(void *opaque),
+                void *opaque)
+{
+    Timer *t;
+
+    t = new_timer_ms(rt_clock, cb, opaque);
+    if (!t)
+        return NULL;
+    mod_timer(t, get_clock_ms(rt_clock) + delay_ms);
+
+    return t;
+}
+
+static bool
+timers_pending(void)
+{
+    int timeout = INT_MAX;
+
+    timer_deadline(NULL, rt_clock, &timeout);
+    return timeout != INT_MAX;
+}
+
+/* sockets, as the nickel ones: connect deferred to the loop, reads and
+ * writes return 0 when they would block, errors surface as CLOSING */
+
+#define SS_CLOSED       0
+#define SS_CONNECT      1
+#define SS_CONNECTING   2
+#define SS_CONNECTED    3
+#define SS_NEEDS_CLOSE  4
+#define SS_CLOSING      5
+
+struct socket {
+    LIST_ENTRY(socket) entry;
+    int fd;
+    bool udp;
+    int state;
+    bool del;
+    bool want_write;
+    uint32_t evt;
+    int err;
+    short revents;
+    so_event_t cb;
+    void *opaque;
+    struct net_addr addr;
+    uint16_t port;
+};
+
+static LIST_HEAD(, socket) sockets = LIST_HEAD_INITIALIZER(sockets);
+static int n_sockets;
+
+struct socket *
+so_create(struct nickel *ni, bool udp, so_event_t cb, void *opaque)
+{
+    struct socket *so;
+
+    so = calloc(1, sizeof(*so));
+    if (!so)
+        return NULL;
+    so->fd = -1;
+    so->udp = udp;
+    so->cb = cb;
+    so->opaque = opaque;
+    LIST_INSERT_HEAD(&sockets, so, entry);
+    n_sockets++;
+
+    return so;
+}
+
+int
+so_close(struct socket *so)
+{
+    so->del = true;
+    so->cb = NULL;
+    return 0;
+}
+
+int
+so_connect(struct socket *so, const struct net_addr *addr, uint16_t port)
+{
+    so->addr = *addr;
+    so->port = port;
+    so->state = SS_CONNECT;
+    return 0;
+}
+
+size_t
+so_read(struct socket *so, const uint8_t *buf, size_t len)
+{
+    ssize_t ret;
+
+    if (so->state != SS_CONNECTED)
+        return 0;
+    ret = recv(so->fd, (void *) buf, len, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (ret < 0 || (ret == 0 && !so->udp)) {
+        so->err = ret < 0 ? errno : 0;
+        so->state = SS_NEEDS_CLOSE;
+        return 0;
+    }
+
+    return ret;
+}
+
+size_t
+so_write(struct socket *so, const uint8_t *buf, size_t len)
+{
+    ssize_t ret;
+
+    if (so->del || so->state != SS_CONNECTED)
+        return 0;
+    ret = send(so->fd, buf, len, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        so->want_write = true;
+        return 0;
+    }
+    if (ret < 0) {
+        so->err = errno;
+        so->state = SS_NEEDS_CLOSE;
+        return 0;
+    }
+
+    return ret;
+}
+
+static void
+so_start(struct socket *so)
+{
+    struct sockaddr_storage ss;
+    socklen_t sl;
+
+    memset(&ss, 0, sizeof(ss));
+    if (so->addr.family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+
+        sin->sin_family = AF_INET;
+        sin->sin_addr = so->addr.ipv4;
+        sin->sin_port = so->port;
+        sl = sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &ss;
+
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = so->addr.ipv6;
+        sin6->sin6_port = so->port;
+        sl = sizeof(*sin6);
+    }
+
+    so->fd = socket(so->addr.family, so->udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (so->fd < 0)
+        goto err;
+    fcntl(so->fd, F_SETFL, fcntl(so->fd, F_GETFL) | O_NONBLOCK);
+    if (connect(so->fd, (struct sockaddr *) &ss, sl) == 0) {
+        so->state = SS_CONNECTED;
+        so->evt |= SO_EVT_CONNECTED;
+        return;
+    }
+    if (errno == EINPROGRESS) {
+        so->state = SS_CONNECTING;
+        return;
+    }
+
+err:
+    so->err = errno;
+    so->state = SS_NEEDS_CLOSE;
+}
+
+static void
+loop_once(int64_t max_ms)
+{
+    struct pollfd pfds[1024];
+    struct socket *so, *so_next;
+    int64_t now, next;
+    int n = 0, i, err, timeout = max_ms;
+    socklen_t el;
+
+    LIST_FOREACH_SAFE(so, &sockets, entry, so_next) {
+        if (so->del) {
+            if (so->fd >= 0)
+                close(so->fd);
+            LIST_REMOVE(so, entry);
+            n_sockets--;
+            free(so);
+            continue;
+        }
+        if (so->state == SS_CONNECT)
+            so_start(so);
+    }
+
+    now = get_clock_ms(rt_clock);
+    timer_deadline(NULL, rt_clock, &timeout);
+    next = now + timeout;
+    LIST_FOREACH(so, &sockets, entry) {
+        so->revents = 0;
+        if (so->evt || so->state == SS_NEEDS_CLOSE)
+            next = now;
+        if (so->fd < 0 || (so->state != SS_CONNECTING &&
+                           so->state != SS_CONNECTED))
+            continue;
+        assert(n < 1024);
+        pfds[n].fd = so->fd;
+        pfds[n].events = POLLIN;
+        if (so->state == SS_CONNECTING || so->want_write)
+            pfds[n].events |= POLLOUT;
+        n++;
+    }
+
+    poll(pfds, n, next > now ? (int) (next - now) : 0);
+
+    i = 0;
+    LIST_FOREACH(so, &sockets, entry) {
+        if (so->fd < 0 || (so->state != SS_CONNECTING &&
+                           so->state != SS_CONNECTED))
+            continue;
+        so->revents = pfds[i++].revents;
+    }
+
+    LIST_FOREACH(so, &sockets, entry) {
+        uint32_t evt;
+
+        if (so->del)
+            continue;
+        if (so->state == SS_CONNECTING && so->revents) {
+            err = 0;
+            el = sizeof(err);
+            getsockopt(so->fd, SOL_SOCKET, SO_ERROR, &err, &el);
+            if (err) {
+                so->err = err;
+                so->state = SS_NEEDS_CLOSE;
+            } else {
+                so->state = SS_CONNECTED;
+                so->evt |= SO_EVT_CONNECTED | SO_EVT_WRITE;
+            }
+            so->revents = 0;
+        }
+        if (so->state == SS_CONNECTED) {
+            if (so->revents & POLLOUT) {
+                so->want_write = false;
+                so->evt |= SO_EVT_WRITE;
+            }
+            if (so->revents & (POLLIN | POLLERR | POLLHUP))
+                so->evt |= SO_EVT_READ;
+        }
+        if (so->state == SS_NEEDS_CLOSE) {
+            so->state = SS_CLOSING;
+            so->evt |= SO_EVT_CLOSING;
+        }
+
+        evt = so->evt;
+        so->evt = 0;
+        if (evt && so->cb)
+            so->cb(so->opaque, evt, so->err);
+    }
+
+    run_timers(NULL, rt_clock);
+}
+
+/* the stand-in servers */
+
+struct held {
+    uint8_t msg[512];
+    size_t len;
+    struct sockaddr_in from;
+};
+
+struct server {
+    int idx;
+    int udp, tcp;
+    pthread_t thread;
+    struct held held[PIPE_N];
+    int n_held;
+    uint16_t last_port;
+    int port_changes;
+};
+
+static struct server servers[2];
+static uint16_t server_port;
+static int servers_stop;
+static int drops;
+static int server_queries[2];
+
+struct reply {
+    uint8_t buf[1024];
+    size_t len;
+};
+
+static void
+reply_start(struct reply *rp, const uint8_t *q, size_t qend, uint16_t id,
+            uint16_t flags, uint16_t ancount)
+{
+    memcpy(rp->buf, q, qend);
+    wr16(rp->buf, id);
+    wr16(rp->buf + 2, flags);
+    wr16(rp->buf + 4, 1);
+    wr16(rp->buf + 6, ancount);
+    wr16(rp->buf + 8, 0);
+    wr16(rp->buf + 10, 0);
+    rp->len = qend;
+}
+
+/* returns where rdata went */
+static size_t
+reply_rr(struct reply *rp, const void *owner, size_t owner_len, uint16_t type,
+         uint32_t ttl, const void *rdata, uint16_t rdlen)
+{
+    uint8_t *p = rp->buf + rp->len;
+
+    memcpy(p, owner, owner_len);
+    p += owner_len;
+    wr16(p, type);
+    wr16(p + 2, 1);
+    wr16(p + 4, ttl >> 16);
+    wr16(p + 6, ttl & 0xffff);
+    wr16(p + 8, rdlen);
+    memcpy(p + 10, rdata, rdlen);
+    rp->len += owner_len + 10 + rdlen;
+
+    return rp->len - rdlen;
+}
+
+static const uint8_t qname_ptr[] = { 0xc0, 0x0c };
+
+static void
+reply_addr(struct reply *rp, uint16_t type, const char *str, uint32_t ttl)
+{
+    uint8_t a[16];
+
+    inet_pton(type == 1 ? AF_INET : AF_INET6, str, a);
+    reply_rr(rp, qname_ptr, sizeof(qname_ptr), type, ttl, a,
+             type == 1 ? 4 : 16);
+}
+
+/* 0 to send rp, -1 to drop the question, 1 to hold on to it */
+static int
+server_answer(struct server *srv, const uint8_t *q, size_t len, bool tcp,
+              struct reply *rp)
+{
+    char name[256];
+    size_t off = 12, n = 0;
+    uint16_t id, type;
+    uint8_t l;
+
+    if (len < 12)
+        return -1;
+    id = rd16(q);
+    while (off < len && (l = q[off])) {
+        if (off + 1 + l > len || n + l + 1 >= sizeof(name))
+            return -1;
+        if (n)
+            name[n++] = '.';
+        memcpy(name + n, q + off + 1, l);
+        n += l;
+        off += 1 + l;
+    }
+    name[n] = 0;
+    off++;
+    if (off + 4 > len)
+        return -1;
+    type = rd16(q + off);
+    off += 4;
+
+    __atomic_add_fetch(&server_queries[srv->idx], 1, __ATOMIC_RELAXED);
+
+    if (!strcasecmp(name, "a.test")) {
+        if (type == 1) {
+            reply_start(rp, q, off, id, 0x8180, 2);
+            reply_addr(rp, 1, "192.0.2.1", 300);
+            reply_addr(rp, 1, "192.0.2.2", 300);
+        } else {
+            reply_start(rp, q, off, id, 0x8180, 1);
+            reply_addr(rp, 28, "2001:db8::1", 300);
+        }
+    } else if (!strcmp(name, "cname.test")) {
+        static const uint8_t alias[] = "\005alias\004test";
+        uint8_t ptr[2], a[4];
+        size_t at;
+
+        if (type != 1) {
+            reply_start(rp, q, off, id, 0x8180, 0);
+            return 0;
+        }
+        reply_start(rp, q, off, id, 0x8180, 2);
+        at = reply_rr(rp, qname_ptr, sizeof(qname_ptr), 5, 60, alias,
+                      sizeof(alias));
+        ptr[0] = 0xc0 | (at >> 8);
+        ptr[1] = at & 0xff;
+        inet_pton(AF_INET, "192.0.2.10", a);
+        reply_rr(rp, ptr, sizeof(ptr), 1, 120, a, sizeof(a));
+    } else if (!strcmp(name, "nx.test")) {
+        reply_start(rp, q, off, id, 0x8183, 0);
+    } else if (!strcmp(name, "nodata.test")) {
+        reply_start(rp, q, off, id, 0x8180, 0);
+    } else if (!strcmp(name, "drop.test")) {
+        if (__atomic_add_fetch(&drops, 1, __ATOMIC_RELAXED) == 1)
+            return -1;
+        reply_start(rp, q, off, id, 0x8180, 1);
+        reply_addr(rp, 1, "192.0.2.20", 300);
+    } else if (!strcmp(name, "servfail.test")) {
+        if (srv->idx == 0) {
+            reply_start(rp, q, off, id, 0x8182, 0);
+        } else {
+            reply_start(rp, q, off, id, 0x8180, 1);
+            reply_addr(rp, 1, "192.0.2.30", 300);
+        }
+    } else if (!strcmp(name, "tc.test")) {
+        if (!tcp) {
+            reply_start(rp, q, off, id, 0x8380, 0);
+        } else {
+            reply_start(rp, q, off, id, 0x8180, 1);
+            reply_addr(rp, 1, "192.0.2.40", 300);
+        }
+    } else if (!strcmp(name, "loop.test")) {
+        uint8_t ptr[2];
+
+        /* an owner name pointing at itself */
+        reply_start(rp, q, off, id, 0x8180, 1);
+        ptr[0] = 0xc0 | (rp->len >> 8);
+        ptr[1] = rp->len & 0xff;
+        reply_rr(rp, ptr, sizeof(ptr), 1, 300, "\300\000\002\001", 4);
+    } else if (!strncmp(name, "pipe", 4)) {
+        char a[32];
+
+        if (srv->n_held < PIPE_N)
+            return 1;
+        snprintf(a, sizeof(a), "10.1.0.%d", atoi(name + 4));
+        reply_start(rp, q, off, id, 0x8180, 1);
+        reply_addr(rp, 1, a, 300);
+    } else if (!strcmp(name, "spoof.test")) {
+        reply_start(rp, q, off, id, 0x8180, 1);
+        reply_addr(rp, 1, "192.0.2.50", 300);
+    } else {
+        reply_start(rp, q, off, id, 0x8183, 0);
+    }
+
+    return 0;
+}
+
+static void
+server_udp(struct server *srv)
+{
+    struct sockaddr_in from;
+    socklen_t fl = sizeof(from);
+    struct reply rp, bad;
+    uint8_t q[512];
+    ssize_t len;
+    int i;
+
+    len = recvfrom(srv->udp, q, sizeof(q), 0, (struct sockaddr *) &from, &fl);
+    if (len <= 0)
+        return;
+    if (srv->last_port && from.sin_port != srv->last_port)
+        __atomic_add_fetch(&srv->port_changes, 1, __ATOMIC_RELAXED);
+    srv->last_port = from.sin_port;
+
+    switch (server_answer(srv, q, len, false, &rp)) {
+    case -1:
+        return;
+    case 1:
+        memcpy(srv->held[srv->n_held].msg, q, len);
+        srv->held[srv->n_held].len = len;
+        srv->held[srv->n_held].from = from;
+        if (++srv->n_held < PIPE_N)
+            return;
+        /* all in, answered last to first */
+        for (i = PIPE_N - 1; i >= 0; i--) {
+            struct held *h = &srv->held[i];
+
+            if (server_answer(srv, h->msg, h->len, false, &rp) == 0)
+                sendto(srv->udp, rp.buf, rp.len, 0,
+                       (struct sockaddr *) &h->from, sizeof(h->from));
+        }
+        srv->n_held = 0;
+        return;
+    }
+
+    if (len > 20 && !memcmp(q + 13, "spoof", 5)) {
+        /* a wrong id, then the right id for another name, and then only
+         * the answer */
+        bad = rp;
+        wr16(bad.buf, rd16(rp.buf) ^ 0x5a5a);
+        bad.buf[bad.len - 1] = 66;
+        sendto(srv->udp, bad.buf, bad.len, 0, (struct sockaddr *) &from, fl);
+        bad = rp;
+        bad.buf[13] = 'x';
+        bad.buf[bad.len - 1] = 66;
+        sendto(srv->udp, bad.buf, bad.len, 0, (struct sockaddr *) &from, fl);
+    }
+    sendto(srv->udp, rp.buf, rp.len, 0, (struct sockaddr *) &from, fl);
+}
+
+static void
+server_tcp(struct server *srv)
+{
+    struct reply rp;
+    uint8_t hdr[2], q[512];
+    size_t len;
+    int fd;
+
+    fd = accept(srv->tcp, NULL, NULL);
+    if (fd < 0)
+        return;
+    if (recv(fd, hdr, 2, MSG_WAITALL) != 2)
+        goto out;
+    len = rd16(hdr);
+    if (len > sizeof(q) || recv(fd, q, len, MSG_WAITALL) != (ssize_t) len)
+        goto out;
+    if (server_answer(srv, q, len, true, &rp))
+        goto out;
+    wr16(hdr, rp.len);
+    if (send(fd, hdr, 2, 0) == 2)
+        send(fd, rp.buf, rp.len, 0);
+out:
+    close(fd);
+}
+
+static void *
+server_run(void *opaque)
+{
+    struct server *srv = opaque;
+    struct pollfd pfds[2];
+
+    pfds[0].fd = srv->udp;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = srv->tcp;
+    pfds[1].events = POLLIN;
+
+    while (!__atomic_load_n(&servers_stop, __ATOMIC_RELAXED)) {
+        if (poll(pfds, 2, 20) <= 0)
+            continue;
+        if (pfds[0].revents)
+            server_udp(srv);
+        if (pfds[1].revents)
+            server_tcp(srv);
+    }
+
+    return NULL;
+}
+
+static int
+server_bind(int type, const char *ip, uint16_t port)
+{
+    struct sockaddr_in sin;
+    socklen_t sl = sizeof(sin);
+    int fd, one = 1;
+
+    fd = socket(AF_INET, type, 0);
+    if (fd < 0)
+        err(1, "socket");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = port;
+    inet_pton(AF_INET, ip, &sin.sin_addr);
+    if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (type == SOCK_STREAM && listen(fd, 16) < 0)
+        err(1, "listen");
+    if (!port) {
+        getsockname(fd, (struct sockaddr *) &sin, &sl);
+        server_port = sin.sin_port;
+    }
+
+    return fd;
+}
+
+static void
+servers_start(void)
+{
+    static const char *ips[] = { "127.0.0.1", "127.0.0.2" };
+    int tries, i;
+
+    for (tries = 0; tries < 16; tries++) {
+        server_port = 0;
+        servers[0].udp = server_bind(SOCK_DGRAM, ips[0], 0);
+        if (servers[0].udp < 0)
+            err(1, "bind");
+        servers[0].tcp = server_bind(SOCK_STREAM, ips[0], server_port);
+        servers[1].udp = server_bind(SOCK_DGRAM, ips[1], server_port);
+        servers[1].tcp = server_bind(SOCK_STREAM, ips[1], server_port);
+        if (servers[0].tcp >= 0 && servers[1].udp >= 0 && servers[1].tcp >= 0)
+            break;
+        for (i = 0; i < 2; i++) {
+            if (servers[i].udp >= 0)
+                close(servers[i].udp);
+            if (servers[i].tcp >= 0)
+                close(servers[i].tcp);
+        }
+    }
+    if (tries == 16)
+        errx(1, "no port for the servers");
+
+    for (i = 0; i < 2; i++) {
+        servers[i].idx = i;
+        if (pthread_create(&servers[i].thread, NULL, server_run, &servers[i]))
+            errx(1, "pthread_create");
+    }
+}
+
+static void
+servers_stop_all(void)
+{
+    int i;
+
+    __atomic_store_n(&servers_stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < 2; i++) {
+        pthread_join(servers[i].thread, NULL);
+        close(servers[i].udp);
+        close(servers[i].tcp);
+    }
+}
+
+/* the tests */
+
+static int n_results;
+
+struct result {
+    bool done;
+    int err;
+    struct net_addr a[16];
+    int n_a;
+    char canon[256];
+    int64_t ttl_ms;
+};
+
+static void
+result_cb(void *opaque, struct dns_response *resp, int64_t ttl_ms)
+{
+    struct result *res = opaque;
+    int i;
+
+    res->done = true;
+    n_results++;
+    res->err = resp->err;
+    res->ttl_ms = ttl_ms;
+    for (i = 0; resp->a && resp->a[i].family && i < 16; i++)
+        res->a[res->n_a++] = resp->a[i];
+    if (resp->canon_name)
+        snprintf(res->canon, sizeof(res->canon), "%s", resp->canon_name);
+    free(resp->a);
+    free(resp->canon_name);
+}
+
+static bool
+has_addr(const struct result *res, int i, const char *str)
+{
+    struct net_addr a;
+
+    memset(&a, 0, sizeof(a));
+    if (inet_pton(AF_INET, str, &a.ipv4) == 1)
+        a.family = AF_INET;
+    else if (inet_pton(AF_INET6, str, &a.ipv6) == 1)
+        a.family = AF_INET6;
+    if (i >= res->n_a || res->a[i].family != a.family)
+        return false;
+    if (a.family == AF_INET)
+        return res->a[i].ipv4.s_addr == a.ipv4.s_addr;
+    return !memcmp(&res->a[i].ipv6, &a.ipv6, sizeof(a.ipv6));
+}
+
+static void
+run_until(bool *done, int64_t max_ms)
+{
+    int64_t end = get_clock_ms(rt_clock) + max_ms;
+
+    while (!*done && get_clock_ms(rt_clock) < end)
+        loop_once(end - get_clock_ms(rt_clock));
+}
+
+static void
+run_until_results(int n, int64_t max_ms)
+{
+    int64_t end = get_clock_ms(rt_clock) + max_ms;
+
+    while (n_results < n && get_clock_ms(rt_clock) < end)
+        loop_once(end - get_clock_ms(rt_clock));
+}
+
+static void
+lookup(struct dns_resolver *r, const char *name, bool ipv6,
+       struct result *res)
+{
+    int ret;
+
+    memset(res, 0, sizeof(*res));
+    ret = dns_resolver_lookup(r, name, ipv6, result_cb, res);
+    check(ret == 0, "%s: lookup not started", name);
+    if (ret)
+        return;
+    run_until(&res->done, 5000);
+    check(res->done, "%s: no answer", name);
+}
+
+static struct dns_resolver *
+resolver_new(const char **ips, int n)
+{
+    struct dns_resolver_config config;
+    struct dns_resolver *r;
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    for (i = 0; i < n; i++) {
+        config.servers[i].family = AF_INET;
+        inet_pton(AF_INET, ips[i], &config.servers[i].ipv4);
+    }
+    config.n_servers = n;
+    config.port = server_port;
+    config.timeout_ms = TEST_TIMEOUT_MS;
+    config.attempts = TEST_ATTEMPTS;
+
+    r = dns_resolver_new(NULL, &config);
+    if (!r)
+        errx(1, "dns_resolver_new");
+    return r;
+}
+
+static void
+test_answers(struct dns_resolver *r)
+{
+    struct result res;
+    int i, n;
+
+    lookup(r, "a.test", true, &res);
+    check(!res.err, "a.test err %d", res.err);
+    check(res.n_a == 3, "a.test %d addresses", res.n_a);
+    check(has_addr(&res, 0, "192.0.2.1") && has_addr(&res, 1, "192.0.2.2"),
+          "a.test A");
+    check(has_addr(&res, 2, "2001:db8::1"), "a.test AAAA");
+    check(res.ttl_ms == 300 * 1000, "a.test ttl %"PRId64, res.ttl_ms);
+    check(!res.canon[0], "a.test canon %s", res.canon);
+
+    lookup(r, "A.Test.", false, &res);
+    check(!res.err && res.n_a == 2, "A.Test. err %d n %d", res.err, res.n_a);
+
+    lookup(r, "cname.test", true, &res);
+    check(!res.err && res.n_a == 1 && has_addr(&res, 0, "192.0.2.10"),
+          "cname.test err %d n %d", res.err, res.n_a);
+    check(!strcmp(res.canon, "alias.test"), "cname.test canon %s", res.canon);
+    check(res.ttl_ms == 60 * 1000, "cname.test ttl %"PRId64, res.ttl_ms);
+
+    /* every question from a port of its own */
+    __atomic_store_n(&servers[0].port_changes, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < 8; i++)
+        lookup(r, "a.test", false, &res);
+    n = __atomic_load_n(&servers[0].port_changes, __ATOMIC_RELAXED);
+    check(n >= 4, "source port changed %d times in 8 questions", n);
+
+    lookup(r, "nx.test", true, &res);
+    check(res.err == EAI_NONAME && !res.n_a, "nx.test err %d", res.err);
+
+    lookup(r, "nodata.test", true, &res);
+    check(res.err == EAI_NONAME && !res.n_a, "nodata.test err %d", res.err);
+
+    check(dns_resolver_lookup(r, "no..name", false, result_cb, &res) < 0,
+          "empty label asked");
+    check(dns_resolver_lookup(r, "x123456789012345678901234567890123456789012345"
+                              "678901234567890123.test", false, result_cb,
+                              &res) < 0, "long label asked");
+}
+
+static void
+test_failures(struct dns_resolver *r)
+{
+    struct result res;
+    int64_t t;
+
+    t = get_clock_ms(rt_clock);
+    lookup(r, "drop.test", false, &res);
+    t = get_clock_ms(rt_clock) - t;
+    check(!res.err && has_addr(&res, 0, "192.0.2.20"), "drop.test err %d",
+          res.err);
+    check(t >= TEST_TIMEOUT_MS, "drop.test retried after %"PRId64" ms", t);
+
+    __atomic_store_n(&server_queries[1], 0, __ATOMIC_RELAXED);
+    t = get_clock_ms(rt_clock);
+    lookup(r, "servfail.test", false, &res);
+    t = get_clock_ms(rt_clock) - t;
+    check(!res.err && has_addr(&res, 0, "192.0.2.30"), "servfail.test err %d",
+          res.err);
+    check(__atomic_load_n(&server_queries[1], __ATOMIC_RELAXED) == 1,
+          "servfail.test %d on the second server",
+          server_queries[1]);
+    check(t < TEST_TIMEOUT_MS, "servfail.test waited %"PRId64" ms", t);
+
+    lookup(r, "tc.test", false, &res);
+    check(!res.err && has_addr(&res, 0, "192.0.2.40"), "tc.test err %d",
+          res.err);
+
+    lookup(r, "spoof.test", false, &res);
+    check(!res.err && res.n_a == 1 && has_addr(&res, 0, "192.0.2.50"),
+          "spoof.test err %d n %d", res.err, res.n_a);
+
+    lookup(r, "loop.test", false, &res);
+    check(res.err == EAI_AGAIN, "loop.test err %d", res.err);
+}
+
+static void
+test_pipeline(struct dns_resolver *r)
+{
+    struct result res[PIPE_N];
+    char name[32], a[32];
+    int i;
+
+    n_results = 0;
+    for (i = 0; i < PIPE_N; i++) {
+        memset(&res[i], 0, sizeof(res[i]));
+        snprintf(name, sizeof(name), "pipe%d.test", i + 1);
+        check(!dns_resolver_lookup(r, name, false, result_cb, &res[i]),
+              "%s not started", name);
+    }
+    run_until_results(PIPE_N, 5000);
+    for (i = 0; i < PIPE_N; i++) {
+        snprintf(a, sizeof(a), "10.1.0.%d", i + 1);
+        check(!res[i].err && res[i].n_a == 1 && has_addr(&res[i], 0, a),
+              "pipe%d err %d", i + 1, res[i].err);
+    }
+}
+
+static void
+test_many(struct dns_resolver *r)
+{
+    static struct result res[MANY_N];
+    int64_t t;
+    int i, n;
+
+    n_results = 0;
+    t = get_clock_ms(rt_clock);
+    for (i = 0; i < MANY_N; i++) {
+        memset(&res[i], 0, sizeof(res[i]));
+        dns_resolver_lookup(r, "a.test", true, result_cb, &res[i]);
+    }
+    run_until_results(MANY_N, 5000);
+    t = get_clock_ms(rt_clock) - t;
+    for (i = n = 0; i < MANY_N; i++)
+        n += !res[i].err && res[i].n_a == 3;
+    check(n == MANY_N, "%d of %d concurrent lookups", n, MANY_N);
+    printf("%d concurrent lookups in %"PRId64" ms\n", MANY_N, t);
+}
+
+static void
+test_dead_server(void)
+{
+    static const char *ips[] = { "127.0.0.3", "127.0.0.1" };
+    struct dns_resolver *r;
+    struct result res;
+
+    /* nothing listens on the first, the second answers */
+    r = resolver_new(ips, 2);
+    lookup(r, "a.test", false, &res);
+    check(!res.err && res.n_a == 2, "dead server err %d n %d", res.err,
+          res.n_a);
+    dns_resolver_free(r);
+}
+
+static void
+test_free_in_flight(void)
+{
+    static const char *ips[] = { "127.0.0.1" };
+    struct dns_resolver *r;
+    struct result res;
+    bool never = false;
+
+    memset(&res, 0, sizeof(res));
+    r = resolver_new(ips, 1);
+    check(!dns_resolver_lookup(r, "loop.test", true, result_cb, &res),
+          "loop.test not started");
+    run_until(&never, 20);
+    dns_resolver_free(r);
+    run_until(&never, 20);
+    check(!res.done, "callback after free");
+    check(!n_sockets, "%d sockets left", n_sockets);
+    check(!timers_pending(), "timers left");
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *ips[] = { "127.0.0.1", "127.0.0.2" };
+    struct dns_resolver *r;
+    bool never = false;
+
+    setprogname(argv[0]);
+    timers_init(NULL);
+    servers_start();
+
+    r = resolver_new(ips, 2);
+    test_answers(r);
+    test_failures(r);
+    test_pipeline(r);
+    test_many(r);
+    dns_resolver_free(r);
+
+    test_dead_server();
+    test_free_in_flight();
+
+    run_until(&never, 10);
+    servers_stop_all();
+
+    check_done();
+
+    return 0;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * filebuf-test: write a file through dm/filebuf.c, synchronously and
+ * with the async writer, in random sized chunks with seeks back to
+ * patch earlier data, then read it back with seeks inside and outside
+ * the read buffer, checking everything against an in-memory copy.  A
+ * seek that writes the buffer out to a full device has to fail.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filebuf.h"
+
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+#define BUFFER_MAX 4096
+
+static void
+fill(uint8_t *p, size_t len)
+{
+
+    while (len--)
+        *p++ = rnd();
+}
+
+static void
+test_write(const char *fn, const char *mode, uint8_t *ref, size_t size)
+{
+    struct filebuf *fb;
+    uint8_t chunk[3 * BUFFER_MAX];
+    size_t end = 0;
+
+    fb = filebuf_open(fn, mode);
+    if (!fb)
+        err(1, "filebuf_open %s", fn);
+    filebuf_buffer_max(fb, BUFFER_MAX);
+
+    while (end < size) {
+        size_t len = 1 + rnd() % sizeof(chunk);
+
+        if (len > size - end)
+            len = size - end;
+        fill(chunk, len);
+        check(filebuf_write(fb, chunk, len) == len, "%s: write", mode);
+        memcpy(ref + end, chunk, len);
+        end += len;
+
+        /* patch earlier data, then continue at the end */
+        if (!(rnd() % 8)) {
+            size_t o = rnd() % end;
+
+            len = 1 + rnd() % 64;
+            if (len > end - o)
+                len = end - o;
+            fill(chunk, len);
+            check(filebuf_seek(fb, o, FILEBUF_SEEK_SET) == o,
+                  "%s: seek to %zx", mode, o);
+            check(filebuf_write(fb, chunk, len) == len, "%s: write", mode);
+            memcpy(ref + o, chunk, len);
+            check(filebuf_seek(fb, end, FILEBUF_SEEK_SET) == end,
+                  "%s: seek to end %zx", mode, end);
+        }
+
+        /* seeking to where we are is free */
+        if (!(rnd() % 8))
+            check(filebuf_seek(fb, 0, FILEBUF_SEEK_CUR) == end,
+                  "%s: seek cur at %zx", mode, end);
+    }
+
+    check(filebuf_flush(fb) == 0, "%s: flush", mode);
+    check(filebuf_seek(fb, 0, FILEBUF_SEEK_END) == size,
+          "%s: seek end", mode);
+    filebuf_close(fb);
+}
+
+static void
+test_read(const char *fn, const char *mode, const uint8_t *ref, size_t size)
+{
+    struct filebuf *fb;
+    uint8_t buf[2 * BUFFER_MAX];
+    int i;
+
+    fb = filebuf_open(fn, "rb");
+    if (!fb)
+        err(1, "filebuf_open %s", fn);
+    filebuf_buffer_max(fb, BUFFER_MAX);
+
+    check(filebuf_seek(fb, 0, FILEBUF_SEEK_END) == size, "%s: size", mode);
+
+    for (i = 0; i < 1000; i++) {
+        off_t pos = filebuf_tell(fb), o;
+        size_t len = 1 + rnd() % sizeof(buf), exp;
+
+        switch (rnd() % 3) {
+        case 0:                 /* anywhere */
+            o = rnd() % size;
+            check(filebuf_seek(fb, o, FILEBUF_SEEK_SET) == o,
+                  "%s: seek to %"PRIx64, mode, (uint64_t)o);
+            break;
+        case 1:                 /* back, likely within the buffer */
+            o = rnd() % 256;
+            if (o > pos)
+                o = pos;
+            check(filebuf_seek(fb, -o, FILEBUF_SEEK_CUR) == pos - o,
+                  "%s: seek back %"PRIx64, mode, (uint64_t)o);
+            o = pos - o;
+            break;
+        default:                /* on */
+            o = pos;
+            break;
+        }
+
+        exp = o < size ? size - o : 0;
+        if (exp > len)
+            exp = len;
+        check(filebuf_read(fb, buf, len) == exp,
+              "%s: read %zx at %"PRIx64, mode, len, (uint64_t)o);
+        check(!memcmp(buf, ref + o, exp),
+              "%s: data at %"PRIx64" differs", mode, (uint64_t)o);
+        check(filebuf_tell(fb) == o + exp, "%s: tell after read at %"PRIx64,
+              mode, (uint64_t)o);
+    }
+
+    filebuf_close(fb);
+}
+
+/* the async writer's failure is reported by every later submit */
+static void
+test_seek_error(const char *mode)
+{
+    struct filebuf *fb;
+    uint8_t chunk[64];
+
+    fb = filebuf_open("/dev/full", mode);
+    if (!fb)
+        err(1, "filebuf_open /dev/full");
+    filebuf_buffer_max(fb, BUFFER_MAX);
+
+    fill(chunk, sizeof(chunk));
+    check(filebuf_write(fb, chunk, sizeof(chunk)) == sizeof(chunk),
+          "%s: write", mode);
+    check(filebuf_flush(fb) < 0, "%s: flush to a full device", mode);
+    check(filebuf_write(fb, chunk, sizeof(chunk)) == sizeof(chunk),
+          "%s: write", mode);
+    check(filebuf_seek(fb, 0, FILEBUF_SEEK_SET) == -1,
+          "%s: seek writing to a full device", mode);
+    filebuf_close(fb);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s size]\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *modes[] = { "wb", "wba" };
+    char fn[] = "/tmp/filebuf-test.XXXXXX";
+    size_t size = 1 << 20;
+    uint8_t *ref;
+    int c, i, fd;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "s:")) != -1) {
+        switch (c) {
+        case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!size)
+        usage(argv[0]);
+
+    fd = mkstemp(fn);
+    if (fd < 0)
+        err(1, "mkstemp");
+    close(fd);
+
+    ref = malloc(size);
+    if (!ref)
+        err(1, "malloc");
+
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        test_write(fn, modes[i], ref, size);
+        test_read(fn, modes[i], ref, size);
+        test_seek_error(modes[i]);
+        printf("%-4s %s\n", modes[i], failures ? "FAILED" : "ok");
+    }
+
+    unlink(fn);
+    free(ref);
+
+    check_done();
+
+    return 0;
+}
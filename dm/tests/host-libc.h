@@ -0,0 +1,19 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _TESTS_HOST_LIBC_H_
+#define _TESTS_HOST_LIBC_H_
+
+/*
+ * Included ahead of every source the tests build: glibc's <string.h>
+ * declares int ffs(int), which clashes with the one bitops.h defines, so
+ * it is renamed away as osx.h does for the osx libc.
+ */
+
+#define ffs libc_ffs
+#include <string.h>
+#undef ffs
+
+#endif  /* _TESTS_HOST_LIBC_H_ */
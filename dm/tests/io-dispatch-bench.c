@@ -0,0 +1,447 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * io-dispatch-bench: time port and MMIO dispatch through dm/ioport.c and
+ * dm/iomem.c against the rbtree lookups they replace, on a PC-like set of
+ * devices with a skewed access pattern, and check both dispatch every
+ * access to the same device.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dm.h"
+#include "iomem.h"
+#include "ioport.h"
+#include "mr.h"
+#include "rbtree.h"
+#include "xen.h"
+
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+/* dispatch only, nothing is mapped in a hypervisor */
+uint64_t whpx_enable = 0;
+
+void
+xen_map_iorange(uint64_t addr, uint64_t size, int is_mmio,
+                unsigned int serverid)
+{
+}
+
+void
+xen_unmap_iorange(uint64_t addr, uint64_t size, int is_mmio,
+                  unsigned int serverid)
+{
+}
+
+uint64_t
+memory_region_absolute_offset(MemoryRegion *mr)
+{
+
+    return 0;
+}
+
+static uint64_t
+mix(uint64_t x)
+{
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+#define NO_DEVICE 0xffffffff
+
+/* the device handling the last access, what both dispatchers must agree
+ * on */
+static uint32_t hit;
+
+struct device {
+    uint32_t id;
+};
+
+static uint32_t
+dev_ioport_read(void *opaque, uint32_t address)
+{
+
+    hit = ((struct device *)opaque)->id;
+    return address;
+}
+
+static void
+dev_ioport_write(void *opaque, uint32_t address, uint32_t data)
+{
+
+    hit = ((struct device *)opaque)->id;
+}
+
+static uint32_t
+dev_mmio_read(void *opaque, uint64_t addr)
+{
+
+    hit = ((struct device *)opaque)->id;
+    return addr;
+}
+
+static void
+dev_mmio_write(void *opaque, uint64_t addr, uint32_t value)
+{
+
+    hit = ((struct device *)opaque)->id;
+}
+
+static IOMemReadFunc *mmio_read_fns[3] = {
+    dev_mmio_read, dev_mmio_read, dev_mmio_read
+};
+static IOMemWriteFunc *mmio_write_fns[3] = {
+    dev_mmio_write, dev_mmio_write, dev_mmio_write
+};
+
+/* the rbtree lookups ioport.c and iomem.c used for every access */
+struct ref_port {
+    uint32_t port;
+    uint32_t id;
+    uint32_t widths;
+    struct rb_node rbnode;
+};
+
+static int
+ref_port_compare_key(void *ctx, const void *b, const void *key)
+{
+    const struct ref_port * const pnp = b;
+    const uint32_t * const fhp = key;
+
+    return pnp->port - *fhp;
+}
+
+static int
+ref_port_compare_nodes(void *ctx, const void *parent, const void *node)
+{
+    const struct ref_port * const np = node;
+
+    return ref_port_compare_key(ctx, parent, &np->port);
+}
+
+static rb_tree_t ref_port_rbtree;
+static const rb_tree_ops_t ref_port_rbtree_ops = {
+    .rbto_compare_nodes = ref_port_compare_nodes,
+    .rbto_compare_key = ref_port_compare_key,
+    .rbto_node_offset = offsetof(struct ref_port, rbnode),
+    .rbto_context = NULL
+};
+
+struct ref_mmio_key {
+    uint64_t addr;
+    uint64_t size;
+};
+
+struct ref_mmio {
+    struct ref_mmio_key key;
+    uint32_t id;
+    struct rb_node rbnode;
+};
+
+static int
+ref_mmio_compare_key(void *ctx, const void *b, const void *key)
+{
+    const struct ref_mmio * const pnp = b;
+    const struct ref_mmio_key * const fhp = key;
+
+    if ((pnp->key.addr >= fhp->addr &&
+         pnp->key.addr + pnp->key.size < fhp->addr + fhp->size) ||
+        (fhp->addr >= pnp->key.addr &&
+         fhp->addr + fhp->size < pnp->key.addr + pnp->key.size))
+        return 0;
+    return pnp->key.addr < fhp->addr ? -1 : 1;
+}
+
+static int
+ref_mmio_compare_nodes(void *ctx, const void *parent, const void *node)
+{
+    const struct ref_mmio * const np = node;
+
+    return ref_mmio_compare_key(ctx, parent, &np->key);
+}
+
+static rb_tree_t ref_mmio_rbtree;
+static const rb_tree_ops_t ref_mmio_rbtree_ops = {
+    .rbto_compare_nodes = ref_mmio_compare_nodes,
+    .rbto_compare_key = ref_mmio_compare_key,
+    .rbto_node_offset = offsetof(struct ref_mmio, rbnode),
+    .rbto_context = NULL
+};
+
+static uint32_t
+ref_port_lookup(uint32_t port, int width)
+{
+    struct ref_port *p = rb_tree_find_node(&ref_port_rbtree, &port);
+
+    return p && (p->widths & (1 << width)) ? p->id : NO_DEVICE;
+}
+
+static uint32_t
+ref_mmio_lookup(uint64_t addr, uint32_t width)
+{
+    struct ref_mmio_key key = { addr, width };
+    struct ref_mmio *m = rb_tree_find_node(&ref_mmio_rbtree, &key);
+
+    return m ? m->id : NO_DEVICE;
+}
+
+/* a PC's worth of ports, size is the access width they are registered
+ * at */
+static const struct {
+    uint32_t start, len, size;
+} port_ranges[] = {
+    { 0x20, 2, 1 }, { 0x40, 4, 1 }, { 0x60, 1, 1 }, { 0x64, 1, 1 },
+    { 0x70, 2, 1 }, { 0x80, 1, 1 }, { 0xa0, 2, 1 }, { 0x170, 8, 1 },
+    { 0x1f0, 8, 1 }, { 0x1f0, 8, 2 }, { 0x1f0, 8, 4 }, { 0x376, 1, 1 },
+    { 0x3c0, 32, 1 }, { 0x3c0, 32, 2 }, { 0x3f6, 1, 1 }, { 0x3f8, 8, 1 },
+    { 0x4d0, 2, 1 }, { 0xcf8, 4, 4 }, { 0xcfc, 4, 1 }, { 0xcfc, 4, 2 },
+    { 0xcfc, 4, 4 }, { 0xb000, 64, 1 }, { 0xb000, 64, 2 },
+    { 0xb000, 64, 4 }, { 0xc000, 256, 1 }, { 0xc000, 256, 4 },
+};
+#define NR_PORT_RANGES (sizeof(port_ranges) / sizeof(port_ranges[0]))
+
+#define NR_MMIO 48
+
+static struct device port_devs[NR_PORT_RANGES];
+static struct device mmio_devs[NR_MMIO];
+static uint64_t mmio_base[NR_MMIO], mmio_size[NR_MMIO];
+
+static void
+setup(void)
+{
+    struct ref_port *p;
+    struct ref_mmio *m;
+    uint32_t port, id;
+    int i, index;
+
+    ioport_init();
+    mmio_init();
+    rb_tree_init(&ref_port_rbtree, &ref_port_rbtree_ops);
+    rb_tree_init(&ref_mmio_rbtree, &ref_mmio_rbtree_ops);
+
+    for (i = 0; i < NR_PORT_RANGES; i++) {
+        /* ranges registered at several widths are one device */
+        id = i;
+        while (id && port_ranges[id - 1].start == port_ranges[i].start)
+            id--;
+        port_devs[i].id = id;
+        register_ioport_read(port_ranges[i].start, port_ranges[i].len,
+                             port_ranges[i].size, dev_ioport_read,
+                             &port_devs[id]);
+        register_ioport_write(port_ranges[i].start, port_ranges[i].len,
+                              port_ranges[i].size, dev_ioport_write,
+                              &port_devs[id]);
+        for (port = port_ranges[i].start;
+             port < port_ranges[i].start + port_ranges[i].len;
+             port += port_ranges[i].size) {
+            p = rb_tree_find_node(&ref_port_rbtree, &port);
+            if (!p) {
+                p = calloc(1, sizeof(*p));
+                if (!p)
+                    err(1, "calloc");
+                p->port = port;
+                p->id = id;
+                rb_tree_insert_node(&ref_port_rbtree, p);
+            }
+            p->widths |= 1 << ioport_width(port_ranges[i].size, NULL, 0);
+        }
+    }
+
+    /* legacy vga, then BARs of various sizes below and above 4G */
+    for (i = 0; i < NR_MMIO; i++) {
+        if (!i) {
+            mmio_base[i] = 0xa0000;
+            mmio_size[i] = 0x20000;
+        } else {
+            mmio_size[i] = 0x1000ULL << (mix(i) % 12);
+            mmio_base[i] = (i < NR_MMIO * 3 / 4 ? 0xe0000000ULL :
+                            0x800000000ULL) + (uint64_t)i * 0x01000000;
+        }
+        mmio_devs[i].id = i;
+        index = register_iomem(0, mmio_read_fns, mmio_write_fns,
+                               &mmio_devs[i]);
+        register_mmio(mmio_base[i], mmio_size[i], index);
+
+        m = calloc(1, sizeof(*m));
+        if (!m)
+            err(1, "calloc");
+        m->key.addr = mmio_base[i];
+        m->key.size = mmio_size[i];
+        m->id = i;
+        rb_tree_insert_node(&ref_mmio_rbtree, m);
+    }
+}
+
+/* skewed towards a few hot devices, like a guest hammering its disk,
+ * interrupt controller and one BAR, with some unclaimed accesses */
+static uint32_t
+gen_port(uint64_t r)
+{
+    int i;
+
+    if (r % 16 == 0)
+        return (r >> 8) & 0xffff;
+    i = (r >> 4) % 4 ? (r >> 8) % 4 : (r >> 8) % NR_PORT_RANGES;
+    i = (i * 7) % NR_PORT_RANGES;
+    return port_ranges[i].start +
+        ((r >> 16) % port_ranges[i].len & ~(port_ranges[i].size - 1));
+}
+
+static uint64_t
+gen_mmio(uint64_t r)
+{
+    int i;
+
+    if (r % 16 == 0)
+        return (r >> 8) & 0xfffffffffULL;
+    /* hot devices are mostly hit on a few registers */
+    if ((r >> 4) % 4) {
+        i = (r >> 8) % 3 + 5;
+        return mmio_base[i] + ((r >> 16) % 64) * 4;
+    }
+    i = (r >> 8) % NR_MMIO;
+    return mmio_base[i] + ((r >> 16) % mmio_size[i] & ~3ULL);
+}
+
+static void
+check_dispatch(uint64_t seed, int n)
+{
+    uint64_t r = seed, addr;
+    uint32_t port, val, width, ref;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        r = mix(r + i);
+        width = (r >> 40) % 3;
+
+        port = gen_port(r);
+        ref = ref_port_lookup(port, 0);
+        hit = NO_DEVICE;
+        ioport_read(0, port);
+        check(hit == ref, "port %x dispatched to %x, expected %x", port, hit,
+              ref);
+
+        addr = gen_mmio(r);
+        ref = ref_mmio_lookup(addr, width);
+        hit = NO_DEVICE;
+        check(!mmio_read(addr, width, &val) || hit == NO_DEVICE,
+              "mmio %"PRIx64" failed but dispatched", addr);
+        check(hit == ref, "mmio %"PRIx64"/%d dispatched to %x, expected %x",
+              addr, width, hit, ref);
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n accesses] [-r runs] [-s seed]\n"
+            "  -n  accesses per run (default 10000000)\n"
+            "  -r  timed runs (default 5)\n"
+            "  -s  random seed\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    uint64_t seed = 1, *mmio_addrs;
+    uint32_t *ports, sum, val;
+    double t, best[4] = { 0 };
+    int n = 10000000, runs = 5, c, i, r;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "n:r:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (n < 1 || runs < 1)
+        usage(argv[0]);
+
+    setup();
+    check_dispatch(seed, 1000000);
+    check_done();
+    printf("dispatch check ok\n");
+
+    ports = calloc(n, sizeof(*ports));
+    mmio_addrs = calloc(n, sizeof(*mmio_addrs));
+    if (!ports || !mmio_addrs)
+        err(1, "calloc");
+    for (i = 0; i < n; i++) {
+        ports[i] = gen_port(mix(seed + i));
+        mmio_addrs[i] = gen_mmio(mix(seed + i));
+    }
+
+    printf("%d ports, %d mmio regions, %d accesses\n",
+           (int)NR_PORT_RANGES, NR_MMIO, n);
+
+    sum = 0;
+    for (r = 0; r < runs; r++) {
+        t = rtc();
+        for (i = 0; i < n; i++)
+            sum += ref_port_lookup(ports[i], 0);
+        t = rtc() - t;
+        if (!r || t < best[0])
+            best[0] = t;
+
+        t = rtc();
+        for (i = 0; i < n; i++)
+            sum += ioport_read(0, ports[i]);
+        t = rtc() - t;
+        if (!r || t < best[1])
+            best[1] = t;
+
+        t = rtc();
+        for (i = 0; i < n; i++)
+            sum += ref_mmio_lookup(mmio_addrs[i], 2);
+        t = rtc() - t;
+        if (!r || t < best[2])
+            best[2] = t;
+
+        t = rtc();
+        for (i = 0; i < n; i++)
+            if (!mmio_read(mmio_addrs[i], 2, &val))
+                sum += val;
+        t = rtc() - t;
+        if (!r || t < best[3])
+            best[3] = t;
+    }
+
+    printf("%-6s rbtree lookup %6.1f ns  dispatch %6.1f ns\n", "pio",
+           best[0] * 1e9 / n, best[1] * 1e9 / n);
+    printf("%-6s rbtree lookup %6.1f ns  dispatch %6.1f ns\n", "mmio",
+           best[2] * 1e9 / n, best[3] * 1e9 / n);
+    if (!sum)
+        printf("\n");
+
+    free(ports);
+    free(mmio_addrs);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * ioh-bench: time one ioh_wait_for_objects() round -- wait, dispatch
+ * and callback -- with a growing number of idle pipes and events
+ * registered next to the one that is ready, and check that exactly the
+ * ready object's callback runs.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "ioh.h"
+
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+struct object {
+    int idx;
+    int fd[2];                  /* pipe, if not an event */
+    ioh_event event;
+};
+
+static struct object *objects;
+static int fired, nr_fired;
+
+static void
+fd_ready(void *opaque, int revents)
+{
+    struct object *o = opaque;
+    char c;
+
+    check(revents & POLLIN, "fd %d: revents %x", o->idx, revents);
+    if (read(o->fd[0], &c, 1) != 1)
+        err(1, "read");
+    fired = o->idx;
+    nr_fired++;
+}
+
+static void
+event_ready(void *opaque)
+{
+    struct object *o = opaque;
+
+    fired = o->idx;
+    nr_fired++;
+}
+
+/* odd objects are events, even ones pipes */
+static double
+bench(int n, int rounds)
+{
+    WaitObjects w;
+    double t;
+    int i, r;
+
+    ioh_init_wait_objects(&w);
+
+    for (i = 0; i < n; i++) {
+        struct object *o = &objects[i];
+
+        o->idx = i;
+        if (i & 1) {
+            ioh_event_init(&o->event);
+            ioh_add_wait_object(&o->event, event_ready, o, &w);
+        } else {
+            if (pipe(o->fd))
+                err(1, "pipe");
+            ioh_add_wait_fd(o->fd[0], POLLIN, fd_ready, o, &w);
+        }
+    }
+
+    t = rtc();
+    for (r = 0; r < rounds; r++) {
+        int timeout = 1000;
+
+        i = rnd() % n;
+        if (i & 1)
+            ioh_event_set(&objects[i].event);
+        else if (write(objects[i].fd[1], "x", 1) != 1)
+            err(1, "write");
+
+        fired = -1;
+        nr_fired = 0;
+        ioh_wait_for_objects(NULL, &w, NULL, &timeout, NULL);
+        check(fired == i && nr_fired == 1,
+              "n %d: object %d ready, %d callbacks, last %d", n, i,
+              nr_fired, fired);
+    }
+    t = rtc() - t;
+
+    for (i = 0; i < n; i++) {
+        struct object *o = &objects[i];
+
+        if (i & 1) {
+            ioh_del_wait_object(&o->event, &w);
+            ioh_event_close(&o->event);
+        } else {
+            ioh_del_wait_fd(o->fd[0], &w);
+            close(o->fd[0]);
+            close(o->fd[1]);
+        }
+    }
+    ioh_cleanup_wait_objects(&w);
+
+    return t;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n max objects] [-r rounds]\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct rlimit rl;
+    int c, n, max_n = 4096, rounds = 100000;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+        switch (c) {
+        case 'n':
+            max_n = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (max_n < 1 || rounds < 1)
+        usage(argv[0]);
+
+    /* a pipe takes two fds, an event one, plus the epoll set and its
+     * interrupt eventfd */
+    if (getrlimit(RLIMIT_NOFILE, &rl))
+        err(1, "getrlimit");
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if ((rlim_t)max_n * 3 / 2 + 16 > rl.rlim_cur) {
+        max_n = (rl.rlim_cur - 16) * 2 / 3;
+        warnx("fd limit %"PRIu64", using at most %d objects",
+              (uint64_t)rl.rlim_cur, max_n);
+    }
+
+    objects = calloc(max_n, sizeof(objects[0]));
+    if (!objects)
+        err(1, "calloc");
+
+    printf("%8s %12s\n", "objects", "ns/round");
+    for (n = 2; n <= max_n; n *= 4) {
+        double t = bench(n, rounds);
+
+        printf("%8d %12.0f\n", n, t * 1e9 / rounds);
+    }
+
+    free(objects);
+
+    check_done();
+
+    return 0;
+}
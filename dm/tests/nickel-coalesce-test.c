@@ -0,0 +1,358 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * nickel-coalesce-test: runs the tcp-coalesce paths of dm/nickel/tcpip.c
+ * against a fake guest that connects through tcpip_input, checks the
+ * checksums and sequence numbers of every frame nickel sends and
+ * reassembles the stream.  A tail held back by a write goes out with the
+ * next tcpip_prepare, or ahead of the FIN, counts against the guest
+ * window in tcpip_can_output, and is dropped with the socket on a reset.
+ * Then a bulk download of host reads of random sizes, with and without
+ * tcp-coalesce, reports the frames each needed.
+ *
+ * nickel-test.c stands in for the rest of nickel; uxen_net is not linked,
+ * the frames stop at ni_buff_output.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nickel-test.h"
+
+#define TEST_NETLOG
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+#define GUEST_ISS       1000
+#define GUEST_WIN       65535
+
+static uint8_t *stream;
+static size_t stream_len, mss = 1460, max_read = 16384;
+static int max_reads = 4;
+
+/* the fake guest, one connection at a time */
+static struct {
+    uint16_t port;
+    uint32_t nxt;           /* next sequence number expected from nickel */
+    size_t rcvd;            /* stream bytes received */
+    uint64_t frames;        /* frames carrying data */
+    uint64_t short_frames;  /* of which less than an mss */
+    int synacks;
+    int fins;
+    int rsts;
+} guest;
+
+void
+guest_receive(const struct tcp *tcp, const uint8_t *data, size_t len)
+{
+    uint32_t seq;
+
+    if (NI_NTOHS(tcp->th_dport) != guest.port)
+        return;
+
+    seq = NI_NTOHL(tcp->th_seq);
+    if ((tcp->th_flags & TH_RST)) {
+        guest.rsts++;
+        return;
+    }
+    if ((tcp->th_flags & TH_SYN)) {
+        guest.synacks++;
+        guest.nxt = seq + 1;
+        return;
+    }
+
+    if (len) {
+        check(seq == guest.nxt, "data at seq %u, expected %u", seq, guest.nxt);
+        check(len <= mss, "%zu bytes over mss", len);
+        check(guest.rcvd + len <= stream_len &&
+              !memcmp(data, stream + guest.rcvd, len),
+              "data at %zu differs", guest.rcvd);
+        guest.nxt += len;
+        guest.rcvd += len;
+        guest.frames++;
+        if (len < mss)
+            guest.short_frames++;
+    }
+    if ((tcp->th_flags & TH_FIN)) {
+        check(seq + len == guest.nxt, "fin at seq %u, expected %u", seq,
+              guest.nxt);
+        guest.nxt++;
+        guest.fins++;
+    }
+}
+
+static void
+guest_ack(int flags)
+{
+
+    guest_send(guest.port, GUEST_ISS + 1, guest.nxt, flags, GUEST_WIN, 0,
+               NULL, 0);
+}
+
+static struct ni_socket *
+guest_connect(const char *name)
+{
+    static uint16_t port = 49152;
+
+    memset(&guest, 0, sizeof(guest));
+    guest.port = port++;
+    conn_so = NULL;
+
+    guest_send(guest.port, GUEST_ISS, 0, TH_SYN, GUEST_WIN, mss, NULL, 0);
+    if (!conn_so)
+        errx(1, "%s: nickel did not connect", name);
+    tcpip_event(conn_so, CHR_EVENT_OPENED);
+    check(guest.synacks == 1, "%s: %d syn-acks", name, guest.synacks);
+    guest_ack(TH_ACK);
+
+    return conn_so;
+}
+
+/* the char layer closes its side on the reset, and the socket is freed */
+static void
+guest_reset(const char *name, struct ni_socket *so)
+{
+
+    last_event = 0;
+    guest_ack(TH_RST | TH_ACK);
+    check(last_event == CHR_EVENT_NI_RST, "%s: event %x on reset", name,
+          last_event);
+    tcpip_close(so);
+    nickel_gc();
+}
+
+/* ------------------------------------------------------------------ */
+
+static void
+test_prepare(void)
+{
+    struct ni_socket *so;
+    int timeout = 1000;
+
+    so = guest_connect("prepare");
+    tcpip_output(so, stream, mss + 100);
+    check(guest.rcvd == mss, "prepare: %zu bytes sent before the prepare",
+          guest.rcvd);
+    check(LIST_FIRST(&nickel.tcp_corked) == so, "prepare: tail not corked");
+    tcpip_output(so, stream + mss + 100, 100);
+    check(guest.rcvd == mss, "prepare: %zu bytes sent for a short write",
+          guest.rcvd);
+    tcpip_prepare(&nickel, &timeout);
+    check(guest.rcvd == mss + 200 && guest.frames == 2,
+          "prepare: %zu bytes in %"PRIu64" frames after the prepare",
+          guest.rcvd, guest.frames);
+    check(LIST_EMPTY(&nickel.tcp_corked), "prepare: still corked");
+    guest_reset("prepare", so);
+}
+
+/* a held tail counts against the guest window like data in flight */
+static void
+test_can_output(void)
+{
+    struct ni_socket *so;
+    size_t win;
+    int timeout = 1000;
+
+    so = guest_connect("can_output");
+    win = tcpip_can_output(so);
+    check(win == GUEST_WIN, "can_output: %zu on an idle connection", win);
+    tcpip_output(so, stream, mss + 100);
+    win = tcpip_can_output(so);
+    check(win == GUEST_WIN - mss - 100, "can_output: %zu with a tail held, "
+          "expected %zu", win, GUEST_WIN - mss - 100);
+    tcpip_prepare(&nickel, &timeout);
+    win = tcpip_can_output(so);
+    check(win == GUEST_WIN - mss - 100, "can_output: %zu after the prepare, "
+          "expected %zu", win, GUEST_WIN - mss - 100);
+    guest_ack(TH_ACK);
+    win = tcpip_can_output(so);
+    check(win == GUEST_WIN, "can_output: %zu once acked", win);
+
+    /* a window filled by data held back is full */
+    tcpip_output(so, stream + mss + 100, GUEST_WIN);
+    win = tcpip_can_output(so);
+    check(!win, "can_output: %zu with the window taken", win);
+    guest_reset("can_output", so);
+}
+
+/* the tail goes out ahead of the fin */
+static void
+test_fin(void)
+{
+    struct ni_socket *so;
+
+    so = guest_connect("fin");
+    tcpip_output(so, stream, 100);
+    check(!guest.rcvd, "fin: %zu bytes sent for a short write", guest.rcvd);
+    check(!tcpip_send_fin(so), "fin: tcpip_send_fin failed");
+    check(guest.rcvd == 100, "fin: %zu bytes sent before the fin",
+          guest.rcvd);
+    check(LIST_EMPTY(&nickel.tcp_corked), "fin: still corked");
+    /* with data in flight, the fin waits for the ack */
+    guest_ack(TH_ACK);
+    check(guest.fins == 1, "fin: %d fins", guest.fins);
+    guest_reset("fin", so);
+}
+
+/* the tail is dropped with the socket, which is off the cork list before
+ * it is freed */
+static void
+test_reset(void)
+{
+    struct ni_socket *so;
+    int timeout = 1000;
+
+    so = guest_connect("reset");
+    tcpip_output(so, stream, 100);
+    check(LIST_FIRST(&nickel.tcp_corked) == so, "reset: tail not corked");
+    guest_ack(TH_RST | TH_ACK);
+    check(LIST_EMPTY(&nickel.tcp_corked), "reset: still corked");
+    check(guest.rsts == 1, "reset: %d resets", guest.rsts);
+    tcpip_close(so);
+    nickel_gc();
+    tcpip_prepare(&nickel, &timeout);
+    check(!guest.rcvd, "reset: %zu bytes sent after the reset", guest.rcvd);
+}
+
+/* host reads of random sizes, as many as the window takes, a few per
+ * loop iteration, then the prepare and the guest's ack */
+static double
+run(int coalesce, uint64_t seed)
+{
+    struct ni_socket *so;
+    size_t off = 0, len;
+    double t;
+    int n, timeout = 1000;
+
+    nickel.tcp_coalesce = coalesce;
+    rnd_state = seed | 1;
+    so = guest_connect("bulk");
+
+    t = rtc();
+    while (off < stream_len) {
+        for (n = 1 + rnd() % max_reads; n && off < stream_len; n--) {
+            len = 1 + rnd() % max_read;
+            if (len > stream_len - off)
+                len = stream_len - off;
+            if (len > tcpip_can_output(so))
+                len = tcpip_can_output(so);
+            if (!len)
+                break;
+            tcpip_output(so, stream + off, len);
+            off += len;
+        }
+        if (coalesce)
+            check(!guest.short_frames, "bulk: %"PRIu64" short frames before "
+                  "the prepare", guest.short_frames);
+        tcpip_prepare(&nickel, &timeout);
+        if (coalesce) {
+            check(guest.short_frames <= 1, "bulk: %"PRIu64" short frames "
+                  "after the prepare", guest.short_frames);
+            check(guest.rcvd == off, "bulk: %zu of %zu bytes sent after the "
+                  "prepare", guest.rcvd, off);
+            guest.short_frames = 0;
+        }
+        guest_ack(TH_ACK);
+    }
+    t = rtc() - t;
+
+    check(guest.rcvd == stream_len, "bulk: guest received %zu of %zu bytes",
+          guest.rcvd, stream_len);
+    guest_reset("bulk", so);
+
+    return t;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-l MiB] [-m mss] [-r max-read] [-n reads] "
+            "[-s seed]\n"
+            "  -l  data downloaded (default 256)\n"
+            "  -m  mss the guest announces (default 1460)\n"
+            "  -r  largest host socket read (default 16384)\n"
+            "  -n  most reads per loop iteration (default 4)\n"
+            "  -s  random seed\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    uint64_t seed = 1, frames[2];
+    size_t i;
+    double t;
+    int c;
+
+    setprogname(argv[0]);
+
+    stream_len = 256;
+    while ((c = getopt(argc, argv, "l:m:r:n:s:")) != -1) {
+        switch (c) {
+        case 'l':
+            stream_len = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            mss = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            max_read = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            max_reads = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!stream_len || mss < 200 || mss > GUEST_WIN / 2 || !max_read ||
+        max_reads < 1)
+        usage(argv[0]);
+    stream_len <<= 20;
+
+    stream = malloc(stream_len);
+    if (!stream)
+        err(1, "malloc");
+    for (i = 0; i < stream_len; i++)
+        stream[i] = rnd();
+
+    nickel_test_init();
+    nickel.tcp_coalesce = 1;
+
+    test_prepare();
+    test_can_output();
+    test_fin();
+    test_reset();
+
+    printf("%zu MiB, mss %zu, reads up to %zu bytes, up to %d per "
+           "iteration\n", stream_len >> 20, mss, max_read, max_reads);
+    for (i = 0; i < 2; i++) {
+        t = run(i, seed);
+        frames[i] = guest.frames;
+        printf("%-10s %9"PRIu64" frames %6.0f bytes/frame %7.1f ns/frame "
+               "%6.0f MiB/s\n", i ? "coalesce" : "per-write", frames[i],
+               (double)stream_len / frames[i], t * 1e9 / frames[i],
+               stream_len / t / (1 << 20));
+    }
+    check(frames[1] <= frames[0], "coalescing sent %"PRIu64" frames, "
+          "%"PRIu64" without", frames[1], frames[0]);
+
+    tcpip_exit(&nickel);
+    free(stream);
+
+    check_done();
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _TESTS_NICKEL_TEST_H_
+#define _TESTS_NICKEL_TEST_H_
+
+/*
+ * dm/nickel/tcpip.c linked on its own: nickel-test.c stands in for the
+ * rest of nickel, the char layer and lava, and carries frames between
+ * tcpip.c and a fake guest.  The test includes test.h with TEST_NETLOG
+ * for nickel's logging.
+ */
+
+#include <nickel.h>
+#include <proto.h>
+
+#define GUEST_ADDR      0x0f02000a  /* 10.0.2.15, network order */
+#define HOST_ADDR       0x0202000a  /* 10.0.2.2 */
+#define HOST_PORT       80
+
+extern struct nickel nickel;
+
+/* the socket of the last connection nickel made for the guest, and the
+ * last event, other than buffer changes, it sent the char layer */
+extern struct ni_socket *conn_so;
+extern int last_event;
+
+void nickel_test_init(void);
+/* frees the sockets nickel is done with, as its gc bh would */
+void nickel_gc(void);
+
+/* a segment from guest port port to HOST_PORT, with an mss option if
+ * mss is not 0 */
+void guest_send(uint16_t port, uint32_t seq, uint32_t ack, int flags,
+                uint16_t win, uint16_t mss, const uint8_t *data, size_t len);
+
+/* provided by the test: each tcp segment nickel sends the guest, once its
+ * addresses and checksums are checked */
+void guest_receive(const struct tcp *tcp, const uint8_t *data, size_t len);
+
+#endif  /* _TESTS_NICKEL_TEST_H_ */
@@ -0,0 +1,327 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * nickel-timer-bench: the per-socket timers of dm/nickel/tcpip.c on
+ * dm/timer.c, over a simulated clock at one loop iteration per ms.  A few
+ * connections carry data both ways, the guest losing some of what nickel
+ * sends, first on their own, then among many idle connections, and the
+ * cost of a loop iteration -- the traffic, tcpip_prepare and the timers
+ * -- is reported for both.  The delayed ACKs must go out in time, what
+ * the guest lost must be retransmitted, and the idle connections must
+ * see nothing.
+ *
+ * nickel-test.c stands in for the rest of nickel.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "timer.h"
+#include "nickel-test.h"
+
+#define TEST_NETLOG
+#define TEST_SIM_CLOCK
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+/* as in dm/nickel/tcpip.c */
+#define DELAY_ACK_MAX_MS    40
+#define RETRANSMIT_TIMEOUT  600
+
+#define PORT_BASE           10000
+#define MAX_SOCKETS         50000
+#define GUEST_ISS           1000
+#define GUEST_WIN           65535
+#define GUEST_WRITE         100
+#define HOST_WRITE          200
+#define WRITES_HELD         64      /* guest writes awaiting an ack */
+
+static inline int64_t
+now_ms(void)
+{
+
+    return sim_now / SCALE_MS;
+}
+
+/* the guest's side of a connection */
+struct conn {
+    struct ni_socket *so;
+    uint16_t port;
+    uint32_t nxt;           /* next sequence number expected from nickel */
+    uint32_t hi;            /* past the furthest data nickel sent */
+    uint32_t seq;           /* the guest's next sequence number */
+    uint32_t acked;         /* guest data nickel acked */
+    int64_t write_ts[WRITES_HELD];  /* when each guest write went out */
+    uint64_t sent;          /* written by the host */
+    uint64_t rcvd;          /* of that, received by the guest */
+    uint64_t frames;
+    int got;                /* data to ack this iteration */
+};
+
+static struct conn *conns;
+static int nr_conns, nr_sockets, nr_active;
+static uint8_t payload[HOST_WRITE];
+
+static uint64_t lost, retransmits, late_acks;
+static int64_t max_ack_delay;
+
+/* times the guest writes the ack covers */
+static void
+guest_acked(struct conn *c, uint32_t ack)
+{
+    int64_t delay;
+
+    for (; (int32_t)(ack - c->acked) >= GUEST_WRITE;
+         c->acked += GUEST_WRITE) {
+        delay = now_ms() -
+            c->write_ts[(c->acked - GUEST_ISS - 1) / GUEST_WRITE %
+                        WRITES_HELD];
+        if (delay > max_ack_delay)
+            max_ack_delay = delay;
+        if (delay > DELAY_ACK_MAX_MS)
+            late_acks++;
+    }
+}
+
+void
+guest_receive(const struct tcp *tcp, const uint8_t *data, size_t len)
+{
+    struct conn *c;
+    uint32_t seq;
+    int idx;
+
+    idx = NI_NTOHS(tcp->th_dport) - PORT_BASE;
+    if (idx < 0 || idx >= nr_conns)
+        errx(1, "segment to port %u", NI_NTOHS(tcp->th_dport));
+    c = &conns[idx];
+    c->frames++;
+
+    seq = NI_NTOHL(tcp->th_seq);
+    check(!(tcp->th_flags & TH_RST), "port %u: reset", c->port);
+    if ((tcp->th_flags & TH_SYN)) {
+        c->nxt = c->hi = seq + 1;
+        return;
+    }
+    if ((tcp->th_flags & TH_ACK))
+        guest_acked(c, NI_NTOHL(tcp->th_ack));
+    if (!len)
+        return;
+
+    c->got = 1;
+    if ((int32_t)(seq + len - c->hi) <= 0)
+        retransmits++;
+    else
+        c->hi = seq + len;
+    if (seq != c->nxt)
+        return;
+    if (!(rnd() % 64)) {
+        lost++;
+        return;
+    }
+    c->nxt += len;
+    c->rcvd += len;
+}
+
+static void
+connect_conns(int n)
+{
+    struct conn *c;
+
+    while (nr_conns < n) {
+        c = &conns[nr_conns];
+        c->port = PORT_BASE + nr_conns++;
+        c->seq = c->acked = GUEST_ISS + 1;
+        conn_so = NULL;
+        guest_send(c->port, GUEST_ISS, 0, TH_SYN, GUEST_WIN, 0, NULL, 0);
+        if (!conn_so)
+            errx(1, "port %u: nickel did not connect", c->port);
+        c->so = conn_so;
+        tcpip_event(c->so, CHR_EVENT_OPENED);
+        guest_send(c->port, c->seq, c->nxt, TH_ACK, GUEST_WIN, 0, NULL, 0);
+    }
+}
+
+/* one loop iteration: the traffic, then what nickel's loop does */
+static void
+iteration(int traffic)
+{
+    int64_t now = now_ms();
+    struct conn *c;
+    size_t len;
+    int i, timeout;
+
+    for (i = 0; traffic && i < nr_active; i++) {
+        uint64_t r = rnd();
+
+        c = &conns[i];
+        if (!(r % 8)) {
+            if (c->seq - c->acked >= WRITES_HELD * GUEST_WRITE)
+                errx(1, "port %u: %d guest writes unacked", c->port,
+                     WRITES_HELD);
+            c->write_ts[(c->seq - GUEST_ISS - 1) / GUEST_WRITE %
+                        WRITES_HELD] = now;
+            c->seq += GUEST_WRITE;
+            guest_send(c->port, c->seq - GUEST_WRITE, c->nxt,
+                       TH_ACK | TH_PUSH, GUEST_WIN, 0, payload, GUEST_WRITE);
+        }
+        if (!((r >> 8) % 8)) {
+            len = tcpip_can_output(c->so);
+            if (len > HOST_WRITE)
+                len = HOST_WRITE;
+            if (len) {
+                tcpip_output(c->so, payload, len);
+                c->sent += len;
+            }
+        }
+    }
+
+    timeout = 1 << 30;
+    tcpip_prepare(&nickel, &timeout);
+    timer_deadline(NULL, vm_clock, &timeout);
+    run_timers(NULL, vm_clock);
+
+    for (i = 0; i < nr_active; i++) {
+        c = &conns[i];
+        if (c->got) {
+            guest_send(c->port, c->seq, c->nxt, TH_ACK, GUEST_WIN, 0, NULL,
+                       0);
+            c->got = 0;
+        }
+    }
+
+    sim_now += SCALE_MS;
+}
+
+static double
+run(int64_t iterations)
+{
+    int64_t it;
+    double t;
+
+    t = rtc();
+    for (it = 0; it < iterations; it++)
+        iteration(1);
+
+    return rtc() - t;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n sockets] [-a active] [-t seconds] "
+            "[-s seed]\n"
+            "  -n  sockets (default 10000)\n"
+            "  -a  sockets with traffic (default 64)\n"
+            "  -t  simulated seconds at one loop iteration per ms "
+            "(default 10)\n"
+            "  -s  random seed\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int64_t seconds = 10, it;
+    uint64_t seed = 1, *idle_frames;
+    double active_t, all_t;
+    int c, i, done;
+
+    setprogname(argv[0]);
+
+    nr_sockets = 10000;
+    nr_active = 64;
+    while ((c = getopt(argc, argv, "n:a:t:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            nr_sockets = atoi(optarg);
+            break;
+        case 'a':
+            nr_active = atoi(optarg);
+            break;
+        case 't':
+            seconds = strtoll(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nr_sockets < 1 || nr_sockets > MAX_SOCKETS || nr_active < 1 ||
+        nr_active > nr_sockets || seconds < 1)
+        usage(argv[0]);
+
+    conns = calloc(nr_sockets, sizeof(*conns));
+    idle_frames = calloc(nr_sockets, sizeof(*idle_frames));
+    if (!conns || !idle_frames)
+        err(1, "calloc");
+    rnd_state = seed | 1;
+
+    sim_now = 1000 * SCALE_MS;
+    nickel_test_init();
+
+    printf("%d sockets, %d active, %"PRId64" s, %"PRId64" iterations\n",
+           nr_sockets, nr_active, seconds, seconds * 1000);
+
+    connect_conns(nr_active);
+    active_t = run(seconds * 1000);
+
+    connect_conns(nr_sockets);
+    for (i = nr_active; i < nr_sockets; i++)
+        idle_frames[i] = conns[i].frames;
+    all_t = run(seconds * 1000);
+
+    printf("%6d sockets %8.1f ns/iteration\n", nr_active,
+           active_t * 1e9 / (seconds * 1000));
+    printf("%6d sockets %8.1f ns/iteration\n", nr_sockets,
+           all_t * 1e9 / (seconds * 1000));
+
+    /* no more traffic, until both sides have all of it */
+    for (it = 0; it < 10 * RETRANSMIT_TIMEOUT; it++) {
+        for (done = 0; done < nr_active; done++)
+            if (conns[done].rcvd != conns[done].sent ||
+                conns[done].acked != conns[done].seq)
+                break;
+        if (done == nr_active)
+            break;
+        iteration(0);
+    }
+
+    printf("%"PRIu64" segments lost, %"PRIu64" retransmitted, guest "
+           "writes acked within %"PRId64" ms\n", lost, retransmits,
+           max_ack_delay);
+
+    check(!late_acks, "%"PRIu64" guest writes acked after more than %d ms",
+          late_acks, DELAY_ACK_MAX_MS);
+    for (i = 0; i < nr_active; i++) {
+        check(conns[i].rcvd == conns[i].sent, "port %u: guest received "
+              "%"PRIu64" of %"PRIu64" bytes", conns[i].port, conns[i].rcvd,
+              conns[i].sent);
+        check(conns[i].acked == conns[i].seq, "port %u: %u bytes of guest "
+              "data unacked", conns[i].port, conns[i].seq - conns[i].acked);
+    }
+    check(!lost || retransmits, "nothing retransmitted");
+    for (i = nr_active; i < nr_sockets; i++)
+        check(conns[i].frames == idle_frames[i], "port %u: %"PRIu64
+              " frames to an idle connection", conns[i].port,
+              conns[i].frames - idle_frames[i]);
+
+    tcpip_exit(&nickel);
+    free(idle_frames);
+    free(conns);
+
+    check_done();
+
+    return 0;
+}
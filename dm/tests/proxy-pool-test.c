@@ -0,0 +1,253 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * proxy-pool-test: the idle connection pool of dm/nickel/http/proxy.c --
+ * most recently used first, the per-proxy limit and the waiters that lift
+ * it, connections the caller won't take, removal, idle expiry, and the
+ * flush of every pool when the credentials change.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nickel.h>
+#include <log.h>
+#include <http/proxy.h>
+
+#define TEST_NETLOG
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+#define MAX_IDLE        2
+#define IDLE_TIMEOUT    1000
+
+uint64_t hide_log_sensitive_data = 1;
+
+/* the proxy cache isn't exercised */
+void
+buff_strtolower(char *s)
+{
+}
+
+Timer *
+ni_new_rt_timer(struct nickel *ni, int64_t delay_ms, void (*cb)(void *opaque),
+                void *opaque)
+{
+
+    return NULL;
+}
+
+void
+free_timer(Timer *t)
+{
+}
+
+char *
+ni_priv_strdup(const char *s)
+{
+
+    return strdup(s);
+}
+
+void
+ni_priv_free(void *ptr)
+{
+
+    free(ptr);
+}
+
+struct conn {
+    struct proxy_idle pool;
+    int ready;
+    int closed;
+};
+
+#define NR_CONNS 4
+static struct conn conns[NR_CONNS];
+
+static void
+conn_close(struct proxy_idle *pi)
+{
+    struct conn *c = container_of(pi, struct conn, pool);
+
+    check(!LIST_IN_LIST(pi, entry), "conn %d closed while pooled",
+          (int)(c - conns));
+    c->closed++;
+}
+
+static bool
+conn_ready(struct proxy_idle *pi, void *opaque)
+{
+
+    return container_of(pi, struct conn, pool)->ready;
+}
+
+static void
+reset(void)
+{
+    int i;
+
+    memset(conns, 0, sizeof(conns));
+    for (i = 0; i < NR_CONNS; i++) {
+        conns[i].pool.cred_gen = proxy_cred_gen;
+        conns[i].ready = 1;
+    }
+}
+
+static struct conn *
+get(struct proxy_t *proxy)
+{
+    struct proxy_idle *pi;
+
+    pi = proxy_pool_get(proxy, conn_ready, NULL);
+    return pi ? container_of(pi, struct conn, pool) : NULL;
+}
+
+static void
+test_add_get(struct proxy_t *proxy)
+{
+    struct clt_ctx waiter;
+
+    reset();
+    check(!proxy_pool_add(proxy, &conns[0].pool, MAX_IDLE, 0) &&
+          !proxy_pool_add(proxy, &conns[1].pool, MAX_IDLE, 0),
+          "add: adding failed");
+    check(!proxy_pool_add(proxy, &conns[1].pool, MAX_IDLE, 0) &&
+          proxy->nr_idle == 2, "add: adding twice gave %d idle",
+          proxy->nr_idle);
+    check(proxy_pool_add(proxy, &conns[2].pool, MAX_IDLE, 0) < 0,
+          "add: %d idle, over max-idle-conn-per-proxy", proxy->nr_idle);
+
+    /* someone waiting for a connection lifts the limit */
+    RLIST_INSERT_TAIL(&proxy->w_list, &waiter, w_list);
+    check(!proxy_pool_add(proxy, &conns[2].pool, MAX_IDLE, 0),
+          "add: limit held with a request waiting");
+    RLIST_REMOVE(&waiter, w_list);
+
+    check(get(proxy) == &conns[2] && get(proxy) == &conns[1],
+          "get: not the most recently used first");
+    conns[0].ready = 0;
+    check(!get(proxy), "get: took a connection the caller won't use");
+    check(proxy->nr_idle == 1, "get: %d idle after gets", proxy->nr_idle);
+
+    proxy_pool_remove(proxy, &conns[0].pool);
+    proxy_pool_remove(proxy, &conns[0].pool);
+    check(!proxy->nr_idle && LIST_EMPTY(&proxy->idle_list),
+          "remove: %d idle after removing", proxy->nr_idle);
+}
+
+/* a connection authenticated with credentials since replaced is neither
+ * added nor handed out */
+static void
+test_cred_gen(struct proxy_t *proxy)
+{
+
+    reset();
+    conns[0].pool.cred_gen = proxy_cred_gen - 1;
+    check(proxy_pool_add(proxy, &conns[0].pool, MAX_IDLE, 0) < 0,
+          "cred gen: added a stale connection");
+    check(!proxy_pool_add(proxy, &conns[1].pool, MAX_IDLE, 0),
+          "cred gen: adding failed");
+    conns[1].pool.cred_gen--;
+    check(!get(proxy), "cred gen: got a stale connection");
+    proxy_pool_flush(proxy, conn_close);
+    check(conns[1].closed == 1 && !proxy->nr_idle,
+          "cred gen: flush closed %d, %d idle", conns[1].closed,
+          proxy->nr_idle);
+}
+
+static void
+test_expire(struct proxy_t *proxy)
+{
+    int64_t t;
+
+    reset();
+    check(proxy_pool_expire(0, IDLE_TIMEOUT, conn_close) == -1,
+          "expire: %d idle, but a timeout", proxy->nr_idle);
+    proxy_pool_add(proxy, &conns[0].pool, MAX_IDLE, 0);
+    proxy_pool_add(proxy, &conns[1].pool, MAX_IDLE, 100);
+
+    t = proxy_pool_expire(50, IDLE_TIMEOUT, conn_close);
+    check(t == IDLE_TIMEOUT - 50, "expire: next in %"PRId64" ms at 50", t);
+    /* only the timeout, nothing closes without close */
+    t = proxy_pool_expire(IDLE_TIMEOUT + 50, IDLE_TIMEOUT, NULL);
+    check(!t && proxy->nr_idle == 2, "expire: %"PRId64" ms, %d idle "
+          "without close", t, proxy->nr_idle);
+
+    t = proxy_pool_expire(IDLE_TIMEOUT, IDLE_TIMEOUT, conn_close);
+    check(conns[0].closed == 1 && !conns[1].closed && t == 100,
+          "expire: closed %d/%d, next in %"PRId64" ms", conns[0].closed,
+          conns[1].closed, t);
+    t = proxy_pool_expire(IDLE_TIMEOUT + 100, IDLE_TIMEOUT, conn_close);
+    check(conns[1].closed == 1 && t == -1 && !proxy->nr_idle,
+          "expire: closed %d, next in %"PRId64" ms, %d idle",
+          conns[1].closed, t, proxy->nr_idle);
+}
+
+static void
+test_creds_changed(struct proxy_t *proxy, struct proxy_t *proxy2)
+{
+    uint32_t gen = proxy_cred_gen;
+
+    reset();
+    proxy_pool_add(proxy, &conns[0].pool, MAX_IDLE, 0);
+    proxy_pool_add(proxy, &conns[1].pool, MAX_IDLE, 0);
+    proxy_pool_add(proxy2, &conns[2].pool, MAX_IDLE, 0);
+    proxy_creds_changed(conn_close);
+    check(proxy_cred_gen == gen + 1, "creds changed: generation %u, "
+          "expected %u", proxy_cred_gen, gen + 1);
+    check(conns[0].closed == 1 && conns[1].closed == 1 &&
+          conns[2].closed == 1 && !conns[3].closed,
+          "creds changed: closed %d %d %d %d", conns[0].closed,
+          conns[1].closed, conns[2].closed, conns[3].closed);
+    check(!proxy->nr_idle && !proxy2->nr_idle,
+          "creds changed: %d and %d idle", proxy->nr_idle, proxy2->nr_idle);
+    check(proxy_pool_add(proxy, &conns[0].pool, MAX_IDLE, 0) < 0,
+          "creds changed: took back a connection on the old credentials");
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct proxy_t *proxy, *proxy2;
+    int c;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "")) != -1) {
+        switch (c) {
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    proxy = proxy_save("proxy", 8080, 0, NULL);
+    proxy2 = proxy_save("proxy2", 3128, 0, NULL);
+    if (!proxy || !proxy2)
+        errx(1, "proxy_save failed");
+
+    test_add_get(proxy);
+    test_cred_gen(proxy);
+    test_expire(proxy);
+    test_creds_changed(proxy, proxy2);
+
+    check_done();
+    printf("ok\n");
+
+    return 0;
+}
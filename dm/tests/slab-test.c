@@ -0,0 +1,221 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * slab-test: allocate, grow and free objects of every size class through
+ * dm/slab.c from rounds of short lived threads, half of them freed by the
+ * main thread, checking their contents, then check that draining the
+ * heap gives every backing allocation back once the threads are gone.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+#define OBJS_PER_THREAD 256
+
+struct object {
+    uint8_t *p;
+    size_t size;
+    uint8_t fill;
+};
+
+struct worker {
+    int idx;
+    uxen_thread handle;
+    uint64_t rnd_state;
+    struct object objs[OBJS_PER_THREAD];
+};
+
+static struct slab_heap *heap;
+static volatile int64_t backing_outstanding;
+
+static void *
+backing_alloc(void *opaque, size_t size)
+{
+
+    __sync_fetch_and_add(&backing_outstanding, 1);
+    return malloc(size);
+}
+
+static void
+backing_free(void *opaque, void *ptr)
+{
+
+    __sync_fetch_and_sub(&backing_outstanding, 1);
+    free(ptr);
+}
+
+static uint64_t
+worker_rnd(struct worker *w)
+{
+
+    w->rnd_state ^= w->rnd_state << 13;
+    w->rnd_state ^= w->rnd_state >> 7;
+    w->rnd_state ^= w->rnd_state << 17;
+    return w->rnd_state;
+}
+
+static int
+object_ok(const struct object *o)
+{
+    size_t i;
+
+    for (i = 0; i < o->size; i++)
+        if (o->p[i] != o->fill)
+            return 0;
+    return 1;
+}
+
+/* sizes from 1 byte to past the largest class, most of them small */
+static size_t
+object_size(struct worker *w)
+{
+    int shift = 5 + worker_rnd(w) % (worker_rnd(w) % 64 ? 8 : 19);
+
+    return 1 + worker_rnd(w) % (1UL << shift);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI
+worker_run(void *opaque)
+#else
+static void *
+worker_run(void *opaque)
+#endif
+{
+    struct worker *w = opaque;
+    struct object *o;
+    size_t size;
+    int i;
+
+    for (i = 0; i < OBJS_PER_THREAD; i++) {
+        o = &w->objs[i];
+        o->size = object_size(w);
+        o->fill = w->idx + i;
+        o->p = slab_malloc(heap, o->size);
+        check(o->p, "worker %d: malloc %zu failed", w->idx, o->size);
+        if (o->p)
+            memset(o->p, o->fill, o->size);
+    }
+
+    /* grow or shrink some, free the odd ones, leave the even ones for
+     * the main thread */
+    for (i = 0; i < OBJS_PER_THREAD; i++) {
+        o = &w->objs[i];
+        if (!o->p)
+            continue;
+        check(object_ok(o), "worker %d: object %d corrupt", w->idx, i);
+        if (!(worker_rnd(w) % 4)) {
+            size = object_size(w);
+            o->p = slab_realloc(heap, o->p, size);
+            check(o->p, "worker %d: realloc %zu failed", w->idx, size);
+            if (!o->p)
+                continue;
+            if (size > o->size)
+                memset(o->p + o->size, o->fill, size - o->size);
+            o->size = size;
+        }
+        if (i & 1) {
+            slab_free(heap, o->p);
+            o->p = NULL;
+        }
+    }
+
+    return 0;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-r rounds] [-t threads]\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct worker *workers;
+    int c, i, j, r, rounds = 100, threads = 8;
+    double t;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "r:t:")) != -1) {
+        switch (c) {
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (rounds < 1 || threads < 1)
+        usage(argv[0]);
+
+    workers = calloc(threads, sizeof(workers[0]));
+    if (!workers)
+        err(1, "calloc");
+
+    heap = slab_heap_create("test", backing_alloc, backing_free, NULL);
+    if (!heap)
+        errx(1, "slab_heap_create failed");
+
+    t = rtc();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < threads; i++) {
+            workers[i].idx = r * threads + i;
+            workers[i].rnd_state = workers[i].idx + 1;
+            if (create_thread(&workers[i].handle, worker_run, &workers[i]))
+                errx(1, "create_thread failed");
+        }
+        for (i = 0; i < threads; i++) {
+            wait_thread(workers[i].handle);
+            close_thread_handle(workers[i].handle);
+        }
+
+        /* what the exited threads left, freed from here */
+        for (i = 0; i < threads; i++)
+            for (j = 0; j < OBJS_PER_THREAD; j++) {
+                struct object *o = &workers[i].objs[j];
+
+                if (!o->p)
+                    continue;
+                check(object_ok(o), "round %d: worker %d object %d corrupt",
+                      r, workers[i].idx, j);
+                slab_free(heap, o->p);
+                o->p = NULL;
+            }
+    }
+    t = rtc() - t;
+    printf("%d rounds of %d threads: %.0f us/thread\n", rounds, threads,
+           t * 1e6 / (rounds * threads));
+
+    /* the exited threads' caches are back with the heap, and nothing is
+     * allocated, so all of it can be released */
+    slab_heap_drain(heap);
+    check(!backing_outstanding, "%"PRId64" backing allocations left after "
+          "drain", backing_outstanding);
+
+    slab_heap_destroy(heap);
+    free(workers);
+
+    check_done();
+
+    return 0;
+}
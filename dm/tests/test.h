@@ -0,0 +1,104 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _TESTS_TEST_H_
+#define _TESTS_TEST_H_
+
+#include <err.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+static inline double rtc(void)
+{
+    struct timeval time;
+    gettimeofday(&time,0);
+    return ( (double)(time.tv_sec)+(double)(time.tv_usec)/1e6f );
+}
+
+/* xorshift, reseeded by setting rnd_state to anything but 0 */
+static uint64_t rnd_state = 1;
+
+static inline uint64_t
+rnd(void)
+{
+
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+static int failures;
+
+/* report the first few failed checks, count all of them */
+#define check(cond, fmt, ...) do {                                      \
+        if (!(cond)) {                                                  \
+            if (failures++ < 10)                                        \
+                warnx(fmt, ## __VA_ARGS__);                             \
+        }                                                               \
+    } while (0)
+
+static inline void
+check_done(void)
+{
+
+    if (failures)
+        errx(1, "%d failures", failures);
+}
+
+#ifdef TEST_SIM_CLOCK
+#include <stdlib.h>
+
+#include "clock.h"
+
+/* dm/clock.c replaced by a clock the test advances, in ns */
+static int64_t sim_now;
+
+Clock *
+new_clock(int type)
+{
+    Clock *clock;
+
+    clock = calloc(1, sizeof(Clock));
+    if (!clock)
+        err(1, "calloc");
+    clock->type = type;
+
+    return clock;
+}
+
+int64_t
+get_clock_ns(Clock *clock)
+{
+
+    return sim_now;
+}
+
+int64_t
+clock_is_paused(Clock *clock)
+{
+
+    return 0;
+}
+
+int64_t
+_os_get_clock(int type)
+{
+
+    return sim_now;
+}
+#endif  /* TEST_SIM_CLOCK */
+
+#ifdef TEST_NETLOG
+/* nickel logging is off */
+int ni_log_level = 0;
+
+void
+netlog(const char *fmt, ...)
+{
+}
+#endif  /* TEST_NETLOG */
+
+#endif  /* _TESTS_TEST_H_ */
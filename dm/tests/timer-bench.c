@@ -0,0 +1,398 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * timer-bench: drive dm/timer.c and the sorted list it replaces with the
+ * same workload on a simulated clock -- n timers re-arming themselves on
+ * expiry, like per-connection timeouts, while random timers are pushed
+ * out on every tick -- check both fire the same timers at the same
+ * times, and time arming and running them.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "file.h"
+#include "queue.h"
+#include "timer.h"
+
+#define TEST_SIM_CLOCK
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+/* save_timer() and load_timer() aren't exercised */
+void
+qemu_put_be64(QEMUFile *f, uint64_t v)
+{
+}
+
+uint64_t
+qemu_get_be64(QEMUFile *f)
+{
+
+    return 0;
+}
+
+
+/* the sorted list timer.c replaces */
+struct ref_timer {
+    int64_t expire_time;
+    TimerCB *cb;
+    void *opaque;
+    TAILQ_ENTRY(ref_timer) queue;
+};
+static TAILQ_HEAD(, ref_timer) ref_queue = TAILQ_HEAD_INITIALIZER(ref_queue);
+
+static void
+ref_del_timer(struct ref_timer *ts)
+{
+
+    if (TAILQ_ACTIVE(ts, queue))
+        TAILQ_REMOVE(&ref_queue, ts, queue);
+}
+
+static void
+ref_mod_timer_ns(struct ref_timer *ts, int64_t expire_time)
+{
+    struct ref_timer *t;
+
+    if (TAILQ_ACTIVE(ts, queue)) {
+        if (ts->expire_time == expire_time)
+            return;
+        TAILQ_REMOVE(&ref_queue, ts, queue);
+    }
+
+    TAILQ_FOREACH(t, &ref_queue, queue)
+        if (t->expire_time > expire_time)
+            break;
+    ts->expire_time = expire_time;
+    if (t)
+        TAILQ_INSERT_BEFORE(t, ts, queue);
+    else
+        TAILQ_INSERT_TAIL(&ref_queue, ts, queue);
+}
+
+static void
+ref_run_timers(void)
+{
+    struct ref_timer *ts;
+
+    while ((ts = TAILQ_FIRST(&ref_queue))) {
+        if (ts->expire_time > sim_now)
+            break;
+        TAILQ_REMOVE(&ref_queue, ts, queue);
+        ts->cb(ts->opaque);
+    }
+}
+
+static int64_t
+ref_first_expire(void)
+{
+    struct ref_timer *ts = TAILQ_FIRST(&ref_queue);
+
+    return ts ? ts->expire_time : INT64_MAX;
+}
+
+/* one simulated connection */
+struct conn {
+    int id;
+    int wheel;
+    uint64_t fired;
+    Timer *timer;
+    struct ref_timer ref;
+};
+
+static struct conn *conns;
+static int nr_conns;
+static int64_t max_delay = 2000 * SCALE_MS;
+
+/* order independent summary of what fired when */
+static uint64_t fired, fire_sum;
+static int64_t last_fire;
+
+static uint64_t
+mix(uint64_t x)
+{
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* delays only depend on the connection and how often it fired, so both
+ * implementations see the same timers whatever order ties run in */
+static int64_t
+conn_delay(struct conn *c)
+{
+
+    return 1 + mix(((uint64_t)c->id << 32) ^ c->fired) % max_delay;
+}
+
+static void
+conn_arm(struct conn *c, int64_t expire_time)
+{
+
+    if (c->wheel)
+        mod_timer_ns(c->timer, expire_time);
+    else
+        ref_mod_timer_ns(&c->ref, expire_time);
+}
+
+static void
+conn_cb(void *opaque)
+{
+    struct conn *c = opaque;
+    int64_t expire_time = c->wheel ? c->timer->expire_time :
+        c->ref.expire_time;
+
+    if (expire_time > sim_now)
+        errx(1, "timer %d fired %"PRId64" ns early", c->id,
+             expire_time - sim_now);
+    if (expire_time < last_fire)
+        errx(1, "timer %d fired out of order", c->id);
+    last_fire = expire_time;
+
+    fired++;
+    fire_sum += mix(((uint64_t)c->id << 32) ^ c->fired) ^ expire_time;
+    c->fired++;
+    conn_arm(c, sim_now + conn_delay(c));
+}
+
+static void
+run(int wheel, int64_t duration, int churn, uint64_t seed, double *arm_t,
+    double *run_t)
+{
+    int64_t end = sim_now + duration;
+    uint64_t r = seed;
+    double t;
+    int i, timeout;
+
+    fired = fire_sum = 0;
+    last_fire = INT64_MIN;
+
+    for (i = 0; i < nr_conns; i++) {
+        struct conn *c = &conns[i];
+
+        c->id = i;
+        c->wheel = wheel;
+        c->fired = 0;
+        if (wheel)
+            c->timer = new_timer_ns(vm_clock, conn_cb, c);
+        else {
+            memset(&c->ref, 0, sizeof(c->ref));
+            c->ref.cb = conn_cb;
+            c->ref.opaque = c;
+        }
+    }
+
+    t = rtc();
+    for (i = 0; i < nr_conns; i++)
+        conn_arm(&conns[i], sim_now + conn_delay(&conns[i]));
+    *arm_t = rtc() - t;
+
+    t = rtc();
+    while (sim_now < end) {
+        /* activity on random connections pushes their timeout out */
+        for (i = 0; i < churn; i++) {
+            struct conn *c;
+
+            r = mix(r + i);
+            c = &conns[r % nr_conns];
+            conn_arm(c, sim_now + conn_delay(c) + (r >> 40) % SCALE_MS);
+        }
+
+        /* the main loop asks for the deadline before every run */
+        if (wheel) {
+            timeout = 1 << 30;
+            timer_deadline(NULL, vm_clock, &timeout);
+            run_timers(NULL, vm_clock);
+        } else {
+            ref_first_expire();
+            ref_run_timers();
+        }
+
+        sim_now += SCALE_MS / 4 + r % (SCALE_MS / 2);
+    }
+    *run_t = rtc() - t;
+
+    for (i = 0; i < nr_conns; i++) {
+        if (wheel)
+            free_timer(conns[i].timer);
+        else
+            ref_del_timer(&conns[i].ref);
+    }
+}
+
+static uint64_t check_fired;
+
+static void
+check_cb(void *opaque)
+{
+
+    check_fired++;
+}
+
+/* random arms, cancels and clock jumps over all levels of the wheel, the
+ * deadline and the timers run must match the list */
+static void
+check_deadline(uint64_t seed)
+{
+    struct ref_timer ref[64], *ts;
+    Timer *timers[64];
+    uint64_t r = seed, ref_fired = 0;
+    int64_t e;
+    int i, n, timeout, ref_timeout;
+
+    for (i = 0; i < 64; i++) {
+        timers[i] = new_timer_ns(vm_clock, check_cb, NULL);
+        memset(&ref[i], 0, sizeof(ref[i]));
+    }
+
+    check_fired = 0;
+    for (n = 0; n < 1000000; n++) {
+        r = mix(r + n);
+        i = r % 64;
+        if ((r >> 8) % 4 == 0) {
+            del_timer(timers[i]);
+            ref_del_timer(&ref[i]);
+        } else {
+            e = sim_now - SCALE_MS +
+                (int64_t)((r >> 16) % (1ULL << (20 + (r >> 10) % 40)));
+            mod_timer_ns(timers[i], e);
+            ref_mod_timer_ns(&ref[i], e);
+        }
+
+        timeout = ref_timeout = 1 << 30;
+        timer_deadline(NULL, vm_clock, &timeout);
+        if ((ts = TAILQ_FIRST(&ref_queue))) {
+            e = ts->expire_time - sim_now;
+            if (e < 0)
+                e = 0;
+            else if (e > 0) {
+                e /= SCALE_MS;
+                if (e < 1)
+                    e = 1;
+            }
+            if (e < ref_timeout)
+                ref_timeout = e;
+        }
+        if (timeout != ref_timeout)
+            errx(1, "deadline %d ms, expected %d ms", timeout, ref_timeout);
+
+        if ((r >> 32) % 8 == 0)
+            sim_now += (r >> 36) % (1ULL << ((r >> 61) < 6 ? 24 : 40));
+        run_timers(NULL, vm_clock);
+        while ((ts = TAILQ_FIRST(&ref_queue)) && ts->expire_time <= sim_now) {
+            ref_del_timer(ts);
+            ref_fired++;
+        }
+        if (check_fired != ref_fired)
+            errx(1, "%"PRIu64" timers run, expected %"PRIu64,
+                 check_fired, ref_fired);
+    }
+
+    for (i = 0; i < 64; i++) {
+        free_timer(timers[i]);
+        ref_del_timer(&ref[i]);
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-n timers] [-t seconds] [-c churn] "
+            "[-d max-delay-ms] [-s seed] [-R]\n"
+            "  -n  active timers (default 10000)\n"
+            "  -t  simulated seconds (default 10)\n"
+            "  -c  re-arms of random timers per tick (default 10)\n"
+            "  -d  maximum timeout in ms (default 2000)\n"
+            "  -s  random seed\n"
+            "  -R  skip the sorted list reference\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    int64_t seconds = 10, start;
+    int churn = 10, skip_ref = 0, c;
+    uint64_t seed = 1, ref_fired = 0, ref_sum = 0;
+    double arm_t, run_t;
+
+    setprogname(argv[0]);
+
+    nr_conns = 10000;
+    while ((c = getopt(argc, argv, "n:t:c:d:s:R")) != -1) {
+        switch (c) {
+        case 'n':
+            nr_conns = atoi(optarg);
+            break;
+        case 't':
+            seconds = strtoll(optarg, NULL, 0);
+            break;
+        case 'c':
+            churn = atoi(optarg);
+            break;
+        case 'd':
+            max_delay = strtoll(optarg, NULL, 0) * SCALE_MS;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'R':
+            skip_ref = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nr_conns < 1 || seconds < 1 || churn < 0 || max_delay < 1)
+        usage(argv[0]);
+
+    conns = calloc(nr_conns, sizeof(*conns));
+    if (!conns)
+        err(1, "calloc");
+
+    sim_now = start = 1000 * SCALE_MS;
+    timers_init(NULL);
+
+    check_deadline(seed);
+    printf("deadline check ok\n");
+
+    printf("%d timers, %"PRId64" s, %d re-arms per tick, timeouts up to "
+           "%"PRId64" ms\n", nr_conns, seconds, churn, (int64_t)(max_delay / SCALE_MS));
+
+    start = sim_now;
+    if (!skip_ref) {
+        run(0, seconds * 1000 * SCALE_MS, churn, seed, &arm_t, &run_t);
+        ref_fired = fired;
+        ref_sum = fire_sum;
+        printf("%-6s arm %8.1f ns/timer  run %8.3f s  %"PRIu64" fired\n",
+               "list", arm_t * 1e9 / nr_conns, run_t, fired);
+    }
+
+    sim_now = start;
+    timers_init(NULL);
+    run(1, seconds * 1000 * SCALE_MS, churn, seed, &arm_t, &run_t);
+    printf("%-6s arm %8.1f ns/timer  run %8.3f s  %"PRIu64" fired\n",
+           "wheel", arm_t * 1e9 / nr_conns, run_t, fired);
+
+    if (!skip_ref && (fired != ref_fired || fire_sum != ref_sum))
+        errx(1, "wheel fired %"PRIu64" timers, list %"PRIu64
+             ", or at different times", fired, ref_fired);
+
+    free(conns);
+    return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * zero-scan-bench: time dm/zero-scan.c against the open-coded uint64_t
+ * loop it replaces, on a buffer with a given share of zero pages, for
+ * every scanner the cpu supports.
+ */
+
+#include "config.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "zero-scan.h"
+
+#include "test.h"
+
+DECLARE_PROGNAME;
+
+/* same as the whpx save path */
+#define MAX_GAP 64
+
+/* the loop zero-scan replaces */
+static int
+page_is_zero_ref(const void *p)
+{
+    const uint64_t *q = p;
+    const uint64_t *end = (const uint64_t *)((const uint8_t *)p + PAGE_SIZE);
+
+    while (q != end) {
+        if (*q)
+            return 0;
+        q++;
+    }
+
+    return 1;
+}
+
+/* the whpx find_nonzero_pageranges() algorithm zero-scan replaces, to
+ * check the ranges against */
+static int
+nonzero_ranges_ref(const uint8_t *p, uint64_t npages,
+                   struct zero_scan_range **ranges)
+{
+    uint64_t idx, s = 0, e = 0;
+    int in_nonzero = 0, zeroc = 0, nr = 0;
+
+    *ranges = NULL;
+    for (idx = 0; idx < npages; idx++) {
+        int is_zero = page_is_zero_ref(p + (idx << PAGE_SHIFT));
+
+        if (!is_zero) {
+            if (!in_nonzero)
+                s = idx;
+            e = idx;
+            zeroc = 0;
+            in_nonzero = 1;
+        } else if (in_nonzero)
+            zeroc++;
+        if (in_nonzero && (zeroc > MAX_GAP || idx == npages - 1)) {
+            *ranges = realloc(*ranges, (nr + 1) * sizeof(**ranges));
+            if (!*ranges)
+                err(1, "realloc");
+            (*ranges)[nr].start = s;
+            (*ranges)[nr].end = e + 1;
+            nr++;
+            in_nonzero = 0;
+        }
+    }
+
+    return nr;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m MB] [-z zero-ratio] [-r runs] [-l] "
+            "[-s seed]\n"
+            "  -m  buffer size in MB (default 1024)\n"
+            "  -z  share of zero pages, 0.0-1.0 (default 0.9)\n"
+            "  -r  timed passes per scanner (default 5)\n"
+            "  -l  put the non-zero byte at the end of non-zero pages "
+            "(worst case)\n"
+            "  -s  random seed\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *impls[] = { "avx2", "sse2", "generic" };
+    uint64_t mb = 1024, npages, i, zero_ref = 0, nr_zero;
+    double zero_ratio = 0.9, t, best;
+    int runs = 5, last_byte = 0, seed = 1;
+    struct zero_scan_range *ranges, *ranges_ref;
+    uint8_t *buf;
+    int c, n, r, nr_ranges, nr_ranges_ref;
+
+    setprogname(argv[0]);
+
+    while ((c = getopt(argc, argv, "m:z:r:ls:")) != -1) {
+        switch (c) {
+        case 'm':
+            mb = strtoull(optarg, NULL, 0);
+            break;
+        case 'z':
+            zero_ratio = strtod(optarg, NULL);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'l':
+            last_byte = 1;
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (!mb || runs < 1 || zero_ratio < 0.0 || zero_ratio > 1.0)
+        usage(argv[0]);
+
+    npages = (mb << 20) >> PAGE_SHIFT;
+    buf = mmap(NULL, npages << PAGE_SHIFT, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        err(1, "mmap %"PRIu64" MB", mb);
+
+    /* zero pages come in runs, like idle guest memory does */
+    srand(seed);
+    for (i = 0; i < npages; ) {
+        uint64_t run = 1 + rand() % 256;
+        int zero = (double)rand() / RAND_MAX < zero_ratio;
+
+        for (; run && i < npages; run--, i++) {
+            uint8_t *p = buf + (i << PAGE_SHIFT);
+
+            if (zero) {
+                zero_ref++;
+                continue;
+            }
+            p[last_byte ? PAGE_SIZE - 1 : rand() % PAGE_SIZE] =
+                1 + rand() % 255;
+        }
+    }
+
+    printf("%"PRIu64" MB, %"PRIu64" pages, %"PRIu64" zero (%.1f%%), "
+           "default scanner %s\n", mb, npages, zero_ref,
+           100.0 * zero_ref / npages, zero_scan_impl());
+
+    best = 0;
+    for (r = 0; r < runs; r++) {
+        t = rtc();
+        for (nr_zero = i = 0; i < npages; i++)
+            nr_zero += page_is_zero_ref(buf + (i << PAGE_SHIFT));
+        t = rtc() - t;
+        if (!r || t < best)
+            best = t;
+    }
+    if (nr_zero != zero_ref)
+        errx(1, "reference counted %"PRIu64" zero pages, expected %"PRIu64,
+             nr_zero, zero_ref);
+    printf("%-8s page %8.2f GB/s\n", "ref", mb / 1024.0 / best);
+
+    nr_ranges_ref = nonzero_ranges_ref(buf, npages, &ranges_ref);
+
+    for (n = 0; n < sizeof(impls) / sizeof(impls[0]); n++) {
+        double best_ranges = 0;
+
+        if (zero_scan_select(impls[n])) {
+            printf("%-8s not supported\n", impls[n]);
+            continue;
+        }
+
+        best = 0;
+        for (r = 0; r < runs; r++) {
+            t = rtc();
+            for (nr_zero = i = 0; i < npages; i++)
+                nr_zero += zero_scan_page(buf + (i << PAGE_SHIFT));
+            t = rtc() - t;
+            if (!r || t < best)
+                best = t;
+        }
+        if (nr_zero != zero_ref)
+            errx(1, "%s counted %"PRIu64" zero pages, expected %"PRIu64,
+                 impls[n], nr_zero, zero_ref);
+
+        nr_ranges = 0;
+        for (r = 0; r < runs; r++) {
+            t = rtc();
+            ranges = zero_scan_nonzero_ranges(buf, npages, MAX_GAP,
+                                              &nr_ranges);
+            t = rtc() - t;
+            if (nr_ranges < 0)
+                errx(1, "zero_scan_nonzero_ranges failed");
+            if (nr_ranges != nr_ranges_ref ||
+                (nr_ranges && memcmp(ranges, ranges_ref,
+                                     nr_ranges * sizeof(ranges[0]))))
+                errx(1, "%s ranges differ from reference", impls[n]);
+            free(ranges);
+            if (!r || t < best_ranges)
+                best_ranges = t;
+        }
+
+        printf("%-8s page %8.2f GB/s  ranges %8.2f GB/s  (%d ranges)\n",
+               impls[n], mb / 1024.0 / best, mb / 1024.0 / best_ranges,
+               nr_ranges);
+    }
+
+    free(ranges_ref);
+    munmap(buf, npages << PAGE_SHIFT);
+    return 0;
+}
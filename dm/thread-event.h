@@ -10,6 +10,9 @@
 #ifdef _WIN32
 typedef HANDLE thread_event;
 #else
+#include <errno.h>
+#include <sys/time.h>
+
 typedef struct thread_event {
     int set;
     pthread_mutex_t mutex;
@@ -60,6 +63,38 @@ void thread_event_wait(thread_event *ev)
 #endif
 }
 
+/* returns 0 if the event was set, 1 if ms elapsed first */
+static inline
+int thread_event_wait_timeout(thread_event *ev, int ms)
+{
+#ifdef _WIN32
+    return WaitForSingleObject(*ev, ms) == WAIT_TIMEOUT;
+#else
+    struct timespec ts;
+    struct timeval tv;
+    int timed_out = 0;
+
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec + ms / 1000;
+    ts.tv_nsec = tv.tv_usec * 1000 + (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&ev->mutex);
+    while (!ev->set && !timed_out)
+        timed_out = pthread_cond_timedwait(&ev->cond, &ev->mutex,
+                                           &ts) == ETIMEDOUT;
+    if (ev->set) {
+        ev->set = 0;
+        timed_out = 0;
+    }
+    pthread_mutex_unlock(&ev->mutex);
+    return timed_out;
+#endif
+}
+
 static inline
 void thread_event_close(thread_event *ev)
 {
@@ -5,14 +5,17 @@
  */
 
 #include "config.h"
+#include "file.h"
+#include "dm.h"
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
-#include "file.h"
 #include "clock.h"
 #include "timer.h"
+#include "trace.h"
 #include "queue.h"
-#include "dm.h"
 
 #if defined(_WIN32)
 #include <mmsystem.h>
@@ -37,6 +40,274 @@ timer_queue_modified(Timer *ts)
 #endif
 }
 
+#define WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define WHEEL_TOP (TIMER_WHEEL_LEVELS - 1)
+#define level_shift(level) ((level) * TIMER_WHEEL_BITS)
+
+static inline struct TimerList *
+wheel_slot(TimerQueue *q, int slot)
+{
+
+    return &q->slots[slot >> TIMER_WHEEL_BITS][slot & WHEEL_MASK];
+}
+
+static void
+wheel_place(TimerQueue *q, Timer *ts)
+{
+    int64_t tick = ts->expire_time >> TIMER_WHEEL_GRANULARITY;
+    struct TimerList *slot;
+    int level, idx;
+
+    /* overdue timers go in the current slot, to run on the next pass */
+    if (tick < q->clk)
+        tick = q->clk;
+
+    for (level = 0; level < WHEEL_TOP; level++)
+        if ((tick >> level_shift(level)) - (q->clk >> level_shift(level)) <
+            TIMER_WHEEL_SIZE)
+            break;
+    /* beyond the top level, park in its last slot, the timer is placed
+     * again when that slot cascades */
+    if (level == WHEEL_TOP &&
+        (tick >> level_shift(level)) - (q->clk >> level_shift(level)) >=
+        TIMER_WHEEL_SIZE)
+        tick = ((q->clk >> level_shift(level)) + TIMER_WHEEL_SIZE - 1) <<
+            level_shift(level);
+
+    idx = (tick >> level_shift(level)) & WHEEL_MASK;
+    slot = &q->slots[level][idx];
+    if (!level && idx == q->sorted_slot && !TAILQ_EMPTY(slot) &&
+        TAILQ_LAST(slot, TimerList)->expire_time > ts->expire_time)
+        q->sorted_slot = -1;
+    TAILQ_INSERT_TAIL(slot, ts, queue);
+    q->occupied[level] |= 1ULL << idx;
+    ts->slot = (level << TIMER_WHEEL_BITS) | idx;
+}
+
+static void
+wheel_insert(TimerQueue *q, Timer *ts)
+{
+
+    wheel_place(q, ts);
+    q->nr_timers++;
+    if (q->next_valid && ts->expire_time < q->next_expire)
+        q->next_expire = ts->expire_time;
+}
+
+static void
+wheel_remove(TimerQueue *q, Timer *ts)
+{
+    struct TimerList *slot = wheel_slot(q, ts->slot);
+
+    TAILQ_REMOVE(slot, ts, queue);
+    if (TAILQ_EMPTY(slot))
+        q->occupied[ts->slot >> TIMER_WHEEL_BITS] &=
+            ~(1ULL << (ts->slot & WHEEL_MASK));
+    q->nr_timers--;
+    if (ts->expire_time == q->next_expire)
+        q->next_valid = 0;
+}
+
+/* first occupied slot of a level, searching circularly from slot base */
+static inline int
+wheel_first_slot(TimerQueue *q, int level, int64_t base)
+{
+    uint64_t occupied = q->occupied[level];
+    int start = base & WHEEL_MASK;
+
+    if (start)
+        occupied = (occupied >> start) | (occupied << (64 - start));
+    return (start + __builtin_ctzll(occupied)) & WHEEL_MASK;
+}
+
+/* earliest tick, at or after clk, at which a level 0 slot holds timers or
+ * a higher level slot is due to cascade */
+static int64_t
+wheel_next_tick(TimerQueue *q)
+{
+    int64_t next = INT64_MAX, base, tick;
+    int level, idx;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (!q->occupied[level])
+            continue;
+        /* slots for the current group above level 0 have cascaded */
+        base = (q->clk >> level_shift(level)) + (level ? 1 : 0);
+        idx = wheel_first_slot(q, level, base);
+        tick = (base + ((idx - base) & WHEEL_MASK)) << level_shift(level);
+        if (tick < next)
+            next = tick;
+    }
+
+    return next;
+}
+
+/* move clk forward, cascading the slots of every level whose current
+ * group changes -- callers only skip ticks without pending work */
+static void
+wheel_set_clk(TimerQueue *q, int64_t clk)
+{
+    struct TimerList list;
+    int64_t old = q->clk;
+    Timer *ts;
+    int level, idx;
+
+    q->clk = clk;
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if ((clk >> level_shift(level)) == (old >> level_shift(level)))
+            break;
+        idx = (clk >> level_shift(level)) & WHEEL_MASK;
+        if (!(q->occupied[level] & (1ULL << idx)))
+            continue;
+        TAILQ_INIT(&list);
+        TAILQ_CONCAT(&list, &q->slots[level][idx], queue);
+        q->occupied[level] &= ~(1ULL << idx);
+        while ((ts = TAILQ_FIRST(&list))) {
+            TAILQ_REMOVE(&list, ts, queue);
+            wheel_place(q, ts);
+        }
+    }
+}
+
+static Timer *
+wheel_merge(Timer *a, Timer *b)
+{
+    Timer *head = NULL, **tail = &head;
+
+    /* ties keep a first, which makes the sort stable */
+    while (a && b) {
+        if (b->expire_time < a->expire_time) {
+            *tail = b;
+            b = TAILQ_NEXT(b, queue);
+        } else {
+            *tail = a;
+            a = TAILQ_NEXT(a, queue);
+        }
+        tail = &TAILQ_NEXT(*tail, queue);
+    }
+    *tail = a ? a : b;
+
+    return head;
+}
+
+/* merge sort a slot into expiry order */
+static void
+wheel_sort_slot(struct TimerList *slot)
+{
+    Timer *part[64] = { }, *list = TAILQ_FIRST(slot), *ts, **prev;
+    int n, max = 0;
+
+    while (list) {
+        ts = list;
+        list = TAILQ_NEXT(list, queue);
+        TAILQ_NEXT(ts, queue) = NULL;
+        for (n = 0; part[n]; n++) {
+            ts = wheel_merge(part[n], ts);
+            part[n] = NULL;
+        }
+        part[n] = ts;
+        if (n > max)
+            max = n;
+    }
+    ts = NULL;
+    for (n = 0; n <= max; n++)
+        if (part[n])
+            ts = wheel_merge(part[n], ts);
+
+    slot->tqh_first = ts;
+    prev = &slot->tqh_first;
+    for (; ts; ts = TAILQ_NEXT(ts, queue)) {
+        ts->queue.tqe_prev = prev;
+        prev = &TAILQ_NEXT(ts, queue);
+    }
+    slot->tqh_last = prev;
+}
+
+/* run the expired timers of the current level 0 slot, in expiry order */
+static void
+wheel_run_slot(TimerQueue *q, int64_t current_time)
+{
+    int idx = q->clk & WHEEL_MASK;
+    struct TimerList *slot = &q->slots[0][idx];
+    Timer *ts;
+
+    while ((ts = TAILQ_FIRST(slot))) {
+        /* callbacks re-arming into this slot can unsort it */
+        if (q->sorted_slot != idx) {
+            wheel_sort_slot(slot);
+            q->sorted_slot = idx;
+            ts = TAILQ_FIRST(slot);
+        }
+        if (ts->expire_time > current_time)
+            break;
+
+        /* remove timer from the wheel before calling the callback */
+        wheel_remove(q, ts);
+
+        /* run the callback (the timers can be modified) */
+        TRACE_BEGIN(TRACE_TIMER_FIRE, (uintptr_t)ts->cb, ts->clock->type);
+        ts->cb(ts->opaque);
+        TRACE_END(TRACE_TIMER_FIRE, 0, 0);
+    }
+}
+
+static void
+slot_first_expire(struct TimerList *slot, int64_t *next)
+{
+    Timer *ts;
+
+    TAILQ_FOREACH(ts, slot, queue)
+        if (ts->expire_time < *next)
+            *next = ts->expire_time;
+}
+
+static int64_t
+wheel_first_expire(TimerQueue *q)
+{
+    int64_t next = INT64_MAX;
+    int level, idx;
+
+    if (q->next_valid)
+        return q->next_expire;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (!q->occupied[level])
+            continue;
+        /* the first occupied slot holds the earliest timers of its
+         * level, except at the top, where far-off timers are parked */
+        if (level == WHEEL_TOP) {
+            for (idx = 0; idx < TIMER_WHEEL_SIZE; idx++)
+                slot_first_expire(&q->slots[level][idx], &next);
+            continue;
+        }
+        idx = wheel_first_slot(q, level, (q->clk >> level_shift(level)) +
+                               (level ? 1 : 0));
+        slot_first_expire(&q->slots[level][idx], &next);
+    }
+
+    q->next_expire = next;
+    q->next_valid = 1;
+    return next;
+}
+
+static void
+wheel_init(TimerQueue *q, Clock *clock)
+{
+    int level, idx;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (idx = 0; idx < TIMER_WHEEL_SIZE; idx++)
+            TAILQ_INIT(&q->slots[level][idx]);
+        q->occupied[level] = 0;
+    }
+    q->clk = get_clock_ns(clock) >> TIMER_WHEEL_GRANULARITY;
+    if (q->clk < 0)
+        q->clk = 0;
+    q->sorted_slot = -1;
+    q->nr_timers = 0;
+    q->next_valid = 0;
+}
+
 Timer *_new_timer(TimerQueue *active_timers, Clock *clock, int scale, TimerCB *cb, void *opaque,
 		  const char *fn, int line)
 {
@@ -67,7 +338,7 @@ void del_timer(Timer *ts)
 {
 
     if (TAILQ_ACTIVE(ts, queue))
-	TAILQ_REMOVE(&ts->active_timers[ts->clock->type], ts, queue);
+        wheel_remove(&ts->active_timers[ts->clock->type], ts);
 
     timer_queue_modified(ts);
 }
@@ -81,23 +352,17 @@ void advance_timer(Timer *ts, int64_t expire_time)
 
 void mod_timer_ns(Timer *ts, int64_t expire_time)
 {
-    Timer *t;
+    TimerQueue *q = &ts->active_timers[ts->clock->type];
 
     if (TAILQ_ACTIVE(ts, queue)) {
         /* already set at expire_time */
         if (ts->expire_time == expire_time)
             return;
-	TAILQ_REMOVE(&ts->active_timers[ts->clock->type], ts, queue);
+        wheel_remove(q, ts);
     }
 
-    TAILQ_FOREACH(t, &ts->active_timers[ts->clock->type], queue)
-	if (t->expire_time > expire_time)
-	    break;
     ts->expire_time = expire_time;
-    if (t)
-	TAILQ_INSERT_BEFORE(t, ts, queue);
-    else
-	TAILQ_INSERT_TAIL(&ts->active_timers[ts->clock->type], ts, queue);
+    wheel_insert(q, ts);
 
     timer_queue_modified(ts);
 }
@@ -127,8 +392,8 @@ static inline int timer_expired(Timer *t, int64_t current_time)
 
 void run_timers(TimerQueue *active_timers, Clock *clock)
 {
-    Timer *ts;
-    int64_t current_time;
+    TimerQueue *q;
+    int64_t current_time, now, tick;
 
     if (!active_timers)
         active_timers = main_active_timers;
@@ -136,17 +401,27 @@ void run_timers(TimerQueue *active_timers, Clock *clock)
     if (clock_is_paused(clock))
         return;
 
+    q = &active_timers[clock->type];
     current_time = get_clock_ns(clock);
 
-    while ((ts = TAILQ_FIRST(&active_timers[clock->type]))) {
-        if (ts->expire_time > current_time)
+    /* never move clk back, if the clock did only overdue timers in the
+     * current slot can have expired */
+    now = current_time >> TIMER_WHEEL_GRANULARITY;
+    if (now < q->clk)
+        now = q->clk;
+
+    for (;;) {
+        /* skip straight to the next slot with timers or a cascade */
+        tick = wheel_next_tick(q);
+        if (tick > now)
+            tick = now;
+        if (tick > q->clk)
+            wheel_set_clk(q, tick);
+
+        wheel_run_slot(q, current_time);
+        if (q->clk == now)
             break;
-
-        /* remove timer from the list before calling the callback */
-	TAILQ_REMOVE(&active_timers[clock->type], ts, queue);
-
-        /* run the callback (the timer list can be modified) */
-        ts->cb(ts->opaque);
+        wheel_set_clk(q, q->clk + 1);
     }
 }
 
@@ -164,8 +439,8 @@ void timers_init(TimerQueue *active_timers)
         rt_clock = new_clock(CLOCK_REALTIME);
         vm_clock = new_clock(CLOCK_VIRTUAL);
     }
-    TAILQ_INIT(&active_timers[rt_clock->type]);
-    TAILQ_INIT(&active_timers[vm_clock->type]);
+    wheel_init(&active_timers[rt_clock->type], rt_clock);
+    wheel_init(&active_timers[vm_clock->type], vm_clock);
 }
 
 /* save a timer */
@@ -212,8 +487,8 @@ void run_one_timer(Timer *ts)
 void
 timer_deadline(TimerQueue *active_timers, Clock *clock, int *timeout)
 {
-    Timer *ts;
-    int64_t delta;
+    TimerQueue *q;
+    int64_t expire_time, delta;
 
     if (!active_timers)
         active_timers = main_active_timers;
@@ -221,17 +496,18 @@ timer_deadline(TimerQueue *active_timers, Clock *clock, int *timeout)
     if (clock_is_paused(clock))
         return;
 
-    ts = TAILQ_FIRST(&active_timers[clock->type]);
-    if (ts == NULL)
+    q = &active_timers[clock->type];
+    if (!q->nr_timers)
 	return;
 
-    delta = ts->expire_time - get_clock_ns(clock);
+    expire_time = wheel_first_expire(q);
+    delta = expire_time - get_clock_ns(clock);
     if (delta < 0) {
 #ifdef CONFIG_AIO
 	if (delta < -SCALE_MS)
 	    debug_printf("timer late exp %"PRId64" now %"PRId64
                          " delta %"PRId64"\n",
-                         (ts->expire_time / SCALE_MS) % 10000,
+                         (expire_time / SCALE_MS) % 10000,
                          get_clock_ms(clock) % 10000, delta);
 #endif
 	delta = 0;
@@ -9,6 +9,7 @@
 
 #include "clock.h"
 #include "queue.h"
+#include "typedef.h"
 
 typedef void TimerCB(void *opaque);
 
@@ -19,13 +20,30 @@ struct Timer {
     TimerCB *cb;
     void *opaque;
     TAILQ_ENTRY(Timer) queue;
+    int slot;                   /* wheel slot the timer is queued on */
     TimerQueue *active_timers;
 };
 
-#ifndef _TYPEDEF_H_
-typedef struct Timer Timer;
-#endif
+/* Hierarchical timing wheel, one per clock: level 0 slots are
+ * 2^TIMER_WHEEL_GRANULARITY ns wide, each level above covers
+ * TIMER_WHEEL_SIZE slots of the level below, and timers cascade down a
+ * level as their slot comes up. */
+#define TIMER_WHEEL_GRANULARITY 20
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 6
 
+TAILQ_HEAD(TimerList, Timer);
+
+struct TimerQueue {
+    struct TimerList slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    int64_t clk;                /* level 0 tick run up to */
+    int sorted_slot;            /* level 0 slot known to be in expiry order */
+    int nr_timers;
+    int next_valid;
+    int64_t next_expire;        /* cached earliest expiry, if next_valid */
+};
 
 extern TimerQueue main_active_timers[];
 
@@ -0,0 +1,414 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+/*
+ * Event tracing: every thread that emits an event gets its own ring of
+ * fixed size binary records, written without locks or atomics -- the
+ * thread stores the record, then publishes it by advancing the ring
+ * head.  When a thread exits, its ring is left for the next thread that
+ * needs one, so there are never more rings than threads tracing at once.
+ * Rings are never freed, and a dump copies each ring and drops whatever
+ * the writer overwrote while it was being copied.  Dumps are written as
+ * Chrome trace-event JSON, for chrome://tracing or Perfetto.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "dict.h"
+#include "monitor.h"
+#include "trace.h"
+
+#define TRACE_RING_SHIFT 14
+#define TRACE_RING_SIZE (1UL << TRACE_RING_SHIFT)
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+/* x86 does not reorder stores with other stores, or loads with other
+ * loads, so keeping the compiler from doing so is enough */
+#define trace_barrier() asm volatile("" ::: "memory")
+
+struct trace_record {
+    uint64_t ts;
+    uint64_t id;
+    uint64_t arg0;
+    uint64_t arg1;
+    uint16_t tp;
+    char phase;
+    uint8_t pad[5];
+};
+
+struct trace_ring {
+    volatile uint64_t head;
+    struct trace_ring *next;
+    volatile unsigned int tid;
+    volatile uint64_t start;    /* the first record of the current thread */
+    volatile int in_use;
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+volatile uint32_t trace_categories = 0;
+
+static struct trace_ring *volatile trace_rings = NULL;
+static volatile unsigned int trace_nr_rings = 0;
+static volatile unsigned int trace_nr_threads = 0;
+static __thread struct trace_ring *trace_ring = NULL;
+
+/* set to the thread's ring, to run trace_thread_exit */
+#if defined(_WIN32)
+static DWORD trace_tls_key;
+#else
+static pthread_key_t trace_tls_key;
+#endif
+static volatile int trace_tls_key_state = 0;
+
+static const struct {
+    const char *name;
+    uint32_t cat;
+} trace_category_names[] = {
+    { "ioreq", TRACE_IOREQ },
+    { "swap", TRACE_SWAP },
+    { "dubtree", TRACE_DUBTREE },
+    { "nickel", TRACE_NICKEL },
+    { "timer", TRACE_TIMER },
+};
+
+#define NR_TRACE_CATEGORIES \
+    (sizeof(trace_category_names) / sizeof(trace_category_names[0]))
+
+static const struct {
+    unsigned int tp;
+    const char *name;
+    const char *arg0;
+    const char *arg1;
+} trace_point_names[] = {
+    { TRACE_IOREQ_HANDLE, "ioreq", "addr", "type" },
+    { TRACE_SWAP_READ, "swap-read", "block", "size" },
+    { TRACE_SWAP_WRITE, "swap-write", "block", "size" },
+    { TRACE_DUBTREE_MERGE, "dubtree-merge", "keys", "level" },
+    { TRACE_NICKEL_IN, "nickel-in", "len", NULL },
+    { TRACE_NICKEL_OUT, "nickel-out", "len", NULL },
+    { TRACE_TIMER_FIRE, "timer", "cb", "clock" },
+};
+
+#if defined(_WIN32)
+static VOID WINAPI
+#else
+static void
+#endif
+trace_thread_exit(void *opaque)
+{
+    struct trace_ring *r = opaque;
+
+    trace_barrier();
+    r->in_use = 0;
+}
+
+static void
+trace_tls_key_init(void)
+{
+
+    if (trace_tls_key_state == 2)
+        return;
+    if (__sync_bool_compare_and_swap(&trace_tls_key_state, 0, 1)) {
+#if defined(_WIN32)
+        trace_tls_key = FlsAlloc(trace_thread_exit);
+        if (trace_tls_key == FLS_OUT_OF_INDEXES)
+            Werr(1, "%s: FlsAlloc", __FUNCTION__);
+#else
+        if (pthread_key_create(&trace_tls_key, trace_thread_exit))
+            err(1, "%s: pthread_key_create", __FUNCTION__);
+#endif
+        __sync_synchronize();
+        trace_tls_key_state = 2;
+    } else
+        while (trace_tls_key_state != 2)
+            __sync_synchronize();
+}
+
+static struct trace_ring *
+trace_ring_new(void)
+{
+    struct trace_ring *r;
+
+    trace_tls_key_init();
+
+    /* the ring of a thread that has exited, else a new one */
+    for (r = trace_rings; r; r = r->next)
+        if (!r->in_use && __sync_bool_compare_and_swap(&r->in_use, 0, 1))
+            break;
+    if (r) {
+        r->start = r->head;
+        r->tid = __sync_add_and_fetch(&trace_nr_threads, 1);
+    } else {
+        r = calloc(1, sizeof(*r));
+        if (!r)
+            return NULL;
+        r->in_use = 1;
+        r->tid = __sync_add_and_fetch(&trace_nr_threads, 1);
+        __sync_add_and_fetch(&trace_nr_rings, 1);
+        do {
+            r->next = trace_rings;
+        } while (!__sync_bool_compare_and_swap(&trace_rings, r->next, r));
+    }
+
+#if defined(_WIN32)
+    FlsSetValue(trace_tls_key, r);
+#else
+    pthread_setspecific(trace_tls_key, r);
+#endif
+    trace_ring = r;
+    return r;
+}
+
+void
+trace_event(unsigned int tp, char phase, uint64_t id, uint64_t arg0,
+            uint64_t arg1)
+{
+    struct trace_ring *r = trace_ring;
+    struct trace_record *rec;
+    uint64_t head;
+
+    if (!r) {
+        r = trace_ring_new();
+        if (!r)
+            return;
+    }
+
+    head = r->head;
+    rec = &r->records[head & TRACE_RING_MASK];
+    rec->ts = os_get_clock();
+    rec->id = id;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+    rec->tp = tp;
+    rec->phase = phase;
+    trace_barrier();
+    r->head = head + 1;
+}
+
+#ifdef MONITOR
+static const char *
+trace_category_name(unsigned int tp)
+{
+    int i;
+
+    for (i = 0; i < NR_TRACE_CATEGORIES; i++)
+        if (trace_category_names[i].cat == TRACE_POINT_CAT(tp))
+            return trace_category_names[i].name;
+
+    return "unknown";
+}
+
+static int
+trace_point_index(unsigned int tp)
+{
+    int i;
+
+    for (i = 0; i < sizeof(trace_point_names) / sizeof(trace_point_names[0]);
+         i++)
+        if (trace_point_names[i].tp == tp)
+            return i;
+
+    return -1;
+}
+
+static void
+trace_write_record(FILE *f, unsigned int tid, const struct trace_record *rec,
+                   int first)
+{
+    int i = trace_point_index(rec->tp);
+
+    if (i < 0)
+        return;
+
+    fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+            "\"ts\":%"PRIu64".%03u,\"pid\":1,\"tid\":%u",
+            first ? "" : ",\n", trace_point_names[i].name,
+            trace_category_name(rec->tp), rec->phase,
+            rec->ts / 1000, (unsigned int)(rec->ts % 1000), tid);
+    if (rec->phase == 'b' || rec->phase == 'e')
+        fprintf(f, ",\"id\":\"0x%"PRIx64"\"", rec->id);
+    else if (rec->phase == 'i')
+        fprintf(f, ",\"s\":\"t\"");
+    if (rec->phase != 'E' && rec->phase != 'e') {
+        fprintf(f, ",\"args\":{\"%s\":%"PRIu64, trace_point_names[i].arg0,
+                rec->arg0);
+        if (trace_point_names[i].arg1)
+            fprintf(f, ",\"%s\":%"PRIu64, trace_point_names[i].arg1,
+                    rec->arg1);
+        fprintf(f, "}");
+    }
+    fprintf(f, "}");
+}
+
+/* copy the live part of a ring, the records of the thread it belongs to,
+ * returns the number of records copied */
+static uint64_t
+trace_ring_copy(struct trace_ring *r, struct trace_record *out,
+                unsigned int *tid)
+{
+    uint64_t head, start, first, n, skip, i;
+
+    *tid = r->tid;
+    start = r->start;
+    trace_barrier();
+    head = r->head;
+    trace_barrier();
+    n = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+    first = head - n;
+    if (first < start) {
+        first = start;
+        n = head - start;
+    }
+    for (i = 0; i < n; i++)
+        out[i] = r->records[(first + i) & TRACE_RING_MASK];
+    trace_barrier();
+
+    /* the writer may have overwritten the oldest records meanwhile,
+     * including the slot for the one it is writing now */
+    head = r->head;
+    skip = 0;
+    if (head + 1 > first + TRACE_RING_SIZE)
+        skip = head + 1 - TRACE_RING_SIZE - first;
+    if (skip > n)
+        skip = n;
+    if (skip)
+        memmove(out, out + skip, (n - skip) * sizeof(*out));
+    n -= skip;
+
+    /* another thread took the ring over meanwhile */
+    if (r->start != start)
+        n = 0;
+
+    return n;
+}
+
+static int
+trace_dump(const char *filename, uint64_t *nr_records)
+{
+    struct trace_record *records;
+    struct trace_ring *r;
+    FILE *f;
+    uint64_t i, n;
+    unsigned int tid;
+    int first = 1;
+
+    *nr_records = 0;
+
+    records = malloc(TRACE_RING_SIZE * sizeof(*records));
+    if (!records)
+        return -1;
+
+    f = fopen(filename, "w");
+    if (!f) {
+        warn("%s: fopen(%s) failed", __FUNCTION__, filename);
+        free(records);
+        return -1;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (r = trace_rings; r; r = r->next) {
+        n = trace_ring_copy(r, records, &tid);
+        for (i = 0; i < n; i++) {
+            trace_write_record(f, tid, &records[i], first);
+            first = 0;
+        }
+        *nr_records += n;
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    free(records);
+    if (fclose(f)) {
+        warn("%s: fclose(%s) failed", __FUNCTION__, filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* comma separated category names, "all" or "none" */
+static int
+trace_parse_categories(const char *s, uint32_t *cats)
+{
+    const char *e;
+    size_t len;
+    int i;
+
+    *cats = 0;
+    while (*s) {
+        e = strchr(s, ',');
+        len = e ? e - s : strlen(s);
+        if (len == 3 && !strncmp(s, "all", len))
+            *cats |= TRACE_ALL;
+        else if (!(len == 4 && !strncmp(s, "none", len)) && len) {
+            for (i = 0; i < NR_TRACE_CATEGORIES; i++)
+                if (strlen(trace_category_names[i].name) == len &&
+                    !strncmp(s, trace_category_names[i].name, len))
+                    break;
+            if (i == NR_TRACE_CATEGORIES)
+                return -1;
+            *cats |= trace_category_names[i].cat;
+        }
+        s += len;
+        if (*s)
+            s++;
+    }
+
+    return 0;
+}
+
+void
+mc_trace_categories(Monitor *mon, const dict args)
+{
+    const char *categories;
+    uint32_t cats;
+    int i;
+
+    categories = dict_get_string(args, "categories");
+    if (categories) {
+        if (trace_parse_categories(categories, &cats)) {
+            monitor_printf(mon, "unknown trace category in %s\n",
+                           categories);
+            return;
+        }
+        trace_categories = cats;
+    }
+
+    monitor_printf(mon, "trace categories:");
+    for (i = 0; i < NR_TRACE_CATEGORIES; i++) {
+        uint32_t cat = trace_category_names[i].cat;
+
+        if (!(TRACE_COMPILED_CATEGORIES & cat))
+            monitor_printf(mon, " %s(compiled out)",
+                           trace_category_names[i].name);
+        else if (trace_categories & cat)
+            monitor_printf(mon, " %s", trace_category_names[i].name);
+    }
+    monitor_printf(mon, "\n");
+}
+
+void
+mc_trace_dump(Monitor *mon, const dict args)
+{
+    const char *filename;
+    uint64_t n;
+
+    filename = dict_get_string(args, "filename");
+    if (trace_dump(filename, &n)) {
+        monitor_printf(mon, "trace dump to %s failed\n", filename);
+        return;
+    }
+
+    monitor_printf(mon, "%"PRIu64" trace events from %u threads written "
+                   "to %s\n", n, trace_nr_rings, filename);
+}
+#endif  /* MONITOR */
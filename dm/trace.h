@@ -0,0 +1,77 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/* categories, toggled at runtime with the trace-categories monitor command */
+#define TRACE_IOREQ     0x01
+#define TRACE_SWAP      0x02
+#define TRACE_DUBTREE   0x04
+#define TRACE_NICKEL    0x08
+#define TRACE_TIMER     0x10
+#define TRACE_ALL       0x1f
+
+/* categories built in, anything not in the mask compiles to nothing */
+#ifndef TRACE_COMPILED_CATEGORIES
+#ifdef CONFIG_TRACE
+#define TRACE_COMPILED_CATEGORIES TRACE_ALL
+#else
+#define TRACE_COMPILED_CATEGORIES 0
+#endif
+#endif
+
+/* trace points carry their category in the high byte, so that testing
+ * the compiled mask folds to a constant */
+#define TRACE_POINT(cat, n) (((cat) << 8) | (n))
+#define TRACE_POINT_CAT(tp) ((tp) >> 8)
+
+enum trace_point {
+    TRACE_IOREQ_HANDLE = TRACE_POINT(TRACE_IOREQ, 0),
+    TRACE_SWAP_READ = TRACE_POINT(TRACE_SWAP, 0),
+    TRACE_SWAP_WRITE = TRACE_POINT(TRACE_SWAP, 1),
+    TRACE_DUBTREE_MERGE = TRACE_POINT(TRACE_DUBTREE, 0),
+    TRACE_NICKEL_IN = TRACE_POINT(TRACE_NICKEL, 0),
+    TRACE_NICKEL_OUT = TRACE_POINT(TRACE_NICKEL, 1),
+    TRACE_TIMER_FIRE = TRACE_POINT(TRACE_TIMER, 0),
+};
+
+extern volatile uint32_t trace_categories;
+
+void trace_event(unsigned int tp, char phase, uint64_t id, uint64_t arg0,
+                 uint64_t arg1);
+
+#if TRACE_COMPILED_CATEGORIES
+
+#define trace_enabled(tp)                                               \
+    ((TRACE_COMPILED_CATEGORIES & TRACE_POINT_CAT(tp)) &&               \
+     (trace_categories & TRACE_POINT_CAT(tp)))
+
+#define __TRACE(tp, phase, id, arg0, arg1) do {                         \
+        if (trace_enabled(tp))                                          \
+            trace_event((tp), (phase), (uint64_t)(id),                  \
+                        (uint64_t)(arg0), (uint64_t)(arg1));            \
+    } while (0)
+
+#else
+
+#define trace_enabled(tp) 0
+#define __TRACE(tp, phase, id, arg0, arg1) do { } while (0)
+
+#endif  /* TRACE_COMPILED_CATEGORIES */
+
+/* duration on the current thread, begin and end must nest */
+#define TRACE_BEGIN(tp, arg0, arg1) __TRACE(tp, 'B', 0, arg0, arg1)
+#define TRACE_END(tp, arg0, arg1) __TRACE(tp, 'E', 0, arg0, arg1)
+/* duration matched by id, may end on another thread */
+#define TRACE_ASYNC_BEGIN(tp, id, arg0, arg1)   \
+    __TRACE(tp, 'b', (uintptr_t)(id), arg0, arg1)
+#define TRACE_ASYNC_END(tp, id, arg0, arg1)     \
+    __TRACE(tp, 'e', (uintptr_t)(id), arg0, arg1)
+#define TRACE_INSTANT(tp, arg0, arg1) __TRACE(tp, 'i', 0, arg0, arg1)
+
+#endif  /* _TRACE_H_ */
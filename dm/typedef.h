@@ -38,7 +38,7 @@ typedef struct RTCState RTCState;
 typedef struct SerialSetParams SerialSetParams;
 typedef struct SerialState SerialState;
 typedef struct Timer Timer;
-typedef TAILQ_HEAD( , Timer) TimerQueue;
+typedef struct TimerQueue TimerQueue;
 typedef struct VLANState VLANState;
 typedef struct VLANClientState VLANClientState;
 typedef struct VMStateField VMStateField;
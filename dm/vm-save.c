@@ -35,6 +35,7 @@
 #include "vm-save.h"
 #include "vm-savefile.h"
 #include "uxen.h"
+#include "zero-scan.h"
 #include "hw/uxen_platform.h"
 #include "mapcache.h"
 
@@ -58,6 +59,9 @@
 #define DECOMPRESS_THREADED
 #define DECOMPRESS_THREADS 2
 
+/* worker threads used to restore indexed page batches */
+#define LOAD_THREADS 4
+
 #ifdef DEBUG
 #define VERBOSE 1
 #endif
@@ -390,6 +394,43 @@ uxenvm_compress_lz4(const void *src, void *dst, int sz)
     }
 }
 
+#define ADLER32_BASE 65521
+/* largest n such that 255n(n+1)/2 + (n+1)(BASE-1) fits in 32 bits */
+#define ADLER32_NMAX 5552
+
+static uint32_t
+adler32_update(uint32_t adler, const uint8_t *buf, size_t len)
+{
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    size_t n;
+
+    while (len) {
+        n = len < ADLER32_NMAX ? len : ADLER32_NMAX;
+        len -= n;
+        while (n--) {
+            a += *buf++;
+            b += a;
+        }
+        a %= ADLER32_BASE;
+        b %= ADLER32_BASE;
+    }
+
+    return (b << 16) | a;
+}
+
+/* write page batch record data, accumulating the record checksum for
+ * the batch index */
+static void
+uxenvm_savevm_write_batch(struct filebuf *f,
+                          struct xc_save_batch_index_entry *e,
+                          void *buf, size_t size)
+{
+
+    filebuf_write(f, buf, size);
+    if (e)
+        e->checksum = adler32_update(e->checksum, buf, size);
+}
+
 static inline int
 compression_is_cuckoo(void)
 {
@@ -466,6 +507,11 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
     int trivial_nr = 0;
     struct xc_save_vm_fingerprints s_vm_fingerprints;
     struct xc_save_index fingerprints_index = { 0, XC_SAVE_ID_FINGERPRINTS };
+    struct xc_save_batch_index_entry *batch_entries = NULL, *e;
+    int batch_entries_nr = 0;
+    int index_batches = 1;
+    struct xc_save_batch_index s_batch_index;
+    struct xc_save_index batch_index_index = { 0, XC_SAVE_ID_BATCH_INDEX };
     int free_mem;
     int ret;
 
@@ -589,19 +635,18 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
             if (gpfn_info_list[j].type == XENMEM_MCGI_TYPE_NORMAL) {
                 uint32_t *p = (uint32_t *)&mem_buffer[gpfn_info_list[j].offset];
                 int i = 0;
-                while (i < (PAGE_SIZE / sizeof(*p)) && p[i] == p[0])
-                    i++;
-                if (i == (PAGE_SIZE / sizeof(*p))) {
-                    if (p[0] == 0) {
-                        gpfn_info_list[j].type = XENMEM_MCGI_TYPE_ZERO;
-                        rezero++;
-                        total_rezero++;
-                        /* Always re-share zero pages. */
-                        if (!free_mem)
-                            rezero_pfns[rezero_nr++] = pfn + j;
-                    } else {
+                if (zero_scan_page(p)) {
+                    gpfn_info_list[j].type = XENMEM_MCGI_TYPE_ZERO;
+                    rezero++;
+                    total_rezero++;
+                    /* Always re-share zero pages. */
+                    if (!free_mem)
+                        rezero_pfns[rezero_nr++] = pfn + j;
+                } else if (p[0]) {
+                    while (i < (PAGE_SIZE / sizeof(*p)) && p[i] == p[0])
+                        i++;
+                    if (i == (PAGE_SIZE / sizeof(*p)))
                         ++trivial_nr;
-                    }
                 }
             }
             if (gpfn_info_list[j].type == XENMEM_MCGI_TYPE_NORMAL) {
@@ -623,19 +668,44 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
                                        XENMEMF_populate_on_demand, rezero_pfns);
             rezero_nr = 0;
         }
+        e = NULL;
         if (_batch) {
             if (vm_save_compress_mode_batched(vm_save_info.compress_mode)) {
                 SAVE_DPRINTF("page batch %08x:%08x = %03x pages,"
                              " rezero %03x, clone %03x, zero %03x",
                              pfn, pfn + batch, _batch, rezero, clone, _zero);
+                if (index_batches &&
+                    !((batch_entries_nr - 1) & batch_entries_nr)) {
+                    struct xc_save_batch_index_entry *n;
+
+                    n = realloc(batch_entries, sizeof(batch_entries[0]) *
+                                (batch_entries_nr ? 2 * batch_entries_nr : 1));
+                    if (!n) {
+                        EPRINTF("%s: batch_entries realloc failed, "
+                                "disabling batch index", __FUNCTION__);
+                        free(batch_entries);
+                        batch_entries = NULL;
+                        index_batches = 0;
+                        batch_entries_nr = 0;
+                    } else
+                        batch_entries = n;
+                }
+                if (index_batches) {
+                    e = &batch_entries[batch_entries_nr];
+                    e->offset = filebuf_tell(f);
+                    e->checksum = 1;
+                    e->pfn_first = pfn_batch[0];
+                    e->pfn_last = pfn_batch[_batch - 1];
+                }
                 if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4)
                     _batch += vm_save_info.single_page ?
                         2 * MAX_BATCH_SIZE : MAX_BATCH_SIZE;
-                filebuf_write(f, &_batch, sizeof(_batch));
+                uxenvm_savevm_write_batch(f, e, &_batch, sizeof(_batch));
                 if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4)
                     _batch -= vm_save_info.single_page ?
                         2 * MAX_BATCH_SIZE : MAX_BATCH_SIZE;
-                filebuf_write(f, pfn_batch, _batch * sizeof(pfn_batch[0]));
+                uxenvm_savevm_write_batch(f, e, pfn_batch,
+                                          _batch * sizeof(pfn_batch[0]));
                 if (vm_save_info.compress_mode == VM_SAVE_COMPRESS_LZ4 &&
                     vm_save_info.single_page) {
                     compress_size = 0;
@@ -690,8 +760,8 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
                             poi.pfn_off[poi_pfn_index(&poi, pfn + run + i)] =
                                 pos + (i << PAGE_SHIFT);
                         }
-                        filebuf_write(
-                            f, &mem_buffer[gpfn_info_list[run].offset],
+                        uxenvm_savevm_write_batch(
+                            f, e, &mem_buffer[gpfn_info_list[run].offset],
                             b_run << PAGE_SHIFT);
                     } else if (vm_save_info.compress_mode ==
                                VM_SAVE_COMPRESS_LZ4) {
@@ -756,26 +826,34 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
                                      compress_size - (m_run << PAGE_SHIFT));
                         compress_size = -1;
                     }
-                    filebuf_write(f, &compress_size, sizeof(compress_size));
+                    uxenvm_savevm_write_batch(f, e, &compress_size,
+                                              sizeof(compress_size));
                     if (compress_size != -1) {
-                        filebuf_write(f, compress_buf, compress_size);
+                        uxenvm_savevm_write_batch(f, e, compress_buf,
+                                                  compress_size);
                         total_compressed_pages += m_run;
                         total_compress_save +=
                             (m_run << PAGE_SHIFT) - compress_size;
                     } else {
-                        filebuf_write(f, compress_mem,
-                                      m_run << PAGE_SHIFT);
+                        uxenvm_savevm_write_batch(f, e, compress_mem,
+                                                  m_run << PAGE_SHIFT);
                         total_compress_in_vain += m_run;
                     }
                 } else {
-                    filebuf_write(f, &compress_size, sizeof(compress_size));
-                    filebuf_write(f, compress_buf, compress_size);
+                    uxenvm_savevm_write_batch(f, e, &compress_size,
+                                              sizeof(compress_size));
+                    uxenvm_savevm_write_batch(f, e, compress_buf,
+                                              compress_size);
                     total_compressed_pages += m_run;
                     total_compress_save +=
                         ((m_run + v_run) << PAGE_SHIFT) - compress_size;
                     total_compress_in_vain += v_run;
                 }
             }
+            if (e) {
+                e->size = filebuf_tell(f) - e->offset;
+                batch_entries_nr++;
+            }
 	}
 	pfn += batch;
     }
@@ -857,6 +935,20 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
             filebuf_write(f, hashes,
                           s_vm_fingerprints.size - sizeof(s_vm_fingerprints));
         }
+
+        if (index_batches && batch_entries_nr) {
+            s_batch_index.marker = XC_SAVE_ID_BATCH_INDEX;
+            s_batch_index.batch_nr = batch_entries_nr;
+            s_batch_index.size = sizeof(s_batch_index) +
+                s_batch_index.batch_nr * sizeof(s_batch_index.batches[0]);
+            batch_index_index.offset = filebuf_tell(f);
+            APRINTF("batch index: pos %"PRId64" size %d nr batches %d",
+                    batch_index_index.offset, s_batch_index.size,
+                    s_batch_index.batch_nr);
+            filebuf_write(f, &s_batch_index, sizeof(s_batch_index));
+            filebuf_write(f, batch_entries,
+                          s_batch_index.size - sizeof(s_batch_index));
+        }
     }
 
     if (!check_aborted()) {
@@ -868,6 +960,8 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
         filebuf_write(f, &page_offsets_index, sizeof(page_offsets_index));
         if (vm_save_info.fingerprint)
             filebuf_write(f, &fingerprints_index, sizeof(fingerprints_index));
+        if (batch_index_index.offset)
+            filebuf_write(f, &batch_index_index, sizeof(batch_index_index));
 
         APRINTF("memory: pages %d zero %d rezero %d clone %d trivial %d",
                 total_pages, total_zero - total_rezero, total_rezero,
@@ -894,6 +988,7 @@ uxenvm_savevm_write_pages(struct filebuf *f, char **err_msg)
     free(poi.pfn_off);
     free(rezero_pfns);
     free(hashes);
+    free(batch_entries);
     free(pfn_batch);
     free(gpfn_info_list);
     free(compress_mem);
@@ -1286,6 +1381,28 @@ uxenvm_load_alloc(xen_pfn_t **pfn_type, int **pfn_err, int **pfn_info,
     return ret;
 }
 
+static int
+uxenvm_load_batch_marker(int32_t *marker, int *decompress, int *single_page,
+                         char **err_msg)
+{
+
+    *decompress = 0;
+    *single_page = 0;
+    if ((unsigned int)*marker > 3 * MAX_BATCH_SIZE) {
+        asprintf(err_msg, "invalid batch size: %x",
+                 (unsigned int)*marker);
+        return -EINVAL;
+    } else if (*marker > 2 * MAX_BATCH_SIZE) {
+        *marker -= 2 * MAX_BATCH_SIZE;
+        *decompress = 1;
+        *single_page = 1;
+    } else if (*marker > MAX_BATCH_SIZE) {
+        *marker -= MAX_BATCH_SIZE;
+        *decompress = 1;
+    }
+    return 0;
+}
+
 static int
 uxenvm_load_batch(struct filebuf *f, int32_t marker, xen_pfn_t *pfn_type,
                   int *pfn_err, int *pfn_info, struct decompress_ctx *dc,
@@ -1296,21 +1413,10 @@ uxenvm_load_batch(struct filebuf *f, int32_t marker, xen_pfn_t *pfn_type,
     int single_page;
     int ret;
 
-    decompress = 0;
-    single_page = 0;
-    if ((unsigned int)marker > 3 * MAX_BATCH_SIZE) {
-        asprintf(err_msg, "invalid batch size: %x",
-                 (unsigned int)marker);
-        ret = -EINVAL;
+    ret = uxenvm_load_batch_marker(&marker, &decompress, &single_page,
+                                   err_msg);
+    if (ret)
         goto out;
-    } else if (marker > 2 * MAX_BATCH_SIZE) {
-        marker -= 2 * MAX_BATCH_SIZE;
-        decompress = 1;
-        single_page = 1;
-    } else if (marker > MAX_BATCH_SIZE) {
-        marker -= MAX_BATCH_SIZE;
-        decompress = 1;
-    }
     if (decompress) {
 #ifdef DECOMPRESS_THREADED
         if (!dc->async_op_ctx) {
@@ -1379,6 +1485,304 @@ uxenvm_load_batch(struct filebuf *f, int32_t marker, xen_pfn_t *pfn_type,
     return ret;
 }
 
+struct indexed_load_ctx {
+    struct filebuf *f;
+    struct xc_save_batch_index *bi;
+    int next;
+    int populate_compressed;
+    int running;
+    int ret;
+    char *err_msg;
+    critical_section lock;
+    ioh_event process_event;
+    xc_interface *xc_handle;
+    int vm_id;
+};
+
+struct indexed_load_worker {
+    struct indexed_load_ctx *ilc;
+    uint8_t *buf;
+    uint32_t buf_size;
+    xc_hypercall_buffer_t pp_buffer;
+    xen_pfn_t *pfn_type;
+    int *pfn_err;
+    int pages;
+};
+
+static int
+indexed_load_one(struct indexed_load_worker *w,
+                 struct xc_save_batch_index_entry *e, char **err_msg)
+{
+    struct indexed_load_ctx *ilc = w->ilc;
+    uint8_t *p, *end, *mem = NULL;
+    int32_t marker, pfn_info, compress_size = -1;
+    int decompress, single_page;
+    int j;
+    int ret;
+
+    if (e->size > w->buf_size) {
+        free(w->buf);
+        w->buf_size = 0;
+        w->buf = malloc(e->size);
+        if (!w->buf) {
+            asprintf(err_msg, "malloc(%u) failed", e->size);
+            ret = -ENOMEM;
+            goto out;
+        }
+        w->buf_size = e->size;
+    }
+
+    ret = filebuf_pread(ilc->f, w->buf, e->size, e->offset);
+    if (ret != e->size) {
+        asprintf(err_msg, "filebuf_pread(batch at %"PRId64") failed",
+                 e->offset);
+        ret = ret < 0 ? -errno : -EIO;
+        goto out;
+    }
+    if (adler32_update(1, w->buf, e->size) != e->checksum) {
+        asprintf(err_msg, "batch at %"PRId64" checksum mismatch", e->offset);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    p = w->buf;
+    end = p + e->size;
+    if (end - p < sizeof(marker))
+        goto short_record;
+    memcpy(&marker, p, sizeof(marker));
+    p += sizeof(marker);
+    ret = uxenvm_load_batch_marker(&marker, &decompress, &single_page,
+                                   err_msg);
+    if (ret)
+        goto out;
+
+    if (!marker || end - p < marker * sizeof(pfn_info))
+        goto short_record;
+    for (j = 0; j < marker; j++) {
+        memcpy(&pfn_info, p, sizeof(pfn_info));
+        p += sizeof(pfn_info);
+        w->pfn_type[j] = pfn_info & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+    }
+    if (w->pfn_type[0] != e->pfn_first ||
+        w->pfn_type[marker - 1] != e->pfn_last) {
+        asprintf(err_msg, "batch at %"PRId64" pfn range mismatch",
+                 e->offset);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (decompress) {
+        if (end - p < sizeof(compress_size))
+            goto short_record;
+        memcpy(&compress_size, p, sizeof(compress_size));
+        p += sizeof(compress_size);
+        if (compress_size == -1)
+            decompress = 0;
+    }
+
+    LOAD_DPRINTF("  populate %08"PRIx64":%08"PRIx64" = %03x pages",
+                 w->pfn_type[0], w->pfn_type[marker - 1] + 1, marker);
+    if (!decompress) {
+        if (end - p < (marker << PAGE_SHIFT))
+            goto short_record;
+        ret = xc_domain_populate_physmap_exact(
+            ilc->xc_handle, ilc->vm_id, marker, 0,
+            XENMEMF_populate_on_demand, w->pfn_type);
+        if (ret) {
+            asprintf(err_msg, "xc_domain_populate_physmap_exact failed");
+            goto out;
+        }
+
+        mem = xc_map_foreign_bulk(ilc->xc_handle, ilc->vm_id, PROT_WRITE,
+                                  w->pfn_type, w->pfn_err, marker);
+        if (mem == NULL) {
+            asprintf(err_msg, "xc_map_foreign_bulk failed");
+            ret = -1;
+            goto out;
+        }
+        for (j = 0; j < marker; j++) {
+            if (w->pfn_err[j]) {
+                asprintf(err_msg, "map fail: %d/%d gpfn %08"PRIx64" err %d",
+                         j, marker, w->pfn_type[j], w->pfn_err[j]);
+                ret = -1;
+                goto out;
+            }
+        }
+        memcpy(mem, p, marker << PAGE_SHIFT);
+    } else {
+        int populate_compressed = single_page && ilc->populate_compressed;
+
+        if (compress_size < 0 || end - p < compress_size ||
+            compress_size > PP_BUFFER_PAGES << PAGE_SHIFT)
+            goto short_record;
+        if (!populate_compressed) {
+            ret = decompress_batch(
+                marker, w->pfn_type,
+                HYPERCALL_BUFFER_ARGUMENT_BUFFER(&w->pp_buffer),
+                (char *)p, compress_size, single_page, err_msg);
+            if (ret)
+                goto out;
+        } else
+            memcpy(HYPERCALL_BUFFER_ARGUMENT_BUFFER(&w->pp_buffer),
+                   p, compress_size);
+
+        ret = xc_domain_populate_physmap_from_buffer(
+            ilc->xc_handle, ilc->vm_id, marker, 0, populate_compressed ?
+            XENMEMF_populate_from_buffer_compressed :
+            XENMEMF_populate_from_buffer, w->pfn_type, &w->pp_buffer);
+        if (ret) {
+            asprintf(err_msg, "xc_domain_populate_physmap_from_buffer "
+                     "failed");
+            goto out;
+        }
+    }
+
+    w->pages += marker;
+    ret = 0;
+  out:
+    if (mem)
+        xc_munmap(ilc->xc_handle, ilc->vm_id, mem, marker * PAGE_SIZE);
+    return ret;
+
+  short_record:
+    asprintf(err_msg, "batch at %"PRId64" truncated", e->offset);
+    ret = -EINVAL;
+    goto out;
+}
+
+static void
+indexed_load_cb(void *opaque)
+{
+    struct indexed_load_worker *w = (struct indexed_load_worker *)opaque;
+    struct indexed_load_ctx *ilc = w->ilc;
+    char *err_msg = NULL;
+    int idx;
+    int ret;
+
+    for (;;) {
+        idx = __sync_fetch_and_add(&ilc->next, 1);
+        if (idx >= ilc->bi->batch_nr || ilc->ret)
+            break;
+        ret = indexed_load_one(w, &ilc->bi->batches[idx], &err_msg);
+        if (ret) {
+            critical_section_enter(&ilc->lock);
+            if (!ilc->ret) {
+                ilc->ret = ret;
+                ilc->err_msg = err_msg;
+                err_msg = NULL;
+            }
+            critical_section_leave(&ilc->lock);
+            free(err_msg);
+            break;
+        }
+    }
+}
+
+static void
+indexed_load_complete(void *opaque)
+{
+    struct indexed_load_worker *w = (struct indexed_load_worker *)opaque;
+
+    w->ilc->running--;
+}
+
+/* restore all page batches listed in the batch index, spreading the
+ * reads, decompression and population over LOAD_THREADS threads */
+static int
+uxenvm_load_batches_indexed(struct filebuf *f, struct xc_save_batch_index *bi,
+                            int populate_compressed, char **err_msg)
+{
+    DECLARE_HYPERCALL_BUFFER(uint8_t, pp_buffer);
+    struct indexed_load_ctx ilc = { };
+    struct indexed_load_worker w[LOAD_THREADS] = { };
+    struct async_op_ctx *async_op_ctx = NULL;
+    int i, pages = 0;
+    int ret;
+
+    ilc.f = f;
+    ilc.bi = bi;
+    ilc.populate_compressed = populate_compressed;
+    ilc.xc_handle = xc_handle;
+    ilc.vm_id = vm_id;
+    critical_section_init(&ilc.lock);
+    ioh_event_init(&ilc.process_event);
+
+    for (i = 0; i < LOAD_THREADS; i++) {
+        w[i].ilc = &ilc;
+        pp_buffer = xc_hypercall_buffer_alloc_pages(
+            xc_handle, pp_buffer, PP_BUFFER_PAGES);
+        if (!pp_buffer) {
+            asprintf(err_msg, "xc_hypercall_buffer_alloc_pages"
+                     "(%d pages) failed", PP_BUFFER_PAGES);
+            ret = -ENOMEM;
+            goto out;
+        }
+        w[i].pp_buffer = *HYPERCALL_BUFFER(pp_buffer);
+        pp_buffer = NULL;
+        w[i].pfn_type = malloc(MAX_BATCH_SIZE * sizeof(*w[i].pfn_type));
+        w[i].pfn_err = malloc(MAX_BATCH_SIZE * sizeof(*w[i].pfn_err));
+        if (!w[i].pfn_type || !w[i].pfn_err) {
+            asprintf(err_msg, "pfn_type/pfn_err = malloc failed");
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    APRINTF("loading %d indexed batches with %d threads", bi->batch_nr,
+            LOAD_THREADS);
+
+    async_op_ctx = async_op_init();
+    for (i = 0; i < LOAD_THREADS; i++) {
+        ret = async_op_add(async_op_ctx, &w[i], &ilc.process_event,
+                           indexed_load_cb, indexed_load_complete);
+        if (ret) {
+            /* stop the workers already running, then wait for them */
+            ilc.ret = -1;
+            asprintf(err_msg, "async_op_add failed");
+            break;
+        }
+        ilc.running++;
+    }
+
+    while (ilc.running) {
+        ioh_event_reset(&ilc.process_event);
+        async_op_process(async_op_ctx);
+        if (ilc.running)
+            ioh_event_wait(&ilc.process_event);
+    }
+
+    if (ilc.ret) {
+        if (ilc.err_msg) {
+            *err_msg = ilc.err_msg;
+            ilc.err_msg = NULL;
+        }
+        ret = ilc.ret;
+        goto out;
+    }
+
+    for (i = 0; i < LOAD_THREADS; i++)
+        pages += w[i].pages;
+    uxenvm_load_progress += pages;
+    APRINTF("memory load %d pages", uxenvm_load_progress);
+
+    ret = 0;
+  out:
+    if (async_op_ctx)
+        async_op_free(async_op_ctx);
+    for (i = 0; i < LOAD_THREADS; i++) {
+        if (HYPERCALL_BUFFER_ARGUMENT_BUFFER(&w[i].pp_buffer))
+            xc__hypercall_buffer_free_pages(xc_handle, &w[i].pp_buffer,
+                                            PP_BUFFER_PAGES);
+        free(w[i].buf);
+        free(w[i].pfn_type);
+        free(w[i].pfn_err);
+    }
+    free(ilc.err_msg);
+    ioh_event_close(&ilc.process_event);
+    critical_section_free(&ilc.lock);
+    return ret;
+}
+
 static int
 apply_immutable_memory(struct immutable_range *r, int nranges)
 {
@@ -1425,6 +1829,82 @@ apply_immutable_memory(struct immutable_range *r, int nranges)
 	(s).marker = (_marker);						\
     } while (0)
 
+/* locate the batch index through the index trailer at the end of the
+ * file, and read it -- the file position is preserved */
+static int
+uxenvm_load_batch_index(struct filebuf *f, struct xc_save_batch_index **bi,
+                        char **err_msg)
+{
+    uint64_t batch_index_pos = 0;
+    struct xc_save_batch_index s_batch_index = { };
+    int32_t marker = 0;
+    off_t pos, resume_pos;
+    size_t sz;
+    int ret = 0;
+
+    *bi = NULL;
+    resume_pos = filebuf_tell(f);
+
+    filebuf_seek(f, 0, FILEBUF_SEEK_END);
+    for (;;) {
+        struct xc_save_index index;
+
+        pos = filebuf_seek(f, -(off_t)sizeof(index), FILEBUF_SEEK_CUR);
+        uxenvm_load_read(f, &index, sizeof(index), ret, err_msg, out);
+        if (!index.marker) {
+            break;
+        } else if (index.marker == XC_SAVE_ID_BATCH_INDEX) {
+            batch_index_pos = index.offset;
+            break;
+        }
+        filebuf_seek(f, pos, FILEBUF_SEEK_SET);
+    }
+
+    if (!batch_index_pos)
+        goto out;
+
+    filebuf_seek(f, batch_index_pos, FILEBUF_SEEK_SET);
+    uxenvm_load_read(f, &s_batch_index.marker, sizeof(s_batch_index.marker),
+                     ret, err_msg, out);
+    if (s_batch_index.marker != XC_SAVE_ID_BATCH_INDEX) {
+        asprintf(err_msg, "no batch index at offset %"PRId64,
+                 batch_index_pos);
+        ret = -EINVAL;
+        goto out;
+    }
+    uxenvm_load_read_struct(f, s_batch_index, XC_SAVE_ID_BATCH_INDEX, ret,
+                            err_msg, out);
+
+    sz = s_batch_index.batch_nr * sizeof(s_batch_index.batches[0]);
+    if (!s_batch_index.batch_nr ||
+        s_batch_index.size != sizeof(s_batch_index) + sz) {
+        asprintf(err_msg, "invalid batch index: size %d nr batches %d",
+                 s_batch_index.size, s_batch_index.batch_nr);
+        ret = -EINVAL;
+        goto out;
+    }
+    *bi = malloc(s_batch_index.size);
+    if (!*bi) {
+        asprintf(err_msg, "batch_index = malloc(%d) failed",
+                 s_batch_index.size);
+        ret = -ENOMEM;
+        goto out;
+    }
+    **bi = s_batch_index;
+    uxenvm_load_read(f, (*bi)->batches, sz, ret, err_msg, out);
+    APRINTF("found batch index: %d batches at offset %"PRId64,
+            s_batch_index.batch_nr, batch_index_pos);
+
+    ret = 0;
+  out:
+    if (ret && *bi) {
+        free(*bi);
+        *bi = NULL;
+    }
+    filebuf_seek(f, resume_pos, FILEBUF_SEEK_SET);
+    return ret;
+}
+
 #ifdef SAVE_CUCKOO_ENABLED
 static int
 map_template_fingerprints(struct filebuf *t,
@@ -1655,6 +2135,8 @@ uxenvm_loadvm_execute(struct filebuf *f, int restore_mode, char **err_msg)
     struct xc_save_cuckoo_data s_cuckoo = { };
 #endif
     struct xc_save_whpx_memory_data s_whpx_memory = { };
+    struct xc_save_generic s_generic = { };
+    struct xc_save_batch_index *batch_index = NULL;
     struct immutable_range *immutable_ranges = NULL;
     uint8_t *hvm_buf = NULL;
     uint8_t *zero_bitmap = NULL, *zero_bitmap_compressed = NULL;
@@ -1682,12 +2164,25 @@ uxenvm_loadvm_execute(struct filebuf *f, int restore_mode, char **err_msg)
         goto out;
     }
     uxenvm_load_read_struct(f, s_version_info, marker, ret, err_msg, out);
-    if (s_version_info.version != SAVE_FORMAT_VERSION) {
-        asprintf(err_msg, "version info mismatch: %d != %d",
-                 s_version_info.version, SAVE_FORMAT_VERSION);
+    if (s_version_info.version < SAVE_FORMAT_VERSION_MIN ||
+        s_version_info.version > SAVE_FORMAT_VERSION) {
+        asprintf(err_msg, "version info mismatch: %d not in %d-%d",
+                 s_version_info.version, SAVE_FORMAT_VERSION_MIN,
+                 SAVE_FORMAT_VERSION);
         ret = -EINVAL;
         goto out;
     }
+    if (s_version_info.version >= 6) {
+        char *index_err_msg = NULL;
+
+        /* a missing or unreadable batch index only disables the
+         * parallel restore path */
+        if (uxenvm_load_batch_index(f, &batch_index, &index_err_msg)) {
+            EPRINTF("ignoring batch index: %s",
+                    index_err_msg ? : "read failed");
+            free(index_err_msg);
+        }
+    }
     while (!vm_quit_interrupt) {
         uxenvm_load_read(f, &marker, sizeof(marker), ret, err_msg, out);
 	if (marker == 0)	/* end marker */
@@ -1898,9 +2393,39 @@ uxenvm_loadvm_execute(struct filebuf *f, int restore_mode, char **err_msg)
                                     err_msg, out);
             clock_save_adjust = s_clock_info.adjust_offset;
             break;
+        case XC_SAVE_ID_BATCH_INDEX:
+            uxenvm_load_read_struct(f, s_generic, marker, ret, err_msg, out);
+            ret = filebuf_seek(f, s_generic.size - sizeof(s_generic),
+                               FILEBUF_SEEK_CUR) != -1 ? 0 : -EIO;
+            if (ret < 0) {
+                asprintf(err_msg, "filebuf_seek(batch_index) failed");
+                goto out;
+            }
+            break;
 	default:
             uxenvm_check_restore_clone(restore_mode);
             uxenvm_check_mapcache_init();
+            if (batch_index && filebuf_tell(f) - sizeof(marker) ==
+                batch_index->batches[0].offset) {
+                struct xc_save_batch_index_entry *last =
+                    &batch_index->batches[batch_index->batch_nr - 1];
+
+                ret = uxenvm_load_batches_indexed(f, batch_index,
+                                                  populate_compressed,
+                                                  err_msg);
+                if (ret)
+                    goto out;
+                ret = filebuf_seek(f, last->offset + last->size,
+                                   FILEBUF_SEEK_SET) != -1 ? 0 : -EIO;
+                if (ret < 0) {
+                    asprintf(err_msg, "filebuf_seek(batch end) failed");
+                    goto out;
+                }
+                /* batches are only ever loaded once */
+                free(batch_index);
+                batch_index = NULL;
+                break;
+            }
             ret = uxenvm_load_batch(f, marker, pfn_type, pfn_err, pfn_info,
                                     &dc, populate_compressed, err_msg);
             if (ret)
@@ -2008,6 +2533,7 @@ uxenvm_loadvm_execute(struct filebuf *f, int restore_mode, char **err_msg)
     if (dc.async_op_ctx)
         (void)decompress_wait_all(&dc, NULL);
 #endif  /* DECOMPRESS_THREADED */
+    free(batch_index);
     free(pfn_err);
     free(pfn_info);
     free(pfn_type);
@@ -2183,10 +2709,10 @@ vm_save_execute(void)
     APRINTF("device model saving state: %s", vm_save_info.filename);
 
     if (!vm_save_info.save_via_temp)
-        f = filebuf_open(vm_save_info.filename, "wb");
+        f = filebuf_open(vm_save_info.filename, "wba");
     else {
         char *temp = vm_save_file_temp_filename(vm_save_info.filename);
-        f = filebuf_open(temp, "wb");
+        f = filebuf_open(temp, "wba");
         free(temp);
     }
     if (f == NULL) {
@@ -2342,6 +2868,7 @@ vm_restore_memory(void)
         case XC_SAVE_ID_PAGE_OFFSETS:
         case XC_SAVE_ID_ZERO_BITMAP:
         case XC_SAVE_ID_FINGERPRINTS:
+        case XC_SAVE_ID_BATCH_INDEX:
             uxenvm_load_read_struct(f, s_generic, marker, ret, &err_msg,
                                     out);
             ret = filebuf_seek(f, s_generic.size - sizeof(s_generic),
@@ -11,7 +11,9 @@
 #include <fingerprint.h>
 #include <xen/hvm/params.h>
 
-#define SAVE_FORMAT_VERSION 5
+#define SAVE_FORMAT_VERSION 6
+/* oldest version still loadable, version 6 added the batch index */
+#define SAVE_FORMAT_VERSION_MIN 5
 // #include <xg_save_restore.h>
 #define XC_SAVE_ID_VCPU_INFO          -2 /* Additional VCPU info */
 #define XC_SAVE_ID_TSC_INFO           -7
@@ -31,6 +33,7 @@
 #define XC_SAVE_ID_CLOCK_INFO         -25
 #define XC_SAVE_ID_WHPX_MEMORY_DATA   -26
 #define XC_SAVE_ID_WHPX_HVM_CONTEXT   -27
+#define XC_SAVE_ID_BATCH_INDEX        -28
 
 #define MAX_BATCH_SIZE 1023
 
@@ -135,6 +138,24 @@ struct PACKED xc_save_index {
                                  * an index end marker */
 };
 
+/* one entry per page batch record, in file order -- offset and size
+ * cover the whole record starting at the batch marker, checksum is
+ * adler32 over those bytes */
+struct PACKED xc_save_batch_index_entry {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t checksum;
+    uint32_t pfn_first;
+    uint32_t pfn_last;
+};
+
+struct xc_save_batch_index {
+    struct xc_save_generic;
+
+    uint32_t batch_nr;
+    struct xc_save_batch_index_entry batches[];
+};
+
 struct xc_save_cuckoo_data {
     int32_t marker;
     int32_t simple_mode;
@@ -25,6 +25,7 @@
 //#include <assert.h>
 
 #include "vram.h"
+#include "zero-scan.h"
 
 #include <dm/whpx/whpx.h>
 
@@ -42,6 +43,241 @@
 #define DPRINTF(fmt, ...) do {} while (0)
 #endif
 
+/*
+ * Tiled save format, used when vm_vram_keyframe_interval is non-zero.
+ * The lz4 length field holds VRAM_TILED, followed by the length of a
+ * blob of: tile size, tile count, one info word per tile, then the
+ * payloads of all tiles in order.  Zero tiles have no payload and
+ * uniform tiles a 4 byte fill value.  The other tiles are LZ4 streams
+ * or, if they do not compress, raw.
+ *
+ * The hash and encoding of every tile is kept from one save to the
+ * next, so tiles unchanged since the previous save are copied rather
+ * than compressed again.  Every vm_vram_keyframe_interval saves all
+ * tiles are encoded from scratch, which bounds how long a hash
+ * collision can go unnoticed.
+ */
+#define VRAM_TILED 0xffffffff
+#define VRAM_TILE_SIZE (64 << 10)
+#define VRAM_TILE_KIND_SHIFT 30
+#define VRAM_TILE_LEN_MASK ((1U << VRAM_TILE_KIND_SHIFT) - 1)
+#define VRAM_TILE_ZERO 0U
+#define VRAM_TILE_FILL 1U
+#define VRAM_TILE_LZ4 2U
+#define VRAM_TILE_RAW 3U
+#define vram_tile_kind(info) ((info) >> VRAM_TILE_KIND_SHIFT)
+#define vram_tile_len(info) ((info) & VRAM_TILE_LEN_MASK)
+
+struct vram_tile {
+    uint64_t hash;
+    uint32_t info;
+    int valid;
+    uint8_t *data;              /* LZ4 and fill payloads */
+};
+
+struct vram_tiled_hdr {
+    uint32_t tile_size;
+    uint32_t ntiles;
+    uint32_t info[];
+};
+
+static void
+vram_tiles_free(struct vram_tiles *t)
+{
+    size_t i, ntiles;
+
+    if (!t->tile)
+        return;
+    ntiles = (t->len + VRAM_TILE_SIZE - 1) / VRAM_TILE_SIZE;
+    for (i = 0; i < ntiles; i++)
+        free(t->tile[i].data);
+    free(t->tile);
+    t->tile = NULL;
+    t->len = 0;
+}
+
+static uint64_t
+vram_tile_hash(const uint8_t *p, size_t len)
+{
+    const uint64_t *q = (const uint64_t *)p;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(*q); i++)
+        h = (h ^ q[i]) * 0x100000001b3ULL;
+    for (i *= sizeof(*q); i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+/* encode tile p of len bytes at out, return its info word */
+static uint32_t
+vram_tile_encode(const uint8_t *p, size_t len, uint8_t *out)
+{
+    const uint32_t *q = (const uint32_t *)p;
+    size_t i;
+    int ret;
+
+    if (!(len & ~TARGET_PAGE_MASK) &&
+        zero_scan_run(p, len >> PAGE_SHIFT, 1) == len >> PAGE_SHIFT)
+        return VRAM_TILE_ZERO << VRAM_TILE_KIND_SHIFT;
+
+    if (!(len % sizeof(*q))) {
+        for (i = 1; i < len / sizeof(*q) && q[i] == q[0]; i++)
+            ;
+        if (i == len / sizeof(*q)) {
+            memcpy(out, q, sizeof(*q));
+            return (VRAM_TILE_FILL << VRAM_TILE_KIND_SHIFT) | sizeof(*q);
+        }
+    }
+
+    ret = LZ4_compress_limitedOutput((const char *)p, (char *)out, len,
+                                     len - 1);
+    if (ret > 0)
+        return (VRAM_TILE_LZ4 << VRAM_TILE_KIND_SHIFT) | ret;
+
+    memcpy(out, p, len);
+    return (VRAM_TILE_RAW << VRAM_TILE_KIND_SHIFT) | len;
+}
+
+static int
+vram_tiles_encode(struct vram_tiles *tiles, const uint8_t *view,
+                  size_t view_len, uint8_t **blob, size_t *blob_len)
+{
+    struct vram_tiled_hdr *hdr;
+    size_t ntiles, i, off, len;
+    uint8_t *out;
+    int keyframe;
+    int reused = 0, kinds[4] = { };
+
+    ntiles = (view_len + VRAM_TILE_SIZE - 1) / VRAM_TILE_SIZE;
+
+    keyframe = !tiles->tile || tiles->len != view_len ||
+        ++tiles->saves_since_keyframe >= vm_vram_keyframe_interval;
+    if (keyframe) {
+        vram_tiles_free(tiles);
+        tiles->tile = calloc(ntiles, sizeof(struct vram_tile));
+        if (!tiles->tile)
+            return -1;
+        tiles->len = view_len;
+        tiles->saves_since_keyframe = 0;
+    }
+
+    hdr = malloc(sizeof(*hdr) + ntiles * sizeof(hdr->info[0]) +
+                 ntiles * LZ4_compressBound(VRAM_TILE_SIZE));
+    if (!hdr)
+        return -1;
+    hdr->tile_size = VRAM_TILE_SIZE;
+    hdr->ntiles = ntiles;
+    out = (uint8_t *)&hdr->info[ntiles];
+
+    for (i = 0, off = 0; i < ntiles; i++, off += VRAM_TILE_SIZE) {
+        struct vram_tile *t = &tiles->tile[i];
+        const uint8_t *p = view + off;
+        uint64_t hash;
+
+        len = view_len - off;
+        if (len > VRAM_TILE_SIZE)
+            len = VRAM_TILE_SIZE;
+
+        hash = vram_tile_hash(p, len);
+        if (t->valid && t->hash == hash) {
+            hdr->info[i] = t->info;
+            memcpy(out, vram_tile_kind(t->info) == VRAM_TILE_RAW ? p :
+                   t->data, vram_tile_len(t->info));
+            reused++;
+        } else {
+            hdr->info[i] = vram_tile_encode(p, len, out);
+            free(t->data);
+            t->data = NULL;
+            t->valid = 0;
+            switch (vram_tile_kind(hdr->info[i])) {
+            case VRAM_TILE_FILL:
+            case VRAM_TILE_LZ4:
+                t->data = malloc(vram_tile_len(hdr->info[i]));
+                if (!t->data)
+                    break;
+                memcpy(t->data, out, vram_tile_len(hdr->info[i]));
+                /* fall through */
+            default:
+                t->hash = hash;
+                t->info = hdr->info[i];
+                t->valid = 1;
+                break;
+            }
+        }
+        kinds[vram_tile_kind(hdr->info[i])]++;
+        out += vram_tile_len(hdr->info[i]);
+    }
+
+    *blob = (uint8_t *)hdr;
+    *blob_len = out - (uint8_t *)hdr;
+
+    DPRINTF("%s: %s %"PRIdSIZE" tiles, %d unchanged, zero %d fill %d "
+            "lz4 %d raw %d, %"PRIdSIZE" bytes\n", __FUNCTION__,
+            keyframe ? "keyframe" : "delta", ntiles, reused,
+            kinds[VRAM_TILE_ZERO], kinds[VRAM_TILE_FILL],
+            kinds[VRAM_TILE_LZ4], kinds[VRAM_TILE_RAW], *blob_len);
+
+    return 0;
+}
+
+static int
+vram_tiles_decode(uint8_t *view, size_t view_len, const uint8_t *blob,
+                  size_t blob_len)
+{
+    const struct vram_tiled_hdr *hdr = (const struct vram_tiled_hdr *)blob;
+    const uint8_t *in, *end = blob + blob_len;
+    size_t i, j, off, len, ntiles;
+    uint32_t info, fill;
+
+    if (blob_len < sizeof(*hdr) || hdr->tile_size != VRAM_TILE_SIZE)
+        return -1;
+    ntiles = (view_len + VRAM_TILE_SIZE - 1) / VRAM_TILE_SIZE;
+    if (hdr->ntiles != ntiles ||
+        blob_len < sizeof(*hdr) + ntiles * sizeof(hdr->info[0]))
+        return -1;
+    in = (const uint8_t *)&hdr->info[ntiles];
+
+    for (i = 0, off = 0; i < ntiles; i++, off += VRAM_TILE_SIZE) {
+        uint8_t *p = view + off;
+
+        len = view_len - off;
+        if (len > VRAM_TILE_SIZE)
+            len = VRAM_TILE_SIZE;
+        info = hdr->info[i];
+        if (end - in < vram_tile_len(info))
+            return -1;
+
+        switch (vram_tile_kind(info)) {
+        case VRAM_TILE_ZERO:
+            memset(p, 0, len);
+            break;
+        case VRAM_TILE_FILL:
+            if (vram_tile_len(info) != sizeof(fill))
+                return -1;
+            memcpy(&fill, in, sizeof(fill));
+            for (j = 0; j < len / sizeof(fill); j++)
+                ((uint32_t *)p)[j] = fill;
+            break;
+        case VRAM_TILE_LZ4:
+            if (LZ4_decompress_safe((const char *)in, (char *)p,
+                                    vram_tile_len(info), len) != len)
+                return -1;
+            break;
+        case VRAM_TILE_RAW:
+            if (vram_tile_len(info) != len)
+                return -1;
+            memcpy(p, in, len);
+            break;
+        }
+        in += vram_tile_len(info);
+    }
+
+    return 0;
+}
+
 int
 vram_init(struct vram_desc *v, size_t max_len)
 {
@@ -168,8 +404,12 @@ vram_resume(struct vram_desc *v)
         if (buf) {
             if (vm_save_read_dm_offset(buf, v->file_offset, v->lz4_len) ==
                     v->lz4_len) {
-                ret = LZ4_decompress_safe(buf, (void *)v->view, v->lz4_len,
-                                          v->shm_len);
+                if (v->tiled)
+                    ret = vram_tiles_decode(v->view, v->shm_len, buf,
+                                            v->lz4_len);
+                else
+                    ret = LZ4_decompress_safe(buf, (void *)v->view,
+                                              v->lz4_len, v->shm_len);
 
                 if (ret < 0)
                     debug_printf("failed to decompress vram data, r=%d\n", ret);
@@ -205,6 +445,9 @@ vram_resize(struct vram_desc *v, uint32_t new_shm_len)
     if (new_shm_len == v->shm_len)
         return 0;
 
+    if (!new_shm_len)
+        vram_tiles_free(&v->tiles);
+
     gfn = v->gfn;
     if (gfn && v->shm_len) {
         ret = vram_unmap(v);
@@ -391,7 +634,19 @@ get_vram(QEMUFile *f, void *pv, size_t size)
         vram_resize(v, len);
         lz4_len = qemu_get_be32(f);
 
-        if (lz4_len) {
+        if (lz4_len == VRAM_TILED) {
+            size_t blob_len = qemu_get_be32(f);
+            void *p = malloc(blob_len);
+            if (p) {
+                qemu_get_buffer(f, p, blob_len);
+                if (vram_tiles_decode(v->view, v->shm_len, p, blob_len) < 0)
+                    warnx("%s: failed to decode tiled vram, len=%"PRIdSIZE,
+                          __FUNCTION__, blob_len);
+                free(p);
+            } else
+                warnx("%s: failed to alloc tiled vram buffer=%"PRIdSIZE,
+                      __FUNCTION__, blob_len);
+        } else if (lz4_len) {
             void *p = malloc(lz4_len);
             if (p) {
                 qemu_get_buffer(f, p, lz4_len);
@@ -421,22 +676,103 @@ put_vram(QEMUFile *f, void *pv, size_t size)
 
     qemu_put_be32(f, v->shm_len);
     if (v->shm_len) {
-        if (!vm_save_info.ignore_framebuffer) {
+        uint8_t *blob;
+        size_t blob_len;
+
+        if (!vm_save_info.ignore_framebuffer && vm_vram_keyframe_interval &&
+            !vram_tiles_encode(&v->tiles, v->view, v->shm_len, &blob,
+                               &blob_len)) {
+            qemu_put_be32(f, VRAM_TILED);
+            qemu_put_be32(f, blob_len);
+            v->lz4_len = blob_len;
+            v->tiled = 1;
+            v->file_offset = qemu_ftell(f);
+            qemu_put_buffer(f, blob, blob_len);
+            free(blob);
+        } else if (!vm_save_info.ignore_framebuffer) {
             void *p = malloc(LZ4_compressBound(v->shm_len));
             size_t lz4_len = LZ4_compress((void *)v->view, p, v->shm_len);
             qemu_put_be32(f, lz4_len);
             v->lz4_len = lz4_len;
+            v->tiled = 0;
             v->file_offset = qemu_ftell(f);
             qemu_put_buffer(f, p, lz4_len);
             free(p);
         } else {
             v->lz4_len = 0;
+            v->tiled = 0;
             v->file_offset = 0;
             qemu_put_be32(f, 0);
         }
     }
 }
 
+/* A length word, which is VRAM_TILED for the tiled format followed by
+ * the blob length and blob, or else the length of one LZ4 stream of the
+ * whole buffer, which is how VGA RAM was saved before. */
+void
+vram_put_buffer(QEMUFile *f, struct vram_tiles *t, const uint8_t *p,
+                size_t len)
+{
+    uint8_t *blob;
+    size_t blob_len;
+    void *lz4;
+    int lz4_len;
+
+    if (vm_vram_keyframe_interval &&
+        !vram_tiles_encode(t, p, len, &blob, &blob_len)) {
+        qemu_put_be32(f, VRAM_TILED);
+        qemu_put_be32(f, blob_len);
+        qemu_put_buffer(f, blob, blob_len);
+        free(blob);
+        return;
+    }
+
+    lz4 = malloc(LZ4_compressBound(len));
+    if (!lz4)
+        errx(1, "%s: failed to alloc compress buffer=%"PRIdSIZE,
+             __FUNCTION__, (size_t)LZ4_compressBound(len));
+    lz4_len = LZ4_compress((const char *)p, lz4, len);
+    qemu_put_be32(f, lz4_len);
+    qemu_put_buffer(f, lz4, lz4_len);
+    free(lz4);
+}
+
+/* like get_vram(), a buffer that can't be restored is only warned
+ * about */
+int
+vram_get_buffer(QEMUFile *f, uint8_t *p, size_t len)
+{
+    size_t blob_len;
+    void *blob;
+    int tiled, ret;
+
+    blob_len = qemu_get_be32(f);
+    tiled = (blob_len == VRAM_TILED);
+    if (tiled)
+        blob_len = qemu_get_be32(f);
+    blob = malloc(blob_len);
+    if (!blob) {
+        warnx("%s: failed to alloc buffer=%"PRIdSIZE, __FUNCTION__,
+              blob_len);
+        qemu_file_skip(f, blob_len);
+        return 0;
+    }
+    qemu_get_buffer(f, blob, blob_len);
+
+    if (tiled)
+        ret = vram_tiles_decode(p, len, blob, blob_len);
+    else
+        ret = LZ4_decompress_safe(blob, (char *)p, blob_len, len) == len ?
+            0 : -1;
+    if (ret < 0)
+        warnx("%s: failed to decode %s, len=%"PRIdSIZE, __FUNCTION__,
+              tiled ? "tiles" : "lz4", blob_len);
+    free(blob);
+
+    return 0;
+}
+
 const VMStateInfo vmstate_info_vram = {
     .name = "vram",
     .get = get_vram,
@@ -9,6 +9,15 @@
 
 #include "vmstate.h"
 
+struct vram_tile;
+
+/* the tiled save format's state of the previous save */
+struct vram_tiles {
+    struct vram_tile *tile;     /* last saved state of each tile */
+    size_t len;                 /* length the tiles were saved at */
+    unsigned int saves_since_keyframe;
+};
+
 struct vram_desc {
     uintptr_t hdl;
     uint8_t *view;
@@ -19,6 +28,10 @@ struct vram_desc {
     uint32_t last_gfn;
     size_t lz4_len;
     int64_t file_offset;
+    int tiled;                  /* lz4_len/file_offset describe a tiled
+                                 * blob rather than one LZ4 stream */
+
+    struct vram_tiles tiles;
 
     void (*notify)(struct vram_desc *, void *);
     void *priv;
@@ -37,6 +50,11 @@ void vram_register_change(struct vram_desc *v,
                      void (*notify)(struct vram_desc *, void *),
                      void *priv);
 
+/* save and restore memory that isn't a vram_desc, e.g. the VGA RAM */
+void vram_put_buffer(QEMUFile *f, struct vram_tiles *t, const uint8_t *p,
+                     size_t len);
+int vram_get_buffer(QEMUFile *f, uint8_t *p, size_t len);
+
 extern const VMStateInfo vmstate_info_vram;
 
 #define VMSTATE_VRAM(_field, _state) {                          \
@@ -13,12 +13,16 @@
 #include <dm/vm-savefile.h>
 #include <dm/filebuf.h>
 #include <dm/control.h>
+#include <dm/zero-scan.h>
 #include <uuid/uuid.h>
 
 #define VM_VA_RANGE_SIZE 0x100000000ULL
 #define ZERO_RANGE_MIN_PAGES 64
 #define mb_saveable(mb) (!((mb)->flags & WHPX_RAM_EXTERNAL))
-#define SAVE_BUFFER_SIZE (1024*1024*64)
+/* per buffer -- the save file's async writer rotates four of them, which
+ * keeps the 64MB that the single synchronous buffer used to take, and
+ * 16MB writes are still large enough for the disk to stream */
+#define SAVE_BUFFER_SIZE (1024*1024*16)
 
 #define PRIVATE_MEM_QUERY_INTERVAL_NS (4 * 1000000000ULL)
 
@@ -846,89 +850,27 @@ enum_private_ranges(void *opaque, int (*cb)(uint64_t pfn, uint64_t count, void *
     return 0;
 }
 
-static bool
-page_is_zero(void *p)
-{
-    uint64_t *q = p;
-    uint64_t *end = (uint64_t*)((uint8_t*)p + PAGE_SIZE);
-
-    while (q != end) {
-        if (*q)
-            return false;
-        q++;
-    }
-
-    return true;
-}
-
-static bool
-find_nonzero_pagerange(uint8_t *p, uint64_t npages, pagerange_t *pr)
-{
-    bool in_nonzero = false;
-    uint64_t s, e;
-    uint64_t idx = 0;
-    int zeroc = 0;
-
-    while (npages) {
-        bool is_zero = page_is_zero(p);
-
-        if (in_nonzero) {
-            if (is_zero == false) {
-                e = idx;
-                zeroc = 0;
-            } else
-                zeroc++;
-        } else {
-            if (is_zero == false) {
-                s = e = idx;
-                zeroc = 0;
-                in_nonzero = true;
-            }
-        }
-
-        if (in_nonzero && ((zeroc > ZERO_RANGE_MIN_PAGES) || (npages == 1))) {
-            pr->start = s;
-            pr->end = e+1;
-
-            return true;
-        }
-
-        p += PAGE_SIZE;
-        npages--;
-        idx++;
-    }
-
-    return false;
-}
-
 static pagerange_t *
 find_nonzero_pageranges(uint8_t *p, uint64_t len, int *count)
 {
-    uint64_t scanoff = 0;
-    int num_ranges = 0;
+    struct zero_scan_range *zr;
     pagerange_t *ranges = NULL;
-    pagerange_t *r;
-
-    *count = 0;
-
-    while (scanoff < len) {
-        pagerange_t nonz = { };
-
-        if (!find_nonzero_pagerange(p + scanoff,
-                (len - scanoff) >> PAGE_SHIFT, &nonz))
-            break;
-
-        num_ranges++;
-        ranges = realloc(ranges, num_ranges * sizeof(pagerange_t));
-
-        r = &ranges[num_ranges-1];
-        r->start = nonz.start + (scanoff >> PAGE_SHIFT);
-        r->end   = nonz.end   + (scanoff >> PAGE_SHIFT);
+    int i;
 
-        scanoff  = r->end << PAGE_SHIFT;
+    zr = zero_scan_nonzero_ranges(p, len >> PAGE_SHIFT, ZERO_RANGE_MIN_PAGES,
+                                  count);
+    if (*count < 0)
+        whpx_panic("zero range scan failed\n");
+    if (*count) {
+        ranges = malloc(*count * sizeof(pagerange_t));
+        if (!ranges)
+            whpx_panic("range allocation failed\n");
+        for (i = 0; i < *count; i++) {
+            ranges[i].start = zr[i].start;
+            ranges[i].end = zr[i].end;
+        }
     }
-
-    *count = num_ranges;
+    free(zr);
 
     return ranges;
 }
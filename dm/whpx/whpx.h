@@ -169,6 +169,8 @@ int whpx_memory_populate_from_buffer(unsigned long nr_pfns, uint64_t *pfns, void
 
 #else /* _WIN32 */
 
+struct filebuf;
+
 #define WHPX_UNSUPPORTED errx(1, "whpx unsupported on this platform\n");
 
 static inline int whpx_vm_init(void) { WHPX_UNSUPPORTED; return -1; }
@@ -180,6 +182,7 @@ static inline void whpx_unlock_iothread(void) { WHPX_UNSUPPORTED; }
 static inline void whpx_register_iorange(uint64_t start, uint64_t length, int is_mmio) { WHPX_UNSUPPORTED; }
 static inline void whpx_unregister_iorange(uint64_t start, uint64_t length, int is_mmio) { WHPX_UNSUPPORTED; }
 static inline void *whpx_ram_map(uint64_t phys_addr, uint64_t *len) { WHPX_UNSUPPORTED; return 0; }
+static inline void whpx_ram_free(void) { WHPX_UNSUPPORTED; }
 static inline void whpx_ram_unmap(void *ptr) { WHPX_UNSUPPORTED; }
 static inline int whpx_ram_populate_with(uint64_t phys_addr, uint64_t len, void *va) { WHPX_UNSUPPORTED; return -1; }
 static inline int whpx_ram_populate(uint64_t phys_addr, uint64_t len) { WHPX_UNSUPPORTED; return -1; }
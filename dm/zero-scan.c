@@ -0,0 +1,218 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#include "config.h"
+
+#include "zero-scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ZERO_SCAN_X86
+#include <immintrin.h>
+#endif
+
+/* prefetch distance, in bytes ahead of the scan position */
+#define ZERO_SCAN_PREFETCH 512
+
+static int
+page_zero_generic(const void *p)
+{
+    const uint64_t *q = p;
+    const uint64_t *end = (const uint64_t *)((const uint8_t *)p + PAGE_SIZE);
+
+    /* or together a cache line at a time, checking once per line */
+    while (q != end) {
+        if (q[0] | q[1] | q[2] | q[3] | q[4] | q[5] | q[6] | q[7])
+            return 0;
+        q += 8;
+    }
+
+    return 1;
+}
+
+#ifdef ZERO_SCAN_X86
+/* SSE2 is part of the x86_64 baseline, and is only built for i386 when
+ * enabled there */
+#if defined(__x86_64__) || defined(__SSE2__)
+#define ZERO_SCAN_SSE2
+static int
+page_zero_sse2(const void *p)
+{
+    const __m128i *q = p;
+    const __m128i *end = (const __m128i *)((const uint8_t *)p + PAGE_SIZE);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc;
+
+    while (q != end) {
+        _mm_prefetch((const char *)q + ZERO_SCAN_PREFETCH, _MM_HINT_T0);
+        acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(q),
+                                        _mm_loadu_si128(q + 1)),
+                           _mm_or_si128(_mm_loadu_si128(q + 2),
+                                        _mm_loadu_si128(q + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+            return 0;
+        q += 4;
+    }
+
+    return 1;
+}
+#endif  /* __x86_64__ || __SSE2__ */
+
+#define ZERO_SCAN_AVX2
+static int __attribute__((target("avx2")))
+page_zero_avx2(const void *p)
+{
+    const __m256i *q = p;
+    const __m256i *end = (const __m256i *)((const uint8_t *)p + PAGE_SIZE);
+    __m256i acc;
+
+    while (q != end) {
+        _mm_prefetch((const char *)q + ZERO_SCAN_PREFETCH, _MM_HINT_T0);
+        _mm_prefetch((const char *)q + ZERO_SCAN_PREFETCH + 64, _MM_HINT_T0);
+        acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(q),
+                                              _mm256_loadu_si256(q + 1)),
+                              _mm256_or_si256(_mm256_loadu_si256(q + 2),
+                                              _mm256_loadu_si256(q + 3)));
+        if (!_mm256_testz_si256(acc, acc))
+            return 0;
+        q += 4;
+    }
+
+    return 1;
+}
+#endif  /* ZERO_SCAN_X86 */
+
+static const struct {
+    const char *name;
+    int (*page_zero)(const void *);
+} zero_scan_impls[] = {
+#ifdef ZERO_SCAN_AVX2
+    { "avx2", page_zero_avx2 },
+#endif
+#ifdef ZERO_SCAN_SSE2
+    { "sse2", page_zero_sse2 },
+#endif
+    { "generic", page_zero_generic },
+};
+#define ZERO_SCAN_NR_IMPLS                                      \
+    (sizeof(zero_scan_impls) / sizeof(zero_scan_impls[0]))
+
+static int zero_scan_impl_idx = -1;
+
+static int
+impl_supported(int idx)
+{
+
+#ifdef ZERO_SCAN_AVX2
+    if (zero_scan_impls[idx].page_zero == page_zero_avx2) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return 1;
+}
+
+static int
+impl_resolve(void)
+{
+    int i;
+
+    /* racing first callers resolve to the same result */
+    if (zero_scan_impl_idx < 0) {
+        for (i = 0; i < ZERO_SCAN_NR_IMPLS; i++)
+            if (impl_supported(i))
+                break;
+        zero_scan_impl_idx = i;
+    }
+
+    return zero_scan_impl_idx;
+}
+
+const char *
+zero_scan_impl(void)
+{
+
+    return zero_scan_impls[impl_resolve()].name;
+}
+
+int
+zero_scan_select(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ZERO_SCAN_NR_IMPLS; i++) {
+        if (strcmp(zero_scan_impls[i].name, name))
+            continue;
+        if (!impl_supported(i))
+            return -1;
+        zero_scan_impl_idx = i;
+        return 0;
+    }
+
+    return -1;
+}
+
+int
+zero_scan_page(const void *p)
+{
+
+    return zero_scan_impls[impl_resolve()].page_zero(p);
+}
+
+uint64_t
+zero_scan_run(const uint8_t *p, uint64_t npages, int zero)
+{
+    int (*page_zero)(const void *) =
+        zero_scan_impls[impl_resolve()].page_zero;
+    uint64_t n = 0;
+
+    zero = !!zero;
+    while (n < npages && page_zero(p) == zero) {
+        p += PAGE_SIZE;
+        n++;
+    }
+
+    return n;
+}
+
+struct zero_scan_range *
+zero_scan_nonzero_ranges(const uint8_t *p, uint64_t npages,
+                         uint64_t max_gap, int *count)
+{
+    struct zero_scan_range *ranges = NULL, *r;
+    uint64_t idx, gap;
+    int nr = 0;
+
+    idx = zero_scan_run(p, npages, 1);
+    while (idx < npages) {
+        if (!((nr - 1) & nr)) {
+            r = realloc(ranges, sizeof(ranges[0]) * (nr ? 2 * nr : 1));
+            if (!r) {
+                free(ranges);
+                *count = -1;
+                return NULL;
+            }
+            ranges = r;
+        }
+        r = &ranges[nr++];
+        r->start = idx;
+        for (;;) {
+            idx += zero_scan_run(p + (idx << PAGE_SHIFT), npages - idx, 0);
+            r->end = idx;
+            /* only scan as far as needed to decide whether the zero run
+             * is short enough to be merged */
+            gap = npages - idx;
+            if (gap > max_gap + 1)
+                gap = max_gap + 1;
+            gap = zero_scan_run(p + (idx << PAGE_SHIFT), gap, 1);
+            idx += gap;
+            if (gap > max_gap || idx == npages)
+                break;
+        }
+        idx += zero_scan_run(p + (idx << PAGE_SHIFT), npages - idx, 1);
+    }
+
+    *count = nr;
+    return ranges;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2019, Bromium, Inc.
+ * SPDX-License-Identifier: ISC
+ */
+
+#ifndef _ZERO_SCAN_H_
+#define _ZERO_SCAN_H_
+
+#include <stdint.h>
+
+struct zero_scan_range {
+    uint64_t start;             /* first page */
+    uint64_t end;               /* last page plus one */
+};
+
+/* non-zero if the page at p is all zero */
+int zero_scan_page(const void *p);
+
+/* number of consecutive pages, at most npages, starting at p which are
+ * all zero (zero != 0) or which each hold some non-zero data (zero == 0) */
+uint64_t zero_scan_run(const uint8_t *p, uint64_t npages, int zero);
+
+/* split the npages pages at p into runs of non-zero pages, merging runs
+ * separated by at most max_gap zero pages -- returns a malloc'ed array
+ * of *count ranges, or NULL if there are none (or on allocation failure,
+ * with *count set to -1) */
+struct zero_scan_range *zero_scan_nonzero_ranges(const uint8_t *p,
+                                                 uint64_t npages,
+                                                 uint64_t max_gap,
+                                                 int *count);
+
+/* name of the scanner selected for this cpu */
+const char *zero_scan_impl(void);
+/* force a scanner ("generic", "sse2", "avx2"), for benchmarking -- fails
+ * if the cpu does not support it */
+int zero_scan_select(const char *name);
+
+#endif  /* _ZERO_SCAN_H_ */